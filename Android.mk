@@ -6,38 +6,61 @@ common_src_files := \
 	VoldCommand.cpp \
 	NetlinkManager.cpp \
 	NetlinkHandler.cpp \
+	OperationStats.cpp \
+	EventBatch.cpp \
+	BackgroundIo.cpp \
 	Process.cpp \
 	fs/Exfat.cpp \
 	fs/Ext4.cpp \
 	fs/F2fs.cpp \
 	fs/Iso9660.cpp \
 	fs/Ntfs.cpp \
+	fs/Sdcardfs.cpp \
 	fs/Vfat.cpp \
 	Loop.cpp \
 	Devmapper.cpp \
+	DmControl.cpp \
 	ResponseCode.cpp \
 	CheckBattery.cpp \
 	VoldUtil.c \
 	cryptfs.c \
 	Disk.cpp \
 	DiskPartition.cpp \
+	DiskMatcher.cpp \
+	PartitionTable.cpp \
+	ProbeCache.cpp \
+	FsProbe.cpp \
 	VolumeBase.cpp \
 	PublicVolume.cpp \
 	PrivateVolume.cpp \
 	EmulatedVolume.cpp \
 	Utils.cpp \
+	MountNamespace.cpp \
+	MountProfile.cpp \
 	MoveTask.cpp \
+	KeyedWorkQueue.cpp \
+	WorkerPool.cpp \
 	Benchmark.cpp \
+	BenchmarkHistory.cpp \
+	BenchmarkProfile.cpp \
+	BenchmarkTrace.cpp \
+	BenchmarkWorkload.cpp \
+	LatencyHistogram.cpp \
+	StorageWear.cpp \
 	TrimTask.cpp \
+	UeventQueue.cpp \
 	secontext.cpp \
 	main.cpp
 
 crypto_src_files := \
 	CryptCommandListener.cpp \
 	Ext4Crypt.cpp \
+	KeyBuffer.cpp \
 	Keymaster.cpp \
 	KeyStorage.cpp \
-	ScryptParameters.cpp
+	Scrypt.cpp \
+	ScryptParameters.cpp \
+	SecureDiscard.cpp
 
 common_c_includes := \
 	system/extras/ext4_utils \
@@ -89,6 +112,8 @@ common_static_libraries := \
 
 vold_conlyflags := -std=c11
 vold_cflags := -Werror -Wall -Wno-missing-field-initializers -Wno-unused-variable -Wno-unused-parameter
+# vold has no atrace tag of its own, so its sections go under package manager
+vold_cflags += -DATRACE_TAG=ATRACE_TAG_PACKAGE_MANAGER
 
 ifeq ($(TARGET_KERNEL_HAVE_EXFAT),true)
 vold_cflags += -DCONFIG_KERNEL_HAVE_EXFAT
@@ -159,7 +184,7 @@ include $(CLEAR_VARS)
 
 LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
 LOCAL_CLANG := true
-LOCAL_SRC_FILES:= secdiscard.cpp
+LOCAL_SRC_FILES:= secdiscard.cpp SecureDiscard.cpp
 LOCAL_MODULE:= secdiscard
 LOCAL_SHARED_LIBRARIES := libbase
 LOCAL_CFLAGS := $(vold_cflags)
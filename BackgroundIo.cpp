@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BackgroundIo.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <cutils/iosched_policy.h>
+#include <cutils/properties.h>
+#include <cutils/sched_policy.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+using android::base::ReadFileToString;
+
+namespace android {
+namespace vold {
+
+static const char* kPsiHighProp = "persist.vold.bg_io_psi_high";
+static const char* kMaxRateProp = "persist.vold.bg_io_max_mbps";
+static const int kPsiHighDefault = 10;
+
+static const char* kPsiPath = "/proc/pressure/io";
+static const char* kBacklightDir = "/sys/class/backlight";
+static const char* kLcdBacklight = "/sys/class/leds/lcd-backlight/brightness";
+static const char* kPowerSupplyDir = "/sys/class/power_supply";
+
+static const int kBackgroundNice = 10;
+/* Lowest priority of the best-effort class */
+static const int kBackgroundIoPrio = 7;
+
+static const nsecs_t kAdjustIntervalNs = 1000000000LL;
+
+ScopedSchedPolicy::ScopedSchedPolicy(SchedPolicy policy) : mApplied(false),
+        mOriginal(SP_DEFAULT) {
+    pid_t tid = gettid();
+    if (get_sched_policy(tid, &mOriginal) != 0) {
+        PLOG(WARNING) << "Failed to get_sched_policy";
+        return;
+    }
+    if (set_sched_policy(tid, policy) != 0) {
+        PLOG(WARNING) << "Failed to set_sched_policy";
+        return;
+    }
+    mApplied = true;
+}
+
+ScopedSchedPolicy::~ScopedSchedPolicy() {
+    if (mApplied && set_sched_policy(gettid(), mOriginal) != 0) {
+        PLOG(WARNING) << "Failed to restore sched policy";
+    }
+}
+
+ScopedBackgroundIo::ScopedBackgroundIo() : mPolicy(SP_BACKGROUND), mNice(0),
+        mIoClass(IoSchedClass_NONE), mIoPrio(0) {
+    pid_t tid = gettid();
+    errno = 0;
+    mNice = getpriority(PRIO_PROCESS, tid);
+    if (errno != 0 || setpriority(PRIO_PROCESS, tid, kBackgroundNice) != 0) {
+        PLOG(WARNING) << "Failed to setpriority";
+    }
+
+    IoSchedClass ioClass = IoSchedClass_NONE;
+    if (android_get_ioprio(tid, &ioClass, &mIoPrio) != 0) {
+        PLOG(WARNING) << "Failed to android_get_ioprio";
+    }
+    mIoClass = ioClass;
+    if (android_set_ioprio(tid, IoSchedClass_BE, kBackgroundIoPrio) != 0) {
+        PLOG(WARNING) << "Failed to android_set_ioprio";
+    }
+}
+
+ScopedBackgroundIo::~ScopedBackgroundIo() {
+    pid_t tid = gettid();
+    if (setpriority(PRIO_PROCESS, tid, mNice) != 0) {
+        PLOG(WARNING) << "Failed to setpriority";
+    }
+    if (android_set_ioprio(tid, static_cast<IoSchedClass>(mIoClass), mIoPrio) != 0) {
+        PLOG(WARNING) << "Failed to android_set_ioprio";
+    }
+}
+
+static bool isZeroFile(const std::string& path, bool& found) {
+    std::string value;
+    if (!ReadFileToString(path, &value)) {
+        return true;
+    }
+    found = true;
+    return atoi(value.c_str()) == 0;
+}
+
+bool IsScreenOff() {
+    bool found = false;
+    if (!isZeroFile(kLcdBacklight, found)) {
+        return false;
+    }
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(kBacklightDir), closedir);
+    if (dir) {
+        struct dirent* ent;
+        while ((ent = readdir(dir.get())) != nullptr) {
+            if (ent->d_name[0] == '.') continue;
+            std::string path(std::string(kBacklightDir) + "/" + ent->d_name + "/brightness");
+            if (!isZeroFile(path, found)) {
+                return false;
+            }
+        }
+    }
+    // Without any backlight to go by, assume someone's looking
+    return found;
+}
+
+bool IsCharging() {
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(kPowerSupplyDir), closedir);
+    if (!dir) {
+        return false;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir.get())) != nullptr) {
+        if (ent->d_name[0] == '.') continue;
+        std::string status;
+        std::string path(std::string(kPowerSupplyDir) + "/" + ent->d_name + "/status");
+        if (ReadFileToString(path, &status)
+                && (!status.compare(0, 8, "Charging") || !status.compare(0, 4, "Full"))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reads the cumulative time every task was stalled on I/O, in microseconds */
+static bool readFullStall(uint64_t& stallUs) {
+    std::string psi;
+    if (!ReadFileToString(kPsiPath, &psi)) {
+        return false;
+    }
+    size_t pos = psi.find("full ");
+    if (pos == std::string::npos) {
+        return false;
+    }
+    const char* total = strstr(psi.c_str() + pos, "total=");
+    if (total == nullptr) {
+        return false;
+    }
+    stallUs = strtoull(total + strlen("total="), nullptr, 10);
+    return true;
+}
+
+IoThrottle::IoThrottle(uint64_t minRate, uint64_t startRate) :
+        mMinRate(minRate), mContended(false), mWindowBytes(0), mWindowStart(0), mStallUs(0),
+        mSampleTime(0) {
+    mPsiHigh = std::max(1, property_get_int32(kPsiHighProp, kPsiHighDefault));
+    mMaxRate = (uint64_t) std::max(0, property_get_int32(kMaxRateProp, 0)) * 1024 * 1024;
+    mHavePsi = readFullStall(mStallUs);
+    if (mHavePsi) {
+        mRate = mMaxRate ? std::min(startRate, mMaxRate) : startRate;
+    } else {
+        mRate = mMaxRate;
+    }
+    mSampleTime = mWindowStart = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+void IoThrottle::adjust(nsecs_t now) {
+    uint64_t stallUs;
+    if (!mHavePsi || !readFullStall(stallUs)) {
+        mSampleTime = now;
+        return;
+    }
+    uint64_t elapsedUs = std::max<nsecs_t>(1, (now - mSampleTime) / 1000);
+    uint64_t pressure = (stallUs - mStallUs) * 100 / elapsedUs;
+    mStallUs = stallUs;
+    mSampleTime = now;
+
+    bool screenOff = IsScreenOff();
+    uint64_t high = mPsiHigh * (screenOff ? 2 : 1);
+    uint64_t ceiling = screenOff ? 0 : mMaxRate;
+    uint64_t rate = mRate;
+    mContended = (pressure > high);
+    if (pressure > high) {
+        rate = std::max(mMinRate, rate / 2);
+    } else if (pressure < high / 5 + 1) {
+        rate += mMinRate * (screenOff ? 4 : 2);
+    }
+    if (ceiling && rate > ceiling) {
+        rate = ceiling;
+    }
+
+    if (rate != mRate) {
+        LOG(VERBOSE) << "Background I/O pressure " << pressure << "%; rate now "
+                << rate / 1024 << "KiB/s";
+        mRate = rate;
+        mWindowStart = now;
+        mWindowBytes = 0;
+    }
+}
+
+void IoThrottle::throttle(uint64_t bytes) {
+    nsecs_t delay;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (now - mSampleTime >= kAdjustIntervalNs) {
+            adjust(now);
+        }
+        if (mRate == 0) {
+            return;
+        }
+
+        mWindowBytes += bytes;
+        delay = mWindowStart + (nsecs_t) (mWindowBytes * 1000000000.0 / mRate) - now;
+        if (delay < -kAdjustIntervalNs) {
+            // Time spent below the rate doesn't bank credit for a burst
+            mWindowStart = now;
+            mWindowBytes = 0;
+        }
+    }
+    if (delay > 0) {
+        usleep(delay / 1000);
+    }
+}
+
+uint64_t IoThrottle::getRate() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRate;
+}
+
+bool IoThrottle::isContended() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mContended;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BACKGROUND_IO_H
+#define ANDROID_VOLD_BACKGROUND_IO_H
+
+#include "Utils.h"
+
+#include <cutils/sched_policy.h>
+#include <utils/Timers.h>
+
+#include <mutex>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Moves the calling thread into the cgroups of policy while in scope, and
+ * back into the ones it was in before.
+ */
+class ScopedSchedPolicy {
+public:
+    explicit ScopedSchedPolicy(SchedPolicy policy);
+    ~ScopedSchedPolicy();
+
+    bool isApplied() const { return mApplied; }
+
+private:
+    bool mApplied;
+    SchedPolicy mOriginal;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedSchedPolicy);
+};
+
+/*
+ * Moves the calling thread into the background cgroups at a low nice
+ * value and the lowest best-effort I/O priority while in scope. Threads
+ * it creates meanwhile inherit all of this, so keep anything that forks
+ * long-lived daemons, like mounting, outside of it.
+ */
+class ScopedBackgroundIo {
+public:
+    ScopedBackgroundIo();
+    ~ScopedBackgroundIo();
+
+private:
+    ScopedSchedPolicy mPolicy;
+    int mNice;
+    int mIoClass;
+    int mIoPrio;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedBackgroundIo);
+};
+
+/*
+ * Rate limit shared by the threads of one background task, adjusted by a
+ * feedback loop on the kernel's io pressure (PSI) "full" stall time,
+ * which only grows while every runnable task, the foreground app
+ * included, waits on I/O. Pressure above persist.vold.bg_io_psi_high
+ * percent halves the rate, pressure below a fifth of that raises it
+ * step by step. While the screen is off the ceiling is lifted and twice
+ * the pressure is tolerated. persist.vold.bg_io_max_mbps caps the rate;
+ * without PSI support the rate stays at that cap, or unlimited.
+ */
+class IoThrottle {
+public:
+    /* Rates are in bytes per second */
+    IoThrottle(uint64_t minRate, uint64_t startRate);
+
+    /* Accounts for bytes just done, sleeping long enough to stay on rate */
+    void throttle(uint64_t bytes);
+
+    /* Rate currently allowed in bytes per second, or 0 when unlimited */
+    uint64_t getRate();
+
+    /* True when the last pressure sample was above the high watermark */
+    bool isContended();
+
+private:
+    std::mutex mLock;
+    const uint64_t mMinRate;
+    uint64_t mMaxRate;
+    uint64_t mRate;
+    int mPsiHigh;
+    bool mHavePsi;
+    bool mContended;
+
+    /* Bytes accounted since mWindowStart */
+    uint64_t mWindowBytes;
+    nsecs_t mWindowStart;
+
+    /* Last PSI sample */
+    uint64_t mStallUs;
+    nsecs_t mSampleTime;
+
+    void adjust(nsecs_t now);
+
+    DISALLOW_COPY_AND_ASSIGN(IoThrottle);
+};
+
+/* True when every backlight is off, as far as sysfs can tell */
+bool IsScreenOff();
+
+/* True when some battery reports charging or full */
+bool IsCharging();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -15,31 +15,64 @@
  */
 
 #include "Benchmark.h"
+#include "BackgroundIo.h"
 #include "BenchmarkGen.h"
+#include "BenchmarkHistory.h"
+#include "BenchmarkProfile.h"
+#include "BenchmarkTrace.h"
+#include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <cutils/iosched_policy.h>
+#include <cutils/properties.h>
+#include <cutils/sched_policy.h>
 #include <private/android_filesystem_config.h>
 
+#include <memory>
+#include <mutex>
+
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define ENABLE_DROP_CACHES 1
 
+/* Traces captured with bench/benchgen.py --trace live here */
+static const char* kTraceDir = "/data/misc/vold/bench";
+static const char* kTraceProp = "persist.vold.bench_trace";
+static const char* kTraceDefault = "default";
+/* When set, replay honours the gaps between ops in the original capture */
+static const char* kTraceTimedProp = "persist.vold.bench_timed";
+/* Scratch directory created at the root of volumes without /misc */
+static const char* kScratchDir = ".vold_bench";
+
 using android::base::ReadFileToString;
-using android::base::WriteStringToFile;
+using android::base::StringPrintf;
 
 namespace android {
 namespace vold {
 
-static void notifyResult(const std::string& path, int64_t create_d,
-        int64_t drop_d, int64_t run_d, int64_t destroy_d) {
+/*
+ * The built-in workload runs in the process-wide working directory, so
+ * benchmarks using it on different volumes, say from concurrent trims,
+ * must take turns
+ */
+static std::mutex sCwdLock;
+
+static std::mutex sLatencyLock;
+static std::vector<std::string> sLatency;
+
+static void notifyResult(const std::string& path, const std::string& ident,
+        int64_t create_d, int64_t drop_d, int64_t run_d, int64_t destroy_d) {
     std::string res(path +
-            + " " + BenchmarkIdent()
+            + " " + ident
             + " " + std::to_string(create_d)
             + " " + std::to_string(drop_d)
             + " " + std::to_string(run_d)
@@ -48,7 +81,91 @@ static void notifyResult(const std::string& path, int64_t create_d,
             ResponseCode::BenchmarkResult, res.c_str(), false);
 }
 
-static nsecs_t benchmark(const std::string& path) {
+/* Flushes only the filesystem under test, leaving every other mount alone */
+static void syncVolume(int dirFd) {
+    if (syncfs(dirFd) != 0) {
+        PLOG(ERROR) << "Failed to syncfs";
+    }
+}
+
+/*
+ * Evicts the page cache of every file under dirFd, which this takes
+ * ownership of. Pages must be clean before the kernel will drop them,
+ * so each file is written back first.
+ */
+static void evictWorkingSet(int dirFd) {
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(fdopendir(dirFd), closedir);
+    if (!dir) {
+        PLOG(ERROR) << "Failed to open benchmark directory";
+        close(dirFd);
+        return;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(dir.get())) != nullptr) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        int fd = TEMP_FAILURE_RETRY(openat(dirfd(dir.get()), ent->d_name,
+                O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK));
+        if (fd == -1) {
+            continue;
+        }
+        struct stat sb;
+        if (fstat(fd, &sb) != 0) {
+            PLOG(WARNING) << "Failed to stat " << ent->d_name;
+            close(fd);
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            evictWorkingSet(fd);
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            if (fdatasync(fd) != 0) {
+                PLOG(WARNING) << "Failed to fdatasync " << ent->d_name;
+            }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(fd);
+    }
+}
+
+/* Loads the configured trace, returning false to use the built-in workload */
+static bool loadTrace(BenchmarkTrace& trace) {
+    char name[PROPERTY_VALUE_MAX];
+    property_get(kTraceProp, name, kTraceDefault);
+    if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        LOG(ERROR) << "Invalid benchmark trace name " << name;
+        return false;
+    }
+
+    std::string tracePath(StringPrintf("%s/%s.trace", kTraceDir, name));
+    if (access(tracePath.c_str(), F_OK) != 0) {
+        return false;
+    }
+    if (trace.load(tracePath) != OK) {
+        return false;
+    }
+    trace.setTimed(property_get_bool(kTraceTimedProp, false));
+    return true;
+}
+
+/* Runs the given workload in path, or the built-in one when null */
+static nsecs_t benchmark(const std::string& path, BenchmarkWorkload* workload) {
+    int fd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return -1;
+    }
+    ScopedFd dir(fd);
+
+    // Only the built-in workload needs the working directory
+    std::unique_lock<std::mutex> cwdLock(sCwdLock, std::defer_lock);
+    if (!workload) {
+        cwdLock.lock();
+    }
+
     errno = 0;
     int orig_prio = getpriority(PRIO_PROCESS, 0);
     if (errno != 0) {
@@ -60,6 +177,13 @@ static nsecs_t benchmark(const std::string& path) {
         return -1;
     }
 
+    // Background tasks like TrimTask run us from their own throttled
+    // threads; measure the media, not the cgroup limits
+    ScopedSchedPolicy foreground(SP_FOREGROUND);
+    if (!foreground.isApplied()) {
+        return -1;
+    }
+
     IoSchedClass orig_clazz = IoSchedClass_NONE;
     int orig_ioprio = 0;
     if (android_get_ioprio(0, &orig_clazz, &orig_ioprio)) {
@@ -72,42 +196,60 @@ static nsecs_t benchmark(const std::string& path) {
     }
 
     char orig_cwd[PATH_MAX];
-    if (getcwd(orig_cwd, PATH_MAX) == NULL) {
-        PLOG(ERROR) << "Failed getcwd";
-        return -1;
-    }
-    if (chdir(path.c_str()) != 0) {
-        PLOG(ERROR) << "Failed chdir";
-        return -1;
+    if (!workload) {
+        if (getcwd(orig_cwd, PATH_MAX) == NULL) {
+            PLOG(ERROR) << "Failed getcwd";
+            return -1;
+        }
+        if (fchdir(dir.get()) != 0) {
+            PLOG(ERROR) << "Failed chdir";
+            return -1;
+        }
     }
 
-    sync();
+    syncVolume(dir.get());
 
     LOG(INFO) << "Benchmarking " << path;
     nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
 
-    BenchmarkCreate();
-    sync();
+    if (workload) {
+        workload->create(dir.get());
+    } else {
+        BenchmarkCreate();
+    }
+    syncVolume(dir.get());
     nsecs_t create = systemTime(SYSTEM_TIME_BOOTTIME);
 
 #if ENABLE_DROP_CACHES
-    LOG(VERBOSE) << "Before drop_caches";
-    if (!WriteStringToFile("3", "/proc/sys/vm/drop_caches")) {
-        PLOG(ERROR) << "Failed to drop_caches";
+    // Only our own files go cold; the rest of the system keeps its cache
+    LOG(VERBOSE) << "Before evicting working set";
+    int dirFd = fcntl(dir.get(), F_DUPFD_CLOEXEC, 0);
+    if (dirFd != -1) {
+        evictWorkingSet(dirFd);
+    } else {
+        PLOG(ERROR) << "Failed to open benchmark directory";
     }
-    LOG(VERBOSE) << "After drop_caches";
+    LOG(VERBOSE) << "After evicting working set";
 #endif
     nsecs_t drop = systemTime(SYSTEM_TIME_BOOTTIME);
 
-    BenchmarkRun();
-    sync();
+    if (workload) {
+        workload->run(dir.get());
+    } else {
+        BenchmarkRun();
+    }
+    syncVolume(dir.get());
     nsecs_t run = systemTime(SYSTEM_TIME_BOOTTIME);
 
-    BenchmarkDestroy();
-    sync();
+    if (workload) {
+        workload->destroy(dir.get());
+    } else {
+        BenchmarkDestroy();
+    }
+    syncVolume(dir.get());
     nsecs_t destroy = systemTime(SYSTEM_TIME_BOOTTIME);
 
-    if (chdir(orig_cwd) != 0) {
+    if (!workload && chdir(orig_cwd) != 0) {
         PLOG(ERROR) << "Failed to chdir";
     }
     if (android_set_ioprio(0, orig_clazz, orig_ioprio)) {
@@ -127,14 +269,33 @@ static nsecs_t benchmark(const std::string& path) {
     LOG(INFO) << "run took " << nanoseconds_to_milliseconds(run_d) << "ms";
     LOG(INFO) << "destroy took " << nanoseconds_to_milliseconds(destroy_d) << "ms";
 
-    notifyResult(path, create_d, drop_d, run_d, destroy_d);
+    notifyResult(path, workload ? workload->ident() : BenchmarkIdent(),
+            create_d, drop_d, run_d, destroy_d);
+
+    // The built-in workload is not timed per op
+    if (workload) {
+        std::vector<std::string> latency(workload->getLatencySummary());
+        std::vector<std::string> threads(workload->getThreadSummary());
+        latency.insert(latency.end(), threads.begin(), threads.end());
+        for (const auto& line : latency) {
+            LOG(INFO) << "latency " << line;
+            std::string res(path + " " + line);
+            VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+                    ResponseCode::BenchmarkLatency, res.c_str(), false);
+        }
+
+        std::lock_guard<std::mutex> lock(sLatencyLock);
+        sLatency.clear();
+        for (const auto& line : latency) {
+            sLatency.push_back(path + " " + line);
+        }
+    }
 
     return run_d;
 }
 
-nsecs_t BenchmarkPrivate(const std::string& path) {
-    std::string benchPath(path);
-    benchPath += "/misc";
+static status_t prepareBenchPrivate(const std::string& path, std::string& benchPath) {
+    benchPath = path + "/misc";
     if (android::vold::PrepareDir(benchPath, 01771, AID_SYSTEM, AID_MISC)) {
         return -1;
     }
@@ -146,7 +307,60 @@ nsecs_t BenchmarkPrivate(const std::string& path) {
     if (android::vold::PrepareDir(benchPath, 0700, AID_ROOT, AID_ROOT)) {
         return -1;
     }
-    return benchmark(benchPath);
+    return OK;
+}
+
+static void recordResult(const std::string& historyKey, const std::string& ident,
+        nsecs_t res) {
+    if (historyKey.empty() || res < 0 || RecordBenchmarkResult(historyKey, ident, res)) {
+        return;
+    }
+    std::string verdict(GetBenchmarkVerdict(historyKey));
+    LOG(INFO) << "Benchmark verdict " << verdict;
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::BenchmarkVerdict, verdict.c_str(), false);
+}
+
+nsecs_t BenchmarkPrivate(const std::string& path, const std::string& historyKey) {
+    return BenchmarkVolume(path, true, nullptr, historyKey);
+}
+
+nsecs_t BenchmarkVolume(const std::string& path, bool isPrivate, BenchmarkProfile* profile,
+        const std::string& historyKey) {
+    std::string benchPath;
+    if (isPrivate) {
+        if (prepareBenchPrivate(path, benchPath)) {
+            return -1;
+        }
+    } else {
+        // Public media may not support ownership, so skip PrepareDir
+        benchPath = path + "/" + kScratchDir;
+        if (mkdir(benchPath.c_str(), 0700) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Failed to create " << benchPath;
+            return -1;
+        }
+    }
+
+    nsecs_t res;
+    if (profile) {
+        res = benchmark(benchPath, profile);
+    } else {
+        // Only the default workload is comparable from run to run
+        BenchmarkTrace trace;
+        bool useTrace = loadTrace(trace);
+        res = benchmark(benchPath, useTrace ? &trace : nullptr);
+        recordResult(historyKey, useTrace ? trace.ident() : BenchmarkIdent(), res);
+    }
+
+    if (!isPrivate && rmdir(benchPath.c_str()) != 0) {
+        PLOG(WARNING) << "Failed to remove " << benchPath;
+    }
+    return res;
+}
+
+std::vector<std::string> GetBenchmarkLatency() {
+    std::lock_guard<std::mutex> lock(sLatencyLock);
+    return sLatency;
 }
 
 }  // namespace vold
@@ -21,12 +21,31 @@
 #include <utils/Timers.h>
 
 #include <string>
+#include <vector>
 
 namespace android {
 namespace vold {
 
-/* Benchmark a private volume mounted at the given path */
-nsecs_t BenchmarkPrivate(const std::string& path);
+class BenchmarkProfile;
+
+/*
+ * Benchmark a private volume mounted at the given path. When historyKey is
+ * set, the result is added to the history for that media and its verdict
+ * broadcast (see BenchmarkHistory.h).
+ */
+nsecs_t BenchmarkPrivate(const std::string& path, const std::string& historyKey = "");
+
+/*
+ * Benchmark any mounted volume. Private volumes use the same directory as
+ * BenchmarkPrivate(); others get a scratch directory at their root that
+ * is removed afterwards. A null profile runs the configured trace or the
+ * built-in workload, the only results recorded under historyKey.
+ */
+nsecs_t BenchmarkVolume(const std::string& path, bool isPrivate, BenchmarkProfile* profile,
+        const std::string& historyKey = "");
+
+/* Per-op latency and per-thread lines from the most recent trace replay, for dump */
+std::vector<std::string> GetBenchmarkLatency();
 
 }  // namespace vold
 }  // namespace android
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkHistory.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+
+namespace android {
+namespace vold {
+
+const char* const kBenchmarkInternalKey = "internal";
+
+static const char* kHistoryPath = "/data/misc/vold/bench_history";
+static const char* kHistoryTempPath = "/data/misc/vold/bench_history.tmp";
+
+/* Percent of the internal baseline beyond which media is reported slow */
+static const char* kSlowPctProp = "persist.vold.bench_slow_pct";
+/* Absolute limit used until internal storage has been benchmarked */
+static const char* kSlowMsProp = "persist.vold.bench_slow_ms";
+/* Percent of a disk's own best run beyond which it is reported degraded */
+static const char* kDegradePctProp = "persist.vold.bench_degrade_pct";
+
+static const size_t kMaxRunsPerKey = 16;
+static const size_t kMaxKeys = 32;
+/* Runs folded into the recent median, to ride out a single noisy result */
+static const size_t kRecentRuns = 3;
+
+struct Run {
+    std::string ident;
+    int64_t time;
+    int64_t runMs;
+};
+
+/* Runs per key, oldest first */
+typedef std::map<std::string, std::vector<Run>> History;
+
+static std::mutex sHistoryLock;
+
+static void loadHistory(History& history) {
+    std::string raw;
+    if (!ReadFileToString(kHistoryPath, &raw)) {
+        return;
+    }
+    std::istringstream in(raw);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        Run run;
+        if (fields >> key >> run.ident >> run.time >> run.runMs) {
+            history[key].push_back(run);
+        }
+    }
+}
+
+static status_t saveHistory(const History& history) {
+    std::string raw;
+    for (const auto& entry : history) {
+        for (const auto& run : entry.second) {
+            raw += StringPrintf("%s %s %" PRId64 " %" PRId64 "\n", entry.first.c_str(),
+                    run.ident.c_str(), run.time, run.runMs);
+        }
+    }
+    if (!WriteStringToFile(raw, kHistoryTempPath, 0600, 0, 0)
+            || rename(kHistoryTempPath, kHistoryPath) != 0) {
+        PLOG(ERROR) << "Failed to write " << kHistoryPath;
+        unlink(kHistoryTempPath);
+        return -EIO;
+    }
+    return OK;
+}
+
+/* Median of the last few matching runs and the best of all of them */
+static size_t summarize(const std::vector<Run>& runs, const std::string& ident,
+        int64_t& recentMs, int64_t& bestMs) {
+    std::vector<int64_t> matching;
+    for (const auto& run : runs) {
+        if (run.ident == ident) {
+            matching.push_back(run.runMs);
+        }
+    }
+    if (matching.empty()) {
+        return 0;
+    }
+    bestMs = *std::min_element(matching.begin(), matching.end());
+    std::vector<int64_t> recent(matching.end() - std::min(matching.size(), kRecentRuns),
+            matching.end());
+    std::sort(recent.begin(), recent.end());
+    recentMs = recent[recent.size() / 2];
+    return matching.size();
+}
+
+static bool isValidField(const std::string& field) {
+    return !field.empty() && field.find_first_of(" \t\n") == std::string::npos;
+}
+
+status_t RecordBenchmarkResult(const std::string& key, const std::string& ident,
+        nsecs_t run) {
+    if (!isValidField(key) || !isValidField(ident) || run < 0) {
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> lock(sHistoryLock);
+    History history;
+    loadHistory(history);
+
+    auto& runs = history[key];
+    runs.push_back({ident, (int64_t) time(nullptr), nanoseconds_to_milliseconds(run)});
+    if (runs.size() > kMaxRunsPerKey) {
+        runs.erase(runs.begin(), runs.end() - kMaxRunsPerKey);
+    }
+
+    // Forget the media seen least recently, but always keep the baseline
+    while (history.size() > kMaxKeys) {
+        auto oldest = history.end();
+        for (auto it = history.begin(); it != history.end(); ++it) {
+            if (it->first == kBenchmarkInternalKey) continue;
+            if (oldest == history.end() || it->second.back().time < oldest->second.back().time) {
+                oldest = it;
+            }
+        }
+        history.erase(oldest);
+    }
+    return saveHistory(history);
+}
+
+std::string GetBenchmarkVerdict(const std::string& key) {
+    std::lock_guard<std::mutex> lock(sHistoryLock);
+    History history;
+    loadHistory(history);
+
+    auto it = history.find(key);
+    if (it == history.end() || it->second.empty()) {
+        return "";
+    }
+    const std::string& ident = it->second.back().ident;
+
+    int64_t recentMs = 0;
+    int64_t bestMs = 0;
+    size_t runs = summarize(it->second, ident, recentMs, bestMs);
+
+    int64_t baselineMs = -1;
+    int64_t baselineBestMs;
+    auto internal = history.find(kBenchmarkInternalKey);
+    if (key != kBenchmarkInternalKey && internal != history.end()) {
+        if (summarize(internal->second, ident, baselineMs, baselineBestMs) == 0) {
+            baselineMs = -1;
+        }
+    }
+
+    bool slow;
+    if (baselineMs > 0) {
+        slow = recentMs * 100 > baselineMs * property_get_int32(kSlowPctProp, 200);
+    } else {
+        slow = recentMs > property_get_int32(kSlowMsProp, 2000);
+    }
+    bool degraded = runs > kRecentRuns
+            && recentMs * 100 > bestMs * property_get_int32(kDegradePctProp, 150);
+
+    const char* verdict = slow ? "slow" : degraded ? "degraded" : "ok";
+    return StringPrintf("%s %s %" PRId64 " %" PRId64 " %" PRId64 " %zu", key.c_str(), verdict,
+            recentMs, bestMs, baselineMs, runs);
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_HISTORY_H
+#define ANDROID_VOLD_BENCHMARK_HISTORY_H
+
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/* History key used for the internal /data volume, the baseline for verdicts */
+extern const char* const kBenchmarkInternalKey;
+
+/*
+ * Appends a benchmark run to the on-disk history for the given media,
+ * keeping the most recent results per key. Runs are only compared with
+ * others of the same workload ident, so changing the trace starts over.
+ */
+status_t RecordBenchmarkResult(const std::string& key, const std::string& ident,
+        nsecs_t run);
+
+/*
+ * Verdict for the given media as "<key> <ok|slow|degraded> <recentMs>
+ * <bestMs> <baselineMs> <runs>". recentMs is the median of the last few
+ * runs and bestMs the fastest on record. Media is slow when recentMs
+ * exceeds the internal storage baseline by persist.vold.bench_slow_pct
+ * (or persist.vold.bench_slow_ms with no baseline), and degraded when it
+ * exceeds its own best by persist.vold.bench_degrade_pct. Returns an
+ * empty string when nothing has been recorded.
+ */
+std::string GetBenchmarkVerdict(const std::string& key);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
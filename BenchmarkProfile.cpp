@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkProfile.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kFileName = "profile.dat";
+
+static const uint64_t kDefaultFileSize = 64 * 1048576ULL;
+static const uint64_t kMaxFileSize = 4096 * 1048576ULL;
+static const int kDefaultDurationMs = 5000;
+static const int kMaxDurationMs = 600000;
+static const int kMaxThreads = 64;
+
+static const size_t kBufferAlign = 4096;
+static const size_t kCreateChunkSize = 1048576;
+
+const BenchmarkProfile::Desc BenchmarkProfile::kProfiles[] = {
+    { "seq_read",        1048576, 100, false, true,  false, 1 },
+    { "seq_write",       1048576, 0,   false, true,  false, 1 },
+    { "rand_read",       4096,    100, true,  true,  false, 1 },
+    { "rand_write",      4096,    0,   true,  true,  false, 1 },
+    { "rand_read_qd32",  4096,    100, true,  true,  false, 32 },
+    { "rand_write_qd32", 4096,    0,   true,  true,  false, 32 },
+    { "fsync",           4096,    0,   false, false, true,  1 },
+    { "mixed",           4096,    70,  true,  true,  false, 4 },
+};
+
+static std::unique_ptr<void, void(*)(void*)> allocBuffer(size_t size) {
+    void* raw = nullptr;
+    if (posix_memalign(&raw, kBufferAlign, size) != 0) {
+        raw = nullptr;
+    }
+    return std::unique_ptr<void, void(*)(void*)>(raw, free);
+}
+
+BenchmarkProfile::BenchmarkProfile() : mDesc(nullptr), mFileSize(0), mDurationMs(0),
+        mThreads(0) {
+}
+
+status_t BenchmarkProfile::init(const std::string& name, uint64_t fileSize,
+        int durationMs, int threads) {
+    mDesc = nullptr;
+    for (const auto& desc : kProfiles) {
+        if (name == desc.name) {
+            mDesc = &desc;
+            break;
+        }
+    }
+    if (mDesc == nullptr) {
+        LOG(ERROR) << "Unknown benchmark profile " << name;
+        return -EINVAL;
+    }
+
+    mFileSize = fileSize ? fileSize : kDefaultFileSize;
+    mDurationMs = durationMs ? durationMs : kDefaultDurationMs;
+    mThreads = threads ? threads : mDesc->threads;
+    mFileSize -= mFileSize % mDesc->blockSize;
+
+    if (mFileSize > kMaxFileSize || mDurationMs < 0 || mDurationMs > kMaxDurationMs
+            || mThreads < 1 || mThreads > kMaxThreads
+            || mFileSize < (uint64_t) mDesc->blockSize * mThreads) {
+        LOG(ERROR) << "Invalid options for benchmark profile " << name;
+        mDesc = nullptr;
+        return -EINVAL;
+    }
+    return OK;
+}
+
+status_t BenchmarkProfile::create(int dirFd) {
+    if (mDesc == nullptr) return -EINVAL;
+
+    std::string buf;
+    if (ReadRandomBytes(kCreateChunkSize, buf) != OK) {
+        LOG(ERROR) << "Failed to read random data";
+        return -EIO;
+    }
+
+    int fd = TEMP_FAILURE_RETRY(openat(dirFd, kFileName,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_LARGEFILE, 0600));
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to open " << kFileName;
+        return -errno;
+    }
+
+    status_t res = OK;
+    uint64_t len = mFileSize;
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(write(fd, buf.data(),
+                std::min(len, (uint64_t) buf.size())));
+        if (n <= 0) {
+            PLOG(ERROR) << "Failed to write " << kFileName;
+            res = -EIO;
+            break;
+        }
+        len -= n;
+    }
+    if (res == OK && fsync(fd) != 0) {
+        PLOG(ERROR) << "Failed to fsync " << kFileName;
+        res = -errno;
+    }
+    close(fd);
+    return res;
+}
+
+status_t BenchmarkProfile::runThread(int dirFd, int index, int64_t deadlineNs, Stats& stats) {
+    const Desc& desc = *mDesc;
+    int flags = O_RDWR | O_CLOEXEC | O_LARGEFILE;
+    int fd = -1;
+    if (desc.direct) {
+        fd = TEMP_FAILURE_RETRY(openat(dirFd, kFileName, flags | O_DIRECT));
+        if (fd < 0 && errno == EINVAL) {
+            LOG(WARNING) << "O_DIRECT not supported; measuring buffered I/O";
+        }
+    }
+    if (fd < 0) {
+        fd = TEMP_FAILURE_RETRY(openat(dirFd, kFileName, flags));
+    }
+    if (fd < 0) {
+        PLOG(ERROR) << "Failed to open " << kFileName;
+        return -errno;
+    }
+
+    auto buf = allocBuffer(desc.blockSize);
+    if (!buf) {
+        LOG(ERROR) << "Failed to allocate buffer";
+        close(fd);
+        return -ENOMEM;
+    }
+    memset(buf.get(), index + 1, desc.blockSize);
+
+    // Sequential threads each walk their own slice; random ones roam the
+    // whole file. Seeded per thread so runs are repeatable.
+    uint64_t blocks = mFileSize / desc.blockSize;
+    uint64_t sliceBlocks = desc.random ? blocks : blocks / mThreads;
+    uint64_t sliceStart = desc.random ? 0 : sliceBlocks * index;
+    uint64_t next = 0;
+    std::mt19937_64 rng(index + 1);
+
+    int failed = 0;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    while (now < deadlineNs) {
+        uint64_t block = desc.random ? rng() % blocks : sliceStart + next++ % sliceBlocks;
+        off64_t offset = block * desc.blockSize;
+        bool isRead = (int) (rng() % 100) < desc.readPercent;
+
+        nsecs_t start = now;
+        ssize_t res;
+        if (isRead) {
+            res = TEMP_FAILURE_RETRY(pread64(fd, buf.get(), desc.blockSize, offset));
+        } else {
+            res = TEMP_FAILURE_RETRY(pwrite64(fd, buf.get(), desc.blockSize, offset));
+        }
+        now = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if (res < 0) {
+            failed++;
+            continue;
+        }
+        Stat stat = isRead ? kStatRead : kStatWrite;
+        stats.latency[stat].record(now - start);
+        stats.bytes[stat] += res;
+
+        if (desc.sync && !isRead) {
+            start = now;
+            res = TEMP_FAILURE_RETRY(fdatasync(fd));
+            now = systemTime(SYSTEM_TIME_MONOTONIC);
+            if (res < 0) {
+                failed++;
+            } else {
+                stats.latency[kStatFsync].record(now - start);
+            }
+        }
+    }
+
+    if (failed > 0) {
+        LOG(WARNING) << failed << " ops failed in " << desc.name << " thread " << index;
+    }
+    close(fd);
+    return OK;
+}
+
+status_t BenchmarkProfile::run(int dirFd) {
+    if (mDesc == nullptr) return -EINVAL;
+
+    std::vector<Stats> stats(mThreads);
+    int64_t deadlineNs = systemTime(SYSTEM_TIME_MONOTONIC)
+            + milliseconds_to_nanoseconds(mDurationMs);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < mThreads; i++) {
+        threads.emplace_back(&BenchmarkProfile::runThread, this, dirFd, i, deadlineNs,
+                std::ref(stats[i]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& threadStats : stats) {
+        mStats.merge(threadStats);
+    }
+    return OK;
+}
+
+status_t BenchmarkProfile::destroy(int dirFd) {
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (unlinkat(dirFd, kFileName, 0) != 0) {
+        return (errno == ENOENT) ? OK : -errno;
+    }
+    mStats.latency[kStatUnlink].record(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+    return OK;
+}
+
+std::string BenchmarkProfile::ident() const {
+    if (mDesc == nullptr) return "";
+    return StringPrintf("%s:m%" PRIu64 ":t%d:r%" PRIu64 ":w%" PRIu64 ":s%" PRIu64,
+            mDesc->name, mFileSize / 1048576, mThreads,
+            mStats.latency[kStatRead].getCount(),
+            mStats.latency[kStatWrite].getCount(),
+            mStats.latency[kStatFsync].getCount());
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_PROFILE_H
+#define ANDROID_VOLD_BENCHMARK_PROFILE_H
+
+#include "BenchmarkWorkload.h"
+#include "Utils.h"
+
+#include <utils/Errors.h>
+
+#include <string>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Synthetic workload against a single preallocated file, for comparing
+ * volumes with standard access patterns instead of a captured trace:
+ *
+ *   seq_read, seq_write        1MiB sequential, each thread in its own slice
+ *   rand_read, rand_write      4KiB random at queue depth 1
+ *   rand_read_qd32,
+ *   rand_write_qd32            4KiB random at queue depth 32
+ *   fsync                      4KiB sequential writes each followed by
+ *                              fdatasync(), the pattern SQLite journals produce
+ *   mixed                      4KiB random, 70% reads, queue depth 4
+ *
+ * Queue depth is the number of threads keeping a synchronous request in
+ * flight, and can be overridden. Data goes through O_DIRECT where the
+ * filesystem allows it so the device is measured rather than the page
+ * cache; the fsync profile is always buffered.
+ */
+class BenchmarkProfile : public BenchmarkWorkload {
+public:
+    BenchmarkProfile();
+
+    /* Zero selects the default for fileSize, durationMs and threads */
+    status_t init(const std::string& name, uint64_t fileSize, int durationMs, int threads);
+
+    status_t create(int dirFd) override;
+    status_t run(int dirFd) override;
+    status_t destroy(int dirFd) override;
+
+    std::string ident() const override;
+
+private:
+    struct Desc {
+        const char* name;
+        uint32_t blockSize;
+        int readPercent;
+        bool random;
+        bool direct;
+        bool sync;
+        int threads;
+    };
+
+    const Desc* mDesc;
+    uint64_t mFileSize;
+    int mDurationMs;
+    int mThreads;
+
+    static const Desc kProfiles[];
+
+    status_t runThread(int dirFd, int index, int64_t deadlineNs, Stats& stats);
+
+    DISALLOW_COPY_AND_ASSIGN(BenchmarkProfile);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
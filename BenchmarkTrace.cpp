@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkTrace.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char kTraceMagic[] = "VBT1";
+static const size_t kHeaderSize = 20;
+static const size_t kOpSize = 32;
+
+/* Bounds on what we accept from a trace file, far above real captures */
+static const uint32_t kMaxFiles = 65536;
+static const uint32_t kMaxHandles = 65536;
+static const uint32_t kMaxThreads = 256;
+static const uint32_t kMaxOps = 16 * 1024 * 1024;
+static const uint64_t kMaxFileSize = 1ULL << 32;
+
+/* Same cap benchgen.py has always applied to individual requests */
+static const size_t kBufferSize = 1048576;
+static const size_t kCreateChunkSize = 65536;
+
+static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static int toOpenFlags(uint32_t flags) {
+    int res = O_CLOEXEC | O_LARGEFILE;
+    switch (flags & BenchmarkTrace::kOpenAccessMask) {
+    case 1: res |= O_WRONLY; break;
+    case 2: res |= O_RDWR; break;
+    default: res |= O_RDONLY; break;
+    }
+    if (flags & BenchmarkTrace::kOpenCreate) res |= O_CREAT;
+    if (flags & BenchmarkTrace::kOpenTruncate) res |= O_TRUNC;
+    if (flags & BenchmarkTrace::kOpenAppend) res |= O_APPEND;
+    if (flags & BenchmarkTrace::kOpenSync) res |= O_DSYNC;
+    return res;
+}
+
+static std::string fileName(uint32_t id) {
+    return StringPrintf("file%u", id);
+}
+
+BenchmarkTrace::BenchmarkTrace() : mHandleCount(0), mReads(0), mWrites(0), mSyncs(0),
+        mTimed(false), mWall(0) {
+}
+
+status_t BenchmarkTrace::load(const std::string& path) {
+    std::string raw;
+    if (!ReadFileToString(path, &raw)) {
+        PLOG(ERROR) << "Failed to read " << path;
+        return -errno;
+    }
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(raw.data());
+
+    if (raw.size() < kHeaderSize || memcmp(data, kTraceMagic, 4)) {
+        LOG(ERROR) << path << " is not a benchmark trace";
+        return -EINVAL;
+    }
+    uint32_t fileCount = get32(data + 4);
+    uint32_t handleCount = get32(data + 8);
+    uint32_t threadCount = get32(data + 12);
+    uint32_t opCount = get32(data + 16);
+    if (fileCount > kMaxFiles || handleCount > kMaxHandles || threadCount == 0
+            || threadCount > kMaxThreads || opCount > kMaxOps
+            || raw.size() != kHeaderSize + fileCount * 8 + (uint64_t) opCount * kOpSize) {
+        LOG(ERROR) << path << " has an invalid header";
+        return -EINVAL;
+    }
+
+    mFileSizes.clear();
+    mThreadOps.assign(threadCount, std::vector<Op>());
+    mHandleCount = handleCount;
+    mReads = mWrites = mSyncs = 0;
+
+    const uint8_t* p = data + kHeaderSize;
+    for (uint32_t i = 0; i < fileCount; i++, p += 8) {
+        mFileSizes.push_back(std::min(get64(p), kMaxFileSize));
+    }
+
+    // Which file each handle has open, and the last op that modified each
+    // file as a thread and count of ops that thread had finished by then
+    std::vector<int64_t> handleFiles(handleCount, -1);
+    std::vector<std::pair<int32_t, uint32_t>> lastWrites(fileCount, std::make_pair(-1, 0));
+
+    for (uint32_t i = 0; i < opCount; i++, p += kOpSize) {
+        Op op;
+        op.type = static_cast<OpType>(p[0]);
+        op.thread = get16(p + 2);
+        op.handle = get32(p + 4);
+        op.arg = get32(p + 8);
+        op.length = std::min((size_t) get32(p + 12), kBufferSize);
+        op.offset = (int64_t) get64(p + 16);
+        op.timeUs = get64(p + 24);
+        op.waitThread = -1;
+        op.waitCount = 0;
+        op.signal = false;
+
+        if (op.thread >= threadCount || op.handle >= handleCount
+                || op.type < OpType::kOpen || op.type > OpType::kFdatasync
+                || (op.type == OpType::kOpen && op.arg >= fileCount)) {
+            LOG(ERROR) << path << " has an invalid op " << i;
+            return -EINVAL;
+        }
+
+        switch (op.type) {
+        case OpType::kRead: case OpType::kPread: mReads++; break;
+        case OpType::kWrite: case OpType::kPwrite: mWrites++; break;
+        case OpType::kFsync: case OpType::kFdatasync: mSyncs++; break;
+        default: break;
+        }
+
+        // Ops are sorted by time, so waits only ever point backwards and
+        // can't deadlock
+        auto& threadOps = mThreadOps[op.thread];
+        bool modifies = false;
+        if (op.type == OpType::kOpen) {
+            handleFiles[op.handle] = op.arg;
+            const auto& last = lastWrites[op.arg];
+            if (last.first != -1 && last.first != op.thread) {
+                op.waitThread = last.first;
+                op.waitCount = last.second;
+                mThreadOps[last.first][last.second - 1].signal = true;
+            }
+            modifies = (op.offset & (kOpenCreate | kOpenTruncate));
+        } else {
+            modifies = (op.type == OpType::kWrite || op.type == OpType::kPwrite
+                    || op.type == OpType::kFsync || op.type == OpType::kFdatasync);
+        }
+        if (modifies && handleFiles[op.handle] != -1) {
+            lastWrites[handleFiles[op.handle]] = std::make_pair(op.thread, threadOps.size() + 1);
+        }
+        threadOps.push_back(op);
+    }
+
+    LOG(INFO) << "Loaded " << opCount << " ops over " << fileCount << " files and "
+            << threadCount << " threads from " << path;
+    return OK;
+}
+
+status_t BenchmarkTrace::create(int dirFd) {
+    std::string buf;
+    if (ReadRandomBytes(kCreateChunkSize, buf) != OK) {
+        LOG(ERROR) << "Failed to read random data";
+        return -EIO;
+    }
+
+    status_t res = OK;
+    for (size_t i = 0; i < mFileSizes.size(); i++) {
+        std::string name(fileName(i));
+        int fd = TEMP_FAILURE_RETRY(openat(dirFd, name.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (fd < 0) {
+            PLOG(ERROR) << "Failed to open " << name;
+            res = -errno;
+            continue;
+        }
+        uint64_t len = mFileSizes[i];
+        while (len > 0) {
+            ssize_t n = TEMP_FAILURE_RETRY(write(fd, buf.data(),
+                    std::min(len, (uint64_t) buf.size())));
+            if (n <= 0) {
+                PLOG(ERROR) << "Failed to write " << name;
+                res = -EIO;
+                break;
+            }
+            len -= n;
+        }
+        close(fd);
+    }
+    return res;
+}
+
+status_t BenchmarkTrace::runThread(int dirFd, size_t thread, std::vector<int>& fds, int64_t startNs,
+        Stats& stats, ThreadResult& result) {
+    const std::vector<Op>& ops = mThreadOps[thread];
+    std::unique_ptr<char[]> buf(new char[kBufferSize]);
+    int failed = 0;
+    result = {};
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        const Op& op = ops[i];
+        if (op.waitThread != -1) {
+            nsecs_t waitStart = systemTime(SYSTEM_TIME_MONOTONIC);
+            std::unique_lock<std::mutex> lock(mProgressLock);
+            mProgressCv.wait(lock, [&] { return mProgress[op.waitThread] >= op.waitCount; });
+            result.wait += systemTime(SYSTEM_TIME_MONOTONIC) - waitStart;
+        }
+        if (mTimed) {
+            int64_t delayNs = startNs + (int64_t) op.timeUs * 1000
+                    - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (delayNs > 0) {
+                usleep(delayNs / 1000);
+            }
+        }
+
+        int& fd = fds[op.handle];
+        ssize_t res = 0;
+        int stat = -1;
+        if (op.type == OpType::kOpen && fd >= 0) {
+            close(fd);
+        }
+        std::string name(op.type == OpType::kOpen ? fileName(op.arg) : "");
+
+        nsecs_t opStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        switch (op.type) {
+        case OpType::kOpen:
+            fd = TEMP_FAILURE_RETRY(openat(dirFd, name.c_str(), toOpenFlags(op.offset)));
+            res = fd;
+            stat = kStatOpen;
+            break;
+        case OpType::kClose:
+            res = close(fd);
+            fd = -1;
+            break;
+        case OpType::kRead:
+            res = TEMP_FAILURE_RETRY(read(fd, buf.get(), op.length));
+            stat = kStatRead;
+            break;
+        case OpType::kWrite:
+            res = TEMP_FAILURE_RETRY(write(fd, buf.get(), op.length));
+            stat = kStatWrite;
+            break;
+        case OpType::kPread:
+            res = TEMP_FAILURE_RETRY(pread64(fd, buf.get(), op.length, op.offset));
+            stat = kStatPread;
+            break;
+        case OpType::kPwrite:
+            res = TEMP_FAILURE_RETRY(pwrite64(fd, buf.get(), op.length, op.offset));
+            stat = kStatWrite;
+            break;
+        case OpType::kLseek:
+            res = TEMP_FAILURE_RETRY(lseek64(fd, op.offset, op.arg));
+            break;
+        case OpType::kFsync:
+            res = TEMP_FAILURE_RETRY(fsync(fd));
+            stat = kStatFsync;
+            break;
+        case OpType::kFdatasync:
+            res = TEMP_FAILURE_RETRY(fdatasync(fd));
+            stat = kStatFsync;
+            break;
+        }
+        nsecs_t opEnd = systemTime(SYSTEM_TIME_MONOTONIC);
+        result.stall += opEnd - opStart;
+
+        if (op.signal) {
+            std::lock_guard<std::mutex> lock(mProgressLock);
+            mProgress[thread] = i + 1;
+            mProgressCv.notify_all();
+        }
+
+        if (res < 0) {
+            failed++;
+        } else if (stat >= 0) {
+            stats.latency[stat].record(opEnd - opStart);
+            if (stat != kStatOpen && stat != kStatFsync) {
+                stats.bytes[stat] += res;
+            }
+        }
+    }
+
+    result.ops = ops.size();
+    result.wall = systemTime(SYSTEM_TIME_MONOTONIC) - startNs;
+
+    if (failed > 0) {
+        LOG(WARNING) << failed << " of " << ops.size() << " replayed ops failed";
+    }
+    return OK;
+}
+
+status_t BenchmarkTrace::run(int dirFd) {
+    std::vector<int> fds(mHandleCount, -1);
+    std::vector<Stats> stats(mThreadOps.size());
+    mThreadResults.assign(mThreadOps.size(), ThreadResult());
+    mProgress.assign(mThreadOps.size(), 0);
+    int64_t startNs = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (mThreadOps.size() == 1) {
+        runThread(dirFd, 0, fds, startNs, stats[0], mThreadResults[0]);
+    } else {
+        // Handles never cross threads, so sharing the table is safe
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < mThreadOps.size(); i++) {
+            threads.emplace_back(&BenchmarkTrace::runThread, this, dirFd, i, std::ref(fds),
+                    startNs, std::ref(stats[i]), std::ref(mThreadResults[i]));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    mWall = systemTime(SYSTEM_TIME_MONOTONIC) - startNs;
+
+    for (const auto& threadStats : stats) {
+        mStats.merge(threadStats);
+    }
+
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+    return OK;
+}
+
+status_t BenchmarkTrace::destroy(int dirFd) {
+    status_t res = OK;
+    for (size_t i = 0; i < mFileSizes.size(); i++) {
+        std::string name(fileName(i));
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (unlinkat(dirFd, name.c_str(), 0) != 0) {
+            if (errno != ENOENT) {
+                res = -errno;
+            }
+        } else {
+            mStats.latency[kStatUnlink].record(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+        }
+    }
+    return res;
+}
+
+std::string BenchmarkTrace::ident() const {
+    return StringPrintf("r%d:w%d:s%d", mReads, mWrites, mSyncs);
+}
+
+std::vector<std::string> BenchmarkTrace::getThreadSummary() const {
+    std::vector<std::string> res;
+    if (mThreadResults.empty()) {
+        return res;
+    }
+    for (size_t i = 0; i < mThreadResults.size(); i++) {
+        const ThreadResult& result = mThreadResults[i];
+        if (result.ops == 0) continue;
+        res.push_back(StringPrintf("thread %zu ops %zu wall %" PRId64 " stall %" PRId64
+                " wait %" PRId64, i, result.ops, nanoseconds_to_microseconds(result.wall),
+                nanoseconds_to_microseconds(result.stall),
+                nanoseconds_to_microseconds(result.wait)));
+    }
+    res.push_back(StringPrintf("threads %zu wall %" PRId64, mThreadResults.size(),
+            nanoseconds_to_microseconds(mWall)));
+    return res;
+}
+
+}  // namespace vold
+}  // namespace android
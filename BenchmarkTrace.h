@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_TRACE_H
+#define ANDROID_VOLD_BENCHMARK_TRACE_H
+
+#include "BenchmarkWorkload.h"
+#include "Utils.h"
+
+#include <utils/Errors.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Storage workload captured by bench/benchgen.py --trace. All integers are
+ * little-endian:
+ *
+ *   char     magic[4]        "VBT1"
+ *   uint32_t fileCount, handleCount, threadCount, opCount
+ *   uint64_t fileSizes[fileCount]
+ *   Op       ops[opCount]    32 bytes each, sorted by time
+ *
+ * Files are created as "file<N>" in the working directory. Handles stand
+ * in for the traced file descriptors and are only ever used by the thread
+ * that opened them, so each thread replays on its own worker. Files are
+ * shared though: when a thread opens a file that another thread wrote
+ * earlier in the capture, replay waits for that write to finish first,
+ * so untimed replays keep the original ordering between threads.
+ */
+class BenchmarkTrace : public BenchmarkWorkload {
+public:
+    enum class OpType : uint8_t {
+        kOpen = 1,
+        kClose = 2,
+        kRead = 3,
+        kWrite = 4,
+        kPread = 5,
+        kPwrite = 6,
+        kLseek = 7,
+        kFsync = 8,
+        kFdatasync = 9,
+    };
+
+    /* Portable open flags; the low two bits carry the access mode */
+    static const uint32_t kOpenAccessMask = 3;
+    static const uint32_t kOpenCreate = 1 << 2;
+    static const uint32_t kOpenTruncate = 1 << 3;
+    static const uint32_t kOpenAppend = 1 << 4;
+    static const uint32_t kOpenSync = 1 << 5;
+
+    struct Op {
+        OpType type;
+        uint16_t thread;
+        uint32_t handle;
+        /* File id for kOpen, whence for kLseek */
+        uint32_t arg;
+        uint32_t length;
+        /* Open flags for kOpen, otherwise file offset */
+        int64_t offset;
+        /* Microseconds since the start of the capture */
+        uint64_t timeUs;
+        /* Wait for waitThread to finish waitCount ops first, if not -1 */
+        int32_t waitThread;
+        uint32_t waitCount;
+        /* Another thread waits on this op */
+        bool signal;
+    };
+
+    BenchmarkTrace();
+
+    status_t load(const std::string& path);
+
+    /* Honour the gaps between ops in the original capture during run() */
+    void setTimed(bool timed) { mTimed = timed; }
+
+    status_t create(int dirFd) override;
+    status_t run(int dirFd) override;
+    status_t destroy(int dirFd) override;
+
+    std::string ident() const override;
+    std::vector<std::string> getThreadSummary() const override;
+
+private:
+    struct ThreadResult {
+        size_t ops;
+        /* From the start of replay until this thread's last op */
+        nsecs_t wall;
+        /* Spent inside replayed syscalls, blocked on storage */
+        nsecs_t stall;
+        /* Spent waiting on other threads' writes */
+        nsecs_t wait;
+    };
+
+    std::vector<uint64_t> mFileSizes;
+    uint32_t mHandleCount;
+    std::vector<std::vector<Op>> mThreadOps;
+    int mReads;
+    int mWrites;
+    int mSyncs;
+    bool mTimed;
+
+    std::vector<ThreadResult> mThreadResults;
+    nsecs_t mWall;
+
+    /* Ops finished by each thread, for ops that wait on another thread */
+    std::mutex mProgressLock;
+    std::condition_variable mProgressCv;
+    std::vector<uint32_t> mProgress;
+
+    status_t runThread(int dirFd, size_t thread, std::vector<int>& fds, int64_t startNs, Stats& stats,
+            ThreadResult& result);
+
+    DISALLOW_COPY_AND_ASSIGN(BenchmarkTrace);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
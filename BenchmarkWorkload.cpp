@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BenchmarkWorkload.h"
+
+#include <android-base/stringprintf.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kStatNames[] = { "open", "read", "pread", "write", "fsync", "unlink" };
+
+void BenchmarkWorkload::Stats::merge(const Stats& other) {
+    for (int i = 0; i < kStatCount; i++) {
+        latency[i].merge(other.latency[i]);
+        bytes[i] += other.bytes[i];
+    }
+}
+
+std::vector<std::string> BenchmarkWorkload::getLatencySummary() const {
+    std::vector<std::string> res;
+    for (int i = 0; i < kStatCount; i++) {
+        const LatencyHistogram& latency = mStats.latency[i];
+        if (latency.getCount() == 0) continue;
+
+        double mbps = 0;
+        if (latency.getTotal() > 0) {
+            mbps = (mStats.bytes[i] / 1048576.0) / (latency.getTotal() / 1e9);
+        }
+        res.push_back(StringPrintf("%s %s %.2f", kStatNames[i],
+                latency.toString().c_str(), mbps));
+    }
+    return res;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_BENCHMARK_WORKLOAD_H
+#define ANDROID_VOLD_BENCHMARK_WORKLOAD_H
+
+#include "LatencyHistogram.h"
+
+#include <utils/Errors.h>
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Workload driven by Benchmark.cpp in the directory dirFd refers to:
+ * create() lays out files, run() exercises them after caches are dropped
+ * and destroy() removes them. Files are only reached relative to dirFd,
+ * never the working directory, so workloads on different volumes can run
+ * at once. Implementations time the individual ops they issue so the
+ * latency distribution can be reported alongside totals.
+ */
+class BenchmarkWorkload {
+public:
+    virtual ~BenchmarkWorkload() {}
+
+    virtual status_t create(int dirFd) = 0;
+    virtual status_t run(int dirFd) = 0;
+    virtual status_t destroy(int dirFd) = 0;
+
+    /* Summary of the workload, in the same form BenchmarkGen.h reports */
+    virtual std::string ident() const = 0;
+
+    /*
+     * Latency of every timed op, one line per op type as
+     * "<op> count p50 p90 p99 p99.9 max MB/s" with latencies in
+     * microseconds and throughput over the time spent inside those ops.
+     */
+    std::vector<std::string> getLatencySummary() const;
+
+    /*
+     * For workloads that replay several threads, one line per thread as
+     * "thread <n> ops <count> wall <us> stall <us> wait <us>" followed by
+     * "threads <count> wall <us>" for the replay as a whole.
+     */
+    virtual std::vector<std::string> getThreadSummary() const { return {}; }
+
+protected:
+    enum Stat {
+        kStatOpen,
+        kStatRead,
+        kStatPread,
+        kStatWrite,
+        kStatFsync,
+        kStatUnlink,
+        kStatCount,
+    };
+
+    struct Stats {
+        LatencyHistogram latency[kStatCount];
+        uint64_t bytes[kStatCount] = {};
+
+        void merge(const Stats& other);
+    };
+
+    Stats mStats;
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -32,6 +32,9 @@
 #include <inttypes.h>
 #include <ctype.h>
 
+#include <string>
+#include <vector>
+
 #define LOG_TAG "VoldCmdListener"
 
 #include <android-base/logging.h>
@@ -41,6 +44,11 @@
 #include <sysutils/SocketClient.h>
 #include <private/android_filesystem_config.h>
 
+#include "Benchmark.h"
+#include "BenchmarkHistory.h"
+#include "Ext4Crypt.h"
+#include "Keymaster.h"
+#include "KeyedWorkQueue.h"
 #include "CommandListener.h"
 #include "VolumeManager.h"
 #include "VolumeBase.h"
@@ -49,11 +57,19 @@
 #include "Loop.h"
 #include "Devmapper.h"
 #include "MoveTask.h"
+#include "MountNamespace.h"
+#include "NetlinkManager.h"
+#include "OperationStats.h"
+#include "StorageWear.h"
 #include "TrimTask.h"
+#include "cryptfs.h"
 
 #define DUMP_ARGS 0
 #define DEBUG_APPFUSE 0
 
+/* Enough for a slow mount or format plus a few quick commands */
+static const size_t kCommandThreads = 4;
+
 CommandListener::CommandListener() :
                  FrameworkListener("vold", true) {
     registerCmd(new DumpCmd());
@@ -97,7 +113,7 @@ void CommandListener::dumpArgs(int argc, char **argv, int argObscure) {
 void CommandListener::dumpArgs(int /*argc*/, char ** /*argv*/, int /*argObscure*/) { }
 #endif
 
-int CommandListener::sendGenericOkFail(SocketClient *cli, int cond) {
+int CommandListener::sendGenericOkFail(QueuedReply *cli, int cond) {
     if (!cond) {
         return cli->sendMsg(ResponseCode::CommandOkay, "Command succeeded", false);
     } else {
@@ -105,6 +121,37 @@ int CommandListener::sendGenericOkFail(SocketClient *cli, int cond) {
     }
 }
 
+static android::vold::KeyedWorkQueue& getCommandQueue() {
+    static android::vold::KeyedWorkQueue queue(kCommandThreads);
+    return queue;
+}
+
+CommandListener::AsyncCommand::AsyncCommand(const char *cmd) :
+                 VoldCommand(cmd) {
+}
+
+int CommandListener::AsyncCommand::runCommand(SocketClient *cli,
+                                              int argc, char **argv) {
+    // Neither argv nor the client's sequence number outlive this call
+    std::vector<std::string> args(argv, argv + argc);
+    int cmdNum = cli->getCmdNum();
+    cli->incRef();
+
+    getCommandQueue().enqueue(getQueueKey(argc, argv), [this, cli, cmdNum, args] {
+        std::vector<std::string> argStorage(args);
+        std::vector<char *> queuedArgv;
+        for (auto& arg : argStorage) {
+            queuedArgv.push_back(&arg[0]);
+        }
+        queuedArgv.push_back(nullptr);
+
+        // The listener rewrites the client's sequence number per command
+        QueuedReply reply(cli, cmdNum);
+        runQueued(&reply, argStorage.size(), queuedArgv.data());
+    });
+    return 0;
+}
+
 CommandListener::DumpCmd::DumpCmd() :
                  VoldCommand("dump") {
 }
@@ -129,17 +176,78 @@ int CommandListener::DumpCmd::runCommand(SocketClient *cli,
         }
         fclose(fp);
     }
+    cli->sendMsg(0, "Dumping benchmark latency", false);
+    for (const auto& line : android::vold::GetBenchmarkLatency()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
+    cli->sendMsg(0, "Dumping dm-crypt options", false);
+    char opts[256];
+    for (int i = 0; cryptfs_get_crypt_opts(i, opts, sizeof(opts)) == 0; i++) {
+        cli->sendMsg(0, opts, false);
+    }
+    cli->sendMsg(0, "Dumping cipher selection", false);
+    for (int i = 0; cryptfs_get_cipher_bench(i, opts, sizeof(opts)) == 0; i++) {
+        cli->sendMsg(0, opts, false);
+    }
+    cli->sendMsg(0, "Dumping file encryption keys", false);
+    for (int i = 0; e4crypt_get_key_status(i, opts, sizeof(opts)) == 0; i++) {
+        cli->sendMsg(0, opts, false);
+    }
+    cli->sendMsg(0, "Dumping disk queue tuning", false);
+    for (const auto& line : VolumeManager::Instance()->getQueueTuning()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
+    cli->sendMsg(0, "Dumping uevent queue", false);
+    for (const auto& line : NetlinkManager::Instance()->getStats()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
+    cli->sendMsg(0, "Dumping operation stats", false);
+    for (const auto& line : android::vold::GetOperationStats()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
+    cli->sendMsg(0, "Dumping storage wear", false);
+    for (const auto& line : android::vold::GetStorageWear()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
+    cli->sendMsg(0, "Dumping keymaster calls", false);
+    for (const auto& line : android::vold::Keymaster::getCallStats()) {
+        cli->sendMsg(0, line.c_str(), false);
+    }
 
     cli->sendMsg(ResponseCode::CommandOkay, "dump complete", false);
     return 0;
 }
 
 CommandListener::VolumeCmd::VolumeCmd() :
-                 VoldCommand("volume") {
+                 AsyncCommand("volume") {
+}
+
+std::string CommandListener::VolumeCmd::getQueueKey(int argc, char **argv) {
+    std::string cmd((argc > 1) ? argv[1] : "");
+    if (argc > 2 && cmd == "partition") {
+        return std::string("disk:") + argv[2];
+    } else if (argc > 2 && (cmd == "mount" || cmd == "unmount" || cmd == "format"
+            || cmd == "benchmark")) {
+        // Volumes follow their disk, so they can't race a reset or
+        // partition of it; internal ones all share one key
+        auto vol = VolumeManager::Instance()->findVolume(argv[2]);
+        if (vol == nullptr) {
+            return "volume";
+        }
+        std::string diskId(vol->getHostDiskId());
+        return diskId.empty() ? "internal" : "disk:" + diskId;
+    } else if (cmd == "debug" || cmd == "mkdirs" || cmd == "benchmark_verdict"
+            || cmd == "remount_uid") {
+        // Nothing here creates, destroys, mounts or unmounts volumes
+        return "volume";
+    }
+    // Everything else changes the lifecycle of more than one volume, or
+    // state their mounts depend on, so it runs alone
+    return "";
 }
 
-int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
-                                           int argc, char **argv) {
+int CommandListener::VolumeCmd::runQueued(QueuedReply *cli,
+                                          int argc, char **argv) {
     dumpArgs(argc, argv, -1);
 
     if (argc < 2) {
@@ -147,8 +255,9 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         return 0;
     }
 
+    // Each branch takes only the locks it needs, so queries and commands
+    // for other disks never wait behind a slow mount or format
     VolumeManager *vm = VolumeManager::Instance();
-    std::lock_guard<std::mutex> lock(vm->getLock());
 
     // TODO: tease out methods not directly related to volumes
 
@@ -169,6 +278,10 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         if (disk == nullptr) {
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown disk", false);
         }
+        std::lock_guard<std::mutex> lock(disk->getLock());
+        if (vm->findDisk(id) != disk) {
+            return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown disk", false);
+        }
 
         std::string type(argv[3]);
         if (type == "public") {
@@ -212,10 +325,25 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         if (vol == nullptr) {
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
+        std::lock_guard<std::mutex> lock(vm->getVolumeLock(vol));
+        if (vm->findVolume(id) != vol) {
+            return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
+        }
 
         int mountFlags = (argc > 3) ? atoi(argv[3]) : 0;
         userid_t mountUserId = (argc > 4) ? atoi(argv[4]) : -1;
 
+        // A volume kept mounted across reset is simply confirmed
+        if (vol->getState() == android::vold::VolumeBase::State::kMounted) {
+            if (vol->getMountFlags() == mountFlags && vol->getMountUserId() == mountUserId) {
+                if (mountFlags & android::vold::VolumeBase::MountFlags::kPrimary) {
+                    vm->setPrimary(vol);
+                }
+                return sendGenericOkFail(cli, android::OK);
+            }
+            vol->unmount();
+        }
+
         vol->setMountFlags(mountFlags);
         vol->setMountUserId(mountUserId);
 
@@ -232,6 +360,10 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         if (vol == nullptr) {
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
+        std::lock_guard<std::mutex> lock(vm->getVolumeLock(vol));
+        if (vm->findVolume(id) != vol) {
+            return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
+        }
         bool detach = (argc > 3 && !strcmp(argv[3], "detach"));
 
         return sendGenericOkFail(cli, vol->unmount(detach));
@@ -244,6 +376,10 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         if (vol == nullptr) {
             return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
         }
+        std::lock_guard<std::mutex> lock(vm->getVolumeLock(vol));
+        if (vm->findVolume(id) != vol) {
+            return cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown volume", false);
+        }
 
         return sendGenericOkFail(cli, vol->format(fsType));
 
@@ -259,12 +395,31 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
         return sendGenericOkFail(cli, 0);
 
     } else if (cmd == "benchmark" && argc > 2) {
-        // benchmark [volId]
+        // benchmark [volId] [profile|default] [sizeMb] [durationMs] [threads]
         std::string id(argv[2]);
-        nsecs_t res = vm->benchmarkPrivate(id);
+        std::string name((argc > 3) ? argv[3] : "default");
+        android::vold::BenchmarkProfile profile;
+        if (name != "default") {
+            uint64_t sizeMb = (argc > 4) ? strtoull(argv[4], nullptr, 10) : 0;
+            int durationMs = (argc > 5) ? atoi(argv[5]) : 0;
+            int threads = (argc > 6) ? atoi(argv[6]) : 0;
+            if (profile.init(name, sizeMb * 1048576, durationMs, threads)) {
+                return cli->sendMsg(ResponseCode::CommandSyntaxError,
+                        "Unknown profile or invalid options", false);
+            }
+        }
+        nsecs_t res = vm->benchmarkVolume(id, (name != "default") ? &profile : nullptr);
         return cli->sendMsg(ResponseCode::CommandOkay,
                 android::base::StringPrintf("%" PRId64, res).c_str(), false);
 
+    } else if (cmd == "benchmark_verdict" && argc > 2) {
+        // benchmark_verdict [volId]
+        std::string verdict(android::vold::GetBenchmarkVerdict(vm->getBenchmarkKey(argv[2])));
+        if (verdict.empty()) {
+            return cli->sendMsg(ResponseCode::OperationFailed, "No benchmark history", false);
+        }
+        return cli->sendMsg(ResponseCode::CommandOkay, verdict.c_str(), false);
+
     } else if (cmd == "forget_partition" && argc > 2) {
         // forget_partition [partGuid]
         std::string partGuid(argv[2]);
@@ -281,10 +436,15 @@ int CommandListener::VolumeCmd::runCommand(SocketClient *cli,
 }
 
 CommandListener::StorageCmd::StorageCmd() :
-                 VoldCommand("storage") {
+                 AsyncCommand("storage") {
+}
+
+std::string CommandListener::StorageCmd::getQueueKey(int argc, char **argv) {
+    // mountall touches every fstab entry, so let it run alone
+    return (argc > 1 && !strcmp(argv[1], "mountall")) ? "" : "storage";
 }
 
-int CommandListener::StorageCmd::runCommand(SocketClient *cli,
+int CommandListener::StorageCmd::runQueued(QueuedReply *cli,
                                                       int argc, char **argv) {
     /* Guarantied to be initialized by vold's main() before the CommandListener is active */
     extern struct fstab *fstab;
@@ -306,40 +466,22 @@ int CommandListener::StorageCmd::runCommand(SocketClient *cli,
         return 0;
     }
     if (!strcmp(argv[1], "users")) {
-        DIR *dir;
-        struct dirent *de;
+        std::vector<Process::Info> processes;
 
         if (argc < 3) {
             cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument: user <mountpoint>", false);
             return 0;
         }
-        if (!(dir = opendir("/proc"))) {
+        if (Process::scan(processes, argv[2]) != 0) {
             cli->sendMsg(ResponseCode::OperationFailed, "Failed to open /proc", true);
             return 0;
         }
 
-        while ((de = readdir(dir))) {
-            int pid = Process::getPid(de->d_name);
-
-            if (pid < 0) {
-                continue;
-            }
-
-            char processName[255];
-            Process::getProcessName(pid, processName, sizeof(processName));
-
-            if (Process::checkFileDescriptorSymLinks(pid, argv[2]) ||
-                Process::checkFileMaps(pid, argv[2]) ||
-                Process::checkSymLink(pid, argv[2], "cwd") ||
-                Process::checkSymLink(pid, argv[2], "root") ||
-                Process::checkSymLink(pid, argv[2], "exe")) {
-
-                char msg[1024];
-                snprintf(msg, sizeof(msg), "%d %s", pid, processName);
-                cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
-            }
+        for (const auto& info : processes) {
+            char msg[1024];
+            snprintf(msg, sizeof(msg), "%d %s", info.pid, info.name.c_str());
+            cli->sendMsg(ResponseCode::StorageUsersListResult, msg, false);
         }
-        closedir(dir);
         cli->sendMsg(ResponseCode::CommandOkay, "Storage user list complete", false);
     } else {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Unknown storage cmd", false);
@@ -348,10 +490,10 @@ int CommandListener::StorageCmd::runCommand(SocketClient *cli,
 }
 
 CommandListener::AsecCmd::AsecCmd() :
-                 VoldCommand("asec") {
+                 AsyncCommand("asec") {
 }
 
-void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const char *directory) {
+void CommandListener::AsecCmd::listAsecsInDirectory(QueuedReply *cli, const char *directory) {
     DIR *d = opendir(directory);
 
     if (!d) {
@@ -389,7 +531,12 @@ void CommandListener::AsecCmd::listAsecsInDirectory(SocketClient *cli, const cha
     free(dent);
 }
 
-int CommandListener::AsecCmd::runCommand(SocketClient *cli,
+std::string CommandListener::AsecCmd::getQueueKey(int /*argc*/, char ** /*argv*/) {
+    // Shares the container table with obb
+    return "container";
+}
+
+int CommandListener::AsecCmd::runQueued(QueuedReply *cli,
                                                       int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
@@ -528,10 +675,14 @@ int CommandListener::AsecCmd::runCommand(SocketClient *cli,
 }
 
 CommandListener::ObbCmd::ObbCmd() :
-                 VoldCommand("obb") {
+                 AsyncCommand("obb") {
+}
+
+std::string CommandListener::ObbCmd::getQueueKey(int /*argc*/, char ** /*argv*/) {
+    return "container";
 }
 
-int CommandListener::ObbCmd::runCommand(SocketClient *cli,
+int CommandListener::ObbCmd::runQueued(QueuedReply *cli,
                                                       int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing Argument", false);
@@ -544,7 +695,11 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
     if (!strcmp(argv[1], "list")) {
         dumpArgs(argc, argv, -1);
 
-        rc = vm->listMountedObbs(cli);
+        std::vector<std::string> ids;
+        rc = vm->listMountedObbs(ids);
+        for (const auto& id : ids) {
+            cli->sendMsg(ResponseCode::AsecListResult, id.c_str(), false);
+        }
     } else if (!strcmp(argv[1], "mount")) {
             dumpArgs(argc, argv, 3);
             if (argc != 5) {
@@ -592,9 +747,13 @@ int CommandListener::ObbCmd::runCommand(SocketClient *cli,
 }
 
 CommandListener::FstrimCmd::FstrimCmd() :
-                 VoldCommand("fstrim") {
+                 AsyncCommand("fstrim") {
 }
-int CommandListener::FstrimCmd::runCommand(SocketClient *cli,
+std::string CommandListener::FstrimCmd::getQueueKey(int /*argc*/, char ** /*argv*/) {
+    return "fstrim";
+}
+
+int CommandListener::FstrimCmd::runQueued(QueuedReply *cli,
                                                       int argc, char **argv) {
     if ((cli->getUid() != 0) && (cli->getUid() != AID_SYSTEM)) {
         cli->sendMsg(ResponseCode::CommandNoPermission, "No permission to run fstrim commands", false);
@@ -606,13 +765,13 @@ int CommandListener::FstrimCmd::runCommand(SocketClient *cli,
         return 0;
     }
 
-    VolumeManager *vm = VolumeManager::Instance();
-    std::lock_guard<std::mutex> lock(vm->getLock());
-
     int flags = 0;
 
     std::string cmd(argv[1]);
-    if (cmd == "dotrim") {
+    if (cmd == "cancel") {
+        android::vold::TrimTask::cancelAll();
+        return sendGenericOkFail(cli, 0);
+    } else if (cmd == "dotrim") {
         flags = 0;
     } else if (cmd == "dotrimbench") {
         flags = android::vold::TrimTask::Flags::kBenchmarkAfter;
@@ -712,65 +871,48 @@ static android::status_t runCommandInNamespace(const std::string& command,
 
     // Matches so far, but refuse to touch if in root namespace
     {
-        char rootName[PATH_MAX];
-        char pidName[PATH_MAX];
-        const int root_result =
-                android::vold::SaneReadLinkAt(dirfd(dir.get()), "1/ns/mnt", rootName, PATH_MAX);
-        const int pid_result =
-                android::vold::SaneReadLinkAt(pid_fd.get(), "ns/mnt", pidName, PATH_MAX);
-        if (root_result == -1) {
-            LOG(ERROR) << "Failed to readlink for /proc/1/ns/mnt";
+        struct stat sb;
+        if (fstatat(pid_fd.get(), "ns/mnt", &sb, 0) == -1) {
+            PLOG(ERROR) << "Failed to stat /proc/" << pid << "/ns/mnt";
             return -EPERM;
         }
-        if (pid_result == -1) {
-            LOG(ERROR) << "Failed to readlink for /proc/" << pid << "/ns/mnt";
+        const ino_t root = android::vold::GetRootMountNamespace();
+        if (root == 0) {
+            LOG(ERROR) << "Failed to find root namespace";
             return -EPERM;
         }
-        if (!strcmp(rootName, pidName)) {
+        if (sb.st_ino == root) {
             LOG(ERROR) << "Don't mount appfuse in root namespace";
             return -EPERM;
         }
     }
 
-    // We purposefully leave the namespace open across the fork
-    android::vold::ScopedFd ns_fd(openat(pid_fd.get(), "ns/mnt", O_RDONLY));
+    android::vold::ScopedFd ns_fd(openat(pid_fd.get(), "ns/mnt", O_RDONLY | O_CLOEXEC));
     if (ns_fd.get() < 0) {
         PLOG(ERROR) << "Failed to open namespace for /proc/" << pid << "/ns/mnt";
         return -errno;
     }
 
-    int child = fork();
-    if (child == 0) {
-        if (setns(ns_fd.get(), CLONE_NEWNS) != 0) {
-            PLOG(ERROR) << "Failed to setns";
-            _exit(-errno);
-        }
-
+    if (command != "mount" && command != "unmount") {
+        LOG(ERROR) << "Unknown appfuse command " << command;
+        return -EPERM;
+    }
+    return android::vold::RunInMountNamespace(ns_fd.get(), [&]() -> android::status_t {
         if (command == "mount") {
-            _exit(mountInNamespace(uid, device_fd, path));
-        } else if (command == "unmount") {
-            android::vold::ForceUnmount(path);
-            _exit(android::OK);
-        } else {
-            LOG(ERROR) << "Unknown appfuse command " << command;
-            _exit(-EPERM);
+            return mountInNamespace(uid, device_fd, path);
         }
-    }
-
-    if (child == -1) {
-        PLOG(ERROR) << "Failed to folk child process";
-        return -errno;
-    }
+        android::vold::ForceUnmount(path);
+        return android::OK;
+    });
+}
 
-    android::status_t status;
-    TEMP_FAILURE_RETRY(waitpid(child, &status, 0));
+CommandListener::AppFuseCmd::AppFuseCmd() : AsyncCommand("appfuse") {}
 
-    return status;
+std::string CommandListener::AppFuseCmd::getQueueKey(int /*argc*/, char ** /*argv*/) {
+    return "appfuse";
 }
 
-CommandListener::AppFuseCmd::AppFuseCmd() : VoldCommand("appfuse") {}
-
-int CommandListener::AppFuseCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+int CommandListener::AppFuseCmd::runQueued(QueuedReply *cli, int argc, char **argv) {
     if (argc < 2) {
         cli->sendMsg(ResponseCode::CommandSyntaxError, "Missing argument", false);
         return 0;
@@ -838,7 +980,7 @@ int CommandListener::AppFuseCmd::runCommand(SocketClient *cli, int argc, char **
     return cli->sendMsg(ResponseCode::CommandSyntaxError,  "Unknown appfuse cmd", false);
 }
 
-android::status_t CommandListener::AppFuseCmd::sendFd(SocketClient *cli, int fd) {
+android::status_t CommandListener::AppFuseCmd::sendFd(QueuedReply *cli, int fd) {
     struct iovec data;
     char dataBuffer[128];
     char controlBuffer[CMSG_SPACE(sizeof(int))];
@@ -21,6 +21,8 @@
 #include <utils/Errors.h>
 #include "VoldCommand.h"
 
+#include <string>
+
 class CommandListener : public FrameworkListener {
 public:
     CommandListener();
@@ -28,7 +30,23 @@ public:
 
 private:
     static void dumpArgs(int argc, char **argv, int argObscure);
-    static int sendGenericOkFail(SocketClient *cli, int cond);
+    static int sendGenericOkFail(QueuedReply *cli, int cond);
+
+    /*
+     * Runs on the shared command queue instead of the listener thread, so
+     * a slow mount or format can't hold up unrelated commands. Commands
+     * with the same queue key still run in the order they arrived, and an
+     * empty key waits for, and holds off, everything else.
+     */
+    class AsyncCommand : public VoldCommand {
+    public:
+        AsyncCommand(const char *cmd);
+        virtual ~AsyncCommand() {}
+        int runCommand(SocketClient *c, int argc, char ** argv) final;
+    protected:
+        virtual std::string getQueueKey(int argc, char ** argv) = 0;
+        virtual int runQueued(QueuedReply *c, int argc, char ** argv) = 0;
+    };
 
     class DumpCmd : public VoldCommand {
     public:
@@ -37,50 +55,62 @@ private:
         int runCommand(SocketClient *c, int argc, char ** argv);
     };
 
-    class VolumeCmd : public VoldCommand {
+    class VolumeCmd : public AsyncCommand {
     public:
         VolumeCmd();
         virtual ~VolumeCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     };
 
-    class AsecCmd : public VoldCommand {
+    class AsecCmd : public AsyncCommand {
     public:
         AsecCmd();
         virtual ~AsecCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     private:
-        void listAsecsInDirectory(SocketClient *c, const char *directory);
+        void listAsecsInDirectory(QueuedReply *c, const char *directory);
     };
 
-    class ObbCmd : public VoldCommand {
+    class ObbCmd : public AsyncCommand {
     public:
         ObbCmd();
         virtual ~ObbCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     };
 
-    class StorageCmd : public VoldCommand {
+    class StorageCmd : public AsyncCommand {
     public:
         StorageCmd();
         virtual ~StorageCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     };
 
-    class FstrimCmd : public VoldCommand {
+    class FstrimCmd : public AsyncCommand {
     public:
         FstrimCmd();
         virtual ~FstrimCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     };
 
-    class AppFuseCmd : public VoldCommand {
+    class AppFuseCmd : public AsyncCommand {
     public:
         AppFuseCmd();
         virtual ~AppFuseCmd() {}
-        int runCommand(SocketClient *c, int argc, char ** argv);
+    protected:
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     private:
-        android::status_t sendFd(SocketClient *c, int fd);
+        android::status_t sendFd(QueuedReply *c, int fd);
     };
 };
 
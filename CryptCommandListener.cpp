@@ -30,7 +30,9 @@
 #include <inttypes.h>
 
 #include <algorithm>
+#include <string>
 #include <thread>
+#include <vector>
 
 #define LOG_TAG "VoldCryptCmdListener"
 
@@ -49,10 +51,14 @@
 #include "ResponseCode.h"
 #include "cryptfs.h"
 #include "Ext4Crypt.h"
+#include "KeyedWorkQueue.h"
 #include "Utils.h"
 
 #define DUMP_ARGS 0
 
+// Enough for a few users to stretch secrets and prepare storage at once
+static const size_t kCryptCommandThreads = 4;
+
 CryptCommandListener::CryptCommandListener() :
 FrameworkListener("cryptd", true) {
     registerCmd(new CryptfsCmd());
@@ -90,7 +96,7 @@ void CryptCommandListener::dumpArgs(int argc, char **argv, int argObscure) {
 void CryptCommandListener::dumpArgs(int /*argc*/, char ** /*argv*/, int /*argObscure*/) { }
 #endif
 
-int CryptCommandListener::sendGenericOkFailOnBool(SocketClient *cli, bool success) {
+int CryptCommandListener::sendGenericOkFailOnBool(QueuedReply *cli, bool success) {
     if (success) {
         return cli->sendMsg(ResponseCode::CommandOkay, "Command succeeded", false);
     } else {
@@ -125,7 +131,7 @@ static char* parseNull(char* arg) {
     }
 }
 
-static bool check_argc(SocketClient *cli, const std::string &subcommand, int argc,
+static bool check_argc(QueuedReply *cli, const std::string &subcommand, int argc,
         int expected, std::string usage) {
     assert(expected >= 2);
     if (expected == 2) {
@@ -169,6 +175,24 @@ static int do_enablecrypto(char* arg2, char* arg4, int type, bool no_ui) {
     return -1;
 }
 
+static android::vold::KeyedWorkQueue& getCryptCommandQueue() {
+    static android::vold::KeyedWorkQueue queue(kCryptCommandThreads);
+    return queue;
+}
+
+std::string CryptCommandListener::CryptfsCmd::getQueueKey(int argc, char **argv) {
+    std::string subcommand(argv[1]);
+    if (subcommand == "create_user_key" || subcommand == "destroy_user_key"
+            || subcommand == "add_user_key_auth" || subcommand == "fixate_newest_user_key_auth"
+            || subcommand == "unlock_user_key" || subcommand == "lock_user_key") {
+        if (argc > 2) return std::string("user:") + argv[2];
+    } else if (subcommand == "prepare_user_storage" || subcommand == "destroy_user_storage") {
+        if (argc > 3) return std::string("user:") + argv[3];
+    }
+    // Full disk encryption and init_user0 touch state shared by every user
+    return "";
+}
+
 int CryptCommandListener::CryptfsCmd::runCommand(SocketClient *cli,
                                                  int argc, char **argv) {
     if ((cli->getUid() != 0) && (cli->getUid() != AID_SYSTEM)) {
@@ -181,6 +205,27 @@ int CryptCommandListener::CryptfsCmd::runCommand(SocketClient *cli,
         return 0;
     }
 
+    // Commands for different users run side by side, so one user's
+    // scrypt or keymaster round trip doesn't hold up another's start
+    std::vector<std::string> args(argv, argv + argc);
+    int cmdNum = cli->getCmdNum();
+    cli->incRef();
+    getCryptCommandQueue().enqueue(getQueueKey(argc, argv), [this, cli, cmdNum, args] {
+        std::vector<std::string> argStorage(args);
+        std::vector<char *> queuedArgv;
+        for (auto& arg : argStorage) {
+            queuedArgv.push_back(&arg[0]);
+        }
+        queuedArgv.push_back(nullptr);
+
+        QueuedReply reply(cli, cmdNum);
+        runQueued(&reply, argStorage.size(), queuedArgv.data());
+    });
+    return 0;
+}
+
+int CryptCommandListener::CryptfsCmd::runQueued(QueuedReply *cli,
+                                                int argc, char **argv) {
     int rc = 0;
 
     std::string subcommand(argv[1]);
@@ -317,6 +362,22 @@ int CryptCommandListener::CryptfsCmd::runCommand(SocketClient *cli,
         if (!check_argc(cli, subcommand, argc, 4, "<fieldname> <value>")) return 0;
         dumpArgs(argc, argv, -1);
         rc = cryptfs_setfield(argv[2], argv[3]);
+    } else if (subcommand == "setfields") {
+        // Sets every pair or none of them, writing the metadata once
+        if (argc < 4 || (argc % 2) != 0) {
+            cli->sendMsg(ResponseCode::CommandSyntaxError,
+                    "Usage: cryptfs setfields <fieldname> <value> [<fieldname> <value> ...]",
+                    false);
+            return 0;
+        }
+        dumpArgs(argc, argv, -1);
+        std::vector<const char*> fieldnames;
+        std::vector<const char*> values;
+        for (int i = 2; i < argc; i += 2) {
+            fieldnames.push_back(argv[i]);
+            values.push_back(argv[i + 1]);
+        }
+        rc = cryptfs_setfields(fieldnames.size(), fieldnames.data(), values.data());
     } else if (subcommand == "mountdefaultencrypted") {
         if (!check_argc(cli, subcommand, argc, 2, "")) return 0;
         SLOGD("cryptfs mountdefaultencrypted");
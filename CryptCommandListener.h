@@ -19,6 +19,9 @@
 
 #include <sysutils/FrameworkListener.h>
 #include <utils/Errors.h>
+
+#include <string>
+
 #include "VoldCommand.h"
 
 class CryptCommandListener : public FrameworkListener {
@@ -28,13 +31,17 @@ public:
 
 private:
     static void dumpArgs(int argc, char **argv, int argObscure);
-    static int sendGenericOkFailOnBool(SocketClient *cli, bool success);
+    static int sendGenericOkFailOnBool(QueuedReply *cli, bool success);
 
     class CryptfsCmd : public VoldCommand {
     public:
         CryptfsCmd();
         virtual ~CryptfsCmd() {}
         int runCommand(SocketClient *c, int argc, char ** argv);
+    private:
+        /* Commands for one user run in order; those without a user run alone */
+        std::string getQueueKey(int argc, char ** argv);
+        int runQueued(QueuedReply *c, int argc, char ** argv);
     };
     int getSocket();
 };
@@ -32,8 +32,6 @@ public:
 
 private:
     static void *_align(void *ptr, unsigned int a);
-    static void ioctlInit(struct dm_ioctl *io, size_t data_size,
-                          const char *name, unsigned flags);
 };
 
 #endif
@@ -15,6 +15,10 @@
  */
 
 #include "Disk.h"
+#include "EventBatch.h"
+#include "OperationStats.h"
+#include "PartitionTable.h"
+#include "ProbeCache.h"
 #include "PublicVolume.h"
 #include "PrivateVolume.h"
 #include "Utils.h"
@@ -22,12 +26,16 @@
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 #include "Ext4Crypt.h"
+#include "cryptfs.h"
 
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
-#include <diskconfig/diskconfig.h>
+#include <android-base/strings.h>
+#include <cutils/properties.h>
+#include <utils/Trace.h>
 
+#include <algorithm>
 #include <vector>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -44,25 +52,39 @@ using android::base::StringPrintf;
 namespace android {
 namespace vold {
 
-#ifdef MINIVOLD
-static const char* kSgdiskPath = "/sbin/sgdisk";
-#else
-static const char* kSgdiskPath = "/system/bin/sgdisk";
-#endif
-static const char* kSgdiskToken = " \t\n";
-
 static const char* kSysfsMmcMaxMinors = "/sys/module/mmcblk/parameters/perdev_minors";
 
+/*
+ * Block queue settings per kind of media. Schedulers are listed in order
+ * of preference, since which ones exist depends on the kernel; anything
+ * empty or negative is left at the kernel default. Each value can be
+ * overridden with persist.vold.q.<media>.<key>, e.g.
+ * persist.vold.q.sd.ra_kb=1024, where "default" skips that setting.
+ */
+struct QueueProfile {
+    const char* media;
+    const char* scheduler;
+    int readAheadKb;
+    int nrRequests;
+    int rqAffinity;
+    int addRandom;
+};
+
+static const QueueProfile kQueueProfiles[] = {
+    // Cheap flash controllers fall apart under deep, reordered queues
+    { "sd", "mq-deadline,deadline", 512, 64, -1, 0 },
+    { "usb", "mq-deadline,deadline", 1024, 64, -1, 0 },
+    { "nvme", "none,noop", 128, -1, 2, 0 },
+    { "virtio", "none,noop", -1, -1, -1, 0 },
+    { "cdrom", "", 1024, -1, -1, 0 },
+};
+
 static const char* kGptBasicData = "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7";
 static const char* kGptLinuxFilesystem = "0FC63DAF-8483-4772-8E79-3D69D8477DE4";
 static const char* kGptAndroidMeta = "19A710A2-B3CA-11E4-B026-10604B889DCF";
 static const char* kGptAndroidExpand = "193D1EA4-B3CA-11E4-B075-10604B889DCF";
 
-enum class Table {
-    kUnknown,
-    kMbr,
-    kGpt,
-};
+static const int kMbrTypeFat32 = 0x0c;
 
 bool Disk::isVirtioBlkDevice(unsigned int major) {
     /*
@@ -100,7 +122,7 @@ static bool isNvmeBlkDevice(unsigned int major, const std::string& sysPath) {
 Disk::Disk(const std::string& eventPath, dev_t device,
         const std::string& nickname, int flags) :
         mDevice(device), mSize(-1), mNickname(nickname), mFlags(flags), mCreated(
-                false), mJustPartitioned(false), mSkipChange(false) {
+                false), mJustPartitioned(false) {
     mId = StringPrintf("disk:%u_%u", major(device), minor(device));
     mEventPath = eventPath;
     mSysPath = StringPrintf("/sys/%s", eventPath.c_str());
@@ -114,6 +136,7 @@ Disk::~Disk() {
 }
 
 std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         if (vol->getId() == id) {
             return vol;
@@ -127,6 +150,7 @@ std::shared_ptr<VolumeBase> Disk::findVolume(const std::string& id) {
 }
 
 void Disk::listVolumes(VolumeBase::Type type, std::list<std::string>& list) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         if (vol->getType() == type) {
             list.push_back(vol->getId());
@@ -138,7 +162,10 @@ void Disk::listVolumes(VolumeBase::Type type, std::list<std::string>& list) {
 status_t Disk::create() {
     CHECK(!mCreated);
     mCreated = true;
+    // Everything about a new disk, down to its volumes, reaches clients at once
+    ScopedEventBatch batch;
     notifyEvent(ResponseCode::DiskCreated, StringPrintf("%d", mFlags));
+    applyQueueTuning();
     readMetadata();
     readPartitions();
     return OK;
@@ -152,10 +179,40 @@ status_t Disk::destroy() {
     return OK;
 }
 
+bool Disk::isConsistent() {
+    if (!mCreated) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mVolumesLock);
+    for (auto vol : mVolumes) {
+        if (!vol->isConsistent()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Disk::replay() {
+    std::vector<std::shared_ptr<VolumeBase>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        volumes = mVolumes;
+    }
+    ScopedEventBatch batch;
+    notifyEvent(ResponseCode::DiskCreated, StringPrintf("%d", mFlags));
+    publishMetadata();
+    for (auto vol : volumes) {
+        vol->replay();
+    }
+    notifyEvent(ResponseCode::DiskScanned);
+}
+
 void Disk::createPublicVolume(dev_t device,
                 const std::string& fstype /* = "" */,
                 const std::string& mntopts /* = "" */) {
-    auto vol = std::shared_ptr<VolumeBase>(new PublicVolume(device, mNickname, fstype, mntopts));
+    auto pub = new PublicVolume(device, mNickname, fstype, mntopts);
+    pub->setMediaClass(getCryptMediaClass());
+    auto vol = std::shared_ptr<VolumeBase>(pub);
     if (mJustPartitioned) {
         LOG(DEBUG) << "Device just partitioned; silently formatting";
         vol->setSilent(true);
@@ -165,8 +222,11 @@ void Disk::createPublicVolume(dev_t device,
         vol->setSilent(false);
     }
 
-    mVolumes.push_back(vol);
     vol->setDiskId(getId());
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        mVolumes.push_back(vol);
+    }
     vol->create();
 }
 
@@ -185,7 +245,23 @@ void Disk::createPrivateVolume(dev_t device, const std::string& partGuid) {
 
     LOG(DEBUG) << "Found key for GUID " << normalizedGuid;
 
-    auto vol = std::shared_ptr<VolumeBase>(new PrivateVolume(device, keyRaw));
+    // Volumes adopted before crypto options existed have no options file
+    // and use the default cipher with 512 byte crypto sectors
+    int sectorSize = 0;
+    std::string cipher;
+    std::string opts;
+    if (ReadFileToString(BuildKeyOptionsPath(normalizedGuid), &opts)) {
+        for (const auto& line : android::base::Split(opts, "\n")) {
+            if (android::base::StartsWith(line, "cipher=")) {
+                cipher = line.substr(strlen("cipher="));
+            } else {
+                sscanf(line.c_str(), "sector_size=%d", &sectorSize);
+            }
+        }
+    }
+
+    auto vol = std::shared_ptr<VolumeBase>(new PrivateVolume(device, keyRaw, cipher,
+            getCryptMediaClass(), sectorSize));
     if (mJustPartitioned) {
         LOG(DEBUG) << "Device just partitioned; silently formatting";
         vol->setSilent(true);
@@ -195,25 +271,124 @@ void Disk::createPrivateVolume(dev_t device, const std::string& partGuid) {
         vol->setSilent(false);
     }
 
-    mVolumes.push_back(vol);
     vol->setDiskId(getId());
     vol->setPartGuid(partGuid);
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        mVolumes.push_back(vol);
+    }
     vol->create();
 }
 
-void Disk::destroyAllVolumes() {
-    for (auto vol : mVolumes) {
-        vol->destroy();
+int Disk::getCryptMediaClass() {
+    if (mFlags & kSd) return CRYPT_MEDIA_SD;
+    if (mFlags & kUsb) return CRYPT_MEDIA_USB;
+    if (isVirtioBlkDevice(major(mDevice))) return CRYPT_MEDIA_VIRTIO;
+    return CRYPT_MEDIA_INTERNAL;
+}
+
+static const char* getQueueMedia(dev_t device, int flags, const std::string& sysPath) {
+    // Internal media is tuned by the device's init scripts, whatever its bus
+    if (flags & (Disk::kEmmc | Disk::kNonRemovable)) return nullptr;
+    unsigned int majorId = major(device);
+    if (flags & Disk::kCdrom || majorId == Disk::kMajorBlockCdrom) return "cdrom";
+    if (flags & Disk::kSd || majorId == Disk::kMajorBlockMmc) return "sd";
+    if (flags & Disk::kUsb) return "usb";
+    if (Disk::isVirtioBlkDevice(majorId)) return "virtio";
+    if (isNvmeBlkDevice(majorId, sysPath)) return "nvme";
+    // Everything else is SCSI, which in practice means USB mass storage
+    return "usb";
+}
+
+/* Returns the override for key, if any; "default" means leave it alone */
+static bool getQueueOverride(const char* media, const char* key, std::string& value) {
+    char buf[PROPERTY_VALUE_MAX];
+    property_get(StringPrintf("persist.vold.q.%s.%s", media, key).c_str(), buf, "");
+    value = buf;
+    return !value.empty();
+}
+
+void Disk::applyQueueTuning() {
+    const char* media = getQueueMedia(mDevice, mFlags, mSysPath);
+    if (media == nullptr) {
+        return;
     }
-    mVolumes.clear();
+    const QueueProfile* profile = nullptr;
+    for (const auto& p : kQueueProfiles) {
+        if (!strcmp(p.media, media)) {
+            profile = &p;
+            break;
+        }
+    }
+    if (profile == nullptr) {
+        return;
+    }
+
+    std::string applied(media);
+    auto apply = [&](const char* attr, const std::string& value) {
+        if (value.empty() || value == "default") return;
+        if (WriteBlockQueueAttribute(mDevice, attr, value) == OK) {
+            applied += StringPrintf(" %s=%s", attr, value.c_str());
+        }
+    };
+    auto applyInt = [&](const char* key, const char* attr, int value) {
+        std::string tmp;
+        if (!getQueueOverride(media, key, tmp) && value >= 0) {
+            tmp = StringPrintf("%d", value);
+        }
+        apply(attr, tmp);
+    };
+
+    std::string scheduler;
+    if (!getQueueOverride(media, "sched", scheduler)) {
+        scheduler = profile->scheduler;
+    }
+    std::string available;
+    if (!scheduler.empty() && scheduler != "default"
+            && ReadBlockQueueAttribute(mDevice, "scheduler", available) == OK) {
+        // Pick the first candidate this kernel offers, e.g. "noop [cfq] deadline"
+        std::string chosen;
+        for (const auto& candidate : android::base::Split(scheduler, ",")) {
+            for (auto offered : android::base::Split(available, " ")) {
+                if (offered.size() > 2 && offered.front() == '[') {
+                    offered = offered.substr(1, offered.size() - 2);
+                }
+                if (offered == candidate) {
+                    chosen = candidate;
+                    break;
+                }
+            }
+            if (!chosen.empty()) break;
+        }
+        apply("scheduler", chosen);
+    }
+    applyInt("ra_kb", "read_ahead_kb", profile->readAheadKb);
+    applyInt("nr_req", "nr_requests", profile->nrRequests);
+    applyInt("rq_aff", "rq_affinity", profile->rqAffinity);
+    applyInt("add_rand", "add_random", profile->addRandom);
+
+    LOG(DEBUG) << "Tuned queue for " << getId() << ": " << applied;
+    std::lock_guard<std::mutex> lock(mTuningLock);
+    mQueueTuning = applied;
 }
 
-status_t Disk::readMetadata() {
+std::string Disk::getQueueTuning() {
+    std::lock_guard<std::mutex> lock(mTuningLock);
+    return mQueueTuning;
+}
 
-    if (mSkipChange) {
-        return OK;
+void Disk::destroyAllVolumes() {
+    std::vector<std::shared_ptr<VolumeBase>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        volumes.swap(mVolumes);
     }
+    for (auto vol : volumes) {
+        vol->destroy();
+    }
+}
 
+status_t Disk::readMetadata() {
     mSize = -1;
     mLabel.clear();
 
@@ -284,37 +459,43 @@ status_t Disk::readMetadata() {
     }
     }
 
+    publishMetadata();
+    return OK;
+}
+
+void Disk::publishMetadata() {
+    ScopedEventBatch batch;
     notifyEvent(ResponseCode::DiskSizeChanged, StringPrintf("%" PRIu64, mSize));
     notifyEvent(ResponseCode::DiskLabelChanged, mLabel);
     notifyEvent(ResponseCode::DiskSysPathChanged, mSysPath);
-    return OK;
 }
 
 status_t Disk::readPartitions() {
+    ATRACE_NAME("Disk::readPartitions");
+    ScopedEventBatch batch;
     int8_t maxMinors = getMaxMinors();
     if (maxMinors < 0) {
         return -ENOTSUP;
     }
 
-    if (mSkipChange) {
-        mSkipChange = false;
-        LOG(INFO) << "Skip first change";
-        return OK;
-    }
-
     destroyAllVolumes();
 
     // Parse partition table
 
-    std::vector<std::string> cmd;
-    cmd.push_back(kSgdiskPath);
-    cmd.push_back("--android-dump");
-    cmd.push_back(mDevPath);
-
-    std::vector<std::string> output;
-    status_t res = maxMinors ? ForkExecvp(cmd, output) : ENODEV;
+    PartitionTable table;
+    std::string cacheKey(maxMinors ? GetProbeCacheKey(mSysPath, mDevPath) : "");
+    status_t res;
+    if (!cacheKey.empty() && LookupCachedPartitions(cacheKey, table)) {
+        LOG(DEBUG) << mId << " partition table unchanged since last probe";
+        res = OK;
+    } else {
+        res = maxMinors ? ReadPartitionTable(mDevPath, table) : ENODEV;
+        if (res == OK && !cacheKey.empty()) {
+            StoreCachedPartitions(cacheKey, table);
+        }
+    }
     if (res != OK) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
+        LOG(WARNING) << "Failed to read partition table of " << mDevPath;
 
         std::string fsType, unused;
         if (ReadMetadataUntrusted(mDevPath, fsType, unused, unused) == OK) {
@@ -330,60 +511,44 @@ status_t Disk::readPartitions() {
         return res;
     }
 
-    Table table = Table::kUnknown;
-    bool foundParts = false;
-    for (auto line : output) {
-        char* cline = (char*) line.c_str();
-        char* token = strtok(cline, kSgdiskToken);
-        if (token == nullptr) continue;
+    bool foundParts = !table.partitions.empty();
+    for (const auto& part : table.partitions) {
+        int i = part.number;
+        if (i <= 0 || i > maxMinors) {
+            LOG(WARNING) << mId << " is ignoring partition " << i
+                    << " beyond max supported devices";
+            continue;
+        }
+        dev_t partDevice = makedev(major(mDevice), minor(mDevice) + i);
+        if (!cacheKey.empty()) {
+            RegisterCachedPartition(partDevice, cacheKey, i);
+        }
 
-        if (!strcmp(token, "DISK")) {
-            const char* type = strtok(nullptr, kSgdiskToken);
-            if (!strcmp(type, "mbr")) {
-                table = Table::kMbr;
-            } else if (!strcmp(type, "gpt")) {
-                table = Table::kGpt;
+        if (table.type == PartitionTable::Type::kMbr) {
+            switch (part.mbrType) {
+            case 0x00: // ISO9660
+            case 0x06: // FAT16
+            case 0x07: // NTFS/exFAT
+            case 0x0b: // W95 FAT32 (LBA)
+            case 0x0c: // W95 FAT32 (LBA)
+            case 0x0e: // W95 FAT16 (LBA)
+            case 0x83: // Linux EXT4/F2FS/...
+                createPublicVolume(partDevice);
+                break;
             }
-        } else if (!strcmp(token, "PART")) {
-            foundParts = true;
-            int i = strtol(strtok(nullptr, kSgdiskToken), nullptr, 10);
-            if (i <= 0 || i > maxMinors) {
-                LOG(WARNING) << mId << " is ignoring partition " << i
-                        << " beyond max supported devices";
-                continue;
-            }
-            dev_t partDevice = makedev(major(mDevice), minor(mDevice) + i);
-
-            if (table == Table::kMbr) {
-                const char* type = strtok(nullptr, kSgdiskToken);
-
-                switch (strtol(type, nullptr, 16)) {
-                case 0x00: // ISO9660
-                case 0x06: // FAT16
-                case 0x07: // NTFS/exFAT
-                case 0x0b: // W95 FAT32 (LBA)
-                case 0x0c: // W95 FAT32 (LBA)
-                case 0x0e: // W95 FAT16 (LBA)
-                case 0x83: // Linux EXT4/F2FS/...
-                    createPublicVolume(partDevice);
-                    break;
-                }
-            } else if (table == Table::kGpt) {
-                const char* typeGuid = strtok(nullptr, kSgdiskToken);
-                const char* partGuid = strtok(nullptr, kSgdiskToken);
-
-                if (!strcasecmp(typeGuid, kGptBasicData)
-                        || !strcasecmp(typeGuid, kGptLinuxFilesystem)) {
-                    createPublicVolume(partDevice);
-                } else if (!strcasecmp(typeGuid, kGptAndroidExpand)) {
-                    createPrivateVolume(partDevice, partGuid);
-                }
+        } else if (table.type == PartitionTable::Type::kGpt) {
+            const char* typeGuid = part.typeGuid.c_str();
+            if (!strcasecmp(typeGuid, kGptBasicData)
+                    || !strcasecmp(typeGuid, kGptLinuxFilesystem)) {
+                createPublicVolume(partDevice);
+            } else if (!strcasecmp(typeGuid, kGptAndroidExpand)) {
+                createPrivateVolume(partDevice, part.partGuid);
             }
         }
     }
 
     // Ugly last ditch effort, treat entire disk as partition
-    if (table == Table::kUnknown || !foundParts) {
+    if (table.type == PartitionTable::Type::kUnknown || !foundParts) {
         LOG(WARNING) << mId << " has unknown partition table; trying entire device";
 
         std::string fsType;
@@ -401,103 +566,41 @@ status_t Disk::readPartitions() {
 }
 
 status_t Disk::unmountAll() {
-    for (auto vol : mVolumes) {
+    std::vector<std::shared_ptr<VolumeBase>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        volumes = mVolumes;
+    }
+    for (auto vol : volumes) {
         vol->unmount();
     }
     return OK;
 }
 
 status_t Disk::partitionPublic() {
-    int res;
+    OperationTimer timer("partition", getId());
 
     // TODO: improve this code
     destroyAllVolumes();
     mJustPartitioned = true;
 
-    // Determine if we're coming from MBR
-    std::vector<std::string> cmd;
-    cmd.push_back(kSgdiskPath);
-    cmd.push_back("--android-dump");
-    cmd.push_back(mDevPath);
+    // The whole table goes out in one pass with a single re-read, so the
+    // only change event we see is for the finished table
+    std::vector<PartitionSpec> specs(1);
+    specs[0].mbrType = kMbrTypeFat32;
+    specs[0].active = true;
+    specs[0].sizeBytes = 0;
 
-    std::vector<std::string> output;
-    res = ForkExecvp(cmd, output);
+    status_t res = WritePartitionTable(mDevPath, PartitionTable::Type::kMbr, specs,
+            GetFlashGeometry(mDevice).eraseBytes);
     if (res != OK) {
-        LOG(WARNING) << "sgdisk failed to scan " << mDevPath;
+        LOG(ERROR) << "Failed to partition; status " << res;
         mJustPartitioned = false;
         return res;
     }
 
-    Table table = Table::kUnknown;
-    for (auto line : output) {
-        char* cline = (char*) line.c_str();
-        char* token = strtok(cline, kSgdiskToken);
-        if (token == nullptr) continue;
-
-        if (!strcmp(token, "DISK")) {
-            const char* type = strtok(nullptr, kSgdiskToken);
-            if (!strcmp(type, "mbr")) {
-                table = Table::kMbr;
-                break;
-            } else if (!strcmp(type, "gpt")) {
-                table = Table::kGpt;
-                break;
-            }
-        }
-    }
-
-    if (table == Table::kMbr) {
-        LOG(INFO) << "skip first disk change event due to MBR -> GPT switch";
-        mSkipChange = true;
-    }
-
-    // First nuke any existing partition table
-    cmd.clear();
-    cmd.push_back(kSgdiskPath);
-    cmd.push_back("--zap-all");
-    cmd.push_back(mDevPath);
-
-    // Zap sometimes returns an error when it actually succeeded, so
-    // just log as warning and keep rolling forward.
-    if ((res = ForkExecvp(cmd)) != 0) {
-        LOG(WARNING) << "Failed to zap; status " << res;
-    }
-
-    struct disk_info dinfo;
-    memset(&dinfo, 0, sizeof(dinfo));
-
-    if (!(dinfo.part_lst = (struct part_info *) malloc(
-            MAX_NUM_PARTS * sizeof(struct part_info)))) {
-        return -1;
-    }
-
-    memset(dinfo.part_lst, 0, MAX_NUM_PARTS * sizeof(struct part_info));
-    dinfo.device = strdup(mDevPath.c_str());
-    dinfo.scheme = PART_SCHEME_MBR;
-    dinfo.sect_size = 512;
-    dinfo.skip_lba = 2048;
-    dinfo.num_lba = 0;
-    dinfo.num_parts = 1;
-
-    struct part_info *pinfo = &dinfo.part_lst[0];
-
-    pinfo->name = strdup("android_sdcard");
-    pinfo->flags |= PART_ACTIVE_FLAG;
-    pinfo->type = PC_PART_TYPE_FAT32;
-    pinfo->len_kb = -1;
-
-    int rc = apply_disk_config(&dinfo, 0);
-    if (rc) {
-        LOG(ERROR) << "Failed to apply disk configuration: " << rc;
-        goto out;
-    }
-
-out:
-    free(pinfo->name);
-    free(dinfo.device);
-    free(dinfo.part_lst);
-
-    return rc;
+    timer.setResult(OK);
+    return OK;
 }
 
 status_t Disk::partitionPrivate() {
@@ -505,33 +608,32 @@ status_t Disk::partitionPrivate() {
 }
 
 status_t Disk::partitionMixed(int8_t ratio) {
-    int res;
+    OperationTimer timer("partition", getId());
 
     if (e4crypt_is_native()) {
         LOG(ERROR) << "Private volumes not yet supported on FBE devices";
         return -EINVAL;
     }
 
+    if (ratio > 0 && (ratio < 10 || ratio > 90)) {
+        LOG(ERROR) << "Mixed partition ratio must be between 10-90%";
+        return -EINVAL;
+    }
+
     destroyAllVolumes();
     mJustPartitioned = true;
 
-    // First nuke any existing partition table
-    std::vector<std::string> cmd;
-    cmd.push_back(kSgdiskPath);
-    cmd.push_back("--zap-all");
-    cmd.push_back(mDevPath);
+    // Use whichever cipher this kind of media runs fastest, which also
+    // decides how long the key has to be
+    int mediaClass = getCryptMediaClass();
+    char cipher[MAX_CRYPTO_TYPE_NAME_LEN];
+    int keySize = cryptfs_select_cipher(mediaClass, cipher, sizeof(cipher));
 
-    // Zap sometimes returns an error when it actually succeeded, so
-    // just log as warning and keep rolling forward.
-    if ((res = ForkExecvp(cmd)) != 0) {
-        LOG(WARNING) << "Failed to zap; status " << res;
-    }
-
-    // We've had some success above, so generate both the private partition
-    // GUID and encryption key and persist them.
+    // Generate both the private partition GUID and encryption key and
+    // persist them before the table that refers to them exists.
     std::string partGuidRaw;
     std::string keyRaw;
-    if (ReadRandomBytes(16, partGuidRaw) || ReadRandomBytes(16, keyRaw)) {
+    if (ReadRandomBytes(16, partGuidRaw) || ReadRandomBytes(keySize, keyRaw)) {
         LOG(ERROR) << "Failed to generate GUID or key";
         return -EIO;
     }
@@ -546,56 +648,57 @@ status_t Disk::partitionMixed(int8_t ratio) {
         LOG(DEBUG) << "Persisted key for GUID " << partGuid;
     }
 
-    // Now let's build the new GPT table. We heavily rely on sgdisk to
-    // force optimal alignment on the created partitions.
-    cmd.clear();
-    cmd.push_back(kSgdiskPath);
+    // Removable media spends most of its crypto time on per-sector
+    // overhead, so use page-sized crypto sectors when the kernel can.
+    // Like the cipher, this fixes the on-disk format, so both are
+    // recorded next to the key.
+    std::string opts = StringPrintf("cipher=%s\n", cipher);
+    if ((mediaClass == CRYPT_MEDIA_SD || mediaClass == CRYPT_MEDIA_USB)
+            && cryptfs_max_sector_size() >= 4096) {
+        opts += "sector_size=4096\n";
+    }
+    if (!WriteStringToFile(opts, BuildKeyOptionsPath(partGuid))) {
+        PLOG(ERROR) << "Failed to persist crypto options";
+        return -EIO;
+    }
+
+    // Now let's build the new GPT table, with every partition starting on
+    // an erase block boundary.
+    std::vector<PartitionSpec> specs;
 
     // If requested, create a public partition first. Mixed-mode partitioning
     // like this is an experimental feature.
     if (ratio > 0) {
-        if (ratio < 10 || ratio > 90) {
-            LOG(ERROR) << "Mixed partition ratio must be between 10-90%";
-            return -EINVAL;
-        }
-
         uint64_t splitMb = ((mSize / 100) * ratio) / 1024 / 1024;
-        cmd.push_back(StringPrintf("--new=0:0:+%" PRId64 "M", splitMb));
-        cmd.push_back(StringPrintf("--typecode=0:%s", kGptBasicData));
-        cmd.push_back("--change-name=0:shared");
+        specs.push_back({ 0, false, kGptBasicData, "", "shared", splitMb * 1024 * 1024 });
     }
 
     // Define a metadata partition which is designed for future use; there
     // should only be one of these per physical device, even if there are
     // multiple private volumes.
-    cmd.push_back("--new=0:0:+16M");
-    cmd.push_back(StringPrintf("--typecode=0:%s", kGptAndroidMeta));
-    cmd.push_back("--change-name=0:android_meta");
+    specs.push_back({ 0, false, kGptAndroidMeta, "", "android_meta", 16 * 1024 * 1024 });
 
     // Define a single private partition filling the rest of disk.
-    cmd.push_back("--new=0:0:-0");
-    cmd.push_back(StringPrintf("--typecode=0:%s", kGptAndroidExpand));
-    cmd.push_back(StringPrintf("--partition-guid=0:%s", partGuid.c_str()));
-    cmd.push_back("--change-name=0:android_expand");
+    specs.push_back({ 0, false, kGptAndroidExpand, partGuid, "android_expand", 0 });
 
-    cmd.push_back(mDevPath);
-
-    if ((res = ForkExecvp(cmd)) != 0) {
+    status_t res = WritePartitionTable(mDevPath, PartitionTable::Type::kGpt, specs,
+            GetFlashGeometry(mDevice).eraseBytes);
+    if (res != OK) {
         LOG(ERROR) << "Failed to partition; status " << res;
+        mJustPartitioned = false;
         return res;
     }
 
+    timer.setResult(OK);
     return OK;
 }
 
 void Disk::notifyEvent(int event) {
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            getId().c_str(), false);
+    SendBroadcast(event, getId());
 }
 
 void Disk::notifyEvent(int event, const std::string& value) {
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            StringPrintf("%s %s", getId().c_str(), value.c_str()).c_str(), false);
+    SendBroadcast(event, StringPrintf("%s %s", getId().c_str(), value.c_str()));
 }
 
 int Disk::getMaxMinors() {
@@ -22,6 +22,7 @@
 
 #include <utils/Errors.h>
 
+#include <mutex>
 #include <vector>
 
 namespace android {
@@ -92,6 +93,9 @@ public:
     const std::string& getLabel() { return mLabel; }
     int getFlags() { return mFlags; }
 
+    /* Held across anything that creates, mounts, formats or destroys volumes on this disk */
+    std::mutex& getLock() { return mLock; }
+
     std::shared_ptr<VolumeBase> findVolume(const std::string& id);
 
     void listVolumes(VolumeBase::Type type, std::list<std::string>& list);
@@ -99,6 +103,14 @@ public:
     virtual status_t create();
     virtual status_t destroy();
 
+    /* Whether every volume on the disk can be replayed as is */
+    bool isConsistent();
+    /*
+     * Re-sends everything create() announced about the disk and its
+     * volumes, for a framework that reconnected, without touching the disk.
+     */
+    void replay();
+
     virtual status_t readMetadata();
     virtual status_t readPartitions();
 
@@ -108,6 +120,11 @@ public:
     virtual status_t partitionPrivate();
     virtual status_t partitionMixed(int8_t ratio);
 
+    /* Queue settings applied when the disk was created, for dump */
+    std::string getQueueTuning();
+
+    void publishMetadata();
+
     void notifyEvent(int msg);
     void notifyEvent(int msg, const std::string& value);
 
@@ -128,8 +145,11 @@ protected:
     uint64_t mSize;
     /* User-visible label, such as manufacturer */
     std::string mLabel;
-    /* Current partitions on disk */
+    /* Current partitions on disk, guarded by mVolumesLock */
     std::vector<std::shared_ptr<VolumeBase>> mVolumes;
+    /* Only held while touching mVolumes, so lookups never wait on a mount */
+    std::mutex mVolumesLock;
+    std::mutex mLock;
     /* Nickname for this disk */
     std::string mNickname;
     /* Flags applicable to this disk */
@@ -138,14 +158,21 @@ protected:
     bool mCreated;
     /* Flag that we just partitioned and should format all volumes */
     bool mJustPartitioned;
-    /* Flag that we need to skip first disk change events after partitioning*/
-    bool mSkipChange;
+    /* Block queue settings we applied, guarded by mTuningLock */
+    std::string mQueueTuning;
+    std::mutex mTuningLock;
 
     void createPublicVolume(dev_t device,
                     const std::string& fstype = "",
                     const std::string& mntopts = "");
     void createPrivateVolume(dev_t device, const std::string& partGuid);
 
+    /* Which CRYPT_MEDIA_* tuning dm-crypt should use on this disk */
+    int getCryptMediaClass();
+
+    /* Applies the block queue profile for this kind of media */
+    void applyQueueTuning();
+
     void destroyAllVolumes();
 
     int getMaxMinors();
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DiskMatcher.h"
+
+#include <fnmatch.h>
+#include <string.h>
+
+namespace android {
+namespace vold {
+
+static size_t literalPrefixLength(const std::string& pattern) {
+    size_t len = pattern.find_first_of("*?[\\");
+    return (len == std::string::npos) ? pattern.size() : len;
+}
+
+DiskMatcher::DiskMatcher() {
+}
+
+void DiskMatcher::add(const std::string& pattern) {
+    Node* node = &mRoot;
+    size_t len = literalPrefixLength(pattern);
+    for (size_t i = 0; i < len; i++) {
+        auto& child = node->children[pattern[i]];
+        if (!child) {
+            child.reset(new Node());
+        }
+        node = child.get();
+    }
+    node->patterns.push_back(mPatterns.size());
+    mPatterns.push_back(pattern);
+}
+
+int DiskMatcher::match(const std::string& path) const {
+    int best = -1;
+    const Node* node = &mRoot;
+    for (size_t i = 0; node != nullptr; i++) {
+        for (int index : node->patterns) {
+            if ((best == -1 || index < best)
+                    && !fnmatch(mPatterns[index].c_str(), path.c_str(), 0)) {
+                best = index;
+            }
+        }
+        if (i == path.size()) {
+            break;
+        }
+        auto child = node->children.find(path[i]);
+        node = (child == node->children.end()) ? nullptr : child->second.get();
+    }
+    return best;
+}
+
+bool DiskMatcher::mayMatchUnder(const std::string& prefix) const {
+    const Node* node = &mRoot;
+    for (size_t i = 0; i < prefix.size(); i++) {
+        // A wildcard before the end of the prefix could swallow the rest
+        if (!node->patterns.empty()) {
+            return true;
+        }
+        auto child = node->children.find(prefix[i]);
+        if (child == node->children.end()) {
+            return false;
+        }
+        node = child->second.get();
+    }
+    // Every pattern from here down starts with the prefix
+    return true;
+}
+
+}  // namespace vold
+}  // namespace android
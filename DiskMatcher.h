@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_DISK_MATCHER_H
+#define ANDROID_VOLD_DISK_MATCHER_H
+
+#include "Utils.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Matches sysfs paths against a set of fnmatch() patterns without trying
+ * each one in turn. The literal prefix of every pattern (everything up to
+ * its first wildcard) is stored in a trie, so one walk down the path finds
+ * the few patterns that could match, and only those are globbed. Most
+ * paths fall out of the trie after a handful of characters.
+ */
+class DiskMatcher {
+public:
+    DiskMatcher();
+
+    /* Patterns are identified by the order they were added in */
+    void add(const std::string& pattern);
+
+    /* Index of the first pattern matching path, or -1 */
+    int match(const std::string& path) const;
+
+    /* True when some pattern could match a path that starts with prefix */
+    bool mayMatchUnder(const std::string& prefix) const;
+
+    size_t size() const { return mPatterns.size(); }
+
+private:
+    struct Node {
+        std::map<char, std::unique_ptr<Node>> children;
+        /* Patterns whose literal prefix ends here */
+        std::vector<int> patterns;
+    };
+
+    Node mRoot;
+    std::vector<std::string> mPatterns;
+
+    DISALLOW_COPY_AND_ASSIGN(DiskMatcher);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DmControl.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+static const char* kControlPath = "/dev/device-mapper";
+
+/* Room ahead of each dm_ioctl for its capacity, keeping the header 8 byte aligned */
+static const size_t kBufferPrefix = 16;
+/* Replies that still don't fit in this much are given up on */
+static const size_t kMaxBufferSize = 1024 * 1024;
+static const size_t kMaxPooledBuffers = 4;
+
+static const int kMaxWaitStepMs = 100;
+
+static std::mutex sControlLock;
+static int sControlFd = -1;
+
+static std::mutex sPoolLock;
+static std::vector<char*> sPool;
+
+static size_t& capacityOf(char* block) {
+    return *reinterpret_cast<size_t*>(block);
+}
+
+static char* blockOf(struct dm_ioctl* io) {
+    return reinterpret_cast<char*>(io) - kBufferPrefix;
+}
+
+static struct dm_ioctl* ioOf(char* block) {
+    return reinterpret_cast<struct dm_ioctl*>(block + kBufferPrefix);
+}
+
+static char* allocateBlock(size_t capacity) {
+    char* block = static_cast<char*>(malloc(kBufferPrefix + capacity));
+    if (block != nullptr) {
+        capacityOf(block) = capacity;
+    }
+    return block;
+}
+
+static int getControlFd() {
+    std::lock_guard<std::mutex> lock(sControlLock);
+    if (sControlFd == -1) {
+        sControlFd = open(kControlPath, O_RDWR | O_CLOEXEC);
+        if (sControlFd == -1) {
+            PLOG(ERROR) << "Failed to open " << kControlPath;
+        }
+    }
+    return sControlFd;
+}
+
+struct dm_ioctl* dm_get_buffer(size_t data_size, const char* name, unsigned flags) {
+    char* block = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(sPoolLock);
+        auto i = std::find_if(sPool.begin(), sPool.end(),
+                [data_size](char* b) { return capacityOf(b) >= data_size; });
+        if (i != sPool.end()) {
+            block = *i;
+            sPool.erase(i);
+        }
+    }
+    if (block == nullptr) {
+        block = allocateBlock(std::max(data_size, (size_t) DM_CONTROL_BUFFER_SIZE));
+        if (block == nullptr) {
+            PLOG(ERROR) << "Failed to allocate device-mapper buffer";
+            return nullptr;
+        }
+    }
+    struct dm_ioctl* io = ioOf(block);
+    dm_reset_buffer(io, name, flags);
+    return io;
+}
+
+void dm_put_buffer(struct dm_ioctl* io) {
+    if (io == nullptr) return;
+    char* block = blockOf(io);
+    // Keys and tables pass through here, so nothing lingers in the pool
+    memset(io, 0, capacityOf(block));
+    {
+        std::lock_guard<std::mutex> lock(sPoolLock);
+        if (sPool.size() < kMaxPooledBuffers) {
+            sPool.push_back(block);
+            return;
+        }
+    }
+    free(block);
+}
+
+void dm_reset_buffer(struct dm_ioctl* io, const char* name, unsigned flags) {
+    size_t capacity = capacityOf(blockOf(io));
+    memset(io, 0, capacity);
+    io->data_size = capacity;
+    io->data_start = sizeof(struct dm_ioctl);
+    io->version[0] = 4;
+    io->version[1] = 0;
+    io->version[2] = 0;
+    io->flags = flags;
+    if (name) {
+        CHECK(strlcpy(io->name, name, sizeof(io->name)) < sizeof(io->name))
+                << "Device-mapper name too long: " << name;
+    }
+}
+
+int dm_control_ioctl(unsigned long cmd, struct dm_ioctl** io) {
+    int fd = getControlFd();
+    if (fd == -1) {
+        return -1;
+    }
+
+    while (true) {
+        // Replies overwrite the header, so keep the request around for a retry
+        struct dm_ioctl request = **io;
+        if (ioctl(fd, cmd, *io)) {
+            return -1;
+        }
+        if (!((*io)->flags & DM_BUFFER_FULL_FLAG)) {
+            return 0;
+        }
+
+        char* old = blockOf(*io);
+        size_t grown = capacityOf(old) * 2;
+        if (grown > kMaxBufferSize) {
+            LOG(ERROR) << "Device-mapper reply exceeds " << kMaxBufferSize << " bytes";
+            errno = ENOBUFS;
+            return -1;
+        }
+        char* block = allocateBlock(grown);
+        if (block == nullptr) {
+            errno = ENOMEM;
+            return -1;
+        }
+        struct dm_ioctl* bigger = ioOf(block);
+        memset(bigger, 0, grown);
+        *bigger = request;
+        bigger->data_size = grown;
+        memset(old + kBufferPrefix, 0, capacityOf(old));
+        free(old);
+        *io = bigger;
+    }
+}
+
+int dm_make_node(__u64 dev, char* path, size_t len) {
+    // The kernel hands device-mapper numbers out in huge_encode_dev() form
+    unsigned major = (dev & 0xfff00) >> 8;
+    unsigned minor = (dev & 0xff) | ((dev >> 12) & 0xfff00);
+    snprintf(path, len, "/dev/block/dm-%u", minor);
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+    status_t res = android::vold::CreateDeviceNode(path, makedev(major, minor));
+    if (res != android::OK) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+int dm_wait_for_device(const char* path, int timeout_ms) {
+    int waitedMs = 0;
+    int stepMs = 1;
+    while (true) {
+        // A new mapping claims its backing device, so that's what to wait for
+        int fd = open(path, O_RDONLY | O_EXCL | O_CLOEXEC);
+        if (fd != -1) {
+            close(fd);
+            return 0;
+        }
+        // Only states that a device still coming up can be in are worth waiting out
+        if ((errno != ENOENT && errno != ENXIO && errno != ENODEV && errno != EBUSY)
+                || waitedMs >= timeout_ms) {
+            return -1;
+        }
+        int saved = errno;
+        usleep(stepMs * 1000);
+        errno = saved;
+        waitedMs += stepMs;
+        stepMs = std::min(stepMs * 2, kMaxWaitStepMs);
+    }
+}
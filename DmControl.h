@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_DM_CONTROL_H
+#define ANDROID_VOLD_DM_CONTROL_H
+
+#include <stddef.h>
+#include <sys/cdefs.h>
+#include <linux/dm-ioctl.h>
+
+/*
+ * Device-mapper control session shared by Devmapper and cryptfs. Every
+ * request goes through a single /dev/device-mapper fd that stays open for
+ * the life of vold, using ioctl buffers taken from a small pool instead of
+ * being allocated per call.
+ */
+
+__BEGIN_DECLS
+
+/* Default payload room, enough for a single target table */
+#define DM_CONTROL_BUFFER_SIZE 4096
+
+/*
+ * Takes a buffer of at least data_size bytes from the pool and fills in
+ * the dm_ioctl header for name. Returns NULL if memory runs out.
+ */
+struct dm_ioctl *dm_get_buffer(size_t data_size, const char *name, unsigned flags);
+/* Hands a buffer back to the pool */
+void dm_put_buffer(struct dm_ioctl *io);
+/* Clears a buffer for the next request, keeping its size */
+void dm_reset_buffer(struct dm_ioctl *io, const char *name, unsigned flags);
+
+/*
+ * Issues cmd on the shared control fd. When the kernel reports that its
+ * reply didn't fit, the buffer is grown and the request repeated, so *io
+ * may move. Returns 0, or -1 with errno set.
+ */
+int dm_control_ioctl(unsigned long cmd, struct dm_ioctl **io);
+
+/*
+ * Creates the /dev/block/dm-N node for a device number returned by the
+ * kernel right away, rather than waiting for ueventd to get to it.
+ */
+int dm_make_node(__u64 dev, char *path, size_t len);
+
+/*
+ * Waits up to timeout_ms for the block device at path to be openable
+ * exclusively, backing off between attempts. Returns 0 once it is, or -1 with errno
+ * from the last attempt.
+ */
+int dm_wait_for_device(const char *path, int timeout_ms);
+
+__END_DECLS
+
+#endif
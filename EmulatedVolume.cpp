@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include "fs/Sdcardfs.h"
 #include "EmulatedVolume.h"
 #include "Utils.h"
 #include "ResponseCode.h"
@@ -22,6 +23,7 @@
 #include <android-base/logging.h>
 #include <cutils/fs.h>
 #include <private/android_filesystem_config.h>
+#include <utils/Trace.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
@@ -65,7 +67,22 @@ status_t EmulatedVolume::doCreate() {
     return OK;
 }
 
+void EmulatedVolume::doReplay() {
+    if (mLabel.size() > 0) {
+        notifyEvent(ResponseCode::VolumeFsLabelChanged, mLabel);
+    }
+}
+
+bool EmulatedVolume::isMountAlive() {
+    if (mFusePid > 0 && !IsChildRunning(mFusePid)) {
+        mFusePid = 0;
+        return false;
+    }
+    return true;
+}
+
 status_t EmulatedVolume::doMount() {
+    ATRACE_NAME("EmulatedVolume::doMount");
     // We could have migrated storage to an adopted private volume, so always
     // call primary storage "emulated" to avoid media rescans.
     std::string label = mLabel;
@@ -89,7 +106,20 @@ status_t EmulatedVolume::doMount() {
         return -errno;
     }
 
-    dev_t before = GetDevice(mFuseFull);
+    // Stacking in the kernel avoids a daemon round trip on every access;
+    // FUSE remains for kernels without sdcardfs
+    if (sdcardfs::IsSupported() && sdcardfs::MountViews(mRawPath, mFuseDefault, mFuseRead,
+            mFuseWrite, mFuseFull, 0, true, true) == OK) {
+        LOG(INFO) << getId() << " serving " << mRawPath << " through sdcardfs";
+        return OK;
+    }
+    LOG(INFO) << getId() << " serving " << mRawPath << " through FUSE";
+
+    std::vector<std::string> fusePaths = { mFuseDefault, mFuseRead, mFuseWrite, mFuseFull };
+    std::vector<dev_t> before;
+    for (auto& path : fusePaths) {
+        before.push_back(GetDevice(path));
+    }
 
     if (!(mFusePid = fork())) {
         if (execl(kFusePath, kFusePath,
@@ -115,6 +145,15 @@ status_t EmulatedVolume::doMount() {
         return -errno;
     }
 
+    status_t res = WaitForMounts(mFusePid, fusePaths, before, GetFuseTimeoutMs());
+    if (res != OK) {
+        // Daemon is already reaped; tear down whatever it left behind
+        LOG(ERROR) << getId() << " FUSE failed to spin up";
+        mFusePid = 0;
+        doUnmount();
+        return res;
+    }
+
     return OK;
 }
 
@@ -148,5 +187,14 @@ status_t EmulatedVolume::doUnmount(bool detach /* = false */) {
     return OK;
 }
 
+status_t EmulatedVolume::doHide(bool mounted) {
+    // Only the FUSE daemon stands between apps and mRawPath, and the
+    // backing storage below it stays mounted
+    if (mounted) {
+        doUnmount();
+    }
+    return setInternalPath(mRawPath);
+}
+
 }  // namespace vold
 }  // namespace android
@@ -45,6 +45,9 @@ protected:
     status_t doCreate() override;
     status_t doMount() override;
     status_t doUnmount(bool detach = false) override;
+    status_t doHide(bool mounted) override;
+    void doReplay() override;
+    bool isMountAlive() override;
 
 private:
     std::string mRawPath;
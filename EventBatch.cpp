@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventBatch.h"
+#include "VolumeManager.h"
+
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <sysutils/SocketClient.h>
+#include <sysutils/SocketClientCommand.h>
+#include <sysutils/SocketListener.h>
+
+using android::base::StringAppendF;
+
+namespace android {
+namespace vold {
+
+static const char* kCoalesceProp = "persist.vold.coalesce_events";
+
+/* Frames queued by the open batch on this thread, if any */
+struct PendingEvents {
+    int depth;
+    std::string frames;
+};
+
+static thread_local PendingEvents* tPending = nullptr;
+
+namespace {
+
+class SendFramesCommand : public SocketClientCommand {
+public:
+    SendFramesCommand(const std::string& frames) : mFrames(frames) {}
+
+    void runSocketCommand(SocketClient* client) override {
+        client->sendData(mFrames.data(), mFrames.size());
+    }
+
+private:
+    const std::string& mFrames;
+};
+
+}  // namespace
+
+ScopedEventBatch::ScopedEventBatch() {
+    if (tPending != nullptr) {
+        tPending->depth++;
+    } else if (property_get_bool(kCoalesceProp, true)) {
+        tPending = new PendingEvents{ 1, "" };
+    }
+}
+
+ScopedEventBatch::~ScopedEventBatch() {
+    if (tPending == nullptr || --tPending->depth > 0) {
+        return;
+    }
+    PendingEvents* pending = tPending;
+    tPending = nullptr;
+
+    SocketListener* broadcaster = VolumeManager::Instance()->getBroadcaster();
+    if (broadcaster != nullptr && !pending->frames.empty()) {
+        SendFramesCommand command(pending->frames);
+        broadcaster->runOnEachSocket(&command);
+    }
+    delete pending;
+}
+
+void SendBroadcast(int code, const std::string& message) {
+    if (tPending != nullptr) {
+        // Same framing SocketClient::sendMsg() uses for a broadcast
+        StringAppendF(&tPending->frames, "%.3d %s", code, message.c_str());
+        tPending->frames.push_back('\0');
+        return;
+    }
+    SocketListener* broadcaster = VolumeManager::Instance()->getBroadcaster();
+    if (broadcaster != nullptr) {
+        broadcaster->sendBroadcast(code, message.c_str(), false);
+    }
+}
+
+}  // namespace vold
+}  // namespace android
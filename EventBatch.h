@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_EVENT_BATCH_H
+#define ANDROID_VOLD_EVENT_BATCH_H
+
+#include "Utils.h"
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Holds back the broadcasts raised on this thread while in scope, and
+ * hands them to each client in a single write when the outermost batch
+ * closes. Every event keeps its own NUL-terminated "code message" frame,
+ * in order, so clients parse the write exactly as they would separate
+ * ones; they just wake once per transition instead of once per event.
+ * Setting persist.vold.coalesce_events=false sends each event on its own.
+ */
+class ScopedEventBatch {
+public:
+    ScopedEventBatch();
+    ~ScopedEventBatch();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedEventBatch);
+};
+
+/* Broadcasts to every client now, or when this thread's batch closes */
+void SendBroadcast(int code, const std::string& message);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -16,25 +16,37 @@
 
 #include "Ext4Crypt.h"
 
+#include "AutoCloseFD.h"
+#include "KeyBuffer.h"
 #include "KeyStorage.h"
+#include "OperationStats.h"
 #include "Utils.h"
+#include "WorkerPool.h"
 
 #include <algorithm>
 #include <iomanip>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
 #include <limits.h>
+#include <linux/keyctl.h>
+#include <openssl/crypto.h>
 #include <openssl/sha.h>
 #include <selinux/android.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 #include <private/android_filesystem_config.h>
@@ -54,6 +66,7 @@
 
 using android::base::StringPrintf;
 using android::vold::kEmptyAuthentication;
+using android::vold::KeyBuffer;
 
 // NOTE: keep in sync with StorageManager
 static constexpr int FLAG_STORAGE_DE = 1 << 0;
@@ -64,6 +77,8 @@ const std::string device_key_dir = std::string() + DATA_MNT_POINT + e4crypt_unen
 const std::string device_key_path = device_key_dir + "/key";
 const std::string device_key_temp = device_key_dir + "/temp";
 
+const std::string key_mode_path = std::string() + DATA_MNT_POINT + e4crypt_key_mode;
+
 const std::string user_key_dir = std::string() + DATA_MNT_POINT + "/misc/vold/user_keys";
 const std::string user_key_temp = user_key_dir + "/temp";
 
@@ -75,9 +90,37 @@ std::set<userid_t> s_ephemeral_users;
 // Map user ids to key references
 std::map<userid_t, std::string> s_de_key_raw_refs;
 std::map<userid_t, std::string> s_ce_key_raw_refs;
+// Guards s_de_key_raw_refs, which boot-time loader threads also fill in
+std::mutex s_de_key_lock;
+// Loads secondary users' DE keys in the background during boot
+std::unique_ptr<android::vold::WorkerPool> s_de_key_loader;
+std::mutex s_de_key_loader_lock;
+
+// Most devices have one or two users, so a handful of threads is plenty
+const size_t kMaxDeKeyLoaderThreads = 4;
+
+// Lets a device opt out of moving new installs onto its inline crypto engine;
+// read-only since it's consulted before persistent properties are loaded
+const char* kInlineCryptoProp = "ro.vold.fbe_inline_crypto";
+
+// Contents mode every policy on /data uses, fixed when /data is first set
+// up: "ice" has the inline crypto engine encrypt pages, "software" the CPU
+std::string s_contents_mode;
+bool s_contents_mode_known = false;
+std::mutex s_contents_mode_lock;
+
+// Which of each user's keys are in the keyring, reported by dump
+constexpr int KEY_STATUS_DE = 1 << 0;
+constexpr int KEY_STATUS_CE = 1 << 1;
+std::map<userid_t, int> s_key_status;
+std::mutex s_key_status_lock;
 // TODO abolish this map. Keys should not be long-lived in user memory, only kernel memory.
 // See b/26948053
-std::map<userid_t, std::string> s_ce_keys;
+std::map<userid_t, KeyBuffer> s_ce_keys;
+// Guards s_ephemeral_users, s_ce_keys and s_ce_key_raw_refs. Commands for
+// different users run concurrently; those for one user are serialized by
+// CryptCommandListener, so this is only ever held for a lookup or update.
+std::mutex s_user_key_lock;
 
 // ext4enc:TODO get this const from somewhere good
 const int EXT4_KEY_DESCRIPTOR_SIZE = 8;
@@ -118,10 +161,12 @@ static std::string generate_key_ref(const char* key, int length) {
 
     static_assert(EXT4_KEY_DESCRIPTOR_SIZE <= SHA512_DIGEST_LENGTH,
                   "Hash too short for descriptor");
+    OPENSSL_cleanse(&c, sizeof(c));
+    OPENSSL_cleanse(key_ref1, sizeof(key_ref1));
     return std::string((char*)key_ref2, EXT4_KEY_DESCRIPTOR_SIZE);
 }
 
-static bool fill_key(const std::string& key, ext4_encryption_key* ext4_key) {
+static bool fill_key(const KeyBuffer& key, ext4_encryption_key* ext4_key) {
     if (key.size() != EXT4_AES_256_XTS_KEY_SIZE) {
         LOG(ERROR) << "Wrong size key " << key.size();
         return false;
@@ -143,6 +188,50 @@ static std::string keyname(const std::string& raw_ref) {
     return o.str();
 }
 
+static void set_key_status(userid_t user_id, int flag, bool installed) {
+    std::lock_guard<std::mutex> lock(s_key_status_lock);
+    int& status = s_key_status[user_id];
+    status = installed ? (status | flag) : (status & ~flag);
+    if (status == 0) s_key_status.erase(user_id);
+}
+
+// Prefers the inline crypto engine whenever the hardware has one, and
+// falls back to software when fstab asks for ICE on hardware without it
+static std::string choose_contents_mode() {
+    std::string configured = escape_null(cryptfs_get_file_encryption_mode());
+    if (cryptfs_has_inline_crypto() && property_get_bool(kInlineCryptoProp, true)) {
+        return "ice";
+    }
+    if (configured == "ice") {
+        LOG(WARNING) << "No inline crypto engine available; using software encryption";
+    }
+    return "software";
+}
+
+// Once /data has policies, their mode can't change, so later boots reuse
+// whatever was recorded next to the device key. Until that record is read,
+// or made by e4crypt_initialize_global_de() with commit set, the mode is
+// only a guess and isn't kept.
+static std::string get_contents_mode(bool commit = false) {
+    std::lock_guard<std::mutex> lock(s_contents_mode_lock);
+    if (s_contents_mode_known) return s_contents_mode;
+
+    std::string mode;
+    if (android::base::ReadFileToString(key_mode_path, &mode) && !mode.empty()) {
+        s_contents_mode = mode;
+    } else if (commit) {
+        s_contents_mode = choose_contents_mode();
+    } else {
+        return choose_contents_mode();
+    }
+    s_contents_mode_known = true;
+    if (s_contents_mode == "ice" && !cryptfs_has_inline_crypto()) {
+        LOG(ERROR) << "/data was set up for inline crypto, but no engine is available";
+    }
+    LOG(INFO) << "Using " << s_contents_mode << " file contents encryption";
+    return s_contents_mode;
+}
+
 // Get the keyring we store all keys in
 static bool e4crypt_keyring(key_serial_t* device_keyring) {
     *device_keyring = keyctl_search(KEY_SPEC_SESSION_KEYRING, "keyring", "e4crypt", 0);
@@ -155,8 +244,10 @@ static bool e4crypt_keyring(key_serial_t* device_keyring) {
 
 // Install password into global keyring
 // Return raw key reference for use in policy
-static bool install_key(const std::string& key, std::string* raw_ref) {
-    ext4_encryption_key ext4_key;
+static bool install_key(const KeyBuffer& key, std::string* raw_ref) {
+    // The payload handed to the kernel holds the key too, so keep it locked
+    KeyBuffer ext4_key_buffer(sizeof(ext4_encryption_key));
+    auto& ext4_key = *reinterpret_cast<ext4_encryption_key*>(ext4_key_buffer.data());
     if (!fill_key(key, &ext4_key)) return false;
     *raw_ref = generate_key_ref(ext4_key.raw, ext4_key.size);
     auto ref = keyname(*raw_ref);
@@ -174,6 +265,31 @@ static bool install_key(const std::string& key, std::string* raw_ref) {
     return true;
 }
 
+// Remove a key installed by install_key from the keyring; files already open
+// keep working until their inodes are evicted
+static bool evict_key(const std::string& raw_ref) {
+    auto ref = keyname(raw_ref);
+    key_serial_t device_keyring;
+    if (!e4crypt_keyring(&device_keyring)) return false;
+    key_serial_t key_id = keyctl_search(device_keyring, "logon", ref.c_str(), 0);
+    if (key_id == -1) {
+        if (errno == ENOKEY) {
+            // Gone already, e.g. unlinked by an earlier lock that failed later
+            LOG(DEBUG) << "Key " << ref << " already removed from keyring " << device_keyring;
+            return true;
+        }
+        PLOG(ERROR) << "Failed to find key " << ref << " in keyring " << device_keyring;
+        return false;
+    }
+    // key_control has no wrapper for unlinking
+    if (syscall(__NR_keyctl, KEYCTL_UNLINK, key_id, device_keyring) == -1) {
+        PLOG(ERROR) << "Failed to remove key " << key_id << " from keyring " << device_keyring;
+        return false;
+    }
+    LOG(DEBUG) << "Removed key " << key_id << " (" << ref << ") from keyring " << device_keyring;
+    return true;
+}
+
 static std::string get_de_key_path(userid_t user_id) {
     return StringPrintf("%s/de/%d", user_key_dir.c_str(), user_id);
 }
@@ -252,7 +368,7 @@ static void fixate_user_ce_key(const std::string& directory_path, const std::str
 
 static bool read_and_fixate_user_ce_key(userid_t user_id,
                                         const android::vold::KeyAuthentication& auth,
-                                        std::string *ce_key) {
+                                        KeyBuffer* ce_key) {
     auto const directory_path = get_ce_key_directory_path(user_id);
     auto const paths = get_ce_key_paths(directory_path);
     for (auto const ce_key_path: paths) {
@@ -267,15 +383,31 @@ static bool read_and_fixate_user_ce_key(userid_t user_id,
     return false;
 }
 
+static bool is_ephemeral_user(userid_t user_id) {
+    std::lock_guard<std::mutex> lock(s_user_key_lock);
+    return s_ephemeral_users.count(user_id) != 0;
+}
+
+static bool has_ce_key(userid_t user_id) {
+    std::lock_guard<std::mutex> lock(s_user_key_lock);
+    return s_ce_key_raw_refs.count(user_id) != 0;
+}
+
+static void set_ce_key(userid_t user_id, KeyBuffer&& ce_key, const std::string& ce_raw_ref) {
+    std::lock_guard<std::mutex> lock(s_user_key_lock);
+    s_ce_keys[user_id] = std::move(ce_key);
+    s_ce_key_raw_refs[user_id] = ce_raw_ref;
+}
+
 static bool read_and_install_user_ce_key(userid_t user_id,
                                          const android::vold::KeyAuthentication& auth) {
-    if (s_ce_key_raw_refs.count(user_id) != 0) return true;
-    std::string ce_key;
+    if (has_ce_key(user_id)) return true;
+    KeyBuffer ce_key;
     if (!read_and_fixate_user_ce_key(user_id, auth, &ce_key)) return false;
     std::string ce_raw_ref;
     if (!install_key(ce_key, &ce_raw_ref)) return false;
-    s_ce_keys[user_id] = ce_key;
-    s_ce_key_raw_refs[user_id] = ce_raw_ref;
+    set_ce_key(user_id, std::move(ce_key), ce_raw_ref);
+    set_key_status(user_id, KEY_STATUS_CE, true);
     LOG(DEBUG) << "Installed ce key for user " << user_id;
     return true;
 }
@@ -298,8 +430,9 @@ static bool destroy_dir(const std::string& dir) {
     return true;
 }
 
-static bool random_key(std::string* key) {
-    if (android::vold::ReadRandomBytes(EXT4_AES_256_XTS_KEY_SIZE, *key) != 0) {
+static bool random_key(KeyBuffer* key) {
+    key->resize(EXT4_AES_256_XTS_KEY_SIZE);
+    if (android::vold::ReadRandomBytes(key->size(), key->data()) != 0) {
         // TODO status_t plays badly with PLOG, fix it.
         LOG(ERROR) << "Random read failed";
         return false;
@@ -311,10 +444,14 @@ static bool path_exists(const std::string& path) {
     return access(path.c_str(), F_OK) == 0;
 }
 
-// NB this assumes that there is only one thread listening for crypt commands, because
-// it creates keys in a fixed location.
+// Each user gets their own temporary location, so keys for different users
+// can be created at the same time
+static std::string get_user_key_temp(userid_t user_id) {
+    return StringPrintf("%s_%d", user_key_temp.c_str(), user_id);
+}
+
 static bool store_key(const std::string& key_path, const std::string& tmp_path,
-                      const android::vold::KeyAuthentication& auth, const std::string& key) {
+                      const android::vold::KeyAuthentication& auth, const KeyBuffer& key) {
     if (path_exists(key_path)) {
         LOG(ERROR) << "Already exists, cannot create key at: " << key_path;
         return false;
@@ -332,11 +469,12 @@ static bool store_key(const std::string& key_path, const std::string& tmp_path,
 }
 
 static bool create_and_install_user_keys(userid_t user_id, bool create_ephemeral) {
-    std::string de_key, ce_key;
+    KeyBuffer de_key, ce_key;
     if (!random_key(&de_key)) return false;
     if (!random_key(&ce_key)) return false;
     if (create_ephemeral) {
         // If the key should be created as ephemeral, don't store it.
+        std::lock_guard<std::mutex> lock(s_user_key_lock);
         s_ephemeral_users.insert(user_id);
     } else {
         auto const directory_path = get_ce_key_directory_path(user_id);
@@ -344,20 +482,24 @@ static bool create_and_install_user_keys(userid_t user_id, bool create_ephemeral
         auto const paths = get_ce_key_paths(directory_path);
         std::string ce_key_path;
         if (!get_ce_key_new_path(directory_path, paths, &ce_key_path)) return false;
-        if (!store_key(ce_key_path, user_key_temp,
+        if (!store_key(ce_key_path, get_user_key_temp(user_id),
                 kEmptyAuthentication, ce_key)) return false;
         fixate_user_ce_key(directory_path, ce_key_path, paths);
         // Write DE key second; once this is written, all is good.
-        if (!store_key(get_de_key_path(user_id), user_key_temp,
+        if (!store_key(get_de_key_path(user_id), get_user_key_temp(user_id),
                 kEmptyAuthentication, de_key)) return false;
     }
     std::string de_raw_ref;
     if (!install_key(de_key, &de_raw_ref)) return false;
-    s_de_key_raw_refs[user_id] = de_raw_ref;
+    {
+        std::lock_guard<std::mutex> lock(s_de_key_lock);
+        s_de_key_raw_refs[user_id] = de_raw_ref;
+    }
+    set_key_status(user_id, KEY_STATUS_DE, true);
     std::string ce_raw_ref;
     if (!install_key(ce_key, &ce_raw_ref)) return false;
-    s_ce_keys[user_id] = ce_key;
-    s_ce_key_raw_refs[user_id] = ce_raw_ref;
+    set_ce_key(user_id, std::move(ce_key), ce_raw_ref);
+    set_key_status(user_id, KEY_STATUS_CE, true);
     LOG(DEBUG) << "Created keys for user " << user_id;
     return true;
 }
@@ -376,13 +518,145 @@ static bool lookup_key_ref(const std::map<userid_t, std::string>& key_map, useri
 static bool ensure_policy(const std::string& raw_ref, const std::string& path) {
     if (e4crypt_policy_ensure(path.c_str(),
                               raw_ref.data(), raw_ref.size(),
-                              cryptfs_get_file_encryption_mode()) != 0) {
+                              get_contents_mode().c_str()) != 0) {
         LOG(ERROR) << "Failed to set policy on: " << path;
         return false;
     }
     return true;
 }
 
+enum class KeyClass { kNone, kDe, kCe };
+
+// Per-user directory, created with the given owner and mode and, for
+// internal storage on FBE devices, the policy of the named key class.
+struct UserDir {
+    std::string (*build)(const char* volume_uuid, userid_t user_id);
+    int flag;
+    mode_t mode;
+    // App ids, offset into the user's uid range when per_user is set
+    uid_t uid;
+    gid_t gid;
+    bool per_user;
+    KeyClass key;
+};
+
+// Prepared in order, so parents must come before their children
+static const UserDir kUserDirs[] = {
+    // DE_sys key
+    {[](const char*, userid_t user_id) {
+         return android::vold::BuildDataSystemLegacyPath(user_id); },
+     FLAG_STORAGE_DE, 0700, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kNone},
+#if MANAGE_MISC_DIRS
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataMiscLegacyPath(user_id); },
+     FLAG_STORAGE_DE, 0750, AID_SYSTEM, AID_EVERYBODY, true, KeyClass::kNone},
+#endif
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataProfilesDePath(user_id); },
+     FLAG_STORAGE_DE, 0771, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kNone},
+    {[](const char*, userid_t user_id) {
+         return android::vold::BuildDataProfilesForeignDexDePath(user_id); },
+     FLAG_STORAGE_DE, 0773, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kNone},
+
+    // DE_n key
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataSystemDePath(user_id); },
+     FLAG_STORAGE_DE, 0770, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kDe},
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataMiscDePath(user_id); },
+     FLAG_STORAGE_DE, 01771, AID_SYSTEM, AID_MISC, false, KeyClass::kDe},
+    {android::vold::BuildDataUserDePath,
+     FLAG_STORAGE_DE, 0771, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kDe},
+
+    // CE_n key
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataSystemCePath(user_id); },
+     FLAG_STORAGE_CE, 0770, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kCe},
+    {[](const char*, userid_t user_id) { return android::vold::BuildDataMiscCePath(user_id); },
+     FLAG_STORAGE_CE, 01771, AID_SYSTEM, AID_MISC, false, KeyClass::kCe},
+    {android::vold::BuildDataMediaCePath,
+     FLAG_STORAGE_CE, 0770, AID_MEDIA_RW, AID_MEDIA_RW, false, KeyClass::kCe},
+    {android::vold::BuildDataUserCePath,
+     FLAG_STORAGE_CE, 0771, AID_SYSTEM, AID_SYSTEM, false, KeyClass::kCe},
+};
+
+// Directories whose policy has been checked this boot, with the key it used
+static std::map<std::string, std::string> s_verified_policies;
+static std::mutex s_verified_policies_lock;
+
+static bool is_policy_verified(const std::string& path, const std::string& raw_ref) {
+    std::lock_guard<std::mutex> lock(s_verified_policies_lock);
+    auto verified = s_verified_policies.find(path);
+    return verified != s_verified_policies.end() && verified->second == raw_ref;
+}
+
+// Creates or fixes up one directory relative to its already-open parent.
+// Returns true in *changed if anything had to be done.
+static bool prepare_dir_at(int parent_fd, const std::string& path, mode_t mode, uid_t uid,
+                           gid_t gid, bool* changed) {
+    auto name = path.substr(path.rfind('/') + 1);
+    struct stat st;
+    *changed = false;
+    if (fstatat(parent_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno != ENOENT) {
+            PLOG(ERROR) << "Failed to stat " << path;
+            return false;
+        }
+        LOG(DEBUG) << "Creating: " << path;
+        if (mkdirat(parent_fd, name.c_str(), mode) != 0 && errno != EEXIST) {
+            PLOG(ERROR) << "Failed to create " << path;
+            return false;
+        }
+        *changed = true;
+    } else if (!S_ISDIR(st.st_mode)) {
+        LOG(ERROR) << "Not a directory: " << path;
+        return false;
+    } else if ((st.st_mode & ALLPERMS) == mode && st.st_uid == uid && st.st_gid == gid) {
+        return true;
+    } else {
+        LOG(DEBUG) << "Fixing up: " << path;
+        *changed = true;
+    }
+    // mkdirat() is subject to our umask, so always set the mode explicitly
+    if (fchmodat(parent_fd, name.c_str(), mode, 0) != 0
+            || fchownat(parent_fd, name.c_str(), uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+        PLOG(ERROR) << "Failed to prepare " << path;
+        return false;
+    }
+    return true;
+}
+
+// Prepares every kUserDirs entry selected by flags in one pass, reusing
+// the parent directory fd between siblings. Directories that already have
+// the right mode, owner and a policy verified earlier cost one fstatat().
+static bool prepare_user_dirs(const char* volume_uuid, userid_t user_id, int flags,
+                              const std::string& de_raw_ref, const std::string& ce_raw_ref) {
+    std::string parent;
+    std::unique_ptr<AutoCloseFD> parent_fd;
+    for (auto const& dir : kUserDirs) {
+        if (!(flags & dir.flag)) continue;
+        auto path = dir.build(volume_uuid, user_id);
+        auto dir_parent = path.substr(0, path.rfind('/'));
+        if (!parent_fd || dir_parent != parent) {
+            parent = dir_parent;
+            parent_fd.reset(new AutoCloseFD(parent, O_RDONLY | O_DIRECTORY));
+            if (!*parent_fd) {
+                PLOG(ERROR) << "Failed to open " << parent;
+                return false;
+            }
+        }
+        uid_t uid = dir.per_user ? multiuser_get_uid(user_id, dir.uid) : dir.uid;
+        gid_t gid = dir.per_user ? multiuser_get_uid(user_id, dir.gid) : dir.gid;
+        bool changed;
+        if (!prepare_dir_at(parent_fd->get(), path, dir.mode, uid, gid, &changed)) return false;
+
+        const std::string* raw_ref = nullptr;
+        if (dir.key == KeyClass::kDe) raw_ref = &de_raw_ref;
+        if (dir.key == KeyClass::kCe) raw_ref = &ce_raw_ref;
+        if (raw_ref == nullptr || raw_ref->empty()) continue;
+        if (!changed && is_policy_verified(path, *raw_ref)) continue;
+        if (!ensure_policy(*raw_ref, path)) return false;
+        std::lock_guard<std::mutex> lock(s_verified_policies_lock);
+        s_verified_policies[path] = *raw_ref;
+    }
+    return true;
+}
+
 static bool is_numeric(const char* name) {
     for (const char* p = name; *p != '\0'; p++) {
         if (!isdigit(*p)) return false;
@@ -390,6 +664,35 @@ static bool is_numeric(const char* name) {
     return true;
 }
 
+// Blocks until every DE key queued by load_all_de_keys() is installed
+static void wait_for_de_keys() {
+    std::lock_guard<std::mutex> lock(s_de_key_loader_lock);
+    if (s_de_key_loader) {
+        s_de_key_loader->wait();
+        s_de_key_loader.reset();
+    }
+}
+
+static bool install_de_keys(const std::vector<userid_t>& user_ids,
+                            const std::vector<std::string>& key_paths) {
+    // Decrypt the whole group in one pass through Keymaster
+    std::vector<KeyBuffer> keys;
+    if (!android::vold::retrieveKeys(key_paths, kEmptyAuthentication, &keys)) return false;
+    bool success = true;
+    for (size_t i = 0; i < user_ids.size(); i++) {
+        std::string raw_ref;
+        if (!install_key(keys[i], &raw_ref)) {
+            success = false;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(s_de_key_lock);
+        s_de_key_raw_refs[user_ids[i]] = raw_ref;
+        set_key_status(user_ids[i], KEY_STATUS_DE, true);
+        LOG(DEBUG) << "Installed de key for user " << user_ids[i];
+    }
+    return success;
+}
+
 static bool load_all_de_keys() {
     auto de_dir = user_key_dir + "/de";
     auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(de_dir.c_str()), closedir);
@@ -397,6 +700,10 @@ static bool load_all_de_keys() {
         PLOG(ERROR) << "Unable to read de key directory";
         return false;
     }
+    wait_for_de_keys();
+    bool need_user0 = false;
+    std::vector<userid_t> user_ids;
+    std::vector<std::string> key_paths;
     for (;;) {
         errno = 0;
         auto entry = readdir(dirp.get());
@@ -412,16 +719,36 @@ static bool load_all_de_keys() {
             continue;
         }
         userid_t user_id = atoi(entry->d_name);
-        if (s_de_key_raw_refs.count(user_id) == 0) {
-            auto key_path = de_dir + "/" + entry->d_name;
-            std::string key;
-            if (!android::vold::retrieveKey(key_path, kEmptyAuthentication, &key)) return false;
-            std::string raw_ref;
-            if (!install_key(key, &raw_ref)) return false;
-            s_de_key_raw_refs[user_id] = raw_ref;
-            LOG(DEBUG) << "Installed de key for user " << user_id;
+        if (s_de_key_raw_refs.count(user_id) != 0) continue;
+        if (user_id == 0) {
+            need_user0 = true;
+        } else {
+            user_ids.push_back(user_id);
+            key_paths.push_back(de_dir + "/" + entry->d_name);
+        }
+    }
+
+    // Only user 0 gates boot; everyone else loads alongside it, and
+    // anything that needs their keys calls wait_for_de_keys() first
+    if (!user_ids.empty()) {
+        size_t threads = std::min(kMaxDeKeyLoaderThreads, user_ids.size());
+        std::lock_guard<std::mutex> lock(s_de_key_loader_lock);
+        s_de_key_loader.reset(new android::vold::WorkerPool(threads));
+        for (size_t t = 0; t < threads; t++) {
+            std::vector<userid_t> group_ids;
+            std::vector<std::string> group_paths;
+            for (size_t i = t; i < user_ids.size(); i += threads) {
+                group_ids.push_back(user_ids[i]);
+                group_paths.push_back(key_paths[i]);
+            }
+            s_de_key_loader->enqueue([group_ids, group_paths]() {
+                if (!install_de_keys(group_ids, group_paths)) {
+                    LOG(ERROR) << "Failed to load some secondary user de keys";
+                }
+            });
         }
     }
+    if (need_user0 && !install_de_keys({0}, {de_dir + "/0"})) return false;
     // ext4enc:TODO: go through all DE directories, ensure that all user dirs have the
     // correct policy set on them, and that no rogue ones exist.
     return true;
@@ -435,14 +762,13 @@ bool e4crypt_initialize_global_de() {
         return true;
     }
 
-    std::string mode_filename = std::string("/data") + e4crypt_key_mode;
-    std::string mode = cryptfs_get_file_encryption_mode();
-    if (!android::base::WriteStringToFile(mode, mode_filename)) {
+    // init reads the mode back for the system directories' policies
+    if (!android::base::WriteStringToFile(get_contents_mode(true), key_mode_path)) {
         PLOG(ERROR) << "Cannot save type";
         return false;
     }
 
-    std::string device_key;
+    KeyBuffer device_key;
     if (path_exists(device_key_path)) {
         if (!android::vold::retrieveKey(device_key_path,
                 kEmptyAuthentication, &device_key)) return false;
@@ -505,12 +831,13 @@ bool e4crypt_vold_create_user_key(userid_t user_id, int serial, bool ephemeral)
         return true;
     }
     // FIXME test for existence of key that is not loaded yet
-    if (s_ce_key_raw_refs.count(user_id) != 0) {
+    if (has_ce_key(user_id)) {
         LOG(ERROR) << "Already exists, can't e4crypt_vold_create_user_key for " << user_id
                    << " serial " << serial;
         // FIXME should we fail the command?
         return true;
     }
+    wait_for_de_keys();
     if (!create_and_install_user_keys(user_id, ephemeral)) {
         return false;
     }
@@ -523,14 +850,21 @@ bool e4crypt_destroy_user_key(userid_t user_id) {
         return true;
     }
     bool success = true;
-    s_ce_keys.erase(user_id);
-    std::string raw_ref;
-    s_ce_key_raw_refs.erase(user_id);
-    s_de_key_raw_refs.erase(user_id);
-    auto it = s_ephemeral_users.find(user_id);
-    if (it != s_ephemeral_users.end()) {
-        s_ephemeral_users.erase(it);
-    } else {
+    bool ephemeral;
+    {
+        std::lock_guard<std::mutex> lock(s_user_key_lock);
+        s_ce_keys.erase(user_id);
+        s_ce_key_raw_refs.erase(user_id);
+        ephemeral = s_ephemeral_users.erase(user_id) != 0;
+    }
+    android::vold::evictStretchedSecrets(get_ce_key_directory_path(user_id));
+    wait_for_de_keys();
+    {
+        std::lock_guard<std::mutex> lock(s_de_key_lock);
+        s_de_key_raw_refs.erase(user_id);
+    }
+    set_key_status(user_id, KEY_STATUS_DE | KEY_STATUS_CE, false);
+    if (!ephemeral) {
         for (auto const path: get_ce_key_paths(get_ce_key_directory_path(user_id))) {
             success &= android::vold::destroyKey(path);
         }
@@ -591,30 +925,34 @@ bool e4crypt_add_user_key_auth(userid_t user_id, int serial, const char* token_h
     LOG(DEBUG) << "e4crypt_add_user_key_auth " << user_id << " serial=" << serial
                << " token_present=" << (strcmp(token_hex, "!") != 0);
     if (!e4crypt_is_native()) return true;
-    if (s_ephemeral_users.count(user_id) != 0) return true;
+    if (is_ephemeral_user(user_id)) return true;
     std::string token, secret;
     if (!parse_hex(token_hex, &token)) return false;
     if (!parse_hex(secret_hex, &secret)) return false;
     auto auth = secret.empty() ? kEmptyAuthentication
                                    : android::vold::KeyAuthentication(token, secret);
-    auto it = s_ce_keys.find(user_id);
-    if (it == s_ce_keys.end()) {
-        LOG(ERROR) << "Key not loaded into memory, can't change for user " << user_id;
-        return false;
+    KeyBuffer ce_key;
+    {
+        std::lock_guard<std::mutex> lock(s_user_key_lock);
+        auto it = s_ce_keys.find(user_id);
+        if (it == s_ce_keys.end()) {
+            LOG(ERROR) << "Key not loaded into memory, can't change for user " << user_id;
+            return false;
+        }
+        ce_key = it->second.copy();
     }
-    auto ce_key = it->second;
     auto const directory_path = get_ce_key_directory_path(user_id);
     auto const paths = get_ce_key_paths(directory_path);
     std::string ce_key_path;
     if (!get_ce_key_new_path(directory_path, paths, &ce_key_path)) return false;
-    if (!store_key(ce_key_path, user_key_temp, auth, ce_key)) return false;
+    if (!store_key(ce_key_path, get_user_key_temp(user_id), auth, ce_key)) return false;
     return true;
 }
 
 bool e4crypt_fixate_newest_user_key_auth(userid_t user_id) {
     LOG(DEBUG) << "e4crypt_fixate_newest_user_key_auth " << user_id;
     if (!e4crypt_is_native()) return true;
-    if (s_ephemeral_users.count(user_id) != 0) return true;
+    if (is_ephemeral_user(user_id)) return true;
     auto const directory_path = get_ce_key_directory_path(user_id);
     auto const paths = get_ce_key_paths(directory_path);
     if (paths.empty()) {
@@ -630,8 +968,9 @@ bool e4crypt_unlock_user_key(userid_t user_id, int serial, const char* token_hex
                              const char* secret_hex) {
     LOG(DEBUG) << "e4crypt_unlock_user_key " << user_id << " serial=" << serial
                << " token_present=" << (strcmp(token_hex, "!") != 0);
+    android::vold::OperationTimer timer("unlockUser");
     if (e4crypt_is_native()) {
-        if (s_ce_key_raw_refs.count(user_id) != 0) {
+        if (has_ce_key(user_id)) {
             LOG(WARNING) << "Tried to unlock already-unlocked key for user " << user_id;
             return true;
         }
@@ -655,13 +994,84 @@ bool e4crypt_unlock_user_key(userid_t user_id, int serial, const char* token_hex
             return false;
         }
     }
+    timer.setResult(true);
     return true;
 }
 
+// Drops the page cache of every file under path once it's on disk, adding
+// to *bytes how much of it was resident
+static void evict_tree(const std::string& path, uint64_t* files, uint64_t* bytes) {
+    char* paths[] = { const_cast<char*>(path.c_str()), nullptr };
+    FTS* fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, nullptr);
+    if (fts == nullptr) {
+        PLOG(WARNING) << "Failed to walk " << path;
+        return;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident;
+    for (FTSENT* ent = fts_read(fts); ent != nullptr; ent = fts_read(fts)) {
+        if (ent->fts_info != FTS_F || ent->fts_statp->st_size == 0) continue;
+        AutoCloseFD fd(ent->fts_accpath, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+        if (!fd) continue;
+        size_t length = ent->fts_statp->st_size;
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (addr != MAP_FAILED) {
+            resident.resize((length + page - 1) / page);
+            if (mincore(addr, length, resident.data()) == 0) {
+                for (auto r : resident) {
+                    if (r & 1) *bytes += page;
+                }
+            }
+            munmap(addr, length);
+        }
+        fdatasync(fd.get());
+        posix_fadvise(fd.get(), 0, 0, POSIX_FADV_DONTNEED);
+        (*files)++;
+    }
+    fts_close(fts);
+}
+
 // TODO: rename to 'evict' for consistency
 bool e4crypt_lock_user_key(userid_t user_id) {
+    // The next unlock must prove the secret at full cost again
+    android::vold::evictStretchedSecrets(get_ce_key_directory_path(user_id));
     if (e4crypt_is_native()) {
-        // TODO: remove from kernel keyring
+        std::string ce_raw_ref;
+        {
+            std::lock_guard<std::mutex> lock(s_user_key_lock);
+            auto refi = s_ce_key_raw_refs.find(user_id);
+            if (refi == s_ce_key_raw_refs.end()) {
+                // Never unlocked since boot, so there's nothing to evict
+                return true;
+            }
+            ce_raw_ref = refi->second;
+        }
+        android::vold::OperationTimer timer("lockUser");
+
+        // The key goes first, so nothing dropped below can be read back in
+        if (!evict_key(ce_raw_ref)) {
+            LOG(ERROR) << "Failed to lock user " << user_id;
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(s_user_key_lock);
+            s_ce_keys.erase(user_id);
+            s_ce_key_raw_refs.erase(user_id);
+        }
+        set_key_status(user_id, KEY_STATUS_CE, false);
+
+        // A stopped user's cached files would otherwise hold on to memory
+        // the running user could use; DE storage stays, since it's needed
+        // to start the user again
+        uint64_t files = 0;
+        uint64_t bytes = 0;
+        evict_tree(android::vold::BuildDataSystemCePath(user_id), &files, &bytes);
+        evict_tree(android::vold::BuildDataMiscCePath(user_id), &files, &bytes);
+        evict_tree(android::vold::BuildDataMediaCePath(nullptr, user_id), &files, &bytes);
+        evict_tree(android::vold::BuildDataUserCePath(nullptr, user_id), &files, &bytes);
+        LOG(INFO) << "Locked user " << user_id << ", reclaiming " << bytes / 1024
+                  << "KiB cached in " << files << " files";
+        timer.setResult(true);
     } else if (e4crypt_is_emulated()) {
         // When in emulation mode, we just use chmod
         if (!emulated_lock(android::vold::BuildDataSystemCePath(user_id)) ||
@@ -681,67 +1091,28 @@ bool e4crypt_prepare_user_storage(const char* volume_uuid, userid_t user_id, int
     LOG(DEBUG) << "e4crypt_prepare_user_storage for volume " << escape_null(volume_uuid)
                << ", user " << user_id << ", serial " << serial << ", flags " << flags;
 
-    if (flags & FLAG_STORAGE_DE) {
-        // DE_sys key
-        auto system_legacy_path = android::vold::BuildDataSystemLegacyPath(user_id);
-        auto misc_legacy_path = android::vold::BuildDataMiscLegacyPath(user_id);
-        auto profiles_de_path = android::vold::BuildDataProfilesDePath(user_id);
-        auto foreign_de_path = android::vold::BuildDataProfilesForeignDexDePath(user_id);
-
-        // DE_n key
-        auto system_de_path = android::vold::BuildDataSystemDePath(user_id);
-        auto misc_de_path = android::vold::BuildDataMiscDePath(user_id);
-        auto user_de_path = android::vold::BuildDataUserDePath(volume_uuid, user_id);
-
-        if (!prepare_dir(system_legacy_path, 0700, AID_SYSTEM, AID_SYSTEM)) return false;
-#if MANAGE_MISC_DIRS
-        if (!prepare_dir(misc_legacy_path, 0750, multiuser_get_uid(user_id, AID_SYSTEM),
-                multiuser_get_uid(user_id, AID_EVERYBODY))) return false;
-#endif
-        if (!prepare_dir(profiles_de_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
-        if (!prepare_dir(foreign_de_path, 0773, AID_SYSTEM, AID_SYSTEM)) return false;
-
-        if (!prepare_dir(system_de_path, 0770, AID_SYSTEM, AID_SYSTEM)) return false;
-        if (!prepare_dir(misc_de_path, 01771, AID_SYSTEM, AID_MISC)) return false;
-        if (!prepare_dir(user_de_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
-
-        // For now, FBE is only supported on internal storage
-        if (e4crypt_is_native() && volume_uuid == nullptr) {
-            std::string de_raw_ref;
+    // For now, FBE is only supported on internal storage
+    std::string de_raw_ref, ce_raw_ref;
+    if (e4crypt_is_native() && volume_uuid == nullptr) {
+        if (flags & FLAG_STORAGE_DE) {
+            if (user_id != 0) wait_for_de_keys();
+            std::lock_guard<std::mutex> lock(s_de_key_lock);
             if (!lookup_key_ref(s_de_key_raw_refs, user_id, &de_raw_ref)) return false;
-            if (!ensure_policy(de_raw_ref, system_de_path)) return false;
-            if (!ensure_policy(de_raw_ref, misc_de_path)) return false;
-            if (!ensure_policy(de_raw_ref, user_de_path)) return false;
+        }
+        if (flags & FLAG_STORAGE_CE) {
+            std::lock_guard<std::mutex> lock(s_user_key_lock);
+            if (!lookup_key_ref(s_ce_key_raw_refs, user_id, &ce_raw_ref)) return false;
         }
     }
 
-    if (flags & FLAG_STORAGE_CE) {
-        // CE_n key
-        auto system_ce_path = android::vold::BuildDataSystemCePath(user_id);
-        auto misc_ce_path = android::vold::BuildDataMiscCePath(user_id);
-        auto media_ce_path = android::vold::BuildDataMediaCePath(volume_uuid, user_id);
-        auto user_ce_path = android::vold::BuildDataUserCePath(volume_uuid, user_id);
-
-        if (!prepare_dir(system_ce_path, 0770, AID_SYSTEM, AID_SYSTEM)) return false;
-        if (!prepare_dir(misc_ce_path, 01771, AID_SYSTEM, AID_MISC)) return false;
-        if (!prepare_dir(media_ce_path, 0770, AID_MEDIA_RW, AID_MEDIA_RW)) return false;
-        if (!prepare_dir(user_ce_path, 0771, AID_SYSTEM, AID_SYSTEM)) return false;
+    if (!prepare_user_dirs(volume_uuid, user_id, flags, de_raw_ref, ce_raw_ref)) return false;
 
-        // For now, FBE is only supported on internal storage
-        if (e4crypt_is_native() && volume_uuid == nullptr) {
-            std::string ce_raw_ref;
-            if (!lookup_key_ref(s_ce_key_raw_refs, user_id, &ce_raw_ref)) return false;
-            if (!ensure_policy(ce_raw_ref, system_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, misc_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, media_ce_path)) return false;
-            if (!ensure_policy(ce_raw_ref, user_ce_path)) return false;
-
-            // Now that credentials have been installed, we can run restorecon
-            // over these paths
-            // NOTE: these paths need to be kept in sync with libselinux
-            android::vold::RestoreconRecursive(system_ce_path);
-            android::vold::RestoreconRecursive(misc_ce_path);
-        }
+    if ((flags & FLAG_STORAGE_CE) && !ce_raw_ref.empty()) {
+        // Now that credentials have been installed, we can run restorecon
+        // over these paths
+        // NOTE: these paths need to be kept in sync with libselinux
+        android::vold::RestoreconRecursive(android::vold::BuildDataSystemCePath(user_id), true);
+        android::vold::RestoreconRecursive(android::vold::BuildDataMiscCePath(user_id), true);
     }
 
     return true;
@@ -794,3 +1165,22 @@ bool e4crypt_destroy_user_storage(const char* volume_uuid, userid_t user_id, int
 
     return res;
 }
+
+int e4crypt_get_key_status(int index, char* out, int len) {
+    if (!e4crypt_is_native()) return -1;
+    if (index == 0) {
+        const std::string& mode = get_contents_mode();
+        snprintf(out, len, "contents %s (%s)", mode.c_str(),
+                 (mode == "ice") ? "inline crypto engine" : "cpu");
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(s_key_status_lock);
+    auto it = s_key_status.begin();
+    for (int i = 1; i < index && it != s_key_status.end(); i++) ++it;
+    if (it == s_key_status.end()) return -1;
+    snprintf(out, len, "user %d: de %s, ce %s via %s", it->first,
+             (it->second & KEY_STATUS_DE) ? "installed" : "absent",
+             (it->second & KEY_STATUS_CE) ? "installed" : "absent",
+             get_contents_mode().c_str());
+    return 0;
+}
@@ -38,4 +38,10 @@ bool e4crypt_lock_user_key(userid_t user_id);
 bool e4crypt_prepare_user_storage(const char* volume_uuid, userid_t user_id, int serial, int flags);
 bool e4crypt_destroy_user_storage(const char* volume_uuid, userid_t user_id, int flags);
 
+/*
+ * Describes the index'th line of key status: first the contents mode in
+ * use, then which keys each user has installed. Returns -1 past the end.
+ */
+int e4crypt_get_key_status(int index, char* out, int len);
+
 __END_DECLS
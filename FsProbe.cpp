@@ -0,0 +1,701 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FsProbe.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const size_t kSectorSize = 512;
+/* Upper bound on any directory or record we pull in from the media */
+static const size_t kMaxProbeRead = 64 * 1024;
+
+static const uint64_t kExtSuperOffset = 1024;
+static const uint16_t kExtMagic = 0xef53;
+static const uint32_t kExtCompatHasJournal = 0x0004;
+/* Everything ext3 understands; anything beyond this makes it ext4 */
+static const uint32_t kExt3IncompatMask = 0x001f;
+static const uint32_t kExt3RoCompatMask = 0x0007;
+
+static const uint64_t kF2fsSuperOffset = 1024;
+static const uint32_t kF2fsMagic = 0xf2f52010;
+static const size_t kF2fsMaxVolumeName = 512;
+
+static const uint16_t kExtStateValid = 0x0001;
+static const uint16_t kExtStateError = 0x0002;
+static const uint32_t kExtIncompatRecover = 0x0004;
+
+static const size_t kF2fsBlockSize = 4096;
+static const uint32_t kF2fsCpUmount = 0x0001;
+static const uint32_t kF2fsCpError = 0x0008;
+static const uint32_t kF2fsCpFsck = 0x0010;
+
+static const uint16_t kExfatVolumeDirty = 0x0002;
+static const uint16_t kExfatMediaFailure = 0x0004;
+
+static const uint32_t kFat16Clean = 0x8000;
+static const uint32_t kFat16NoError = 0x4000;
+static const uint32_t kFat32Clean = 0x08000000;
+static const uint32_t kFat32NoError = 0x04000000;
+
+static const char* kFsckIntervalProp = "persist.vold.fsck_interval_s";
+static const int kDefaultFsckIntervalSec = 24 * 60 * 60;
+
+static const uint64_t kIsoVrsOffset = 32768;
+static const size_t kIsoBlockSize = 2048;
+static const int kIsoMaxDescriptors = 64;
+static const uint64_t kUdfAnchorBlock = 256;
+
+static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static bool readAt(int fd, uint64_t offset, size_t len, std::vector<uint8_t>& buf) {
+    buf.assign(len, 0);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = TEMP_FAILURE_RETRY(
+                pread64(fd, buf.data() + done, len - done, offset + done));
+        if (res <= 0) {
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+static void appendUtf8(uint32_t c, std::string& out) {
+    if (c < 0x80) {
+        out += (char) c;
+    } else if (c < 0x800) {
+        out += (char) (0xc0 | (c >> 6));
+        out += (char) (0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += (char) (0xe0 | (c >> 12));
+        out += (char) (0x80 | ((c >> 6) & 0x3f));
+        out += (char) (0x80 | (c & 0x3f));
+    } else {
+        out += (char) (0xf0 | (c >> 18));
+        out += (char) (0x80 | ((c >> 12) & 0x3f));
+        out += (char) (0x80 | ((c >> 6) & 0x3f));
+        out += (char) (0x80 | (c & 0x3f));
+    }
+}
+
+/* Converts up to count UTF-16 units, stopping at the first NUL */
+static std::string fromUtf16(const uint8_t* p, size_t count, bool bigEndian = false) {
+    std::string out;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* u = p + i * 2;
+        uint32_t c = bigEndian ? ((u[0] << 8) | u[1]) : get16(u);
+        if (c == 0) break;
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < count) {
+            const uint8_t* l = u + 2;
+            uint32_t low = bigEndian ? ((l[0] << 8) | l[1]) : get16(l);
+            if (low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+        }
+        appendUtf8(c, out);
+    }
+    return out;
+}
+
+static std::string trimmed(const uint8_t* p, size_t len) {
+    std::string out(reinterpret_cast<const char*>(p), strnlen((const char*) p, len));
+    size_t end = out.find_last_not_of(' ');
+    out.erase(end == std::string::npos ? 0 : end + 1);
+    return out;
+}
+
+static std::string formatUuid(const uint8_t* p) {
+    return StringPrintf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7],
+            p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
+}
+
+static std::string formatSerial32(const uint8_t* p) {
+    return StringPrintf("%02X%02X-%02X%02X", p[3], p[2], p[1], p[0]);
+}
+
+static bool isPowerOfTwo(uint32_t v) {
+    return v && !(v & (v - 1));
+}
+
+static bool probeNtfs(int fd, const std::vector<uint8_t>& boot, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel) {
+    const uint8_t* b = boot.data();
+    if (memcmp(b + 3, "NTFS    ", 8)) return false;
+
+    uint32_t bytesPerSector = get16(b + 0x0b);
+    uint32_t sectorsPerCluster = b[0x0d];
+    if (sectorsPerCluster > 0x80) {
+        sectorsPerCluster = 1 << (256 - sectorsPerCluster);
+    }
+    if (!isPowerOfTwo(bytesPerSector) || bytesPerSector < 256 || bytesPerSector > 4096
+            || !isPowerOfTwo(sectorsPerCluster)) {
+        return false;
+    }
+
+    fsType = "ntfs";
+    fsUuid = StringPrintf("%016" PRIX64, get64(b + 0x48));
+
+    uint64_t clusterSize = (uint64_t) bytesPerSector * sectorsPerCluster;
+    int8_t clustersPerRecord = (int8_t) b[0x40];
+    if (clustersPerRecord < -12) {
+        return true;
+    }
+    uint64_t recordSize = (clustersPerRecord > 0)
+            ? clustersPerRecord * clusterSize : 1ULL << -clustersPerRecord;
+    if (recordSize < kSectorSize || recordSize > 4096) {
+        return true;
+    }
+
+    // The label lives in the $VOLUME_NAME attribute of $Volume, MFT record 3
+    std::vector<uint8_t> rec;
+    uint64_t mftOffset = get64(b + 0x30) * clusterSize;
+    if (!readAt(fd, mftOffset + 3 * recordSize, recordSize, rec)
+            || memcmp(rec.data(), "FILE", 4)) {
+        return true;
+    }
+
+    // Undo the update sequence fixups at the end of each sector
+    size_t usaOffset = get16(&rec[4]);
+    size_t usaCount = get16(&rec[6]);
+    if (usaOffset + usaCount * 2 > rec.size() || usaCount * kSectorSize > rec.size() + kSectorSize) {
+        return true;
+    }
+    for (size_t i = 1; i < usaCount; i++) {
+        size_t pos = i * kSectorSize - 2;
+        rec[pos] = rec[usaOffset + i * 2];
+        rec[pos + 1] = rec[usaOffset + i * 2 + 1];
+    }
+
+    size_t off = get16(&rec[0x14]);
+    while (off + 0x18 <= rec.size()) {
+        uint32_t type = get32(&rec[off]);
+        uint32_t len = get32(&rec[off + 4]);
+        if (type == 0xffffffff || len < 0x18 || off + len > rec.size()) break;
+
+        if (type == 0x60 && rec[off + 8] == 0) {
+            uint64_t valueLen = get32(&rec[off + 0x10]);
+            uint64_t valueOff = get16(&rec[off + 0x14]);
+            if (valueOff + valueLen <= len) {
+                fsLabel = fromUtf16(&rec[off + valueOff], valueLen / 2);
+            }
+            break;
+        }
+        off += len;
+    }
+    return true;
+}
+
+static bool probeExfat(int fd, const std::vector<uint8_t>& boot, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel) {
+    const uint8_t* b = boot.data();
+    if (memcmp(b + 3, "EXFAT   ", 8)) return false;
+
+    uint32_t sectorShift = b[0x6c];
+    uint32_t clusterShift = b[0x6d];
+    if (sectorShift < 9 || sectorShift > 12 || sectorShift + clusterShift > 25) {
+        return false;
+    }
+
+    fsType = "exfat";
+    fsUuid = formatSerial32(b + 0x64);
+
+    // Only the first cluster of the root directory is scanned for the label,
+    // which is where every formatter puts it
+    uint64_t heapOffset = get32(b + 0x58);
+    uint32_t rootCluster = get32(b + 0x60);
+    if (rootCluster < 2) return true;
+
+    uint64_t offset = (heapOffset + ((uint64_t) (rootCluster - 2) << clusterShift)) << sectorShift;
+    size_t len = std::min<uint64_t>(1ULL << (sectorShift + clusterShift), kMaxProbeRead);
+    std::vector<uint8_t> dir;
+    if (!readAt(fd, offset, len, dir)) return true;
+
+    for (size_t off = 0; off + 32 <= dir.size(); off += 32) {
+        uint8_t type = dir[off];
+        if (type == 0x00) break;
+        if (type == 0x83) {
+            size_t count = std::min<size_t>(dir[off + 1], 11);
+            fsLabel = fromUtf16(&dir[off + 2], count);
+            break;
+        }
+    }
+    return true;
+}
+
+static bool probeVfat(int fd, const std::vector<uint8_t>& boot, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel) {
+    const uint8_t* b = boot.data();
+    uint32_t bytesPerSector = get16(b + 11);
+    uint32_t sectorsPerCluster = b[13];
+    uint32_t reserved = get16(b + 14);
+    uint32_t fats = b[16];
+    uint32_t rootEntries = get16(b + 17);
+    uint8_t media = b[21];
+    if (!isPowerOfTwo(bytesPerSector) || bytesPerSector < 512 || bytesPerSector > 4096
+            || !isPowerOfTwo(sectorsPerCluster) || reserved == 0
+            || fats == 0 || fats > 4 || (media != 0xf0 && media < 0xf8)) {
+        return false;
+    }
+
+    bool fat32 = (get16(b + 22) == 0);
+    uint64_t fatSize = fat32 ? get32(b + 36) : get16(b + 22);
+    if (fatSize == 0) return false;
+
+    // Extended boot signature tells us the serial and label fields are valid
+    const uint8_t* ext = b + (fat32 ? 0x42 : 0x26);
+    bool hasExt = (ext[0] == 0x28 || ext[0] == 0x29);
+    if (!hasExt && (b[510] != 0x55 || b[511] != 0xaa)) {
+        return false;
+    }
+
+    fsType = "vfat";
+    std::string bootLabel;
+    if (hasExt) {
+        fsUuid = formatSerial32(ext + 1);
+        if (ext[0] == 0x29) {
+            bootLabel = trimmed(ext + 5, 11);
+        }
+    }
+
+    // Prefer the volume label entry in the root directory, like blkid
+    uint64_t fatEnd = ((uint64_t) reserved + fats * fatSize) * bytesPerSector;
+    uint64_t offset;
+    size_t len;
+    if (fat32) {
+        uint32_t rootCluster = get32(b + 44);
+        offset = fatEnd + (uint64_t) (rootCluster >= 2 ? rootCluster - 2 : 0)
+                * sectorsPerCluster * bytesPerSector;
+        len = sectorsPerCluster * bytesPerSector;
+    } else {
+        offset = fatEnd;
+        len = rootEntries * 32;
+    }
+    len = std::min(len, kMaxProbeRead);
+
+    std::vector<uint8_t> dir;
+    if (len > 0 && readAt(fd, offset, len, dir)) {
+        for (size_t off = 0; off + 32 <= dir.size(); off += 32) {
+            const uint8_t* entry = &dir[off];
+            if (entry[0] == 0x00) break;
+            if (entry[0] == 0xe5) continue;
+            uint8_t attr = entry[11];
+            if ((attr & 0x0f) == 0x0f || !(attr & 0x08)) continue;
+
+            std::string label = trimmed(entry, 11);
+            if (!label.empty() && label[0] == 0x05) {
+                label[0] = (char) 0xe5;
+            }
+            fsLabel = label;
+            return true;
+        }
+    }
+
+    if (bootLabel != "NO NAME") {
+        fsLabel = bootLabel;
+    }
+    return true;
+}
+
+static bool probeExt(int fd, std::string& fsType, std::string& fsUuid,
+        std::string& fsLabel) {
+    std::vector<uint8_t> sb;
+    if (!readAt(fd, kExtSuperOffset, 1024, sb) || get16(&sb[0x38]) != kExtMagic) {
+        return false;
+    }
+
+    uint32_t compat = get32(&sb[0x5c]);
+    uint32_t incompat = get32(&sb[0x60]);
+    uint32_t roCompat = get32(&sb[0x64]);
+    if ((incompat & ~kExt3IncompatMask) || (roCompat & ~kExt3RoCompatMask)) {
+        fsType = "ext4";
+    } else if (compat & kExtCompatHasJournal) {
+        fsType = "ext3";
+    } else {
+        fsType = "ext2";
+    }
+    fsUuid = formatUuid(&sb[0x68]);
+    fsLabel = std::string(reinterpret_cast<const char*>(&sb[0x78]),
+            strnlen(reinterpret_cast<const char*>(&sb[0x78]), 16));
+    return true;
+}
+
+static bool probeF2fs(int fd, std::string& fsType, std::string& fsUuid,
+        std::string& fsLabel) {
+    std::vector<uint8_t> sb;
+    if (!readAt(fd, kF2fsSuperOffset, 124 + kF2fsMaxVolumeName * 2, sb)
+            || get32(&sb[0]) != kF2fsMagic) {
+        return false;
+    }
+
+    fsType = "f2fs";
+    fsUuid = formatUuid(&sb[108]);
+    fsLabel = fromUtf16(&sb[124], kF2fsMaxVolumeName);
+    return true;
+}
+
+/* UDF dstring: compression id, characters, then used length in the last byte */
+static std::string fromDstring(const uint8_t* p, size_t size) {
+    size_t len = p[size - 1];
+    if (len < 2 || len > size - 1) return "";
+    if (p[0] == 8) {
+        std::string out;
+        for (size_t i = 1; i < len; i++) {
+            appendUtf8(p[i], out);
+        }
+        return out;
+    } else if (p[0] == 16) {
+        return fromUtf16(p + 1, (len - 1) / 2, true);
+    }
+    return "";
+}
+
+static std::string readUdfLabel(int fd) {
+    std::vector<uint8_t> anchor;
+    if (!readAt(fd, kUdfAnchorBlock * kIsoBlockSize, kIsoBlockSize, anchor)
+            || get16(&anchor[0]) != 2) {
+        return "";
+    }
+
+    uint32_t length = get32(&anchor[16]) / kIsoBlockSize;
+    uint32_t location = get32(&anchor[20]);
+    std::string pvdLabel;
+    for (uint32_t i = 0; i < length && i < (uint32_t) kIsoMaxDescriptors; i++) {
+        std::vector<uint8_t> desc;
+        if (!readAt(fd, (uint64_t) (location + i) * kIsoBlockSize, kIsoBlockSize, desc)) break;
+
+        uint16_t tag = get16(&desc[0]);
+        if (tag == 1 && pvdLabel.empty()) {
+            pvdLabel = fromDstring(&desc[24], 32);
+        } else if (tag == 6) {
+            std::string label = fromDstring(&desc[84], 128);
+            if (!label.empty()) return label;
+        } else if (tag == 8) {
+            break;
+        }
+    }
+    return pvdLabel;
+}
+
+static bool probeIso(int fd, std::string& fsType, std::string& fsUuid,
+        std::string& fsLabel) {
+    bool iso = false;
+    bool udf = false;
+    std::string isoLabel;
+    for (int i = 0; i < kIsoMaxDescriptors; i++) {
+        std::vector<uint8_t> desc;
+        if (!readAt(fd, kIsoVrsOffset + i * kIsoBlockSize, kIsoBlockSize, desc)) break;
+
+        const char* id = reinterpret_cast<const char*>(&desc[1]);
+        if (!memcmp(id, "CD001", 5)) {
+            if (desc[0] == 1 && !iso) {
+                iso = true;
+                isoLabel = trimmed(&desc[40], 32);
+            }
+        } else if (!memcmp(id, "NSR02", 5) || !memcmp(id, "NSR03", 5)) {
+            udf = true;
+        } else if (memcmp(id, "BEA01", 5) && memcmp(id, "TEA01", 5)
+                && memcmp(id, "BOOT2", 5) && memcmp(id, "CDW02", 5)) {
+            break;
+        }
+    }
+
+    // Like blkid, neither carries a UUID; PublicVolume falls back to the label
+    fsUuid.clear();
+    if (udf) {
+        fsType = "udf";
+        fsLabel = readUdfLabel(fd);
+        if (fsLabel.empty()) {
+            fsLabel = isoLabel;
+        }
+        return true;
+    } else if (iso) {
+        fsType = "iso9660";
+        fsLabel = isoLabel;
+        return true;
+    }
+    return false;
+}
+
+status_t ProbeFilesystem(const std::string& path, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel) {
+    int rawFd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (rawFd < 0) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return -errno;
+    }
+    ScopedFd fd(rawFd);
+
+    std::vector<uint8_t> boot;
+    if (!readAt(fd.get(), 0, kSectorSize, boot)) {
+        PLOG(WARNING) << "Failed to read " << path;
+        return -EIO;
+    }
+
+    std::string type, uuid, label;
+    if (probeNtfs(fd.get(), boot, type, uuid, label)
+            || probeExfat(fd.get(), boot, type, uuid, label)
+            || probeExt(fd.get(), type, uuid, label)
+            || probeF2fs(fd.get(), type, uuid, label)
+            || probeVfat(fd.get(), boot, type, uuid, label)
+            || probeIso(fd.get(), type, uuid, label)) {
+        // Like blkid, only fields actually present are reported
+        fsType = type;
+        if (!uuid.empty()) fsUuid = uuid;
+        if (!label.empty()) fsLabel = label;
+    } else {
+        fsType.clear();
+    }
+    return OK;
+}
+
+/* When vold last saw fsck pass on each filesystem, keyed by type and UUID */
+static std::mutex sCheckLock;
+static std::map<std::string, nsecs_t> sLastChecks;
+
+static bool extIsClean(int fd, std::string& reason) {
+    std::vector<uint8_t> sb;
+    if (!readAt(fd, kExtSuperOffset, 1024, sb) || get16(&sb[0x38]) != kExtMagic) {
+        reason = "unreadable superblock";
+        return false;
+    }
+    uint16_t state = get16(&sb[0x3a]);
+    if (!(state & kExtStateValid) || (state & kExtStateError)) {
+        reason = StringPrintf("state 0x%x", state);
+        return false;
+    }
+    if (get32(&sb[0x60]) & kExtIncompatRecover) {
+        reason = "journal needs recovery";
+        return false;
+    }
+    int16_t maxMounts = (int16_t) get16(&sb[0x36]);
+    uint16_t mounts = get16(&sb[0x34]);
+    if (maxMounts > 0 && mounts >= maxMounts) {
+        reason = StringPrintf("mounted %u times", mounts);
+        return false;
+    }
+    uint32_t lastCheck = get32(&sb[0x40]);
+    uint32_t interval = get32(&sb[0x44]);
+    if (interval > 0 && (uint64_t) lastCheck + interval < (uint64_t) time(nullptr)) {
+        reason = "check interval passed";
+        return false;
+    }
+    return true;
+}
+
+static uint32_t f2fsCrc(const uint8_t* p, size_t len) {
+    uint32_t crc = kF2fsMagic;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+        }
+    }
+    return crc;
+}
+
+static bool f2fsIsClean(int fd, std::string& reason) {
+    std::vector<uint8_t> sb;
+    if (!readAt(fd, kF2fsSuperOffset, 128, sb) || get32(&sb[0]) != kF2fsMagic
+            || get32(&sb[16]) != 12 || get32(&sb[20]) > 16) {
+        reason = "unreadable superblock";
+        return false;
+    }
+    uint64_t cpAddr = get32(&sb[76]);
+    uint64_t blocksPerSeg = 1ULL << get32(&sb[20]);
+
+    // Whichever of the two checkpoint packs is newest and intact is live
+    bool found = false;
+    uint64_t bestVersion = 0;
+    uint32_t flags = 0;
+    for (int pack = 0; pack < 2; pack++) {
+        std::vector<uint8_t> cp;
+        if (!readAt(fd, (cpAddr + pack * blocksPerSeg) * kF2fsBlockSize, kF2fsBlockSize, cp)) {
+            continue;
+        }
+        uint32_t crcOffset = get32(&cp[164]);
+        if (crcOffset < 192 || crcOffset > kF2fsBlockSize - 4
+                || f2fsCrc(cp.data(), crcOffset) != get32(&cp[crcOffset])) {
+            continue;
+        }
+        uint64_t version = get64(&cp[0]);
+        if (!found || version > bestVersion) {
+            found = true;
+            bestVersion = version;
+            flags = get32(&cp[132]);
+        }
+    }
+    if (!found) {
+        reason = "no valid checkpoint";
+        return false;
+    }
+    if (!(flags & kF2fsCpUmount) || (flags & (kF2fsCpError | kF2fsCpFsck))) {
+        reason = StringPrintf("checkpoint flags 0x%x", flags);
+        return false;
+    }
+    return true;
+}
+
+static bool exfatIsClean(const std::vector<uint8_t>& boot, std::string& reason) {
+    if (memcmp(&boot[3], "EXFAT   ", 8)) {
+        reason = "not exfat";
+        return false;
+    }
+    uint16_t flags = get16(&boot[0x6a]);
+    if (flags & (kExfatVolumeDirty | kExfatMediaFailure)) {
+        reason = StringPrintf("volume flags 0x%x", flags);
+        return false;
+    }
+    return true;
+}
+
+static bool vfatIsClean(int fd, const std::vector<uint8_t>& boot, std::string& reason) {
+    const uint8_t* b = boot.data();
+    uint32_t bytesPerSector = get16(b + 11);
+    uint32_t reserved = get16(b + 14);
+    if (!isPowerOfTwo(bytesPerSector) || bytesPerSector < 512 || bytesPerSector > 4096) {
+        reason = "invalid boot sector";
+        return false;
+    }
+
+    // Only FAT16 and FAT32 record a clean shutdown, in the second FAT entry
+    bool fat32 = (get16(b + 22) == 0);
+    uint32_t sectorsPerCluster = b[13];
+    uint32_t totalSectors = get16(b + 19) ? get16(b + 19) : get32(b + 32);
+    uint32_t rootSectors = (get16(b + 17) * 32 + bytesPerSector - 1) / bytesPerSector;
+    uint32_t fatSectors = fat32 ? get32(b + 36) : get16(b + 22);
+    if (!fat32 && sectorsPerCluster > 0) {
+        uint64_t dataSectors = totalSectors
+                - std::min<uint64_t>(totalSectors, reserved + b[16] * fatSectors + rootSectors);
+        if (dataSectors / sectorsPerCluster < 4085) {
+            reason = "fat12 has no dirty bit";
+            return false;
+        }
+    }
+
+    std::vector<uint8_t> fat;
+    if (!readAt(fd, (uint64_t) reserved * bytesPerSector, 8, fat)) {
+        reason = "unreadable fat";
+        return false;
+    }
+    bool clean = fat32
+            ? (get32(&fat[4]) & (kFat32Clean | kFat32NoError)) == (kFat32Clean | kFat32NoError)
+            : (get16(&fat[2]) & (kFat16Clean | kFat16NoError)) == (kFat16Clean | kFat16NoError);
+    // Windows also flags dirty volumes in the boot sector
+    if (!clean || (b[fat32 ? 0x41 : 0x25] & 0x01)) {
+        reason = "dirty bit set";
+        return false;
+    }
+    return true;
+}
+
+bool NeedsFilesystemCheck(const std::string& path, const std::string& fsType,
+        const std::string& fsUuid, std::string& reason) {
+    if (fsType != "ext4" && fsType != "f2fs" && fsType != "exfat" && fsType != "vfat") {
+        reason = "state unknown for " + fsType;
+        return true;
+    }
+    int interval = property_get_int32(kFsckIntervalProp, kDefaultFsckIntervalSec);
+    if (interval <= 0) {
+        reason = "fast path disabled";
+        return true;
+    }
+    if (fsUuid.empty()) {
+        reason = "no uuid to track";
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sCheckLock);
+        auto it = sLastChecks.find(fsType + ":" + fsUuid);
+        if (it == sLastChecks.end()) {
+            reason = "not checked since boot";
+            return true;
+        }
+        if (systemTime(SYSTEM_TIME_MONOTONIC) - it->second > seconds_to_nanoseconds(interval)) {
+            reason = "forced check interval passed";
+            return true;
+        }
+    }
+
+    int rawFd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (rawFd < 0) {
+        reason = "unable to open";
+        return true;
+    }
+    ScopedFd fd(rawFd);
+    std::vector<uint8_t> boot;
+    if (!readAt(fd.get(), 0, kSectorSize, boot)) {
+        reason = "unable to read";
+        return true;
+    }
+
+    bool clean;
+    if (fsType == "ext4") {
+        clean = extIsClean(fd.get(), reason);
+    } else if (fsType == "f2fs") {
+        clean = f2fsIsClean(fd.get(), reason);
+    } else if (fsType == "exfat") {
+        clean = exfatIsClean(boot, reason);
+    } else {
+        clean = vfatIsClean(fd.get(), boot, reason);
+    }
+    if (clean) {
+        reason = "cleanly unmounted";
+    }
+    return !clean;
+}
+
+void RecordFilesystemCheck(const std::string& fsType, const std::string& fsUuid) {
+    if (fsUuid.empty()) return;
+    std::lock_guard<std::mutex> lock(sCheckLock);
+    sLastChecks[fsType + ":" + fsUuid] = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_FS_PROBE_H
+#define ANDROID_VOLD_FS_PROBE_H
+
+#include <utils/Errors.h>
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Identifies the filesystem on the given block device by reading its
+ * superblock directly, reporting the same type, UUID and label strings
+ * that blkid would. Understands the filesystems vold can mount: vfat,
+ * exfat, ntfs, ext2/3/4, f2fs, iso9660 and udf. Returns OK with an empty
+ * fsType when nothing was recognized, so callers can fall back to blkid.
+ *
+ * Only bounded, fixed-size reads are done, since the media is untrusted.
+ */
+status_t ProbeFilesystem(const std::string& path, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel);
+
+/*
+ * Decides whether fsck must run before mounting, using the clean or dirty
+ * state the filesystem keeps on disk: ext4 s_state and journal recovery,
+ * the f2fs checkpoint flags, the FAT clean shutdown bits and exFAT
+ * VolumeFlags. A check is still forced when ext4's own mount count or
+ * interval is reached, or when persist.vold.fsck_interval_s has passed
+ * since vold last checked this filesystem. Anything else always gets
+ * checked. Sets reason to the deciding state either way.
+ */
+bool NeedsFilesystemCheck(const std::string& path, const std::string& fsType,
+        const std::string& fsUuid, std::string& reason);
+
+/* Notes that fsck just passed, restarting the forced-check interval */
+void RecordFilesystemCheck(const std::string& fsType, const std::string& fsUuid);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeyBuffer.h"
+
+#include <android-base/logging.h>
+#include <openssl/crypto.h>
+
+#include <algorithm>
+#include <bitset>
+#include <mutex>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace android {
+namespace vold {
+
+// Enough for every user's keys on a busy device, with room for the
+// blobs that pass through while they're being decrypted
+static constexpr size_t kArenaBytes = 64 * 1024;
+static constexpr size_t kSlotBytes = 64;
+static constexpr size_t kSlots = kArenaBytes / kSlotBytes;
+
+static void hidePages(void* addr, size_t length) {
+    // Neither core dumps nor forked helpers need to see keys
+    madvise(addr, length, MADV_DONTDUMP);
+    madvise(addr, length, MADV_DONTFORK);
+}
+
+/*
+ * One locked region handed out in kSlotBytes slots. Allocations that
+ * don't fit get locked pages of their own.
+ */
+class KeyArena {
+public:
+    KeyArena() : mBase(nullptr) {
+        void* base = mmap(nullptr, kArenaBytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            PLOG(ERROR) << "Unable to map key arena";
+            return;
+        }
+        if (mlock(base, kArenaBytes) != 0) {
+            PLOG(ERROR) << "Unable to mlock key arena";
+            munmap(base, kArenaBytes);
+            return;
+        }
+        hidePages(base, kArenaBytes);
+        mBase = static_cast<char*>(base);
+    }
+
+    /* Returns zeroed memory, and in *capacity how much of it there is */
+    char* allocate(size_t bytes, size_t* capacity) {
+        size_t slots = (bytes + kSlotBytes - 1) / kSlotBytes;
+        if (mBase != nullptr && slots <= kSlots) {
+            std::lock_guard<std::mutex> lock(mLock);
+            size_t run = 0;
+            for (size_t i = 0; i < kSlots; i++) {
+                run = mUsed[i] ? 0 : run + 1;
+                if (run == slots) {
+                    size_t first = i + 1 - slots;
+                    for (size_t j = first; j <= i; j++) mUsed.set(j);
+                    *capacity = slots * kSlotBytes;
+                    return mBase + first * kSlotBytes;
+                }
+            }
+            LOG(WARNING) << "Key arena full; locking " << bytes << " bytes separately";
+        }
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t length = (bytes + page - 1) / page * page;
+        void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            PLOG(FATAL) << "Unable to map " << length << " bytes for key material";
+        }
+        if (mlock(addr, length) != 0) {
+            PLOG(WARNING) << "Unable to mlock key memory";
+        }
+        hidePages(addr, length);
+        *capacity = length;
+        return static_cast<char*>(addr);
+    }
+
+    /* Wipes and returns memory from allocate() */
+    void release(char* addr, size_t capacity) {
+        OPENSSL_cleanse(addr, capacity);
+        if (mBase != nullptr && addr >= mBase && addr < mBase + kArenaBytes) {
+            std::lock_guard<std::mutex> lock(mLock);
+            size_t first = (addr - mBase) / kSlotBytes;
+            for (size_t j = first; j < first + capacity / kSlotBytes; j++) mUsed.reset(j);
+        } else {
+            munlock(addr, capacity);
+            munmap(addr, capacity);
+        }
+    }
+
+private:
+    std::mutex mLock;
+    char* mBase;
+    std::bitset<kSlots> mUsed;
+
+    DISALLOW_COPY_AND_ASSIGN(KeyArena);
+};
+
+static KeyArena& getArena() {
+    // Never destroyed, since keys held in globals are released at exit
+    static KeyArena* arena = new KeyArena();
+    return *arena;
+}
+
+KeyBuffer::KeyBuffer(size_t size) : KeyBuffer() {
+    resize(size);
+}
+
+KeyBuffer::KeyBuffer(const char* data, size_t size) : KeyBuffer() {
+    append(data, size);
+}
+
+KeyBuffer::KeyBuffer(KeyBuffer&& other) noexcept :
+        mData(other.mData), mSize(other.mSize), mCapacity(other.mCapacity) {
+    other.mData = nullptr;
+    other.mSize = 0;
+    other.mCapacity = 0;
+}
+
+KeyBuffer& KeyBuffer::operator=(KeyBuffer&& other) noexcept {
+    if (this != &other) {
+        clear();
+        std::swap(mData, other.mData);
+        std::swap(mSize, other.mSize);
+        std::swap(mCapacity, other.mCapacity);
+    }
+    return *this;
+}
+
+KeyBuffer::~KeyBuffer() {
+    clear();
+}
+
+void KeyBuffer::reserve(size_t capacity) {
+    if (capacity <= mCapacity) return;
+    size_t newCapacity;
+    char* newData = getArena().allocate(capacity, &newCapacity);
+    if (mData != nullptr) {
+        memcpy(newData, mData, mSize);
+        getArena().release(mData, mCapacity);
+    }
+    mData = newData;
+    mCapacity = newCapacity;
+}
+
+void KeyBuffer::resize(size_t size) {
+    if (size > mCapacity) {
+        reserve(std::max(size, mCapacity * 2));
+    } else if (size < mSize) {
+        // Keep everything past the end zero, so growing again exposes nothing
+        OPENSSL_cleanse(mData + size, mSize - size);
+    }
+    mSize = size;
+}
+
+void KeyBuffer::append(const char* data, size_t size) {
+    size_t offset = mSize;
+    resize(mSize + size);
+    if (size > 0) memcpy(mData + offset, data, size);
+}
+
+void KeyBuffer::clear() {
+    if (mData != nullptr) {
+        getArena().release(mData, mCapacity);
+    }
+    mData = nullptr;
+    mSize = 0;
+    mCapacity = 0;
+}
+
+KeyBuffer KeyBuffer::copy() const {
+    return KeyBuffer(mData, mSize);
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_KEY_BUFFER_H
+#define ANDROID_VOLD_KEY_BUFFER_H
+
+#include "Utils.h"
+
+#include <stddef.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Owns bytes of key material. Storage comes from a small mlock'd arena
+ * excluded from core dumps, or from locked pages of its own once the arena
+ * is full, so keys never reach swap. Contents are wiped whenever storage
+ * is released. Buffers can be moved but not copied; use copy() where a
+ * second owner is really needed.
+ */
+class KeyBuffer {
+public:
+    KeyBuffer() : mData(nullptr), mSize(0), mCapacity(0) {}
+    explicit KeyBuffer(size_t size);
+    KeyBuffer(const char* data, size_t size);
+    KeyBuffer(KeyBuffer&& other) noexcept;
+    KeyBuffer& operator=(KeyBuffer&& other) noexcept;
+    ~KeyBuffer();
+
+    char* data() { return mData; }
+    const char* data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+    /* Keeps existing contents; new bytes are zero */
+    void resize(size_t size);
+    void append(const char* data, size_t size);
+    /* Wipes and releases the storage */
+    void clear();
+    KeyBuffer copy() const;
+
+private:
+    char* mData;
+    size_t mSize;
+    size_t mCapacity;
+
+    void reserve(size_t capacity);
+
+    DISALLOW_COPY_AND_ASSIGN(KeyBuffer);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
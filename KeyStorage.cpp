@@ -17,17 +17,24 @@
 #include "KeyStorage.h"
 
 #include "Keymaster.h"
+#include "Scrypt.h"
 #include "ScryptParameters.h"
+#include "SecureDiscard.h"
 #include "Utils.h"
 
+#include <algorithm>
+#include <mutex>
 #include <vector>
 
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
 #include <openssl/sha.h>
 
 #include <android-base/file.h>
@@ -39,11 +46,6 @@
 
 #include <keymaster/authorization_set.h>
 
-extern "C" {
-
-#include "crypto_scrypt.h"
-}
-
 namespace android {
 namespace vold {
 
@@ -57,10 +59,12 @@ static constexpr size_t SECDISCARDABLE_BYTES = 1 << 14;
 static constexpr size_t STRETCHED_BYTES = 1 << 6;
 
 static constexpr uint32_t AUTH_TIMEOUT = 30; // Seconds
+static constexpr size_t STRETCH_CACHE_ENTRIES = 8;
+// Keymaster implementations must allow at least this many concurrent operations
+static constexpr size_t MAX_PIPELINED_OPS = 8;
 
 static const char* kCurrentVersion = "1";
 static const char* kRmPath = "/system/bin/rm";
-static const char* kSecdiscardPath = "/system/bin/secdiscard";
 static const char* kStretch_none = "none";
 static const char* kStretch_nopassword = "nopassword";
 static const std::string kStretchPrefix_scrypt = "scrypt ";
@@ -138,7 +142,7 @@ static keymaster::AuthorizationSetBuilder beginParams(const KeyAuthentication& a
 
 static bool encryptWithKeymasterKey(Keymaster& keymaster, const std::string& key,
                                     const KeyAuthentication& auth, const std::string& appId,
-                                    const std::string& message, std::string* ciphertext) {
+                                    const KeyBuffer& message, std::string* ciphertext) {
     auto params = beginParams(auth, appId).build();
     keymaster::AuthorizationSet outParams;
     auto opHandle = keymaster.begin(KM_PURPOSE_ENCRYPT, key, params, &outParams);
@@ -161,15 +165,27 @@ static bool encryptWithKeymasterKey(Keymaster& keymaster, const std::string& key
     return true;
 }
 
-static bool decryptWithKeymasterKey(Keymaster& keymaster, const std::string& key,
-                                    const KeyAuthentication& auth, const std::string& appId,
-                                    const std::string& ciphertext, std::string* message) {
+static KeymasterOperation beginDecrypt(Keymaster& keymaster, const std::string& key,
+                                       const KeyAuthentication& auth, const std::string& appId,
+                                       const std::string& ciphertext) {
     auto nonce = ciphertext.substr(0, GCM_NONCE_BYTES);
-    auto bodyAndMac = ciphertext.substr(GCM_NONCE_BYTES);
     auto params = addStringParam(beginParams(auth, appId), keymaster::TAG_NONCE, nonce).build();
-    auto opHandle = keymaster.begin(KM_PURPOSE_DECRYPT, key, params);
+    return keymaster.begin(KM_PURPOSE_DECRYPT, key, params);
+}
+
+// Decrypts the part of the ciphertext after the nonce straight into "message"
+static bool updateDecrypt(KeymasterOperation& opHandle, const std::string& ciphertext,
+                          KeyBuffer* message) {
+    return opHandle.updateCompletely(ciphertext.data() + GCM_NONCE_BYTES,
+                                     ciphertext.size() - GCM_NONCE_BYTES, message);
+}
+
+static bool decryptWithKeymasterKey(Keymaster& keymaster, const std::string& key,
+                                    const KeyAuthentication& auth, const std::string& appId,
+                                    const std::string& ciphertext, KeyBuffer* message) {
+    auto opHandle = beginDecrypt(keymaster, key, auth, appId, ciphertext);
     if (!opHandle) return false;
-    if (!opHandle.updateCompletely(bodyAndMac, message)) return false;
+    if (!updateDecrypt(opHandle, ciphertext, message)) return false;
     if (!opHandle.finish()) return false;
     return true;
 }
@@ -220,10 +236,10 @@ static bool stretchSecret(const std::string& stretching, const std::string& secr
             return false;
         }
         stretched->assign(STRETCHED_BYTES, '\0');
-        if (crypto_scrypt(reinterpret_cast<const uint8_t*>(secret.data()), secret.size(),
-                          reinterpret_cast<const uint8_t*>(salt.data()), salt.size(),
-                          1 << Nf, 1 << rf, 1 << pf,
-                          reinterpret_cast<uint8_t*>(&(*stretched)[0]), stretched->size()) != 0) {
+        if (vold_scrypt(reinterpret_cast<const uint8_t*>(secret.data()), secret.size(),
+                        reinterpret_cast<const uint8_t*>(salt.data()), salt.size(),
+                        1 << Nf, 1 << rf, 1 << pf,
+                        reinterpret_cast<uint8_t*>(&(*stretched)[0]), stretched->size()) != 0) {
             LOG(ERROR) << "scrypt failed with params: " << stretching;
             return false;
         }
@@ -234,16 +250,139 @@ static bool stretchSecret(const std::string& stretching, const std::string& secr
     return true;
 }
 
-static bool generateAppId(const KeyAuthentication& auth, const std::string& stretching,
-                          const std::string& salt, const std::string& secdiscardable,
-                          std::string* appId) {
+// Recently stretched secrets, so that unlocking a user again doesn't pay
+// for scrypt a second time. Entries are found by an HMAC of the stretching,
+// salt and secret under a key picked at first use, so a wrong secret never
+// matches and nothing derived from the secret alone sits in memory. The
+// table is mlock'd and lives only until the key is locked or destroyed.
+struct StretchCacheEntry {
+    bool used;
+    uint64_t lastUse;
+    uint8_t tag[SHA256_DIGEST_LENGTH];
+    uint8_t stretched[STRETCHED_BYTES];
+};
+
+static std::mutex stretchCacheLock;
+static StretchCacheEntry stretchCache[STRETCH_CACHE_ENTRIES];
+// Key directory of each entry, kept apart since it isn't secret
+static std::string stretchCacheDirs[STRETCH_CACHE_ENTRIES];
+static uint8_t stretchCacheKey[SHA256_DIGEST_LENGTH];
+static bool stretchCacheReady;
+static uint64_t stretchCacheClock;
+
+static bool initStretchCache() {
+    if (stretchCacheReady) return true;
+    if (mlock(stretchCache, sizeof(stretchCache)) != 0 ||
+        mlock(stretchCacheKey, sizeof(stretchCacheKey)) != 0) {
+        PLOG(WARNING) << "Unable to mlock stretch cache; not caching";
+        return false;
+    }
+    std::string key;
+    if (ReadRandomBytes(sizeof(stretchCacheKey), key) != OK) {
+        LOG(WARNING) << "Random read failed; not caching";
+        return false;
+    }
+    memcpy(stretchCacheKey, key.data(), sizeof(stretchCacheKey));
+    OPENSSL_cleanse(&key[0], key.size());
+    stretchCacheReady = true;
+    return true;
+}
+
+static void stretchCacheTag(const std::string& stretching, const std::string& salt,
+                            const std::string& secret, uint8_t* tag) {
+    // The stretching string never contains NUL, so it delimits the fields
+    std::string message = stretching + '\0' + salt + secret;
+    unsigned int len = SHA256_DIGEST_LENGTH;
+    HMAC(EVP_sha256(), stretchCacheKey, sizeof(stretchCacheKey),
+         reinterpret_cast<const uint8_t*>(message.data()), message.size(), tag, &len);
+    OPENSSL_cleanse(&message[0], message.size());
+}
+
+static void clearStretchCacheEntry(size_t i) {
+    OPENSSL_cleanse(&stretchCache[i], sizeof(stretchCache[i]));
+    stretchCacheDirs[i].clear();
+}
+
+static bool isScryptStretching(const std::string& stretching) {
+    return stretching.compare(0, kStretchPrefix_scrypt.size(), kStretchPrefix_scrypt) == 0;
+}
+
+static bool stretchSecretCached(const std::string& dir, const std::string& stretching,
+                                const std::string& secret, const std::string& salt,
+                                std::string* stretched) {
+    // Only scrypt is slow enough to be worth remembering
+    if (!isScryptStretching(stretching)) {
+        return stretchSecret(stretching, secret, salt, stretched);
+    }
+
+    uint8_t tag[SHA256_DIGEST_LENGTH];
+    bool tagged = false;
+    {
+        std::lock_guard<std::mutex> lock(stretchCacheLock);
+        if (initStretchCache()) {
+            stretchCacheTag(stretching, salt, secret, tag);
+            tagged = true;
+            for (size_t i = 0; i < STRETCH_CACHE_ENTRIES; i++) {
+                auto& entry = stretchCache[i];
+                if (entry.used && CRYPTO_memcmp(entry.tag, tag, sizeof(tag)) == 0) {
+                    entry.lastUse = ++stretchCacheClock;
+                    stretchCacheDirs[i] = dir;
+                    stretched->assign(reinterpret_cast<const char*>(entry.stretched),
+                                      STRETCHED_BYTES);
+                    return true;
+                }
+            }
+        }
+    }
+
+    // Stretch without holding the lock; it takes hundreds of milliseconds
+    if (!stretchSecret(stretching, secret, salt, stretched)) return false;
+    if (stretched->size() != STRETCHED_BYTES) return true;
+
+    std::lock_guard<std::mutex> lock(stretchCacheLock);
+    if (!stretchCacheReady) return true;
+    // Another thread may have set the cache up while we were stretching
+    if (!tagged) stretchCacheTag(stretching, salt, secret, tag);
+    size_t victim = 0;
+    for (size_t i = 0; i < STRETCH_CACHE_ENTRIES; i++) {
+        if (!stretchCache[i].used) {
+            victim = i;
+            break;
+        }
+        if (stretchCache[i].lastUse < stretchCache[victim].lastUse) victim = i;
+    }
+    clearStretchCacheEntry(victim);
+    // Fill in everything before the entry is marked as used
+    auto& entry = stretchCache[victim];
+    entry.lastUse = ++stretchCacheClock;
+    memcpy(entry.tag, tag, sizeof(tag));
+    memcpy(entry.stretched, stretched->data(), STRETCHED_BYTES);
+    stretchCacheDirs[victim] = dir;
+    entry.used = true;
+    return true;
+}
+
+void evictStretchedSecrets(const std::string& dir) {
+    std::lock_guard<std::mutex> lock(stretchCacheLock);
+    for (size_t i = 0; i < STRETCH_CACHE_ENTRIES; i++) {
+        const auto& entryDir = stretchCacheDirs[i];
+        if (stretchCache[i].used && entryDir.compare(0, dir.size(), dir) == 0 &&
+            (entryDir.size() == dir.size() || entryDir[dir.size()] == '/')) {
+            clearStretchCacheEntry(i);
+        }
+    }
+}
+
+static bool generateAppId(const std::string& dir, const KeyAuthentication& auth,
+                          const std::string& stretching, const std::string& salt,
+                          const std::string& secdiscardable, std::string* appId) {
     std::string stretched;
-    if (!stretchSecret(stretching, auth.secret, salt, &stretched)) return false;
+    if (!stretchSecretCached(dir, stretching, auth.secret, salt, &stretched)) return false;
     *appId = hashSecdiscardable(secdiscardable) + stretched;
     return true;
 }
 
-bool storeKey(const std::string& dir, const KeyAuthentication& auth, const std::string& key) {
+bool storeKey(const std::string& dir, const KeyAuthentication& auth, const KeyBuffer& key) {
     if (TEMP_FAILURE_RETRY(mkdir(dir.c_str(), 0700)) == -1) {
         PLOG(ERROR) << "key mkdir " << dir;
         return false;
@@ -267,7 +406,7 @@ bool storeKey(const std::string& dir, const KeyAuthentication& auth, const std::
         if (!writeStringToFile(salt, dir + "/" + kFn_salt)) return false;
     }
     std::string appId;
-    if (!generateAppId(auth, stretching, salt, secdiscardable, &appId)) return false;
+    if (!generateAppId(dir, auth, stretching, salt, secdiscardable, &appId)) return false;
     Keymaster keymaster;
     if (!keymaster) return false;
     std::string kmKey;
@@ -279,7 +418,15 @@ bool storeKey(const std::string& dir, const KeyAuthentication& auth, const std::
     return true;
 }
 
-bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::string* key) {
+// What retrieveKey() reads from a key directory before asking Keymaster.
+struct StoredKey {
+    std::string appId;
+    std::string kmKey;
+    std::string encryptedMessage;
+};
+
+static bool readStoredKey(const std::string& dir, const KeyAuthentication& auth,
+                          StoredKey* stored) {
     std::string version;
     if (!readFileToString(dir + "/" + kFn_version, &version)) return false;
     if (version != kCurrentVersion) {
@@ -294,15 +441,60 @@ bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::str
     if (stretchingNeedsSalt(stretching)) {
         if (!readFileToString(dir + "/" + kFn_salt, &salt)) return false;
     }
-    std::string appId;
-    if (!generateAppId(auth, stretching, salt, secdiscardable, &appId)) return false;
-    std::string kmKey;
-    if (!readFileToString(dir + "/" + kFn_keymaster_key_blob, &kmKey)) return false;
-    std::string encryptedMessage;
-    if (!readFileToString(dir + "/" + kFn_encrypted_key, &encryptedMessage)) return false;
+    if (!generateAppId(dir, auth, stretching, salt, secdiscardable, &stored->appId)) return false;
+    if (!readFileToString(dir + "/" + kFn_keymaster_key_blob, &stored->kmKey)) return false;
+    if (!readFileToString(dir + "/" + kFn_encrypted_key, &stored->encryptedMessage)) return false;
+    if (stored->encryptedMessage.size() < GCM_NONCE_BYTES) {
+        LOG(ERROR) << "Encrypted key too short in " << dir;
+        return false;
+    }
+    return true;
+}
+
+bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, KeyBuffer* key) {
+    StoredKey stored;
+    if (!readStoredKey(dir, auth, &stored)) return false;
     Keymaster keymaster;
     if (!keymaster) return false;
-    return decryptWithKeymasterKey(keymaster, kmKey, auth, appId, encryptedMessage, key);
+    return decryptWithKeymasterKey(keymaster, stored.kmKey, auth, stored.appId,
+                                   stored.encryptedMessage, key);
+}
+
+bool retrieveKeys(const std::vector<std::string>& dirs, const KeyAuthentication& auth,
+                  std::vector<KeyBuffer>* keys) {
+    std::vector<StoredKey> stored(dirs.size());
+    for (size_t i = 0; i < dirs.size(); i++) {
+        if (!readStoredKey(dirs[i], auth, &stored[i])) return false;
+    }
+    Keymaster keymaster;
+    if (!keymaster) return false;
+
+    keys->clear();
+    keys->resize(dirs.size());
+    // Run each stage for a group of keys before the next, so the TEE sees
+    // back-to-back calls; groups stay under its limit on open operations.
+    for (size_t first = 0; first < dirs.size(); first += MAX_PIPELINED_OPS) {
+        size_t last = std::min(dirs.size(), first + MAX_PIPELINED_OPS);
+        std::vector<KeymasterOperation> ops;
+        ops.reserve(last - first);
+        for (size_t i = first; i < last; i++) {
+            ops.push_back(beginDecrypt(keymaster, stored[i].kmKey, auth, stored[i].appId,
+                                       stored[i].encryptedMessage));
+            if (!ops.back()) {
+                LOG(ERROR) << "Unable to begin decrypting " << dirs[i];
+                return false;
+            }
+        }
+        for (size_t i = first; i < last; i++) {
+            if (!updateDecrypt(ops[i - first], stored[i].encryptedMessage, &(*keys)[i])) {
+                return false;
+            }
+        }
+        for (size_t i = first; i < last; i++) {
+            if (!ops[i - first].finish()) return false;
+        }
+    }
+    return true;
 }
 
 static bool deleteKey(const std::string& dir) {
@@ -315,16 +507,20 @@ static bool deleteKey(const std::string& dir) {
 }
 
 static bool runSecdiscard(const std::string& dir) {
-    if (ForkExecvp(
-            std::vector<std::string>{kSecdiscardPath, "--",
-                dir + "/" + kFn_encrypted_key,
-                dir + "/" + kFn_keymaster_key_blob,
-                dir + "/" + kFn_secdiscardable,
-                }) != 0) {
-        LOG(ERROR) << "secdiscard failed";
-        return false;
+    bool success = true;
+    for (auto const& fn : {kFn_encrypted_key, kFn_keymaster_key_blob, kFn_secdiscardable}) {
+        auto path = dir + "/" + fn;
+        // As with the standalone tool, a failed discard doesn't stop the
+        // key from being deleted
+        if (!SecureDiscardPath(path)) {
+            LOG(ERROR) << "Secure discard failed for: " << path;
+        }
+        if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+            PLOG(ERROR) << "Unable to unlink: " << path;
+            success = false;
+        }
     }
-    return true;
+    return success;
 }
 
 static bool recursiveDeleteKey(const std::string& dir) {
@@ -337,6 +533,7 @@ static bool recursiveDeleteKey(const std::string& dir) {
 
 bool destroyKey(const std::string& dir) {
     bool success = true;
+    evictStretchedSecrets(dir);
     // Try each thing, even if previous things failed.
     success &= deleteKey(dir);
     success &= runSecdiscard(dir);
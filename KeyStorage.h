@@ -17,7 +17,10 @@
 #ifndef ANDROID_VOLD_KEYSTORAGE_H
 #define ANDROID_VOLD_KEYSTORAGE_H
 
+#include "KeyBuffer.h"
+
 #include <string>
+#include <vector>
 
 namespace android {
 namespace vold {
@@ -39,14 +42,24 @@ extern const KeyAuthentication kEmptyAuthentication;
 // in such a way that it can only be retrieved via Keymaster and
 // can be securely deleted.
 // It's safe to move/rename the directory after creation.
-bool storeKey(const std::string& dir, const KeyAuthentication& auth, const std::string& key);
+bool storeKey(const std::string& dir, const KeyAuthentication& auth, const KeyBuffer& key);
+
+// Retrieve the key from the named directory. Keymaster decrypts it
+// directly into "key", so it's never held in ordinary memory.
+bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, KeyBuffer* key);
 
-// Retrieve the key from the named directory.
-bool retrieveKey(const std::string& dir, const KeyAuthentication& auth, std::string* key);
+// Retrieve the keys from each of the named directories, which share "auth", with the
+// Keymaster operations for them pipelined. Fails if any key can't be retrieved.
+bool retrieveKeys(const std::vector<std::string>& dirs, const KeyAuthentication& auth,
+                  std::vector<KeyBuffer>* keys);
 
 // Securely destroy the key stored in the named directory and delete the directory.
 bool destroyKey(const std::string& dir);
 
+// Forget any cached stretched secrets for keys in or below the named directory.
+// retrieveKey() keeps a few in locked memory so repeated unlocks skip scrypt.
+void evictStretchedSecrets(const std::string& dir);
+
 }  // namespace vold
 }  // namespace android
 
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeyedWorkQueue.h"
+
+namespace android {
+namespace vold {
+
+KeyedWorkQueue::KeyedWorkQueue(size_t threads) : mPool(threads) {
+}
+
+KeyedWorkQueue::~KeyedWorkQueue() {
+    mPool.wait();
+}
+
+void KeyedWorkQueue::enqueue(const std::string& key, std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mPending.push_back({ key, std::move(job) });
+    schedule();
+}
+
+void KeyedWorkQueue::schedule() {
+    if (mRunning.count("")) {
+        return;
+    }
+    // Keys that already have an earlier job waiting or running
+    std::unordered_set<std::string> blocked;
+    auto i = mPending.begin();
+    while (i != mPending.end()) {
+        if (i->key.empty()) {
+            // Nothing may pass a barrier, and it only starts once idle
+            if (mRunning.empty() && i == mPending.begin()) {
+                dispatch(std::move(*i));
+                mPending.erase(i);
+            }
+            return;
+        }
+        if (mRunning.count(i->key) || blocked.count(i->key)) {
+            blocked.insert(i->key);
+            ++i;
+            continue;
+        }
+        dispatch(std::move(*i));
+        i = mPending.erase(i);
+    }
+}
+
+void KeyedWorkQueue::dispatch(Entry&& entry) {
+    std::string key(entry.key);
+    std::function<void()> job(std::move(entry.job));
+    mRunning.insert(key);
+    mPool.enqueue([this, key, job] {
+        job();
+        std::lock_guard<std::mutex> lock(mLock);
+        mRunning.erase(key);
+        schedule();
+    });
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_KEYED_WORK_QUEUE_H
+#define ANDROID_VOLD_KEYED_WORK_QUEUE_H
+
+#include "Utils.h"
+#include "WorkerPool.h"
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+namespace android {
+namespace vold {
+
+/*
+ * Runs jobs on a WorkerPool while keeping jobs that share a key in the
+ * order they were enqueued; jobs with different keys run in parallel.
+ * A job with an empty key is a barrier: it waits for everything enqueued
+ * before it, and nothing enqueued after it starts until it's done.
+ */
+class KeyedWorkQueue {
+public:
+    KeyedWorkQueue(size_t threads);
+    virtual ~KeyedWorkQueue();
+
+    void enqueue(const std::string& key, std::function<void()> job);
+
+private:
+    struct Entry {
+        std::string key;
+        std::function<void()> job;
+    };
+
+    std::mutex mLock;
+    std::list<Entry> mPending;
+    /* Keys with a job on the pool; the empty key while a barrier runs */
+    std::unordered_set<std::string> mRunning;
+    /* Last member, so its threads are joined before the rest goes away */
+    WorkerPool mPool;
+
+    void schedule();
+    void dispatch(Entry&& entry);
+
+    DISALLOW_COPY_AND_ASSIGN(KeyedWorkQueue);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
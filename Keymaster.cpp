@@ -15,15 +15,43 @@
  */
 
 #include "Keymaster.h"
+#include "LatencyHistogram.h"
 
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <hardware/hardware.h>
 #include <hardware/keymaster1.h>
 #include <hardware/keymaster2.h>
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+#include <openssl/crypto.h>
+
+#include <mutex>
 
 namespace android {
 namespace vold {
 
+// HAL entry points, for the per-call timing in dump
+enum KeymasterCall {
+    kCallGenerateKey,
+    kCallDeleteKey,
+    kCallBegin,
+    kCallUpdate,
+    kCallFinish,
+    kCallAbort,
+    kCallCount,
+};
+
+static const char* kCallNames[] = {"generate_key", "delete_key", "begin",
+                                   "update",       "finish",     "abort"};
+
+static const char* kTraceNames[] = {"keymaster generate_key", "keymaster delete_key",
+                                    "keymaster begin",        "keymaster update",
+                                    "keymaster finish",       "keymaster abort"};
+
+static std::mutex sCallStatsLock;
+static LatencyHistogram sCallStats[kCallCount];
+
 class IKeymasterDevice {
   public:
     IKeymasterDevice() {}
@@ -48,7 +76,24 @@ class IKeymasterDevice {
     virtual keymaster_error_t abort(keymaster_operation_handle_t operation_handle) const = 0;
 
   protected:
+    // The device is shared by every Keymaster in vold, so calls into the
+    // HAL are serialized here and timed.
+    template <typename F>
+    keymaster_error_t call(KeymasterCall which, F&& f) const {
+        ATRACE_NAME(kTraceNames[which]);
+        std::lock_guard<std::mutex> lock(mLock);
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        auto error = f();
+        nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        std::lock_guard<std::mutex> statsLock(sCallStatsLock);
+        sCallStats[which].record(elapsed);
+        return error;
+    }
+
     DISALLOW_COPY_AND_ASSIGN(IKeymasterDevice);
+
+  private:
+    mutable std::mutex mLock;
 };
 
 template <typename T> class KeymasterDevice : public IKeymasterDevice {
@@ -56,28 +101,33 @@ template <typename T> class KeymasterDevice : public IKeymasterDevice {
     KeymasterDevice(T* d) : mDevice{d} {}
     keymaster_error_t generate_key(const keymaster_key_param_set_t* params,
                                    keymaster_key_blob_t* key_blob) const override final {
-        return mDevice->generate_key(mDevice, params, key_blob, nullptr);
+        return call(kCallGenerateKey,
+                    [&] { return mDevice->generate_key(mDevice, params, key_blob, nullptr); });
     }
     keymaster_error_t delete_key(const keymaster_key_blob_t* key) const override final {
         if (mDevice->delete_key == nullptr) return KM_ERROR_OK;
-        return mDevice->delete_key(mDevice, key);
+        return call(kCallDeleteKey, [&] { return mDevice->delete_key(mDevice, key); });
     }
     keymaster_error_t begin(keymaster_purpose_t purpose, const keymaster_key_blob_t* key,
                             const keymaster_key_param_set_t* in_params,
                             keymaster_key_param_set_t* out_params,
                             keymaster_operation_handle_t* operation_handle) const override final {
-        return mDevice->begin(mDevice, purpose, key, in_params, out_params, operation_handle);
+        return call(kCallBegin, [&] {
+            return mDevice->begin(mDevice, purpose, key, in_params, out_params, operation_handle);
+        });
     }
     keymaster_error_t update(keymaster_operation_handle_t operation_handle,
                              const keymaster_key_param_set_t* in_params,
                              const keymaster_blob_t* input, size_t* input_consumed,
                              keymaster_key_param_set_t* out_params,
                              keymaster_blob_t* output) const override final {
-        return mDevice->update(mDevice, operation_handle, in_params, input, input_consumed,
-                               out_params, output);
+        return call(kCallUpdate, [&] {
+            return mDevice->update(mDevice, operation_handle, in_params, input, input_consumed,
+                                   out_params, output);
+        });
     }
     keymaster_error_t abort(keymaster_operation_handle_t operation_handle) const override final {
-        return mDevice->abort(mDevice, operation_handle);
+        return call(kCallAbort, [&] { return mDevice->abort(mDevice, operation_handle); });
     }
 
   protected:
@@ -93,7 +143,10 @@ class Keymaster1Device : public KeymasterDevice<keymaster1_device_t> {
                              const keymaster_blob_t* signature,
                              keymaster_key_param_set_t* out_params,
                              keymaster_blob_t* output) const override final {
-        return mDevice->finish(mDevice, operation_handle, in_params, signature, out_params, output);
+        return call(kCallFinish, [&] {
+            return mDevice->finish(mDevice, operation_handle, in_params, signature, out_params,
+                                   output);
+        });
     }
 };
 
@@ -106,8 +159,10 @@ class Keymaster2Device : public KeymasterDevice<keymaster2_device_t> {
                              const keymaster_blob_t* signature,
                              keymaster_key_param_set_t* out_params,
                              keymaster_blob_t* output) const override final {
-        return mDevice->finish(mDevice, operation_handle, in_params, nullptr, signature, out_params,
-                               output);
+        return call(kCallFinish, [&] {
+            return mDevice->finish(mDevice, operation_handle, in_params, nullptr, signature,
+                                   out_params, output);
+        });
     }
 };
 
@@ -115,12 +170,13 @@ KeymasterOperation::~KeymasterOperation() {
     if (mDevice) mDevice->abort(mOpHandle);
 }
 
-bool KeymasterOperation::updateCompletely(const std::string& input, std::string* output) {
-    output->clear();
-    auto it = input.begin();
-    while (it != input.end()) {
-        size_t toRead = static_cast<size_t>(input.end() - it);
-        keymaster_blob_t inputBlob{reinterpret_cast<const uint8_t*>(&*it), toRead};
+bool KeymasterOperation::updateAll(const char* input, size_t inputLength,
+                                   const std::function<void(const char*, size_t)>& consume) {
+    const char* it = input;
+    const char* end = input + inputLength;
+    while (it != end) {
+        size_t toRead = static_cast<size_t>(end - it);
+        keymaster_blob_t inputBlob{reinterpret_cast<const uint8_t*>(it), toRead};
         keymaster_blob_t outputBlob;
         size_t inputConsumed;
         auto error =
@@ -130,7 +186,11 @@ bool KeymasterOperation::updateCompletely(const std::string& input, std::string*
             mDevice = nullptr;
             return false;
         }
-        output->append(reinterpret_cast<const char*>(outputBlob.data), outputBlob.data_length);
+        consume(reinterpret_cast<const char*>(outputBlob.data), outputBlob.data_length);
+        // Decrypted output is key material, so don't leave it in the heap
+        if (outputBlob.data != nullptr) {
+            OPENSSL_cleanse(const_cast<uint8_t*>(outputBlob.data), outputBlob.data_length);
+        }
         free(const_cast<uint8_t*>(outputBlob.data));
         if (inputConsumed > toRead) {
             LOG(ERROR) << "update reported too much input consumed";
@@ -142,6 +202,35 @@ bool KeymasterOperation::updateCompletely(const std::string& input, std::string*
     return true;
 }
 
+bool KeymasterOperation::updateCompletely(const std::string& input, std::string* output) {
+    output->clear();
+    return updateAll(input.data(), input.size(),
+                     [output](const char* data, size_t length) { output->append(data, length); });
+}
+
+bool KeymasterOperation::updateCompletely(const KeyBuffer& input, std::string* output) {
+    output->clear();
+    return updateAll(input.data(), input.size(),
+                     [output](const char* data, size_t length) { output->append(data, length); });
+}
+
+bool KeymasterOperation::updateCompletely(const char* input, size_t inputLength,
+                                          KeyBuffer* output) {
+    output->clear();
+    // GCM output is never longer than its input, so this is the only allocation
+    output->resize(inputLength);
+    size_t written = 0;
+    bool success = updateAll(input, inputLength, [output, &written](const char* data,
+                                                                   size_t length) {
+        if (length == 0) return;
+        if (written + length > output->size()) output->resize(written + length);
+        memcpy(output->data() + written, data, length);
+        written += length;
+    });
+    output->resize(written);
+    return success;
+}
+
 bool KeymasterOperation::finish() {
     auto error = mDevice->finish(mOpHandle, nullptr, nullptr, nullptr, nullptr);
     mDevice = nullptr;
@@ -165,34 +254,54 @@ bool KeymasterOperation::finishWithOutput(std::string* output) {
     return true;
 }
 
-Keymaster::Keymaster() {
-    mDevice = nullptr;
+static std::shared_ptr<IKeymasterDevice> openDevice() {
     const hw_module_t* module;
     int ret = hw_get_module_by_class(KEYSTORE_HARDWARE_MODULE_ID, NULL, &module);
     if (ret != 0) {
         LOG(ERROR) << "hw_get_module_by_class returned " << ret;
-        return;
+        return nullptr;
     }
     if (module->module_api_version == KEYMASTER_MODULE_API_VERSION_1_0) {
         keymaster1_device_t* device;
         ret = keymaster1_open(module, &device);
         if (ret != 0) {
             LOG(ERROR) << "keymaster1_open returned " << ret;
-            return;
+            return nullptr;
         }
-        mDevice = std::make_shared<Keymaster1Device>(device);
+        return std::make_shared<Keymaster1Device>(device);
     } else if (module->module_api_version == KEYMASTER_MODULE_API_VERSION_2_0) {
         keymaster2_device_t* device;
         ret = keymaster2_open(module, &device);
         if (ret != 0) {
             LOG(ERROR) << "keymaster2_open returned " << ret;
-            return;
+            return nullptr;
         }
-        mDevice = std::make_shared<Keymaster2Device>(device);
+        return std::make_shared<Keymaster2Device>(device);
     } else {
         LOG(ERROR) << "module_api_version is " << module->module_api_version;
-        return;
+        return nullptr;
+    }
+}
+
+Keymaster::Keymaster() {
+    // Opening the HAL sets up a session with the TEE, so do it once and
+    // share the device; a failed open is retried by the next Keymaster.
+    static std::mutex lock;
+    static std::shared_ptr<IKeymasterDevice> device;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!device) device = openDevice();
+    mDevice = device;
+}
+
+std::vector<std::string> Keymaster::getCallStats() {
+    std::vector<std::string> res;
+    std::lock_guard<std::mutex> lock(sCallStatsLock);
+    for (int i = 0; i < kCallCount; i++) {
+        if (sCallStats[i].getCount() == 0) continue;
+        res.push_back(android::base::StringPrintf("%s %s", kCallNames[i],
+                                                  sCallStats[i].toString().c_str()));
     }
+    return res;
 }
 
 bool Keymaster::generateKey(const keymaster::AuthorizationSet& inParams, std::string* key) {
@@ -17,12 +17,16 @@
 #ifndef ANDROID_VOLD_KEYMASTER_H
 #define ANDROID_VOLD_KEYMASTER_H
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <keymaster/authorization_set.h>
 
+#include "KeyBuffer.h"
+
 namespace android {
 namespace vold {
 
@@ -49,6 +53,10 @@ class KeymasterOperation {
     // Call "update" repeatedly until all of the input is consumed, and
     // concatenate the output. Return true on success.
     bool updateCompletely(const std::string& input, std::string* output);
+    // As above, for encrypting key material held in a KeyBuffer.
+    bool updateCompletely(const KeyBuffer& input, std::string* output);
+    // As above, decrypting straight into a KeyBuffer.
+    bool updateCompletely(const char* input, size_t inputLength, KeyBuffer* output);
     // Finish; pass nullptr for the "output" param.
     bool finish();
     // Finish and write the output to this string.
@@ -62,6 +70,9 @@ class KeymasterOperation {
   private:
     KeymasterOperation(std::shared_ptr<IKeymasterDevice> d, keymaster_operation_handle_t h)
         : mDevice{d}, mOpHandle{h} {}
+    // Feeds every output chunk to "consume", which must copy it before returning.
+    bool updateAll(const char* input, size_t inputLength,
+                   const std::function<void(const char*, size_t)>& consume);
     std::shared_ptr<IKeymasterDevice> mDevice;
     keymaster_operation_handle_t mOpHandle;
     DISALLOW_COPY_AND_ASSIGN(KeymasterOperation);
@@ -72,6 +83,7 @@ class KeymasterOperation {
 // part of one.
 class Keymaster {
   public:
+    // All instances share one device, opened on first use.
     Keymaster();
     // false if we failed to open the keymaster device.
     explicit operator bool() { return mDevice != nullptr; }
@@ -85,6 +97,9 @@ class Keymaster {
     // Begin a new cryptographic operation; don't collect output parameters.
     KeymasterOperation begin(keymaster_purpose_t purpose, const std::string& key,
                              const AuthorizationSet& inParams);
+    // Latency of each HAL entry point so far, as "<call> count p50 p90 p99 p99.9 max"
+    // in microseconds.
+    static std::vector<std::string> getCallStats();
 
   private:
     std::shared_ptr<IKeymasterDevice> mDevice;
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LatencyHistogram.h"
+
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+LatencyHistogram::LatencyHistogram() {
+    clear();
+}
+
+int LatencyHistogram::bucketFor(uint64_t us) {
+    const uint64_t kLinear = 1 << kSubBits;
+    if (us < kLinear) {
+        return us;
+    }
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (us >> (exp - kSubBits)) & (kLinear - 1);
+    return std::min(((exp - kSubBits + 1) << kSubBits) + sub, kBuckets - 1);
+}
+
+uint64_t LatencyHistogram::bucketLimit(int bucket) {
+    const int kLinear = 1 << kSubBits;
+    if (bucket < kLinear) {
+        return bucket + 1;
+    }
+    int exp = (bucket >> kSubBits) + kSubBits - 1;
+    uint64_t sub = bucket & (kLinear - 1);
+    return ((kLinear + sub + 1) << (exp - kSubBits));
+}
+
+void LatencyHistogram::record(nsecs_t latency) {
+    latency = std::max(latency, (nsecs_t) 0);
+    mBuckets[bucketFor(nanoseconds_to_microseconds(latency))]++;
+    mCount++;
+    mTotal += latency;
+    mMax = std::max(mMax, latency);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; i++) {
+        mBuckets[i] += other.mBuckets[i];
+    }
+    mCount += other.mCount;
+    mTotal += other.mTotal;
+    mMax = std::max(mMax, other.mMax);
+}
+
+void LatencyHistogram::clear() {
+    mBuckets.fill(0);
+    mCount = 0;
+    mTotal = 0;
+    mMax = 0;
+}
+
+nsecs_t LatencyHistogram::getPercentile(double percentile) const {
+    if (mCount == 0) {
+        return 0;
+    }
+    uint64_t target = std::max((uint64_t) 1, (uint64_t) (mCount * percentile / 100.0 + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += mBuckets[i];
+        if (seen >= target) {
+            // Never claim more than we actually observed
+            return std::min((nsecs_t) microseconds_to_nanoseconds(bucketLimit(i)), mMax);
+        }
+    }
+    return mMax;
+}
+
+std::string LatencyHistogram::toString() const {
+    return StringPrintf("%llu %lld %lld %lld %lld %lld",
+            (unsigned long long) mCount,
+            (long long) nanoseconds_to_microseconds(getPercentile(50)),
+            (long long) nanoseconds_to_microseconds(getPercentile(90)),
+            (long long) nanoseconds_to_microseconds(getPercentile(99)),
+            (long long) nanoseconds_to_microseconds(getPercentile(99.9)),
+            (long long) nanoseconds_to_microseconds(mMax));
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_LATENCY_HISTOGRAM_H
+#define ANDROID_VOLD_LATENCY_HISTOGRAM_H
+
+#include <utils/Timers.h>
+
+#include <array>
+#include <string>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Log-bucketed histogram of latencies in microseconds. Each power of two
+ * is split into eight linear sub-buckets, so percentiles are accurate to
+ * within 12.5% from 1us up past an hour. Not thread-safe; keep one per
+ * thread and merge() them afterwards.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(nsecs_t latency);
+    void merge(const LatencyHistogram& other);
+    void clear();
+
+    uint64_t getCount() const { return mCount; }
+    nsecs_t getTotal() const { return mTotal; }
+    nsecs_t getMax() const { return mMax; }
+
+    /* Upper bound of the bucket holding the given percentile (0-100) */
+    nsecs_t getPercentile(double percentile) const;
+
+    /* "count p50 p90 p99 p99.9 max", latencies in microseconds */
+    std::string toString() const;
+
+private:
+    static const int kSubBits = 3;
+    static const int kBuckets = (64 - kSubBits) << kSubBits;
+
+    std::array<uint64_t, kBuckets> mBuckets;
+    uint64_t mCount;
+    nsecs_t mTotal;
+    nsecs_t mMax;
+
+    static int bucketFor(uint64_t us);
+    static uint64_t bucketLimit(int bucket);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
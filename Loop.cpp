@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -25,9 +26,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/statvfs.h>
 
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 #include <linux/kdev_t.h>
 
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
 #define LOG_TAG "Vold"
 
 #include <cutils/log.h>
@@ -35,58 +45,206 @@
 #include <sysutils/SocketClient.h>
 #include "Loop.h"
 #include "Asec.h"
+#include "Utils.h"
 #include "VoldUtil.h"
 #include "sehandle.h"
 
-int Loop::dumpState(SocketClient *c) {
-    int i;
-    int fd;
-    char filename[256];
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE 0x4C09
+#endif
+
+static const char* kLoopControlPath = "/dev/loop-control";
+/* Lists every loop device the kernel has, however high its index */
+static const char* kSysBlockPath = "/sys/block";
+/* Another process can grab the device LOOP_CTL_GET_FREE handed us */
+static const int kLoopClaimRetries = 8;
+/* More extents than this and reads through the loop start seeking badly */
+static const uint32_t kImageExtentsWarn = 16;
 
-    for (i = 0; i < LOOP_MAX; i++) {
+/*
+ * Loop devices vold has bound, by id and by device path. Filled by a single
+ * scan on first use so devices left over from a previous vold instance are
+ * still found; after that create/destroy keep it current.
+ */
+static std::mutex sLoopLock;
+static bool sLoopIndexLoaded = false;
+static std::unordered_map<std::string, std::string> sLoopById;
+static std::unordered_map<std::string, std::string> sLoopByDevice;
+/* Indexes whose /dev/block node already exists with the right label */
+static std::unordered_set<int> sLoopNodes;
+
+static void loopDevicePath(int i, char *buffer, size_t len) {
+    snprintf(buffer, len, "/dev/block/loop%d", i);
+}
+
+static void indexLoop(const std::string &id, const std::string &device) {
+    sLoopById[id] = device;
+    sLoopByDevice[device] = id;
+}
+
+static void unindexLoop(const std::string &device) {
+    auto it = sLoopByDevice.find(device);
+    if (it != sLoopByDevice.end()) {
+        sLoopById.erase(it->second);
+        sLoopByDevice.erase(it);
+    }
+}
+
+static void loadLoopIndex() {
+    if (sLoopIndexLoaded) {
+        return;
+    }
+    sLoopIndexLoaded = true;
+
+    DIR* dir = opendir(kSysBlockPath);
+    if (!dir) {
+        SLOGE("Unable to open %s (%s)", kSysBlockPath, strerror(errno));
+        return;
+    }
+
+    char filename[256];
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        int i;
+        char extra;
+        if (sscanf(de->d_name, "loop%d%c", &i, &extra) != 1 || i < 0) {
+            continue;
+        }
         struct loop_info64 li;
-        int rc;
+        loopDevicePath(i, filename, sizeof(filename));
 
-        sprintf(filename, "/dev/block/loop%d", i);
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        sLoopNodes.insert(i);
+        int rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+        close(fd);
+        if (rc == 0 && li.lo_crypt_name[0]) {
+            char id[LO_NAME_SIZE + 1];
+            strlcpy(id, (const char*) li.lo_crypt_name, sizeof(id));
+            indexLoop(id, filename);
+        }
+    }
+    closedir(dir);
+    SLOGD("Indexed %zu active loop devices", sLoopById.size());
+}
 
-        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
-            if (errno != ENOENT) {
+/* Makes sure the node for loop index i exists and is labelled */
+static int prepareLoopNode(int i) {
+    if (sLoopNodes.count(i)) {
+        return 0;
+    }
+
+    char filename[256];
+    char *secontext = NULL;
+    int rc;
+    loopDevicePath(i, filename, sizeof(filename));
+
+    /*
+     * The kernel starts us off with 8 loop nodes, but more
+     * are created on-demand if needed.
+     */
+    mode_t mode = 0660 | S_IFBLK;
+    unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
+
+    if (sehandle) {
+        rc = selabel_lookup(sehandle, &secontext, filename, S_IFBLK);
+        if (rc == 0)
+            setfscreatecon(secontext);
+    }
+
+    rc = mknod(filename, mode, dev);
+    int sverrno = errno;
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+    if (rc < 0 && sverrno != EEXIST) {
+        SLOGE("Error creating loop device node (%s)", strerror(sverrno));
+        errno = sverrno;
+        return -1;
+    }
+
+    sLoopNodes.insert(i);
+    return 0;
+}
+
+/* Returns an open fd for an unbound loop device, filling in its path */
+static int claimFreeLoop(char *filename, size_t len) {
+    int ctl_fd = open(kLoopControlPath, O_RDWR | O_CLOEXEC);
+    if (ctl_fd >= 0) {
+        for (int attempt = 0; attempt < kLoopClaimRetries; attempt++) {
+            int i = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+            if (i < 0) {
+                SLOGW("LOOP_CTL_GET_FREE failed (%s)", strerror(errno));
+                break;
+            }
+            if (prepareLoopNode(i)) {
+                break;
+            }
+
+            struct loop_info64 li;
+            loopDevicePath(i, filename, len);
+            int fd = open(filename, O_RDWR | O_CLOEXEC);
+            if (fd < 0) {
                 SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            } else {
-                continue;
+                break;
             }
+            if (ioctl(fd, LOOP_GET_STATUS64, &li) < 0 && errno == ENXIO) {
+                close(ctl_fd);
+                return fd;
+            }
+            close(fd);
+        }
+        close(ctl_fd);
+    }
+
+    // Older kernels without loop-control; probe each node in turn
+    for (int i = 0; i < Loop::LOOP_MAX; i++) {
+        struct loop_info64 li;
+        int rc;
+
+        if (prepareLoopNode(i)) {
+            return -1;
+        }
+
+        loopDevicePath(i, filename, len);
+        int fd = open(filename, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            SLOGE("Unable to open %s (%s)", filename, strerror(errno));
             return -1;
         }
 
         rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+        if (rc < 0 && errno == ENXIO)
+            return fd;
+
         close(fd);
-        if (rc < 0 && errno == ENXIO) {
-            continue;
-        }
 
         if (rc < 0) {
             SLOGE("Unable to get loop status for %s (%s)", filename,
                  strerror(errno));
             return -1;
         }
-        char *tmp = NULL;
-        asprintf(&tmp, "%s %d %lld:%lld %llu %lld:%lld %lld 0x%x {%s} {%s}", filename, li.lo_number,
-                MAJOR(li.lo_device), MINOR(li.lo_device), li.lo_inode, MAJOR(li.lo_rdevice),
-                        MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags, li.lo_crypt_name,
-                        li.lo_file_name);
-        c->sendMsg(0, tmp, false);
-        free(tmp);
     }
-    return 0;
+
+    SLOGE("Exhausted all loop devices");
+    errno = ENOSPC;
+    return -1;
 }
 
-int Loop::lookupActive(const char *id, char *buffer, size_t len) {
+int Loop::dumpState(SocketClient *c) {
     int i;
     int fd;
     char filename[256];
 
-    memset(buffer, 0, len);
-
     for (i = 0; i < LOOP_MAX; i++) {
         struct loop_info64 li;
         int rc;
@@ -103,93 +261,67 @@ int Loop::lookupActive(const char *id, char *buffer, size_t len) {
         }
 
         rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+        close(fd);
         if (rc < 0 && errno == ENXIO) {
-            close(fd);
             continue;
         }
-        close(fd);
 
         if (rc < 0) {
             SLOGE("Unable to get loop status for %s (%s)", filename,
                  strerror(errno));
             return -1;
         }
-        if (!strncmp((const char*) li.lo_crypt_name, id, LO_NAME_SIZE)) {
-            break;
-        }
-    }
-
-    if (i == LOOP_MAX) {
-        errno = ENOENT;
-        return -1;
+        char *tmp = NULL;
+        asprintf(&tmp, "%s %d %lld:%lld %llu %lld:%lld %lld 0x%x {%s} {%s}", filename, li.lo_number,
+                MAJOR(li.lo_device), MINOR(li.lo_device), li.lo_inode, MAJOR(li.lo_rdevice),
+                        MINOR(li.lo_rdevice), li.lo_offset, li.lo_flags, li.lo_crypt_name,
+                        li.lo_file_name);
+        c->sendMsg(0, tmp, false);
+        free(tmp);
     }
-    strlcpy(buffer, filename, len);
     return 0;
 }
 
-int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
-    int i;
-    int fd;
-    char filename[256];
-
-    for (i = 0; i < LOOP_MAX; i++) {
-        struct loop_info64 li;
-        int rc;
-        char *secontext = NULL;
-
-        sprintf(filename, "/dev/block/loop%d", i);
-
-        /*
-         * The kernel starts us off with 8 loop nodes, but more
-         * are created on-demand if needed.
-         */
-        mode_t mode = 0660 | S_IFBLK;
-        unsigned int dev = (0xff & i) | ((i << 12) & 0xfff00000) | (7 << 8);
-
-        if (sehandle) {
-            rc = selabel_lookup(sehandle, &secontext, filename, S_IFBLK);
-            if (rc == 0)
-                setfscreatecon(secontext);
-        }
+int Loop::lookupActive(const char *id, char *buffer, size_t len) {
+    std::lock_guard<std::mutex> lock(sLoopLock);
+    loadLoopIndex();
 
-        if (mknod(filename, mode, dev) < 0) {
-            if (errno != EEXIST) {
-                int sverrno = errno;
-                SLOGE("Error creating loop device node (%s)", strerror(errno));
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-                errno = sverrno;
-                return -1;
-            }
-        }
-        if (secontext) {
-            freecon(secontext);
-            setfscreatecon(NULL);
-        }
+    memset(buffer, 0, len);
 
-        if ((fd = open(filename, O_RDWR | O_CLOEXEC)) < 0) {
-            SLOGE("Unable to open %s (%s)", filename, strerror(errno));
-            return -1;
-        }
+    auto it = sLoopById.find(id);
+    if (it == sLoopById.end()) {
+        errno = ENOENT;
+        return -1;
+    }
 
-        rc = ioctl(fd, LOOP_GET_STATUS64, &li);
-        if (rc < 0 && errno == ENXIO)
-            break;
+    // Confirm the device is still bound to this id before handing it out
+    std::string device = it->second;
+    struct loop_info64 li;
+    int fd = open(device.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Unable to open %s (%s)", device.c_str(), strerror(errno));
+        return -1;
+    }
+    int rc = ioctl(fd, LOOP_GET_STATUS64, &li);
+    close(fd);
+    if (rc < 0 || strncmp((const char*) li.lo_crypt_name, id, LO_NAME_SIZE)) {
+        SLOGW("Loop device %s no longer bound to %s", device.c_str(), id);
+        unindexLoop(device);
+        errno = ENOENT;
+        return -1;
+    }
 
-        close(fd);
+    strlcpy(buffer, device.c_str(), len);
+    return 0;
+}
 
-        if (rc < 0) {
-            SLOGE("Unable to get loop status for %s (%s)", filename,
-                 strerror(errno));
-            return -1;
-        }
-    }
+int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len) {
+    std::lock_guard<std::mutex> lock(sLoopLock);
+    loadLoopIndex();
 
-    if (i == LOOP_MAX) {
-        SLOGE("Exhausted all loop devices");
-        errno = ENOSPC;
+    char filename[256];
+    int fd = claimFreeLoop(filename, sizeof(filename));
+    if (fd < 0) {
         return -1;
     }
 
@@ -226,10 +358,60 @@ int Loop::create(const char *id, const char *loopFile, char *loopDeviceBuffer, s
     close(fd);
     close(file_fd);
 
+    indexLoop(id, filename);
+    return 0;
+}
+
+int Loop::setDirectIo(const char *loopDevice, const char *loopFile,
+        unsigned int maxBlockSize) {
+    struct stat st;
+    struct statvfs sv;
+    if (stat(loopFile, &st) < 0 || statvfs(loopFile, &sv) < 0) {
+        SLOGE("Failed to stat %s (%s)", loopFile, strerror(errno));
+        return -1;
+    }
+
+    /* Direct I/O needs requests aligned to the host's logical blocks */
+    unsigned int hostBlockSize = 512;
+    std::string tmp;
+    if (android::vold::ReadBlockQueueAttribute(st.st_dev, "logical_block_size", tmp) == 0) {
+        hostBlockSize = std::max(512, atoi(tmp.c_str()));
+    }
+    unsigned int blockSize = std::min((unsigned int) sv.f_bsize, maxBlockSize);
+    if (blockSize < hostBlockSize) {
+        SLOGW("Direct I/O for %s needs %u byte blocks; image allows %u", loopDevice,
+                hostBlockSize, maxBlockSize);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd;
+    if ((fd = open(loopDevice, O_RDWR | O_CLOEXEC)) < 0) {
+        SLOGE("Failed to open %s (%s)", loopDevice, strerror(errno));
+        return -1;
+    }
+
+    if (blockSize > 512 && ioctl(fd, LOOP_SET_BLOCK_SIZE, (unsigned long) blockSize) < 0) {
+        // Older kernels are stuck at 512, which only works on 512 byte hosts
+        SLOGW("Failed to set %s block size to %u (%s)", loopDevice, blockSize, strerror(errno));
+        if (hostBlockSize > 512) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (ioctl(fd, LOOP_SET_DIRECT_IO, 1UL) < 0) {
+        SLOGW("Failed to enable direct I/O on %s (%s)", loopDevice, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
     return 0;
 }
 
 int Loop::destroyByDevice(const char *loopDevice) {
+    std::lock_guard<std::mutex> lock(sLoopLock);
     int device_fd;
 
     device_fd = open(loopDevice, O_RDONLY | O_CLOEXEC);
@@ -245,6 +427,7 @@ int Loop::destroyByDevice(const char *loopDevice) {
     }
 
     close(device_fd);
+    unindexLoop(loopDevice);
     return 0;
 }
 
@@ -253,18 +436,64 @@ int Loop::destroyByFile(const char * /*loopFile*/) {
     return -1;
 }
 
+/*
+ * Returns the number of extents backing the file, or -1 if the
+ * filesystem can't tell us.
+ */
+static int countExtents(int fd) {
+    struct fiemap fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    /* With no extent array the kernel only reports how many there are */
+    fm.fm_extent_count = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0) {
+        return -1;
+    }
+    return fm.fm_mapped_extents;
+}
+
 int Loop::createImageFile(const char *file, unsigned long numSectors) {
     int fd;
+    off_t size = (off_t) numSectors * 512;
 
-    if ((fd = creat(file, 0600)) < 0) {
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
         SLOGE("Error creating imagefile (%s)", strerror(errno));
         return -1;
     }
 
-    if (ftruncate(fd, numSectors * 512) < 0) {
-        SLOGE("Error truncating imagefile (%s)", strerror(errno));
-        close(fd);
-        return -1;
+    /*
+     * Reserve every block up front, so the filesystem can hand out one
+     * contiguous run instead of scattering blocks as the loop device
+     * writes them, and so running out of space fails here rather than
+     * partway through an install.
+     */
+    if (fallocate(fd, 0, 0, size)) {
+        if (errno == ENOSYS || errno == EOPNOTSUPP) {
+            SLOGW("fallocate not supported. Falling back to ftruncate.");
+            if (ftruncate(fd, size) < 0) {
+                SLOGE("Error truncating imagefile (%s)", strerror(errno));
+                int err = errno;
+                close(fd);
+                unlink(file);
+                errno = err;
+                return -1;
+            }
+        } else {
+            SLOGE("Error allocating imagefile (%s)", strerror(errno));
+            int err = errno;
+            close(fd);
+            unlink(file);
+            errno = err;
+            return -1;
+        }
+    } else {
+        int extents = countExtents(fd);
+        if (extents > (int) kImageExtentsWarn) {
+            SLOGW("Imagefile %s is fragmented into %d extents", file, extents);
+        } else if (extents >= 0) {
+            SLOGD("Imagefile %s allocated in %d extents", file, extents);
+        }
     }
     close(fd);
     return 0;
@@ -281,7 +510,7 @@ int Loop::resizeImageFile(const char *file, unsigned long numSectors) {
     SLOGD("Attempting to increase size of %s to %lu sectors.", file, numSectors);
 
     if (fallocate(fd, 0, 0, numSectors * 512)) {
-        if (errno == ENOSYS || errno == ENOTSUP) {
+        if (errno == ENOSYS || errno == EOPNOTSUPP) {
             SLOGW("fallocate not found. Falling back to ftruncate.");
             if (ftruncate(fd, numSectors * 512) < 0) {
                 SLOGE("Error truncating imagefile (%s)", strerror(errno));
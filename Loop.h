@@ -29,6 +29,14 @@ public:
     static int lookupActive(const char *id, char *buffer, size_t len);
     static int lookupInfo(const char *loopDevice, struct asec_superblock *sb, unsigned long *nr_sec);
     static int create(const char *id, const char *loopFile, char *loopDeviceBuffer, size_t len);
+    /*
+     * Switches the loop device to direct I/O against its backing file, so
+     * pages aren't cached once for the file and again for the loop device.
+     * The logical block size is raised toward the host filesystem's block
+     * size, but never beyond maxBlockSize, which the image contents need.
+     */
+    static int setDirectIo(const char *loopDevice, const char *loopFile,
+            unsigned int maxBlockSize);
     static int destroyByDevice(const char *loopDevice);
     static int destroyByFile(const char *loopFile);
     static int createImageFile(const char *file, unsigned long numSectors);
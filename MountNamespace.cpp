@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MountNamespace.h"
+#include "WorkerPool.h"
+
+#include <android-base/logging.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace android {
+namespace vold {
+
+static const char* kRootNamespacePath = "/proc/1/ns/mnt";
+static const char* kSelfNamespacePath = "/proc/self/ns/mnt";
+
+/* remountUid() fans out across every namespace of an app at once */
+static const size_t kNamespaceThreads = 4;
+
+static std::once_flag sInitOnce;
+static ino_t sRootNamespace;
+static int sSelfNamespaceFd = -1;
+static std::mutex sPoolLock;
+static WorkerPool* sPool;
+/* Set when a helper is stuck in an app's namespace; the pool is replaced */
+static std::atomic<bool> sPoolBroken(false);
+
+static void init() {
+    struct stat sb;
+    if (stat(kRootNamespacePath, &sb) == 0) {
+        sRootNamespace = sb.st_ino;
+    } else {
+        PLOG(ERROR) << "Failed to stat " << kRootNamespacePath;
+    }
+    sSelfNamespaceFd = TEMP_FAILURE_RETRY(open(kSelfNamespacePath, O_RDONLY | O_CLOEXEC));
+    if (sSelfNamespaceFd == -1) {
+        PLOG(ERROR) << "Failed to open " << kSelfNamespacePath;
+    }
+    sPool = new WorkerPool(kNamespaceThreads);
+}
+
+ino_t GetRootMountNamespace() {
+    std::call_once(sInitOnce, init);
+    return sRootNamespace;
+}
+
+static status_t runJob(int nsFd, const std::function<status_t()>& fn) {
+    // Threads sharing fs attributes with the rest of vold can't setns()
+    thread_local bool unshared = false;
+    if (!unshared) {
+        if (unshare(CLONE_FS) != 0) {
+            PLOG(ERROR) << "Failed to unshare fs attributes";
+            return -errno;
+        }
+        unshared = true;
+    }
+
+    if (setns(nsFd, CLONE_NEWNS) != 0) {
+        PLOG(ERROR) << "Failed to setns";
+        return -errno;
+    }
+    status_t res = fn();
+
+    // Don't pin the app's namespace, or its mounts, once we're done
+    if (sSelfNamespaceFd == -1 || setns(sSelfNamespaceFd, CLONE_NEWNS) != 0) {
+        PLOG(ERROR) << "Failed to return to vold mount namespace";
+        sPoolBroken = true;
+    }
+    return res;
+}
+
+std::future<status_t> PostInMountNamespace(int nsFd, std::function<status_t()> fn) {
+    std::call_once(sInitOnce, init);
+    auto promise = std::make_shared<std::promise<status_t>>();
+    std::future<status_t> result = promise->get_future();
+
+    int dupFd = fcntl(nsFd, F_DUPFD_CLOEXEC, 0);
+    if (dupFd == -1) {
+        PLOG(ERROR) << "Failed to dup namespace fd";
+        promise->set_value(-errno);
+        return result;
+    }
+
+    // Joined outside the lock, once whatever it still holds has run
+    std::unique_ptr<WorkerPool> stale;
+    {
+        std::lock_guard<std::mutex> lock(sPoolLock);
+        if (sPoolBroken.exchange(false)) {
+            LOG(WARNING) << "Replacing mount namespace helpers";
+            stale.reset(sPool);
+            sPool = new WorkerPool(kNamespaceThreads);
+        }
+        sPool->enqueue([promise, dupFd, fn] {
+            promise->set_value(runJob(dupFd, fn));
+            close(dupFd);
+        });
+    }
+    return result;
+}
+
+status_t RunInMountNamespace(int nsFd, std::function<status_t()> fn) {
+    return PostInMountNamespace(nsFd, std::move(fn)).get();
+}
+
+}  // namespace vold
+}  // namespace android
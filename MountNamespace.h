@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_MOUNT_NAMESPACE_H
+#define ANDROID_VOLD_MOUNT_NAMESPACE_H
+
+#include <utils/Errors.h>
+
+#include <functional>
+#include <future>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/* Inode of init's mount namespace, looked up once and then cached */
+ino_t GetRootMountNamespace();
+
+/*
+ * Runs fn inside the mount namespace that nsFd refers to, without forking.
+ * A small pool of persistent helper threads each unshare their filesystem
+ * attributes, as setns(CLONE_NEWNS) requires in a multithreaded process,
+ * enter the target namespace for the job and return to vold's own after;
+ * should that return fail, the pool is replaced before the next job.
+ * nsFd is duplicated, so the caller may close it right away.
+ */
+std::future<status_t> PostInMountNamespace(int nsFd, std::function<status_t()> fn);
+
+/* Same as PostInMountNamespace(), waiting for the result */
+status_t RunInMountNamespace(int nsFd, std::function<status_t()> fn);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MountProfile.h"
+#include "cryptfs.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <cutils/properties.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mount.h>
+
+#ifndef MS_LAZYTIME
+#define MS_LAZYTIME (1 << 25)
+#endif
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+struct MountFlag {
+    const char* name;
+    unsigned long flag;
+};
+
+static const MountFlag kMountFlags[] = {
+    { "dirsync", MS_DIRSYNC },
+    { "sync", MS_SYNCHRONOUS },
+    { "noatime", MS_NOATIME },
+    { "nodiratime", MS_NODIRATIME },
+    { "relatime", MS_RELATIME },
+    // Kernels before 4.0 quietly ignore this flag
+    { "lazytime", MS_LAZYTIME },
+};
+
+struct DefaultProfile {
+    int mediaClass;
+    const char* fsType;
+    bool adopted;
+    const char* options;
+};
+
+/*
+ * Adopted storage is journaled and mounted much like /data, and left
+ * alone on internal flash. Cards and USB sticks are slow at small writes,
+ * so timestamp updates stay in memory and f2fs merges cache flushes and
+ * keeps small files inline. FAT has no journal, but dirsync makes every
+ * create and rename wait on the card; flush starts writeback at close()
+ * instead, so little is lost when a card is pulled.
+ */
+static const DefaultProfile kDefaultProfiles[] = {
+    { CRYPT_MEDIA_SD, "ext4", true, "lazytime" },
+    { CRYPT_MEDIA_USB, "ext4", true, "lazytime" },
+    { CRYPT_MEDIA_SD, "f2fs", true, "lazytime,inline_data,inline_dentry,flush_merge" },
+    { CRYPT_MEDIA_USB, "f2fs", true, "lazytime,inline_data,inline_dentry,flush_merge" },
+    { CRYPT_MEDIA_SD, "vfat", false, "nodirsync,flush" },
+    { CRYPT_MEDIA_USB, "vfat", false, "nodirsync,flush" },
+};
+
+static const char* getMediaName(int mediaClass) {
+    switch (mediaClass) {
+    case CRYPT_MEDIA_SD: return "sd";
+    case CRYPT_MEDIA_USB: return "usb";
+    case CRYPT_MEDIA_VIRTIO: return "virtio";
+    default: return "internal";
+    }
+}
+
+static MountProfile parseProfile(const std::string& options) {
+    MountProfile profile;
+    for (const auto& option : android::base::Split(options, ",")) {
+        if (option.empty()) continue;
+        bool known = false;
+        for (const auto& flag : kMountFlags) {
+            if (option == flag.name) {
+                profile.setFlags |= flag.flag;
+                profile.clearFlags &= ~flag.flag;
+                known = true;
+            } else if (option == std::string("no") + flag.name) {
+                profile.clearFlags |= flag.flag;
+                profile.setFlags &= ~flag.flag;
+                known = true;
+            }
+        }
+        if (!known) {
+            if (!profile.data.empty()) profile.data += ",";
+            profile.data += option;
+        }
+    }
+    return profile;
+}
+
+MountProfile GetMountProfile(int mediaClass, const std::string& fsType, bool adopted) {
+    std::string options;
+    for (const auto& def : kDefaultProfiles) {
+        if (def.mediaClass == mediaClass && fsType == def.fsType && def.adopted == adopted) {
+            options = def.options;
+            break;
+        }
+    }
+
+    char value[PROPERTY_VALUE_MAX];
+    std::string prop(StringPrintf("persist.vold.mnt.%s.%s", getMediaName(mediaClass),
+            fsType.c_str()));
+    if (property_get(prop.c_str(), value, nullptr) > 0) {
+        options = value;
+    }
+    if (!options.empty()) {
+        LOG(DEBUG) << "Mount profile for " << fsType << " on " << getMediaName(mediaClass)
+                << ": " << options;
+    }
+    return parseProfile(options);
+}
+
+int MountWithProfile(const std::string& source, const std::string& target,
+        const std::string& fsType, unsigned long flags, const std::string& data,
+        const MountProfile& profile) {
+    flags = (flags & ~profile.clearFlags) | profile.setFlags;
+    if (!profile.data.empty()) {
+        std::string full(data.empty() ? profile.data : data + "," + profile.data);
+        int res = mount(source.c_str(), target.c_str(), fsType.c_str(), flags, full.c_str());
+        if (res == 0 || errno != EINVAL) {
+            return res;
+        }
+        LOG(WARNING) << "Kernel rejected " << fsType << " options " << profile.data
+                << "; mounting without them";
+    }
+    return mount(source.c_str(), target.c_str(), fsType.c_str(), flags, data.c_str());
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_MOUNT_PROFILE_H
+#define ANDROID_VOLD_MOUNT_PROFILE_H
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Adjustments a filesystem's Mount() makes to its own flags and options
+ * for the media a volume lives on. A default profile changes nothing.
+ */
+struct MountProfile {
+    MountProfile() : setFlags(0), clearFlags(0) {}
+
+    /* MS_* flags to add */
+    unsigned long setFlags;
+    /* MS_* flags to drop from the filesystem's defaults */
+    unsigned long clearFlags;
+    /* Filesystem options appended to the caller's */
+    std::string data;
+};
+
+/*
+ * Returns the profile for fsType on the given CRYPT_MEDIA_* class, as
+ * adopted or public storage. The built-in defaults can be replaced with
+ * persist.vold.mnt.<media>.<fstype>, a mount(8) style option list where
+ * flags like "lazytime" or "dirsync" are recognized, "no" in front of a
+ * flag drops it, and anything else is passed to the filesystem.
+ */
+MountProfile GetMountProfile(int mediaClass, const std::string& fsType, bool adopted);
+
+/*
+ * mount(2) with the profile applied to flags and data. Kernels that don't
+ * know one of the profile's options reject the mount with EINVAL, so then
+ * it's retried with only the profile's flags.
+ */
+int MountWithProfile(const std::string& source, const std::string& target,
+        const std::string& fsType, unsigned long flags, const std::string& data,
+        const MountProfile& profile);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -15,20 +15,46 @@
  */
 
 #include "MoveTask.h"
+#include "BackgroundIo.h"
+#include "OperationStats.h"
+#include "StorageWear.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "WorkerPool.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
+#include <cutils/fs.h>
 #include <private/android_filesystem_config.h>
 #include <hardware_legacy/power.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <inttypes.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 #include <dirent.h>
-#include <sys/wait.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 #define CONSTRAIN(amount, low, high) (amount < low ? low : (amount > high ? high : amount))
 
+using android::base::ReadFileToString;
 using android::base::StringPrintf;
 
 namespace android {
@@ -38,11 +64,42 @@ namespace vold {
 static const int kMoveSucceeded = -100;
 static const int kMoveFailedInternalError = -6;
 
-static const char* kCpPath = "/system/bin/cp";
-static const char* kRmPath = "/system/bin/rm";
+static const int kProgressIntervalMs = 1000;
+
+static const size_t kCopyThreads = 4;
+static const size_t kCopyQueueDepth = 64;
+static const size_t kCopyChunkSize = 8 * 1024 * 1024;
+static const size_t kCopyBufferSize = 256 * 1024;
+static const size_t kCopyBufferAlign = 4096;
+static const size_t kDirentBufferSize = 32 * 1024;
+
+/* Bounds of the adaptive copy rate, in bytes per second */
+static const uint64_t kCopyMinRate = 4 * 1024 * 1024;
+static const uint64_t kCopyStartRate = 32 * 1024 * 1024;
+
+static const size_t kDeleteThreads = 4;
+/* Batches queued ahead of the unlink threads */
+static const size_t kDeleteQueueDepth = 4096;
+/* Large directories are split so several threads can share them */
+static const size_t kDeleteBatchSize = 256;
 
 static const char* kWakeLock = "MoveTask";
 
+/*
+ * Public media may hold anything at all, so moves onto it land in a
+ * directory of their own, and that's the only place stale data is cleared
+ */
+static const char* kPublicMoveDir = "/MovedStorage";
+
+/* Journal of a move that may be resumed, kept next to the target */
+static const char* kJournalName = "move_journal";
+static const char* kJournalMagic = "VMJ1";
+static const char* kJournalVerified = "verified";
+/* Written before the first entry is renamed across, so it's never lost */
+static const char* kJournalRenaming = "renaming";
+/* How often copied files are made durable and recorded */
+static const int kJournalIntervalMs = 10000;
+
 MoveTask::MoveTask(const std::shared_ptr<VolumeBase>& from,
         const std::shared_ptr<VolumeBase>& to) :
         mFrom(from), mTo(to) {
@@ -55,108 +112,1009 @@ void MoveTask::start() {
     mThread = std::thread(&MoveTask::run, this);
 }
 
-static void notifyProgress(int progress) {
+/* While copying, the current rate limit in KiB/s follows the progress */
+static void notifyProgress(int progress, uint64_t rate = 0) {
+    std::string status(rate ? StringPrintf("%d %" PRIu64, progress, rate / 1024)
+            : StringPrintf("%d", progress));
     VolumeManager::Instance()->getBroadcaster()->sendBroadcast(ResponseCode::MoveStatus,
-            StringPrintf("%d", progress).c_str(), false);
+            status.c_str(), false);
 }
 
-static status_t pushBackContents(const std::string& path, std::vector<std::string>& cmd) {
-    DIR* dir = opendir(path.c_str());
-    if (dir == NULL) {
-        return -1;
+struct DeleteContext {
+    int rootFd;
+    std::unique_ptr<WorkerPool> pool;
+    std::atomic<uint64_t> discovered;
+    std::atomic<uint64_t> removed;
+    std::atomic<bool> failed;
+
+    /* Directories in discovery order, so parents come before children */
+    std::vector<std::string> dirs;
+};
+
+static void unlinkBatch(const std::string& path, const std::vector<std::string>& names,
+        DeleteContext& ctx) {
+    int dfd = path.empty() ? dup(ctx.rootFd) : openat(ctx.rootFd, path.c_str(),
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd == -1) {
+        PLOG(ERROR) << "Failed to open " << path;
+        ctx.failed = true;
+        return;
     }
-    bool found = false;
-    struct dirent* ent;
-    while ((ent = readdir(dir)) != NULL) {
-        if ((!strcmp(ent->d_name, ".")) || (!strcmp(ent->d_name, ".."))) {
-            continue;
+    for (const auto& name : names) {
+        if (unlinkat(dfd, name.c_str(), 0) == 0 || errno == ENOENT) {
+            ctx.removed++;
+        } else {
+            PLOG(ERROR) << "Failed to remove " << path << "/" << name;
+            ctx.failed = true;
+        }
+    }
+    close(dfd);
+}
+
+static void queueUnlinks(const std::string& path, std::vector<std::string>& names,
+        DeleteContext& ctx) {
+    std::vector<std::string> batch;
+    batch.swap(names);
+    ctx.pool->enqueue([path, batch, &ctx] { unlinkBatch(path, batch, ctx); });
+}
+
+/*
+ * Enumerates the tree on the calling thread while the pool unlinks each
+ * directory's files behind it. Enumeration is much cheaper than unlink,
+ * so the discovered count settles early and removed/discovered tracks
+ * real progress.
+ */
+static void discoverDir(int dfd, const std::string& path, DeleteContext& ctx) {
+    std::vector<char> buf(kDirentBufferSize);
+    std::vector<std::string> names;
+    int len;
+    while ((len = syscall(__NR_getdents64, dfd, buf.data(), buf.size())) > 0) {
+        for (int off = 0; off < len;) {
+            auto ent = reinterpret_cast<struct linux_dirent64*>(buf.data() + off);
+            off += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+            bool isDir = (ent->d_type == DT_DIR);
+            if (ent->d_type == DT_UNKNOWN) {
+                struct stat st;
+                isDir = (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                        && S_ISDIR(st.st_mode));
+            }
+            ctx.discovered++;
+
+            if (!isDir) {
+                names.push_back(name);
+                if (names.size() >= kDeleteBatchSize) {
+                    queueUnlinks(path, names, ctx);
+                }
+                continue;
+            }
+
+            std::string childPath(path.empty() ? name : path + "/" + name);
+            int child = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child == -1) {
+                PLOG(ERROR) << "Failed to open " << childPath;
+                ctx.failed = true;
+                continue;
+            }
+            ctx.dirs.push_back(childPath);
+            discoverDir(child, childPath, ctx);
+            close(child);
         }
-        cmd.push_back(StringPrintf("%s/%s", path.c_str(), ent->d_name));
-        found = true;
     }
-    closedir(dir);
-    return found ? OK : -1;
+    if (len < 0) {
+        PLOG(ERROR) << "Failed to read " << path;
+        ctx.failed = true;
+    }
+
+    if (!names.empty()) {
+        queueUnlinks(path, names, ctx);
+    }
 }
 
-static status_t execRm(const std::string& path, int startProgress, int stepProgress) {
+/*
+ * Removes everything below path, leaving path itself in place. Nothing is
+ * synced, since the data is being thrown away anyway. Returns -ENOENT when
+ * path doesn't exist, which only callers clearing stale data may ignore.
+ */
+static status_t deleteContents(const std::string& path, int startProgress, int stepProgress) {
+    ScopedBackgroundIo background;
     notifyProgress(startProgress);
 
-    uint64_t expectedBytes = GetTreeBytes(path);
-    uint64_t startFreeBytes = GetFreeBytes(path);
+    int rootFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == -1) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return (errno == ENOENT) ? -ENOENT : -1;
+    }
+    ScopedFd root(rootFd);
+
+    DeleteContext ctx;
+    ctx.rootFd = root.get();
+    ctx.pool.reset(new WorkerPool(kDeleteThreads, kDeleteQueueDepth));
+    ctx.discovered = 0;
+    ctx.removed = 0;
+    ctx.failed = false;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool done = false;
+    std::thread progress([&] {
+        std::unique_lock<std::mutex> l(lock);
+        int reported = 0;
+        while (!cond.wait_for(l, std::chrono::milliseconds(kProgressIntervalMs), [&] { return done; })) {
+            uint64_t discovered = ctx.discovered;
+            if (discovered == 0) continue;
+            int step = CONSTRAIN((int) ((ctx.removed * stepProgress) / discovered),
+                    0, stepProgress);
+            if (step > reported) {
+                reported = step;
+                notifyProgress(startProgress + step);
+            }
+        }
+    });
+
+    // Walk with a dup so each batch can still open its own directory
+    int walkFd = dup(root.get());
+    if (walkFd == -1) {
+        PLOG(ERROR) << "Failed to dup " << path;
+        ctx.failed = true;
+    } else {
+        discoverDir(walkFd, "", ctx);
+        close(walkFd);
+    }
+    ctx.pool->wait();
+
+    // Directories are empty now; take them down children first
+    for (auto it = ctx.dirs.rbegin(); it != ctx.dirs.rend(); ++it) {
+        if (unlinkat(root.get(), it->c_str(), AT_REMOVEDIR) == 0 || errno == ENOENT) {
+            ctx.removed++;
+        } else {
+            PLOG(ERROR) << "Failed to remove " << *it;
+            ctx.failed = true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        done = true;
+    }
+    cond.notify_all();
+    progress.join();
+
+    LOG(DEBUG) << "Finished removing " << ctx.removed << " of " << ctx.discovered
+            << " entries under " << path << (ctx.failed ? " with errors" : "");
+    return ctx.failed ? -1 : OK;
+}
+
+/*
+ * Records which files of a move already reached the target, so a move cut
+ * short by a reboot or crash picks up where it stopped instead of starting
+ * over. Each line names one file along with the size and mtime it had in
+ * the source; files only count as done while both still match. Entries
+ * are held back until a syncfs() of the target has made their data
+ * durable, so the journal never claims more than the disk has.
+ *
+ * Once the whole copy passes verification the journal says so, letting an
+ * interrupted cleanup of the source skip the copy. The source is checked
+ * against the target again before anything more of it is deleted.
+ */
+class MoveJournal {
+public:
+    MoveJournal(const std::string& path, const std::string& fromPath,
+            const std::string& toPath) :
+            mPath(path), mFd(-1), mVerified(false), mRenaming(false),
+            mForeignRenaming(false) {
+        mHeader = StringPrintf("%s %s %s", kJournalMagic, fromPath.c_str(), toPath.c_str());
+        mTargetSuffix = " " + toPath;
+    }
+
+    ~MoveJournal() {
+        if (mFd != -1) close(mFd);
+    }
 
-    std::vector<std::string> cmd;
-    cmd.push_back(kRmPath);
-    cmd.push_back("-f"); /* force: remove without confirmation, no error if it doesn't exist */
-    cmd.push_back("-R"); /* recursive: remove directory contents */
-    if (pushBackContents(path, cmd) != OK) {
-        LOG(WARNING) << "No contents in " << path;
+    /* Loads what an earlier attempt at this same move left behind */
+    bool load() {
+        std::string journal;
+        if (!ReadFileToString(mPath, &journal)) {
+            return false;
+        }
+        // A torn last line just means that entry gets copied again
+        size_t end = journal.find('\n');
+        if (end == std::string::npos) {
+            return false;
+        }
+        if (journal.compare(0, end, mHeader)) {
+            // Another move renaming into this same target never finished
+            mForeignRenaming = end >= mTargetSuffix.size()
+                    && !journal.compare(end - mTargetSuffix.size(), mTargetSuffix.size(),
+                            mTargetSuffix)
+                    && journal.find(std::string("\n") + kJournalRenaming + "\n")
+                            != std::string::npos;
+            return false;
+        }
+        size_t start = end + 1;
+        while ((end = journal.find('\n', start)) != std::string::npos) {
+            std::string line(journal, start, end - start);
+            start = end + 1;
+
+            unsigned long long size, mtime;
+            int pathOffset = 0;
+            if (line == kJournalVerified) {
+                mVerified = true;
+            } else if (line == kJournalRenaming) {
+                mRenaming = true;
+            } else if (sscanf(line.c_str(), "f %llu %llu %n", &size, &mtime, &pathOffset) == 2
+                    && pathOffset > 0) {
+                mDone[line.substr(pathOffset)] = std::make_pair(size, mtime);
+            }
+        }
+        return true;
+    }
+
+    /* Begins a fresh journal, or appends to the one loaded */
+    status_t open(bool resume) {
+        int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+        if (mFd != -1) close(mFd);
+        mFd = TEMP_FAILURE_RETRY(::open(mPath.c_str(), flags, 0600));
+        if (mFd == -1) {
+            PLOG(ERROR) << "Failed to open " << mPath;
+            return -errno;
+        }
+        if (!resume) {
+            mDone.clear();
+            mVerified = false;
+            return append(mHeader + "\n"
+                    + (mRenaming ? std::string(kJournalRenaming) + "\n" : ""));
+        }
         return OK;
     }
 
-    pid_t pid = ForkExecvpAsync(cmd);
-    if (pid == -1) return -1;
+    bool isVerified() const { return mVerified; }
 
-    int status;
-    while (true) {
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            if (WIFEXITED(status)) {
-                LOG(DEBUG) << "Finished rm with status " << WEXITSTATUS(status);
-                return (WEXITSTATUS(status) == 0) ? OK : -1;
-            } else {
-                break;
+    /* Entries may have been renamed across, so the target holds the only copy */
+    bool isRenaming() const { return mRenaming; }
+
+    /* Set when load() found an unfinished rename by a move into the same target */
+    bool isForeignRenaming() const { return mForeignRenaming; }
+
+    /* Records, durably, that entries are about to be renamed across */
+    status_t markRenaming() {
+        if (mRenaming) {
+            return OK;
+        }
+        mRenaming = true;
+        status_t res = open(false);
+        mRenaming = (res == OK);
+        return res;
+    }
+
+    /* Every renamed entry was put back, so the target holds nothing unique */
+    void clearRenaming() { mRenaming = false; }
+
+    /* Forgets what was copied, so the next open() starts over */
+    void discard() {
+        mDone.clear();
+        mVerified = false;
+    }
+
+    bool isDone(const std::string& path, const struct stat& st) const {
+        auto it = mDone.find(path);
+        return it != mDone.end() && it->second.first == (uint64_t) st.st_size
+                && it->second.second == toNanos(st.st_mtim);
+    }
+
+    /* Called by copy workers once a file is fully copied */
+    void add(const std::string& path, const struct stat& st) {
+        // Such names could never be read back, so they're always recopied
+        if (path.find('\n') != std::string::npos) return;
+        std::lock_guard<std::mutex> lock(mLock);
+        mPending += StringPrintf("f %llu %llu %s\n", (unsigned long long) st.st_size,
+                (unsigned long long) toNanos(st.st_mtim), path.c_str());
+    }
+
+    /* Makes everything copied so far durable, then records it */
+    status_t checkpoint(int toRootFd) {
+        std::string pending;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            pending.swap(mPending);
+        }
+        if (pending.empty()) {
+            return OK;
+        }
+        if (syncfs(toRootFd) != 0) {
+            PLOG(ERROR) << "Failed to sync move target";
+            return -errno;
+        }
+        return append(pending);
+    }
+
+    /* Records that the copy is complete, once all of it is durable */
+    status_t markVerified(const std::string& toPath) {
+        int fd = TEMP_FAILURE_RETRY(::open(toPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (fd == -1) {
+            PLOG(ERROR) << "Failed to open " << toPath;
+            return -errno;
+        }
+        ScopedFd toRoot(fd);
+        if (syncfs(toRoot.get()) != 0) {
+            PLOG(ERROR) << "Failed to sync move target";
+            return -errno;
+        }
+
+        std::string pending;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            pending.swap(mPending);
+        }
+        status_t res = append(pending + kJournalVerified + "\n");
+        mVerified = (res == OK);
+        return res;
+    }
+
+    void remove() {
+        if (mFd != -1) {
+            close(mFd);
+            mFd = -1;
+        }
+        if (unlink(mPath.c_str()) != 0 && errno != ENOENT) {
+            PLOG(WARNING) << "Failed to remove " << mPath;
+        }
+    }
+
+private:
+    std::string mPath;
+    std::string mHeader;
+    std::string mTargetSuffix;
+    int mFd;
+    bool mVerified;
+    bool mRenaming;
+    bool mForeignRenaming;
+    /* Size and mtime of each file an earlier attempt finished */
+    std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> mDone;
+
+    std::mutex mLock;
+    std::string mPending;
+
+    static uint64_t toNanos(const struct timespec& ts) {
+        return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    status_t append(const std::string& data) {
+        if (mFd == -1) {
+            return -EBADF;
+        }
+        const char* buf = data.data();
+        size_t len = data.size();
+        while (len > 0) {
+            ssize_t res = TEMP_FAILURE_RETRY(write(mFd, buf, len));
+            if (res <= 0) {
+                PLOG(ERROR) << "Failed to write " << mPath;
+                return -EIO;
             }
+            buf += res;
+            len -= res;
         }
+        if (fdatasync(mFd) != 0) {
+            PLOG(ERROR) << "Failed to sync " << mPath;
+            return -errno;
+        }
+        return OK;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(MoveJournal);
+};
 
-        sleep(1);
-        uint64_t deltaFreeBytes = GetFreeBytes(path) - startFreeBytes;
-        notifyProgress(startProgress + CONSTRAIN((int)
-                ((deltaFreeBytes * stepProgress) / expectedBytes), 0, stepProgress));
+struct FreeDeleter {
+    void operator()(char* p) const { free(p); }
+};
+
+struct CopyContext {
+    int toRootFd;
+    std::unique_ptr<WorkerPool> pool;
+    std::atomic<uint64_t> copiedBytes;
+    std::atomic<bool> failed;
+    /* errno of the first file that failed to copy */
+    std::atomic<int> error;
+    /* Cleared the first time the target refuses to share extents */
+    std::atomic<bool> canClone;
+    MoveJournal* journal;
+    IoThrottle* throttle;
+
+    /* Directories whose metadata is applied once their contents are done */
+    std::vector<std::pair<std::string, struct stat>> dirs;
+    /* Multiply-linked inodes already copied, keyed by source identity */
+    std::map<std::pair<dev_t, ino_t>, std::string> links;
+};
+
+static status_t writeFully(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = TEMP_FAILURE_RETRY(write(fd, buf, len));
+        if (res <= 0) {
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return OK;
+}
+
+static status_t copyData(int fromFd, int toFd, CopyContext& ctx) {
+    static thread_local std::unique_ptr<char, FreeDeleter> buffer;
+
+    // A reflink shares the source's extents, so nothing is copied at all
+    if (ctx.canClone) {
+        struct stat st;
+        if (ioctl(toFd, FICLONE, fromFd) == 0 && fstat(fromFd, &st) == 0) {
+            ctx.copiedBytes += st.st_size;
+            return OK;
+        }
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL
+                || errno == ENOSYS) {
+            ctx.canClone = false;
+        }
+    }
+
+    // Prefer letting the kernel move the data, and fall back to the next
+    // method as soon as one reports it can't handle this pair of files.
+#ifdef __NR_copy_file_range
+    bool useCopyRange = true;
+#else
+    bool useCopyRange = false;
+#endif
+    bool useSendfile = true;
+    while (!ctx.failed) {
+        ssize_t res = -1;
+        if (useCopyRange) {
+#ifdef __NR_copy_file_range
+            res = syscall(__NR_copy_file_range, fromFd, NULL, toFd, NULL, kCopyChunkSize, 0);
+#endif
+            if (res == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                    || errno == EOPNOTSUPP)) {
+                useCopyRange = false;
+                continue;
+            }
+        } else if (useSendfile) {
+            res = sendfile(toFd, fromFd, NULL, kCopyChunkSize);
+            if (res == -1 && (errno == ENOSYS || errno == EINVAL)) {
+                useSendfile = false;
+                continue;
+            }
+        } else {
+            if (buffer == nullptr) {
+                void* buf;
+                if (posix_memalign(&buf, kCopyBufferAlign, kCopyBufferSize) != 0) {
+                    LOG(ERROR) << "Failed to allocate copy buffer";
+                    return -1;
+                }
+                buffer.reset(static_cast<char*>(buf));
+            }
+            res = TEMP_FAILURE_RETRY(read(fromFd, buffer.get(), kCopyBufferSize));
+            if (res > 0 && writeFully(toFd, buffer.get(), res) != OK) {
+                res = -1;
+            }
+        }
+
+        if (res == 0) {
+            return OK;
+        } else if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ctx.copiedBytes += res;
+        ctx.throttle->throttle(res);
     }
     return -1;
 }
 
-static status_t execCp(const std::string& fromPath, const std::string& toPath,
-        int startProgress, int stepProgress) {
-    notifyProgress(startProgress);
+static status_t copyXattrs(int fromFd, int toFd) {
+    ssize_t len = flistxattr(fromFd, NULL, 0);
+    if (len <= 0) {
+        return (len == 0 || errno == ENOTSUP) ? OK : -1;
+    }
+    std::vector<char> names(len);
+    len = flistxattr(fromFd, names.data(), names.size());
+    if (len < 0) {
+        return -1;
+    }
 
-    uint64_t expectedBytes = GetTreeBytes(fromPath);
-    uint64_t startFreeBytes = GetFreeBytes(toPath);
-
-    std::vector<std::string> cmd;
-    cmd.push_back(kCpPath);
-    cmd.push_back("-p"); /* preserve timestamps, ownership, and permissions */
-    cmd.push_back("-R"); /* recurse into subdirectories (DEST must be a directory) */
-    cmd.push_back("-P"); /* Do not follow symlinks [default] */
-    cmd.push_back("-d"); /* don't dereference symlinks */
-    if (pushBackContents(fromPath, cmd) != OK) {
-        LOG(WARNING) << "No contents in " << fromPath;
-        return OK;
+    std::vector<char> value;
+    for (const char* name = names.data(); name < names.data() + len;
+            name += strlen(name) + 1) {
+        // Labels are assigned by policy at the destination, like cp -p
+        if (!strcmp(name, XATTR_NAME_SELINUX)) continue;
+
+        ssize_t size = fgetxattr(fromFd, name, NULL, 0);
+        if (size < 0) {
+            return -1;
+        }
+        value.resize(size);
+        size = fgetxattr(fromFd, name, value.data(), value.size());
+        if (size < 0) {
+            return -1;
+        }
+        if (fsetxattr(toFd, name, value.data(), size, 0) != 0 && errno != ENOTSUP) {
+            return -1;
+        }
+    }
+    return OK;
+}
+
+static status_t copyMetadata(int fromFd, int toFd, const struct stat& st) {
+    // Ownership first, since chown() clears any setuid/setgid bits
+    if (fchown(toFd, st.st_uid, st.st_gid) != 0) return -1;
+    if (fchmod(toFd, st.st_mode & 07777) != 0) return -1;
+    if (copyXattrs(fromFd, toFd) != OK) return -1;
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (futimens(toFd, times) != 0) return -1;
+    return OK;
+}
+
+static status_t copyMetadataAt(int toFd, const char* name, const struct stat& st) {
+    if (fchownat(toFd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+    if (!S_ISLNK(st.st_mode) && fchmodat(toFd, name, st.st_mode & 07777, 0) != 0) return -1;
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (utimensat(toFd, name, times, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+    return OK;
+}
+
+static void copyFile(int fromFd, int toFd, struct stat st, std::string path, CopyContext& ctx) {
+    if (!ctx.failed) {
+        if (copyData(fromFd, toFd, ctx) != OK || copyMetadata(fromFd, toFd, st) != OK) {
+            int error = errno;
+            PLOG(ERROR) << "Failed to copy " << path;
+            int none = 0;
+            ctx.error.compare_exchange_strong(none, error);
+            ctx.failed = true;
+        } else if (ctx.journal != nullptr) {
+            ctx.journal->add(path, st);
+        }
     }
-    cmd.push_back(toPath.c_str());
+    close(fromFd);
+    close(toFd);
+}
+
+static status_t copyDirContents(int fromFd, int toFd, const std::string& path,
+        CopyContext& ctx) {
+    std::vector<char> buf(kDirentBufferSize);
+    while (!ctx.failed) {
+        int len = syscall(__NR_getdents64, fromFd, buf.data(), buf.size());
+        if (len == 0) {
+            return OK;
+        } else if (len < 0) {
+            PLOG(ERROR) << "Failed to read " << path;
+            return -1;
+        }
+
+        for (int off = 0; off < len && !ctx.failed;) {
+            auto ent = reinterpret_cast<struct linux_dirent64*>(buf.data() + off);
+            off += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+            std::string childPath(path.empty() ? name : path + "/" + name);
+            struct stat st;
+            if (fstatat(fromFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                PLOG(ERROR) << "Failed to stat " << childPath;
+                return -1;
+            }
+
+            if (S_ISDIR(st.st_mode)) {
+                if (mkdirat(toFd, name, 0700) != 0 && errno != EEXIST) {
+                    PLOG(ERROR) << "Failed to create " << childPath;
+                    return -1;
+                }
+                int fromChild = openat(fromFd, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                int toChild = openat(toFd, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                status_t res = -1;
+                if (fromChild == -1 || toChild == -1) {
+                    PLOG(ERROR) << "Failed to open " << childPath;
+                } else {
+                    res = copyDirContents(fromChild, toChild, childPath, ctx);
+                }
+                if (fromChild != -1) close(fromChild);
+                if (toChild != -1) close(toChild);
+                if (res != OK) return res;
+
+                ctx.dirs.push_back(std::make_pair(childPath, st));
+                continue;
+            }
+
+            if (st.st_nlink > 1) {
+                auto key = std::make_pair(st.st_dev, st.st_ino);
+                auto it = ctx.links.find(key);
+                if (it != ctx.links.end()) {
+                    if (linkat(ctx.toRootFd, it->second.c_str(), toFd, name, 0) != 0
+                            && !(errno == EEXIST && unlinkat(toFd, name, 0) == 0
+                            && linkat(ctx.toRootFd, it->second.c_str(), toFd, name, 0) == 0)) {
+                        PLOG(ERROR) << "Failed to link " << childPath;
+                        return -1;
+                    }
+                    continue;
+                }
+                ctx.links[key] = childPath;
+            }
 
-    pid_t pid = ForkExecvpAsync(cmd);
-    if (pid == -1) return -1;
+            if (S_ISREG(st.st_mode)) {
+                // Trust an earlier attempt only while the target still
+                // looks exactly like what it finished
+                struct stat toSt;
+                if (ctx.journal != nullptr && ctx.journal->isDone(childPath, st)
+                        && fstatat(toFd, name, &toSt, AT_SYMLINK_NOFOLLOW) == 0
+                        && S_ISREG(toSt.st_mode) && toSt.st_size == st.st_size
+                        && toSt.st_mtim.tv_sec == st.st_mtim.tv_sec
+                        && toSt.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+                    ctx.copiedBytes += st.st_size;
+                    continue;
+                }
 
-    int status;
-    while (true) {
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            if (WIFEXITED(status)) {
-                LOG(DEBUG) << "Finished cp with status " << WEXITSTATUS(status);
-                return (WEXITSTATUS(status) == 0) ? OK : -1;
+                int fromFile = openat(fromFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                if (fromFile == -1) {
+                    PLOG(ERROR) << "Failed to open " << childPath;
+                    return -1;
+                }
+                int toFile = openat(toFd, name,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+                if (toFile == -1) {
+                    PLOG(ERROR) << "Failed to create " << childPath;
+                    close(fromFile);
+                    return -1;
+                }
+                // Workers take ownership of both descriptors
+                ctx.pool->enqueue(std::bind(copyFile, fromFile, toFile, st, childPath,
+                        std::ref(ctx)));
+            } else if (S_ISLNK(st.st_mode)) {
+                std::vector<char> target(st.st_size > 0 ? st.st_size + 1 : PATH_MAX);
+                ssize_t targetLen = readlinkat(fromFd, name, target.data(), target.size() - 1);
+                if (targetLen < 0) {
+                    PLOG(ERROR) << "Failed to read link " << childPath;
+                    return -1;
+                }
+                target[targetLen] = '\0';
+                // Anything already there was left by an interrupted attempt
+                unlinkat(toFd, name, 0);
+                if (symlinkat(target.data(), toFd, name) != 0
+                        || copyMetadataAt(toFd, name, st) != OK) {
+                    PLOG(ERROR) << "Failed to create link " << childPath;
+                    return -1;
+                }
             } else {
-                break;
+                unlinkat(toFd, name, 0);
+                if (mknodat(toFd, name, st.st_mode, st.st_rdev) != 0
+                        || copyMetadataAt(toFd, name, st) != OK) {
+                    PLOG(ERROR) << "Failed to create node " << childPath;
+                    return -1;
+                }
             }
         }
-
-        sleep(1);
-        uint64_t deltaFreeBytes = startFreeBytes - GetFreeBytes(toPath);
-        notifyProgress(startProgress + CONSTRAIN((int)
-                ((deltaFreeBytes * stepProgress) / expectedBytes), 0, stepProgress));
     }
     return -1;
 }
 
+/*
+ * Copies everything below fromPath into toPath. With a journal, files an
+ * earlier attempt already finished are skipped and new ones are recorded.
+ */
+static status_t copyTree(const std::string& fromPath, const std::string& toPath,
+        int startProgress, int stepProgress, MoveJournal* journal) {
+    ScopedBackgroundIo background;
+    notifyProgress(startProgress);
+    WriteAmpMeter amp("move", toPath);
+
+    // Start copying against a quick estimate, and swap in the exact size
+    // once the source is sized; that's a single quota lookup when the tree
+    // has its own project, and a background walk otherwise
+    std::atomic<uint64_t> expectedBytes(EstimateTreeBytes(fromPath));
+    std::thread sizer([&] {
+        expectedBytes = GetTreeBytes(fromPath);
+        LOG(DEBUG) << "Expecting to copy " << expectedBytes << " bytes";
+    });
+
+    int fromFd = open(fromPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fromFd == -1) {
+        PLOG(ERROR) << "Failed to open " << fromPath;
+        sizer.join();
+        return -1;
+    }
+    ScopedFd fromRoot(fromFd);
+    int toFd = open(toPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (toFd == -1) {
+        PLOG(ERROR) << "Failed to open " << toPath;
+        sizer.join();
+        return -1;
+    }
+    ScopedFd toRoot(toFd);
+
+    CopyContext ctx;
+    ctx.toRootFd = toRoot.get();
+    ctx.pool.reset(new WorkerPool(kCopyThreads, kCopyQueueDepth));
+    ctx.copiedBytes = 0;
+    ctx.failed = false;
+    ctx.error = 0;
+    ctx.canClone = true;
+    ctx.journal = journal;
+    IoThrottle throttle(kCopyMinRate, kCopyStartRate);
+    ctx.throttle = &throttle;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool done = false;
+    std::thread progress([&] {
+        std::unique_lock<std::mutex> l(lock);
+        int sinceCheckpointMs = 0;
+        while (!cond.wait_for(l, std::chrono::milliseconds(kProgressIntervalMs), [&] { return done; })) {
+            sinceCheckpointMs += kProgressIntervalMs;
+            if (journal != nullptr && sinceCheckpointMs >= kJournalIntervalMs) {
+                sinceCheckpointMs = 0;
+                journal->checkpoint(toRoot.get());
+            }
+
+            uint64_t expected = expectedBytes;
+            if (expected == 0 || expected == (uint64_t) -1) continue;
+            notifyProgress(startProgress + CONSTRAIN((int)
+                    ((ctx.copiedBytes * stepProgress) / expected), 0, stepProgress),
+                    throttle.getRate());
+        }
+    });
+
+    // Walk the tree creating the directory skeleton while the pool
+    // copies file bodies behind us
+    if (copyDirContents(fromRoot.get(), toRoot.get(), "", ctx) != OK) {
+        ctx.failed = true;
+    }
+    ctx.pool->wait();
+
+    // Directory timestamps only stick once nothing else lands in them
+    if (!ctx.failed) {
+        for (const auto& dir : ctx.dirs) {
+            int fromDir = openat(fromRoot.get(), dir.first.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            int toDir = openat(toRoot.get(), dir.first.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fromDir == -1 || toDir == -1
+                    || copyMetadata(fromDir, toDir, dir.second) != OK) {
+                PLOG(ERROR) << "Failed to copy metadata for " << dir.first;
+                ctx.failed = true;
+            }
+            if (fromDir != -1) close(fromDir);
+            if (toDir != -1) close(toDir);
+            if (ctx.failed) break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        done = true;
+    }
+    cond.notify_all();
+    progress.join();
+    sizer.join();
+
+    // Whatever did finish is kept for the next attempt, even on failure
+    if (journal != nullptr) {
+        journal->checkpoint(toRoot.get());
+    }
+
+    LOG(DEBUG) << "Finished copy of " << ctx.copiedBytes << " bytes"
+            << (ctx.failed ? " with errors" : "");
+    amp.finish(ctx.copiedBytes);
+    if (ctx.failed) {
+        return ctx.error ? -ctx.error : -1;
+    }
+    return OK;
+}
+
+/*
+ * Walks the source once more, confirming every entry made it to the target
+ * with the same type, and regular files with the same size and mtime.
+ */
+static status_t verifyDir(int fromFd, int toFd, const std::string& path, uint64_t& checked) {
+    std::vector<char> buf(kDirentBufferSize);
+    int len;
+    while ((len = syscall(__NR_getdents64, fromFd, buf.data(), buf.size())) > 0) {
+        for (int off = 0; off < len;) {
+            auto ent = reinterpret_cast<struct linux_dirent64*>(buf.data() + off);
+            off += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+            std::string childPath(path.empty() ? name : path + "/" + name);
+            struct stat fromSt;
+            struct stat toSt;
+            if (fstatat(fromFd, name, &fromSt, AT_SYMLINK_NOFOLLOW) != 0) {
+                PLOG(ERROR) << "Failed to stat " << childPath;
+                return -1;
+            }
+            if (fstatat(toFd, name, &toSt, AT_SYMLINK_NOFOLLOW) != 0
+                    || (fromSt.st_mode & S_IFMT) != (toSt.st_mode & S_IFMT)
+                    || (S_ISREG(fromSt.st_mode) && (fromSt.st_size != toSt.st_size
+                            || fromSt.st_mtim.tv_sec != toSt.st_mtim.tv_sec
+                            || fromSt.st_mtim.tv_nsec != toSt.st_mtim.tv_nsec))) {
+                LOG(ERROR) << "Copy of " << childPath << " doesn't match its source";
+                return -1;
+            }
+            checked++;
+
+            if (S_ISDIR(fromSt.st_mode)) {
+                int fromChild = openat(fromFd, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                int toChild = openat(toFd, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                status_t res = -1;
+                if (fromChild == -1 || toChild == -1) {
+                    PLOG(ERROR) << "Failed to open " << childPath;
+                } else {
+                    res = verifyDir(fromChild, toChild, childPath, checked);
+                }
+                if (fromChild != -1) close(fromChild);
+                if (toChild != -1) close(toChild);
+                if (res != OK) return res;
+            }
+        }
+    }
+    if (len < 0) {
+        PLOG(ERROR) << "Failed to read " << path;
+        return -1;
+    }
+    return OK;
+}
+
+static status_t verifyTree(const std::string& fromPath, const std::string& toPath) {
+    int fromFd = open(fromPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fromFd == -1) {
+        PLOG(ERROR) << "Failed to open " << fromPath;
+        return -1;
+    }
+    ScopedFd fromRoot(fromFd);
+    int toFd = open(toPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (toFd == -1) {
+        PLOG(ERROR) << "Failed to open " << toPath;
+        return -1;
+    }
+    ScopedFd toRoot(toFd);
+
+    uint64_t checked = 0;
+    status_t res = verifyDir(fromRoot.get(), toRoot.get(), "", checked);
+    LOG(DEBUG) << "Verified " << checked << " entries under " << toPath;
+    return res;
+}
+
+/*
+ * When both trees share a filesystem, moving each top-level entry with
+ * renameat() avoids copying any data. The journal is marked first, so an
+ * attempt cut short is finished by the next one instead of wiping the
+ * target. If an entry can't be moved, the ones this call moved are put
+ * back and -EXDEV tells the caller to copy instead; any other error means
+ * the trees are now split between both.
+ */
+static status_t renameTree(const std::string& fromPath, const std::string& toPath,
+        int startProgress, int stepProgress, MoveJournal* journal) {
+    notifyProgress(startProgress);
+
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(fromPath.c_str()), closedir);
+    int toFd = open(toPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!dir || toFd == -1) {
+        PLOG(ERROR) << "Failed to open " << fromPath << " or " << toPath;
+        if (toFd != -1) close(toFd);
+        return -EXDEV;
+    }
+    ScopedFd toRoot(toFd);
+    int fromFd = dirfd(dir.get());
+
+    std::vector<std::string> names;
+    struct dirent* ent;
+    while ((ent = readdir(dir.get())) != nullptr) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        names.push_back(ent->d_name);
+    }
+    bool resumed = journal->isRenaming();
+    if (!names.empty() && journal->markRenaming() != OK) {
+        return -EIO;
+    }
+
+    for (size_t i = 0; i < names.size(); i++) {
+        const char* name = names[i].c_str();
+        if (renameat(fromFd, name, toRoot.get(), name) == 0) continue;
+
+        PLOG(WARNING) << "Failed to rename " << name << "; falling back to copy";
+        while (i-- > 0) {
+            name = names[i].c_str();
+            if (renameat(toRoot.get(), name, fromFd, name) != 0) {
+                PLOG(ERROR) << "Failed to restore " << name << " to " << fromPath;
+                return -EIO;
+            }
+        }
+        // Entries an earlier attempt moved are still only in the target
+        if (!resumed) journal->clearRenaming();
+        return -EXDEV;
+    }
+
+    LOG(DEBUG) << "Moved " << names.size() << " entries by rename";
+    notifyProgress(startProgress + stepProgress);
+    return OK;
+}
+
+/* Tree holding the shared storage a volume presents to apps */
+static std::string getStorageRoot(const std::shared_ptr<VolumeBase>& vol) {
+    if (vol->getType() == VolumeBase::Type::kPrivate) {
+        // Same tree the EmulatedVolume stacked on it serves
+        return vol->getPath() + "/media";
+    }
+    return vol->getInternalPath();
+}
+
+/* A public volume holds a single user's view, like <root>/<userId> elsewhere */
+static std::string getUserSuffix(const std::shared_ptr<VolumeBase>& vol) {
+    userid_t userId = vol->getMountUserId();
+    return StringPrintf("/%u", userId == (userid_t) -1 ? 0 : userId);
+}
+
+static bool isNested(const std::string& a, const std::string& b) {
+    return a == b || (a.size() > b.size() && !a.compare(0, b.size(), b) && a[b.size()] == '/')
+            || (b.size() > a.size() && !b.compare(0, a.size(), a) && b[a.size()] == '/');
+}
+
+/* Holds the volume locks of both ends, which may be one and the same */
+class ScopedVolumesLock {
+public:
+    ScopedVolumesLock(const std::shared_ptr<VolumeBase>& from,
+            const std::shared_ptr<VolumeBase>& to) :
+            mFromLock(VolumeManager::Instance()->getVolumeLock(from)),
+            mToLock(VolumeManager::Instance()->getVolumeLock(to)) {
+        if (&mFromLock == &mToLock) {
+            mFromLock.lock();
+        } else {
+            std::lock(mFromLock, mToLock);
+        }
+    }
+
+    ~ScopedVolumesLock() {
+        mFromLock.unlock();
+        if (&mFromLock != &mToLock) {
+            mToLock.unlock();
+        }
+    }
+
+private:
+    std::mutex& mFromLock;
+    std::mutex& mToLock;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedVolumesLock);
+};
+
+/* Journals live with the target's own vold state, which survives the move */
+static std::string getJournalPath(const std::shared_ptr<VolumeBase>& vol) {
+    if (vol->getType() == VolumeBase::Type::kPrivate) {
+        std::string path(vol->getPath() + "/misc");
+        if (PrepareDir(path, 01771, AID_SYSTEM, AID_MISC) == OK
+                && PrepareDir(path + "/vold", 0700, AID_ROOT, AID_ROOT) == OK) {
+            return path + "/vold/" + kJournalName;
+        }
+    }
+    // Public media has no room for it, and emulated storage is /data anyway
+    return StringPrintf("/data/misc/vold/%s", kJournalName);
+}
+
 static void bringOffline(const std::shared_ptr<VolumeBase>& vol) {
+    // Private volumes stay mounted; only what's stacked on them faces apps
+    if (vol->getType() == VolumeBase::Type::kPrivate) {
+        for (const auto& stacked : vol->getVolumes()) {
+            bringOffline(stacked);
+        }
+        return;
+    }
+    // Hiding only stops FUSE, instead of a full destroy/create/mount cycle
+    if (vol->hide() == OK) {
+        return;
+    }
     vol->destroy();
     vol->setSilent(true);
     vol->create();
@@ -165,68 +1123,164 @@ static void bringOffline(const std::shared_ptr<VolumeBase>& vol) {
 }
 
 static void bringOnline(const std::shared_ptr<VolumeBase>& vol) {
+    if (vol->getType() == VolumeBase::Type::kPrivate) {
+        for (const auto& stacked : vol->getVolumes()) {
+            bringOnline(stacked);
+        }
+        return;
+    }
+    if (vol->isHidden()) {
+        vol->unhide();
+        return;
+    }
     vol->destroy();
     vol->setSilent(false);
     vol->create();
 }
 
 void MoveTask::run() {
+    OperationTimer timer("move", mTo->getId());
     acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLock);
 
     std::string fromPath;
     std::string toPath;
+    struct stat fromSt;
+    struct stat toSt;
+    status_t res;
+    std::unique_ptr<MoveJournal> journal;
+    bool resuming = false;
+    bool fromPublic = (mFrom->getType() == VolumeBase::Type::kPublic);
+    bool toPublic = (mTo->getType() == VolumeBase::Type::kPublic);
 
-    // TODO: add support for public volumes
-    if (mFrom->getType() != VolumeBase::Type::kEmulated) goto fail;
-    if (mTo->getType() != VolumeBase::Type::kEmulated) goto fail;
+    // Emulated volumes can always be brought up silently, but public and
+    // private ones must already have their filesystem mounted
+    for (const auto& vol : { mFrom, mTo }) {
+        auto type = vol->getType();
+        if (type != VolumeBase::Type::kEmulated && type != VolumeBase::Type::kPublic
+                && type != VolumeBase::Type::kPrivate) {
+            LOG(ERROR) << "Unable to move storage on " << vol->getId();
+            goto fail;
+        }
+        if (type != VolumeBase::Type::kEmulated
+                && vol->getState() != VolumeBase::State::kMounted) {
+            LOG(ERROR) << vol->getId() << " must be mounted to move storage";
+            goto fail;
+        }
+    }
 
     // Step 1: tear down volumes and mount silently without making
     // visible to userspace apps
     {
-        std::lock_guard<std::mutex> lock(VolumeManager::Instance()->getLock());
+        ScopedVolumesLock lock(mFrom, mTo);
         bringOffline(mFrom);
         bringOffline(mTo);
     }
 
-    fromPath = mFrom->getInternalPath();
-    toPath = mTo->getInternalPath();
-
-    // Step 2: clean up any stale data
-    if (execRm(toPath, 10, 10) != OK) {
+    fromPath = getStorageRoot(mFrom);
+    toPath = getStorageRoot(mTo);
+    if (fromPublic && !toPublic) {
+        toPath += getUserSuffix(mFrom);
+        fs_prepare_dir(toPath.c_str(), 0770, AID_MEDIA_RW, AID_MEDIA_RW);
+    } else if (toPublic && !fromPublic) {
+        fromPath += getUserSuffix(mTo);
+    }
+    if (toPublic) {
+        toPath += kPublicMoveDir;
+        if (fs_prepare_dir(toPath.c_str(), 0770, AID_MEDIA_RW, AID_MEDIA_RW) != 0) {
+            PLOG(ERROR) << "Failed to prepare " << toPath;
+            goto fail;
+        }
+    }
+    if (fromPath.empty() || toPath.empty() || isNested(fromPath, toPath)) {
+        LOG(ERROR) << "Unable to move " << fromPath << " to " << toPath;
+        goto fail;
+    }
+    LOG(INFO) << "Moving " << fromPath << " to " << toPath;
+    journal.reset(new MoveJournal(getJournalPath(mTo), fromPath, toPath));
+    resuming = journal->load();
+    if (!resuming && journal->isForeignRenaming()) {
+        // Its entries may only exist under toPath, so it can't be cleaned
+        LOG(ERROR) << "Earlier move by rename into " << toPath << " never finished";
         goto fail;
     }
 
-    // Step 3: perform actual copy
-    if (execCp(fromPath, toPath, 20, 60) != OK) {
-        goto copy_fail;
+    // Step 2: clean up any stale data, unless it's our own earlier attempt
+    if (resuming) {
+        LOG(INFO) << "Resuming earlier move" << (journal->isVerified() ? " cleanup"
+                : journal->isRenaming() ? " by rename" : "");
+        notifyProgress(20);
+    } else {
+        res = deleteContents(toPath, 10, 10);
+        if (res != OK && res != -ENOENT) {
+            goto fail;
+        }
+    }
+
+    // Step 3: perform actual copy, or just rename within one filesystem;
+    // an interrupted rename is finished the same way
+    res = -EXDEV;
+    if ((!resuming || journal->isRenaming()) && stat(fromPath.c_str(), &fromSt) == 0
+            && stat(toPath.c_str(), &toSt) == 0 && fromSt.st_dev == toSt.st_dev) {
+        res = renameTree(fromPath, toPath, 20, 60, journal.get());
+        if (res != OK && res != -EXDEV) {
+            // Data now lives in both trees, so neither may be cleaned up
+            goto fail;
+        }
+    }
+    if (res != OK && journal->isVerified() && verifyTree(fromPath, toPath) != OK) {
+        // Written to since the cleanup was cut short; copy it all again
+        LOG(WARNING) << "Source changed since the move was verified";
+        journal->discard();
+        resuming = false;
+    }
+    if (res != OK && !journal->isVerified()) {
+        if (journal->open(resuming) != OK) {
+            goto fail;
+        }
+        if ((res = copyTree(fromPath, toPath, 20, 60, journal.get())) != OK) {
+            goto copy_fail;
+        }
+        // The source only goes away once the whole copy checks out
+        if ((res = verifyTree(fromPath, toPath)) != OK
+                || (res = journal->markVerified(toPath)) != OK) {
+            goto copy_fail;
+        }
     }
 
     // NOTE: MountService watches for this magic value to know
     // that move was successful
     notifyProgress(82);
+
+    // Step 4: clean up old data, while a public source is still mounted
+    // where we can reach it; bringing it online unmounts that view
+    if (deleteContents(fromPath, 85, 15) != OK) {
+        goto fail;
+    }
+    journal->remove();
     {
-        std::lock_guard<std::mutex> lock(VolumeManager::Instance()->getLock());
+        ScopedVolumesLock lock(mFrom, mTo);
         bringOnline(mFrom);
         bringOnline(mTo);
     }
 
-    // Step 4: clean up old data
-    if (execRm(fromPath, 85, 15) != OK) {
-        goto fail;
-    }
-
     notifyProgress(kMoveSucceeded);
     release_wake_lock(kWakeLock);
+    timer.setResult(OK);
     return;
 
 copy_fail:
-    // if we failed to copy the data we should not leave it laying around
-    // in target location. Do not check return value, we can not do any
-    // useful anyway.
-    execRm(toPath, 80, 1);
+    // Whatever was copied stays for the next attempt to resume from,
+    // unless the target simply can't hold it all; then, don't leave it
+    // lying around. Do not check return value, we can not do any useful
+    // anyway.
+    // Renamed entries have no other copy, so they always stay.
+    if ((res == -ENOSPC || res == -EDQUOT) && !journal->isRenaming()) {
+        deleteContents(toPath, 80, 1);
+        journal->remove();
+    }
 fail:
     {
-        std::lock_guard<std::mutex> lock(VolumeManager::Instance()->getLock());
+        ScopedVolumesLock lock(mFrom, mTo);
         bringOnline(mFrom);
         bringOnline(mTo);
     }
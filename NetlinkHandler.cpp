@@ -28,30 +28,34 @@
 #include "VolumeManager.h"
 
 NetlinkHandler::NetlinkHandler(int listenerSocket) :
-                NetlinkListener(listenerSocket) {
+                NetlinkListener(listenerSocket),
+                mQueue([](const android::vold::BlockEvent& event) {
+                    VolumeManager::Instance()->handleBlockEvent(event);
+                }) {
 }
 
 NetlinkHandler::~NetlinkHandler() {
 }
 
 int NetlinkHandler::start() {
+    if (mQueue.start()) {
+        return -1;
+    }
     return this->startListener();
 }
 
 int NetlinkHandler::stop() {
-    return this->stopListener();
+    int res = this->stopListener();
+    mQueue.stop();
+    return res;
 }
 
 void NetlinkHandler::onEvent(NetlinkEvent *evt) {
-    VolumeManager *vm = VolumeManager::Instance();
-    const char *subsys = evt->getSubsystem();
-
-    if (!subsys) {
+    if (!evt->getSubsystem()) {
         SLOGW("No subsystem found in netlink event");
         return;
     }
 
-    if (!strcmp(subsys, "block")) {
-        vm->handleBlockEvent(evt);
-    }
+    // Only copy the event here; disks are probed on the queue's own thread
+    mQueue.push(evt);
 }
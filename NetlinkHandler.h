@@ -19,6 +19,11 @@
 
 #include <sysutils/NetlinkListener.h>
 
+#include <string>
+#include <vector>
+
+#include "UeventQueue.h"
+
 class NetlinkHandler: public NetlinkListener {
 
 public:
@@ -28,7 +33,12 @@ public:
     int start(void);
     int stop(void);
 
+    std::vector<std::string> getStats() { return mQueue.getStats(); }
+
 protected:
     virtual void onEvent(NetlinkEvent *evt);
+
+private:
+    android::vold::UeventQueue mQueue;
 };
 #endif
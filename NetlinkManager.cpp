@@ -43,6 +43,7 @@ NetlinkManager *NetlinkManager::Instance() {
 
 NetlinkManager::NetlinkManager() {
     mBroadcaster = NULL;
+    mHandler = NULL;
 }
 
 NetlinkManager::~NetlinkManager() {
@@ -92,6 +93,13 @@ out:
     return -1;
 }
 
+std::vector<std::string> NetlinkManager::getStats() {
+    if (!mHandler) {
+        return std::vector<std::string>();
+    }
+    return mHandler->getStats();
+}
+
 int NetlinkManager::stop() {
     int status = 0;
 
@@ -20,6 +20,9 @@
 #include <sysutils/SocketListener.h>
 #include <sysutils/NetlinkListener.h>
 
+#include <string>
+#include <vector>
+
 class NetlinkHandler;
 
 class NetlinkManager {
@@ -40,6 +43,8 @@ public:
     void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
     SocketListener *getBroadcaster() { return mBroadcaster; }
 
+    std::vector<std::string> getStats();
+
     static NetlinkManager *Instance();
 
 private:
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OperationStats.h"
+#include "LatencyHistogram.h"
+
+#include <android-base/stringprintf.h>
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <inttypes.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const char* kTotalSubject = "*";
+
+/* Every volume that ever appeared keeps its entry, so bound the total */
+static const size_t kMaxEntries = 256;
+
+struct OperationEntry {
+    uint64_t failed = 0;
+    LatencyHistogram latency;
+};
+
+static std::mutex sStatsLock;
+static std::map<std::pair<std::string, std::string>, OperationEntry> sStats;
+
+static void recordLocked(const std::string& op, const std::string& subject,
+        nsecs_t latency, bool failed) {
+    auto key = std::make_pair(op, subject);
+    auto it = sStats.find(key);
+    if (it == sStats.end()) {
+        if (sStats.size() >= kMaxEntries) {
+            return;
+        }
+        it = sStats.emplace(key, OperationEntry()).first;
+    }
+    it->second.latency.record(latency);
+    if (failed) {
+        it->second.failed++;
+    }
+}
+
+OperationTimer::OperationTimer(const char* op, const std::string& subject) :
+        mOp(op), mSubject(subject), mStart(systemTime(SYSTEM_TIME_BOOTTIME)), mFailed(true) {
+}
+
+OperationTimer::~OperationTimer() {
+    nsecs_t latency = systemTime(SYSTEM_TIME_BOOTTIME) - mStart;
+    std::lock_guard<std::mutex> lock(sStatsLock);
+    recordLocked(mOp, kTotalSubject, latency, mFailed);
+    if (!mSubject.empty()) {
+        recordLocked(mOp, mSubject, latency, mFailed);
+    }
+}
+
+std::vector<std::string> GetOperationStats() {
+    std::vector<std::string> res;
+    std::lock_guard<std::mutex> lock(sStatsLock);
+    for (const auto& it : sStats) {
+        res.push_back(StringPrintf("%s %s %" PRIu64 " %s", it.first.first.c_str(),
+                it.first.second.c_str(), it.second.failed,
+                it.second.latency.toString().c_str()));
+    }
+    return res;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_OPERATION_STATS_H
+#define ANDROID_VOLD_OPERATION_STATS_H
+
+#include "Utils.h"
+
+#include <utils/Errors.h>
+#include <utils/Timers.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Times the enclosing scope as one run of an operation such as "mount" or
+ * "fsck". Each run is counted in the total for the operation, and again
+ * under its subject (a volume, disk or filesystem type) when one is given.
+ * A run counts as failed unless setResult() reports success before the
+ * scope ends.
+ */
+class OperationTimer {
+public:
+    OperationTimer(const char* op, const std::string& subject = "");
+    ~OperationTimer();
+
+    void setResult(status_t res) { mFailed = (res != OK); }
+    void setResult(bool success) { mFailed = !success; }
+
+private:
+    const char* mOp;
+    std::string mSubject;
+    nsecs_t mStart;
+    bool mFailed;
+
+    DISALLOW_COPY_AND_ASSIGN(OperationTimer);
+};
+
+/*
+ * One line per operation and subject, sorted, as
+ * "<op> <subject> <failed> <count> <p50> <p90> <p99> <p99.9> <max>", where
+ * the subject is "*" for the total and latencies are in microseconds.
+ */
+std::vector<std::string> GetOperationStats();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "PartitionTable.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <algorithm>
+#include <array>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const size_t kMbrEntriesOffset = 446;
+static const size_t kMbrEntrySize = 16;
+static const size_t kMbrPrimaryCount = 4;
+static const int kMbrFirstLogical = 5;
+/* Guard against EBR chains that loop back on themselves */
+static const int kMbrMaxLogical = 128;
+
+static const uint8_t kMbrTypeGptProtective = 0xee;
+
+static const char kGptSignature[] = "EFI PART";
+static const size_t kGptHeaderMinSize = 92;
+static const size_t kGptEntryMinSize = 128;
+/* Far beyond anything sgdisk creates, but keeps bogus headers bounded */
+static const size_t kGptEntriesMaxBytes = 1024 * 1024;
+
+/* What sgdisk writes, and what every reader expects */
+static const uint32_t kGptRevision = 0x00010000;
+static const uint32_t kGptEntryCount = 128;
+static const size_t kGptEntrySize = 128;
+static const size_t kGptEntryNameOffset = 56;
+static const size_t kGptEntryNameChars = 36;
+static const uint64_t kMinAlignBytes = 1024 * 1024;
+
+static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static void put16(uint8_t* p, uint16_t val) {
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t val) {
+    put16(p, val);
+    put16(p + 2, val >> 16);
+}
+
+static void put64(uint8_t* p, uint64_t val) {
+    put32(p, val);
+    put32(p + 4, val >> 32);
+}
+
+static std::array<uint32_t, 256> buildCrcTable() {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+uint32_t Crc32(const void* buf, size_t len, uint32_t crc) {
+    static const std::array<uint32_t, 256> table = buildCrcTable();
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+    crc = ~crc;
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* Block devices report their own geometry; image files are taken as 512 byte sectors */
+static int getGeometry(int fd, uint64_t& size, int& sectorSize, bool& image) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return -1;
+    }
+    image = S_ISREG(st.st_mode);
+    if (image) {
+        size = st.st_size;
+        sectorSize = 512;
+        return 0;
+    }
+    return (ioctl(fd, BLKGETSIZE64, &size) || ioctl(fd, BLKSSZGET, &sectorSize)) ? -1 : 0;
+}
+
+static status_t readAt(int fd, uint64_t offset, size_t len, std::vector<uint8_t>& buf) {
+    buf.resize(len);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = TEMP_FAILURE_RETRY(
+                pread64(fd, buf.data() + done, len - done, offset + done));
+        if (res < 0) {
+            return -errno;
+        } else if (res == 0) {
+            return -EIO;
+        }
+        done += res;
+    }
+    return OK;
+}
+
+/* GUIDs are stored mixed-endian; print them the way sgdisk does */
+static std::string formatGuid(const uint8_t* p) {
+    return StringPrintf("%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+            get32(p), get16(p + 4), get16(p + 6), p[8], p[9],
+            p[10], p[11], p[12], p[13], p[14], p[15]);
+}
+
+/* Inverse of formatGuid, also accepting GUIDs without dashes */
+static status_t parseGuid(const std::string& text, uint8_t* p) {
+    std::string raw;
+    if (HexToStr(text, raw) || raw.size() != 16) {
+        return -EINVAL;
+    }
+    const uint8_t* r = reinterpret_cast<const uint8_t*>(raw.data());
+    put32(p, (r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3]);
+    put16(p + 4, (r[4] << 8) | r[5]);
+    put16(p + 6, (r[6] << 8) | r[7]);
+    memcpy(p + 8, r + 8, 8);
+    return OK;
+}
+
+static status_t randomGuid(uint8_t* p) {
+    std::string raw;
+    if (ReadRandomBytes(16, raw)) {
+        return -EIO;
+    }
+    memcpy(p, raw.data(), 16);
+    // Version 4, RFC 4122 variant
+    p[7] = (p[7] & 0x0f) | 0x40;
+    p[8] = (p[8] & 0x3f) | 0x80;
+    return OK;
+}
+
+static bool isZero(const uint8_t* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i]) return false;
+    }
+    return true;
+}
+
+static bool readGpt(int fd, uint32_t sectorSize, uint64_t lba,
+        std::vector<Partition>& partitions) {
+    std::vector<uint8_t> header;
+    if (readAt(fd, lba * sectorSize, sectorSize, header) != OK) {
+        return false;
+    }
+    if (memcmp(header.data(), kGptSignature, 8)) {
+        return false;
+    }
+
+    uint32_t headerSize = get32(&header[12]);
+    if (headerSize < kGptHeaderMinSize || headerSize > sectorSize) {
+        return false;
+    }
+    uint32_t headerCrc = get32(&header[16]);
+    memset(&header[16], 0, 4);
+    if (Crc32(header.data(), headerSize) != headerCrc) {
+        LOG(WARNING) << "GPT header at LBA " << lba << " has bad CRC";
+        return false;
+    }
+    if (get64(&header[24]) != lba) {
+        return false;
+    }
+
+    uint64_t entriesLba = get64(&header[72]);
+    uint32_t numEntries = get32(&header[80]);
+    uint32_t entrySize = get32(&header[84]);
+    uint32_t entriesCrc = get32(&header[88]);
+    if (entrySize < kGptEntryMinSize || entrySize % 8
+            || (uint64_t) numEntries * entrySize > kGptEntriesMaxBytes) {
+        return false;
+    }
+
+    std::vector<uint8_t> entries;
+    if (readAt(fd, entriesLba * sectorSize, numEntries * entrySize, entries) != OK) {
+        return false;
+    }
+    if (Crc32(entries.data(), entries.size()) != entriesCrc) {
+        LOG(WARNING) << "GPT entries for header at LBA " << lba << " have bad CRC";
+        return false;
+    }
+
+    partitions.clear();
+    for (uint32_t i = 0; i < numEntries; i++) {
+        const uint8_t* entry = &entries[i * entrySize];
+        if (isZero(entry, 16)) continue;
+
+        Partition part;
+        part.number = i + 1;
+        part.mbrType = 0;
+        part.typeGuid = formatGuid(entry);
+        part.partGuid = formatGuid(entry + 16);
+        part.firstLba = get64(entry + 32);
+        part.lastLba = get64(entry + 40);
+        partitions.push_back(part);
+    }
+    return true;
+}
+
+static bool isMbrExtended(uint8_t type) {
+    return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+static void addMbrEntry(const uint8_t* entry, uint64_t base, int number,
+        std::vector<Partition>& partitions) {
+    Partition part;
+    part.number = number;
+    part.mbrType = entry[4];
+    part.firstLba = base + get32(entry + 8);
+    part.lastLba = part.firstLba + get32(entry + 12) - 1;
+    partitions.push_back(part);
+}
+
+static void readMbr(int fd, uint32_t sectorSize, const std::vector<uint8_t>& mbr,
+        std::vector<Partition>& partitions) {
+    partitions.clear();
+
+    uint64_t extendedLba = 0;
+    for (size_t i = 0; i < kMbrPrimaryCount; i++) {
+        const uint8_t* entry = &mbr[kMbrEntriesOffset + i * kMbrEntrySize];
+        if (get32(entry + 12) == 0 || entry[4] == kMbrTypeGptProtective) continue;
+
+        addMbrEntry(entry, 0, i + 1, partitions);
+        if (isMbrExtended(entry[4]) && extendedLba == 0) {
+            extendedLba = get32(entry + 8);
+        }
+    }
+
+    // Logical partitions live in a chain of EBRs, each holding one
+    // partition relative to itself and a link relative to the container
+    uint64_t ebrLba = extendedLba;
+    for (int number = kMbrFirstLogical;
+            ebrLba != 0 && number < kMbrFirstLogical + kMbrMaxLogical; number++) {
+        std::vector<uint8_t> ebr;
+        if (readAt(fd, ebrLba * sectorSize, 512, ebr) != OK
+                || ebr[510] != 0x55 || ebr[511] != 0xaa) {
+            LOG(WARNING) << "Invalid EBR at LBA " << ebrLba;
+            break;
+        }
+
+        const uint8_t* entry = &ebr[kMbrEntriesOffset];
+        if (get32(entry + 12) != 0) {
+            addMbrEntry(entry, ebrLba, number, partitions);
+        }
+
+        const uint8_t* link = &ebr[kMbrEntriesOffset + kMbrEntrySize];
+        if (!isMbrExtended(link[4]) || get32(link + 8) == 0) break;
+        ebrLba = extendedLba + get32(link + 8);
+    }
+}
+
+static status_t writeAt(int fd, uint64_t offset, const std::vector<uint8_t>& buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t res = TEMP_FAILURE_RETRY(
+                pwrite64(fd, buf.data() + done, buf.size() - done, offset + done));
+        if (res <= 0) {
+            return res < 0 ? -errno : -EIO;
+        }
+        done += res;
+    }
+    return OK;
+}
+
+static uint64_t roundUp(uint64_t val, uint64_t align) {
+    return (val + align - 1) / align * align;
+}
+
+/* Places each partition on an aligned start, filling in first and last LBA */
+static status_t layoutPartitions(const std::vector<PartitionSpec>& specs, uint32_t sectorSize,
+        uint64_t firstUsable, uint64_t lastUsable, uint64_t alignLba,
+        std::vector<Partition>& partitions) {
+    partitions.clear();
+    uint64_t next = firstUsable;
+    for (size_t i = 0; i < specs.size(); i++) {
+        Partition part;
+        part.number = i + 1;
+        part.mbrType = specs[i].mbrType;
+        part.firstLba = roundUp(next, alignLba);
+        if (specs[i].sizeBytes == 0) {
+            part.lastLba = lastUsable;
+        } else {
+            part.lastLba = part.firstLba + specs[i].sizeBytes / sectorSize - 1;
+        }
+        if (part.firstLba > part.lastLba || part.lastLba > lastUsable) {
+            LOG(ERROR) << "Partition " << part.number << " doesn't fit on disk";
+            return -ENOSPC;
+        }
+        partitions.push_back(part);
+        next = part.lastLba + 1;
+    }
+    return OK;
+}
+
+/* Marks the whole disk as taken, so MBR-only tools leave a GPT alone */
+static void buildProtectiveMbr(uint8_t* mbr, uint64_t totalLba) {
+    uint8_t* entry = &mbr[kMbrEntriesOffset];
+    entry[1] = 0x00;
+    entry[2] = 0x02;
+    entry[4] = kMbrTypeGptProtective;
+    entry[5] = entry[6] = entry[7] = 0xff;
+    put32(entry + 8, 1);
+    put32(entry + 12, std::min<uint64_t>(totalLba - 1, UINT32_MAX));
+    mbr[510] = 0x55;
+    mbr[511] = 0xaa;
+}
+
+static void buildGptHeader(uint8_t* header, const uint8_t* diskGuid, uint64_t myLba,
+        uint64_t alternateLba, uint64_t firstUsable, uint64_t lastUsable,
+        uint64_t entriesLba, uint32_t entriesCrc) {
+    memcpy(header, kGptSignature, 8);
+    put32(header + 8, kGptRevision);
+    put32(header + 12, kGptHeaderMinSize);
+    put64(header + 24, myLba);
+    put64(header + 32, alternateLba);
+    put64(header + 40, firstUsable);
+    put64(header + 48, lastUsable);
+    memcpy(header + 56, diskGuid, 16);
+    put64(header + 72, entriesLba);
+    put32(header + 80, kGptEntryCount);
+    put32(header + 84, kGptEntrySize);
+    put32(header + 88, entriesCrc);
+    put32(header + 16, Crc32(header, kGptHeaderMinSize));
+}
+
+status_t WritePartitionTable(const std::string& devPath, PartitionTable::Type type,
+        const std::vector<PartitionSpec>& specs, uint64_t alignBytes) {
+    if (type == PartitionTable::Type::kUnknown
+            || (type == PartitionTable::Type::kMbr && specs.size() > kMbrPrimaryCount)
+            || (type == PartitionTable::Type::kGpt && specs.size() > kGptEntryCount)) {
+        return -EINVAL;
+    }
+
+    int rawFd = TEMP_FAILURE_RETRY(open(devPath.c_str(), O_RDWR | O_CLOEXEC));
+    if (rawFd < 0) {
+        PLOG(ERROR) << "Failed to open " << devPath;
+        return -errno;
+    }
+    ScopedFd fd(rawFd);
+
+    uint64_t size;
+    int sectorSize;
+    bool image;
+    if (getGeometry(fd.get(), size, sectorSize, image)) {
+        PLOG(ERROR) << "Failed to query geometry of " << devPath;
+        return -errno;
+    }
+    if (sectorSize < 512) {
+        return -EINVAL;
+    }
+
+    const uint64_t totalLba = size / sectorSize;
+    const uint64_t alignLba = std::max(alignBytes, kMinAlignBytes) / sectorSize;
+    const uint64_t entriesSectors = roundUp(kGptEntryCount * kGptEntrySize, sectorSize)
+            / sectorSize;
+    // Both ends are always rewritten in full, so nothing of an older
+    // table of either kind survives to confuse ReadPartitionTable()
+    const uint64_t headSectors = 2 + entriesSectors;
+    const uint64_t tailSectors = 1 + entriesSectors;
+    if (totalLba < headSectors + tailSectors + alignLba) {
+        return -ENOSPC;
+    }
+
+    std::vector<uint8_t> head(headSectors * sectorSize, 0);
+    std::vector<uint8_t> tail(tailSectors * sectorSize, 0);
+    std::vector<Partition> partitions;
+    status_t res;
+
+    if (type == PartitionTable::Type::kGpt) {
+        const uint64_t firstUsable = headSectors;
+        const uint64_t lastUsable = totalLba - tailSectors - 1;
+        if ((res = layoutPartitions(specs, sectorSize, firstUsable, lastUsable, alignLba,
+                partitions))) {
+            return res;
+        }
+
+        std::vector<uint8_t> entries(kGptEntryCount * kGptEntrySize, 0);
+        for (size_t i = 0; i < specs.size(); i++) {
+            uint8_t* entry = &entries[i * kGptEntrySize];
+            if (parseGuid(specs[i].typeGuid, entry)) {
+                LOG(ERROR) << "Invalid partition type " << specs[i].typeGuid;
+                return -EINVAL;
+            }
+            if (specs[i].partGuid.empty() ? randomGuid(entry + 16)
+                    : parseGuid(specs[i].partGuid, entry + 16)) {
+                LOG(ERROR) << "Invalid partition GUID " << specs[i].partGuid;
+                return -EINVAL;
+            }
+            put64(entry + 32, partitions[i].firstLba);
+            put64(entry + 40, partitions[i].lastLba);
+            // Names are UTF-16LE; ours are always plain ASCII
+            const std::string& name = specs[i].name;
+            for (size_t c = 0; c < name.size() && c < kGptEntryNameChars; c++) {
+                put16(entry + kGptEntryNameOffset + c * 2, (uint8_t) name[c]);
+            }
+        }
+        uint32_t entriesCrc = Crc32(entries.data(), entries.size());
+
+        uint8_t diskGuid[16];
+        if (randomGuid(diskGuid)) {
+            return -EIO;
+        }
+
+        buildProtectiveMbr(head.data(), totalLba);
+        buildGptHeader(&head[sectorSize], diskGuid, 1, totalLba - 1, firstUsable, lastUsable,
+                2, entriesCrc);
+        memcpy(&head[2 * sectorSize], entries.data(), entries.size());
+
+        memcpy(tail.data(), entries.data(), entries.size());
+        buildGptHeader(&tail[entriesSectors * sectorSize], diskGuid, totalLba - 1, 1,
+                firstUsable, lastUsable, totalLba - tailSectors, entriesCrc);
+    } else {
+        const uint64_t lastUsable = std::min<uint64_t>(totalLba - 1, UINT32_MAX);
+        if ((res = layoutPartitions(specs, sectorSize, 1, lastUsable, alignLba,
+                partitions))) {
+            return res;
+        }
+
+        std::string diskId;
+        if (ReadRandomBytes(4, diskId)) {
+            return -EIO;
+        }
+        memcpy(&head[440], diskId.data(), 4);
+        for (size_t i = 0; i < specs.size(); i++) {
+            // CHS can't address modern media; everyone reads the LBA fields
+            uint8_t* entry = &head[kMbrEntriesOffset + i * kMbrEntrySize];
+            entry[0] = specs[i].active ? 0x80 : 0x00;
+            entry[1] = entry[5] = 0xfe;
+            entry[2] = entry[3] = entry[6] = entry[7] = 0xff;
+            entry[4] = specs[i].mbrType;
+            put32(entry + 8, partitions[i].firstLba);
+            put32(entry + 12, partitions[i].lastLba - partitions[i].firstLba + 1);
+        }
+        head[510] = 0x55;
+        head[511] = 0xaa;
+    }
+
+    if ((res = writeAt(fd.get(), 0, head))
+            || (res = writeAt(fd.get(), (totalLba - tailSectors) * sectorSize, tail))) {
+        LOG(ERROR) << "Failed to write partition table to " << devPath;
+        return res;
+    }
+    if (fsync(fd.get())) {
+        PLOG(ERROR) << "Failed to flush partition table to " << devPath;
+        return -errno;
+    }
+    if (!image && ioctl(fd.get(), BLKRRPART, nullptr)) {
+        PLOG(ERROR) << "Failed to re-read partition table of " << devPath;
+        return -errno;
+    }
+    return OK;
+}
+
+status_t ReadPartitionTable(const std::string& devPath, PartitionTable& table) {
+    table.type = PartitionTable::Type::kUnknown;
+    table.partitions.clear();
+
+    int rawFd = TEMP_FAILURE_RETRY(open(devPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (rawFd < 0) {
+        PLOG(ERROR) << "Failed to open " << devPath;
+        return -errno;
+    }
+    ScopedFd fd(rawFd);
+
+    uint64_t size;
+    int sectorSize;
+    bool image;
+    if (getGeometry(fd.get(), size, sectorSize, image)) {
+        PLOG(ERROR) << "Failed to query geometry of " << devPath;
+        return -errno;
+    }
+    if (sectorSize < 512 || size < (uint64_t) sectorSize * 2) {
+        return OK;
+    }
+
+    std::vector<uint8_t> mbr;
+    status_t res = readAt(fd.get(), 0, 512, mbr);
+    if (res != OK) {
+        LOG(ERROR) << "Failed to read MBR of " << devPath;
+        return res;
+    }
+
+    uint64_t lastLba = size / sectorSize - 1;
+    if (readGpt(fd.get(), sectorSize, 1, table.partitions)
+            || readGpt(fd.get(), sectorSize, lastLba, table.partitions)) {
+        table.type = PartitionTable::Type::kGpt;
+        return OK;
+    }
+
+    if (mbr[510] == 0x55 && mbr[511] == 0xaa) {
+        table.type = PartitionTable::Type::kMbr;
+        readMbr(fd.get(), sectorSize, mbr, table.partitions);
+    }
+    return OK;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_PARTITION_TABLE_H
+#define ANDROID_VOLD_PARTITION_TABLE_H
+
+#include <utils/Errors.h>
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Single entry from an on-disk partition table. MBR entries only carry
+ * mbrType; GPT entries only carry the two GUIDs, formatted the same way
+ * sgdisk prints them (uppercase, dashed).
+ */
+struct Partition {
+    int number;
+    int mbrType;
+    std::string typeGuid;
+    std::string partGuid;
+    uint64_t firstLba;
+    uint64_t lastLba;
+};
+
+struct PartitionTable {
+    enum class Type {
+        kUnknown,
+        kMbr,
+        kGpt,
+    };
+
+    Type type;
+    std::vector<Partition> partitions;
+};
+
+/*
+ * Reads the partition table directly from the given block device. A GPT
+ * is used when either its primary or backup header validates, otherwise
+ * falls back to MBR (including logical partitions). Media without any
+ * recognizable table is reported as Type::kUnknown and still returns OK.
+ */
+status_t ReadPartitionTable(const std::string& devPath, PartitionTable& table);
+
+/*
+ * One partition of a table about to be written. MBR tables only use
+ * mbrType and active; GPT tables use the GUIDs, in the same text form
+ * Partition carries, and the name. An empty partGuid gets a random one.
+ * A sizeBytes of 0 takes the rest of the disk.
+ */
+struct PartitionSpec {
+    int mbrType;
+    bool active;
+    std::string typeGuid;
+    std::string partGuid;
+    std::string name;
+    uint64_t sizeBytes;
+};
+
+/*
+ * Replaces whatever partition table the device had with a new one of the
+ * given type, built entirely in memory. Each partition starts on a
+ * boundary of alignBytes, or 1MiB if that's larger. Both ends of the disk
+ * are written in one pass each, clearing any stale MBR or GPT, and the
+ * kernel is asked to re-read the table exactly once.
+ */
+status_t WritePartitionTable(const std::string& devPath, PartitionTable::Type type,
+        const std::vector<PartitionSpec>& specs, uint64_t alignBytes);
+
+/* CRC32 as used by GPT headers and entry arrays */
+uint32_t Crc32(const void* buf, size_t len, uint32_t crc = 0);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -16,16 +16,21 @@
 
 #include "fs/Ext4.h"
 #include "fs/F2fs.h"
+#include "EventBatch.h"
+#include "FsProbe.h"
+#include "OperationStats.h"
 #include "PrivateVolume.h"
 #include "EmulatedVolume.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "TrimTask.h"
 #include "cryptfs.h"
 
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
 #include <cutils/fs.h>
+#include <cutils/properties.h>
 #include <private/android_filesystem_config.h>
 
 #include <fcntl.h>
@@ -36,13 +41,28 @@
 #include <sys/wait.h>
 #include <sys/param.h>
 
+#include <mutex>
+#include <set>
+
 using android::base::StringPrintf;
 
 namespace android {
 namespace vold {
 
-PrivateVolume::PrivateVolume(dev_t device, const std::string& keyRaw) :
-        VolumeBase(Type::kPrivate), mRawDevice(device), mKeyRaw(keyRaw) {
+/*
+ * Skips wiping the whole card before formatting, so adoption finishes in
+ * seconds; the free space gets discarded from the first mount instead.
+ */
+static const char* kLazyFormatProp = "persist.vold.lazy_format";
+
+/* Filesystems formatted without a wipe, by UUID, that still need a trim */
+static std::mutex sPendingTrimLock;
+static std::set<std::string> sPendingTrims;
+
+PrivateVolume::PrivateVolume(dev_t device, const std::string& keyRaw, const std::string& cipher,
+        int cryptMediaClass, int cryptSectorSize) :
+        VolumeBase(Type::kPrivate), mRawDevice(device), mKeyRaw(keyRaw), mCipher(cipher),
+        mCryptMediaClass(cryptMediaClass), mCryptSectorSize(cryptSectorSize) {
     setId(StringPrintf("private:%u_%u", major(device), minor(device)));
     mRawDevPath = StringPrintf("/dev/block/vold/%s", getId().c_str());
 }
@@ -52,10 +72,19 @@ PrivateVolume::~PrivateVolume() {
 
 status_t PrivateVolume::readMetadata() {
     status_t res = ReadMetadata(mDmDevPath, mFsType, mFsUuid, mFsLabel);
+    publishMetadata();
+    return res;
+}
+
+void PrivateVolume::publishMetadata() {
+    ScopedEventBatch batch;
     notifyEvent(ResponseCode::VolumeFsTypeChanged, mFsType);
     notifyEvent(ResponseCode::VolumeFsUuidChanged, mFsUuid);
     notifyEvent(ResponseCode::VolumeFsLabelChanged, mFsLabel);
-    return res;
+}
+
+void PrivateVolume::doReplay() {
+    publishMetadata();
 }
 
 status_t PrivateVolume::doCreate() {
@@ -70,8 +99,8 @@ status_t PrivateVolume::doCreate() {
 
     unsigned char* key = (unsigned char*) mKeyRaw.data();
     char crypto_blkdev[MAXPATHLEN];
-    int res = cryptfs_setup_ext_volume(getId().c_str(), mRawDevPath.c_str(),
-            key, mKeyRaw.size(), crypto_blkdev);
+    int res = cryptfs_setup_ext_volume(getId().c_str(), mRawDevPath.c_str(), mCipher.c_str(),
+            key, mKeyRaw.size(), mCryptMediaClass, mCryptSectorSize, crypto_blkdev);
     mDmDevPath = crypto_blkdev;
     if (res != 0) {
         PLOG(ERROR) << getId() << " failed to setup cryptfs";
@@ -82,6 +111,8 @@ status_t PrivateVolume::doCreate() {
 }
 
 status_t PrivateVolume::doDestroy() {
+    // The dm device number is recycled by the next mapping
+    InvalidateMetadata(mDmDevPath);
     if (cryptfs_revert_ext_volume(getId().c_str())) {
         LOG(ERROR) << getId() << " failed to revert cryptfs";
     }
@@ -102,30 +133,47 @@ status_t PrivateVolume::doMount() {
         return -EIO;
     }
 
+    std::string reason;
+    bool needsCheck = NeedsFilesystemCheck(mDmDevPath, mFsType, mFsUuid, reason);
+    LOG(INFO) << getId() << (needsCheck ? " checking filesystem: "
+            : " skipping filesystem check: ") << reason;
+
     if (mFsType == "ext4") {
-        int res = ext4::Check(mDmDevPath, mPath, true);
-        if (res == 0 || res == 1) {
-            LOG(DEBUG) << getId() << " passed filesystem check";
-        } else {
-            PLOG(ERROR) << getId() << " failed filesystem check";
-            return -EIO;
+        if (needsCheck) {
+            OperationTimer timer("fsck", mFsType);
+            int res = ext4::Check(mDmDevPath, mPath, true);
+            timer.setResult(res == 0 || res == 1);
+            if (res == 0 || res == 1) {
+                LOG(DEBUG) << getId() << " passed filesystem check";
+                RecordFilesystemCheck(mFsType, mFsUuid);
+            } else {
+                PLOG(ERROR) << getId() << " failed filesystem check";
+                return -EIO;
+            }
         }
 
-        if (ext4::Mount(mDmDevPath, mPath, false, false, true, "", true)) {
+        if (ext4::Mount(mDmDevPath, mPath, false, false, true, "", true, false,
+                GetMountProfile(mCryptMediaClass, mFsType, true))) {
             PLOG(ERROR) << getId() << " failed to mount";
             return -EIO;
         }
 
     } else if (mFsType == "f2fs") {
-        int res = f2fs::Check(mDmDevPath, true);
-        if (res == 0) {
-            LOG(DEBUG) << getId() << " passed filesystem check";
-        } else {
-            PLOG(ERROR) << getId() << " failed filesystem check";
-            return -EIO;
+        if (needsCheck) {
+            OperationTimer timer("fsck", mFsType);
+            int res = f2fs::Check(mDmDevPath, true);
+            timer.setResult(res == 0);
+            if (res == 0) {
+                LOG(DEBUG) << getId() << " passed filesystem check";
+                RecordFilesystemCheck(mFsType, mFsUuid);
+            } else {
+                PLOG(ERROR) << getId() << " failed filesystem check";
+                return -EIO;
+            }
         }
 
-        if (f2fs::Mount(mDmDevPath, mPath, "", true)) {
+        if (f2fs::Mount(mDmDevPath, mPath, "", true, false,
+                GetMountProfile(mCryptMediaClass, mFsType, true))) {
             PLOG(ERROR) << getId() << " failed to mount";
             return -EIO;
         }
@@ -135,7 +183,17 @@ status_t PrivateVolume::doMount() {
         return -EIO;
     }
 
-    RestoreconRecursive(mPath);
+    RestoreconRecursive(mPath, true);
+
+    {
+        std::lock_guard<std::mutex> lock(sPendingTrimLock);
+        if (sPendingTrims.erase(mFsUuid)) {
+            // Discards pass through dm-crypt via allow_discards, and unlike
+            // wiping the raw device, this leaves the new metadata alone
+            LOG(INFO) << getId() << " starting deferred wipe of free space";
+            (new TrimTask(0, mPath))->start();
+        }
+    }
 
     // Verify that common directories are ready to roll
     if (PrepareDir(mPath + "/app", 0771, AID_SYSTEM, AID_SYSTEM) ||
@@ -183,6 +241,20 @@ status_t PrivateVolume::doFormat(const std::string& fsType) {
         LOG(DEBUG) << "Resolved auto to " << resolvedFsType;
     }
 
+    InvalidateMetadata(mDmDevPath);
+
+    // Wipe the ciphertext underneath the mapping, and the new filesystem
+    // overwrites what it needs. A lazy format leaves free space to be
+    // discarded once mounted.
+    bool lazy = property_get_bool(kLazyFormatProp, true);
+    if (!lazy && WipeBlockDevice(mRawDevPath, [this](int percent) {
+        notifyEvent(ResponseCode::VolumeWipeProgress, StringPrintf("%d", percent));
+    }) != OK) {
+        LOG(WARNING) << getId() << " failed to wipe";
+    }
+
+    // make_ext4fs already leaves inode tables for the kernel's lazyinit
+    // thread and -J skips the journal, so only f2fs needs telling
     if (resolvedFsType == "ext4") {
         // TODO: change reported mountpoint once we have better selinux support
         if (ext4::Format(mDmDevPath, 0, "/data")) {
@@ -190,7 +262,8 @@ status_t PrivateVolume::doFormat(const std::string& fsType) {
             return -EIO;
         }
     } else if (resolvedFsType == "f2fs") {
-        if (f2fs::Format(mDmDevPath)) {
+        // dm-crypt maps sectors one to one, so the raw geometry still holds
+        if (f2fs::Format(mDmDevPath, GetFlashGeometry(mRawDevice), !lazy)) {
             PLOG(ERROR) << getId() << " failed to format";
             return -EIO;
         }
@@ -199,6 +272,14 @@ status_t PrivateVolume::doFormat(const std::string& fsType) {
         return -EINVAL;
     }
 
+    if (lazy) {
+        std::string fsType, fsUuid, fsLabel;
+        if (ReadMetadata(mDmDevPath, fsType, fsUuid, fsLabel) == OK && !fsUuid.empty()) {
+            std::lock_guard<std::mutex> lock(sPendingTrimLock);
+            sPendingTrims.insert(fsUuid);
+        }
+    }
+
     return OK;
 }
 
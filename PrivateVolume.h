@@ -37,7 +37,8 @@ namespace vold {
  */
 class PrivateVolume : public VolumeBase {
 public:
-    PrivateVolume(dev_t device, const std::string& keyRaw);
+    PrivateVolume(dev_t device, const std::string& keyRaw, const std::string& cipher,
+            int cryptMediaClass, int cryptSectorSize);
     virtual ~PrivateVolume();
 
 protected:
@@ -46,8 +47,10 @@ protected:
     status_t doMount() override;
     status_t doUnmount(bool detach = false) override;
     status_t doFormat(const std::string& fsType) override;
+    void doReplay() override;
 
     status_t readMetadata();
+    void publishMetadata();
 
 private:
     /* Kernel device of raw, encrypted partition */
@@ -61,6 +64,12 @@ private:
 
     /* Encryption key as raw bytes */
     std::string mKeyRaw;
+    /* dm-crypt cipher recorded at partition time, or empty for the default */
+    std::string mCipher;
+    /* CRYPT_MEDIA_* class used to tune the dm-crypt mapping */
+    int mCryptMediaClass;
+    /* Crypto sector size recorded at partition time, or 0 for the default */
+    int mCryptSectorSize;
 
     /* Filesystem type */
     std::string mFsType;
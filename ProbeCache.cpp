@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ProbeCache.h"
+#include "Utils.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+using android::base::Trim;
+using android::base::WriteStringToFile;
+
+namespace android {
+namespace vold {
+
+static const char* kCacheDir = "/data/misc/vold";
+static const char* kCachePath = "/data/misc/vold/probe_cache";
+static const char* kCacheTempPath = "/data/misc/vold/probe_cache.tmp";
+static const char* kVolatileCachePath = "/dev/block/vold/.probe_cache";
+static const char* kVolatileCacheTempPath = "/dev/block/vold/.probe_cache.tmp";
+
+static const char* kBootIdPath = "/proc/sys/kernel/random/boot_id";
+
+/* Enough for both sector 0 and the GPT header behind it at 4KiB sectors */
+static const size_t kKeyBytes = 8192;
+/* Beyond this many disks the least recently probed are dropped */
+static const size_t kMaxDisks = 32;
+/* MBR partitions past the primary four live outside the key's sectors */
+static const int kMaxPrimaryNumber = 4;
+
+struct CachedDisk {
+    int64_t time;
+    PartitionTable table;
+};
+
+struct CachedFilesystem {
+    std::string fsType;
+    std::string fsUuid;
+    std::string fsLabel;
+};
+
+static std::mutex sLock;
+static bool sLoaded = false;
+static std::string sBootId;
+static std::map<std::string, CachedDisk> sDisks;
+/* Filesystems by "<disk key>#<partition number>", for the current boot only */
+static std::map<std::string, CachedFilesystem> sFilesystems;
+static std::unordered_map<dev_t, std::string> sRegistered;
+
+static const char* typeName(PartitionTable::Type type) {
+    switch (type) {
+    case PartitionTable::Type::kMbr: return "mbr";
+    case PartitionTable::Type::kGpt: return "gpt";
+    default: return "unknown";
+    }
+}
+
+/* Fields are space separated, so free-form strings are stored as hex */
+static std::string encode(const std::string& str) {
+    std::string hex;
+    if (str.empty() || StrToHex(str, hex) != OK) {
+        return "-";
+    }
+    return hex;
+}
+
+static std::string decode(const std::string& hex) {
+    std::string str;
+    if (hex == "-" || HexToStr(hex, str) != OK) {
+        return "";
+    }
+    return str;
+}
+
+static void loadLocked() {
+    if (sLoaded) return;
+    sLoaded = true;
+
+    std::string bootId;
+    if (ReadFileToString(kBootIdPath, &bootId)) {
+        sBootId = Trim(bootId);
+    }
+
+    std::string raw;
+    if (!ReadFileToString(kCachePath, &raw) && !ReadFileToString(kVolatileCachePath, &raw)) {
+        return;
+    }
+    std::istringstream in(raw);
+    std::string line;
+    bool sameBoot = false;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind, key;
+        if (!(fields >> kind >> key)) continue;
+
+        if (kind == "boot") {
+            sameBoot = !sBootId.empty() && key == sBootId;
+        } else if (kind == "disk") {
+            CachedDisk disk;
+            std::string type;
+            if (!(fields >> disk.time >> type)) continue;
+            disk.table.type = (type == "mbr") ? PartitionTable::Type::kMbr
+                    : (type == "gpt") ? PartitionTable::Type::kGpt
+                    : PartitionTable::Type::kUnknown;
+            sDisks[key] = disk;
+        } else if (kind == "part") {
+            auto it = sDisks.find(key);
+            Partition part;
+            std::string typeGuid, partGuid;
+            if (it == sDisks.end() || !(fields >> part.number >> part.mbrType >> typeGuid
+                    >> partGuid >> part.firstLba >> part.lastLba)) continue;
+            part.typeGuid = decode(typeGuid);
+            part.partGuid = decode(partGuid);
+            it->second.table.partitions.push_back(part);
+        } else if (kind == "fs" && sameBoot) {
+            CachedFilesystem fs;
+            std::string fsType, fsUuid, fsLabel;
+            if (!(fields >> fsType >> fsUuid >> fsLabel)) continue;
+            fs.fsType = decode(fsType);
+            fs.fsUuid = decode(fsUuid);
+            fs.fsLabel = decode(fsLabel);
+            sFilesystems[key] = fs;
+        }
+    }
+    LOG(DEBUG) << "Loaded probe results of " << sDisks.size() << " disks";
+}
+
+static void saveLocked() {
+    std::string raw(StringPrintf("boot %s\n", sBootId.empty() ? "-" : sBootId.c_str()));
+    for (const auto& it : sDisks) {
+        const PartitionTable& table = it.second.table;
+        raw += StringPrintf("disk %s %" PRId64 " %s\n", it.first.c_str(), it.second.time,
+                typeName(table.type));
+        for (const auto& part : table.partitions) {
+            raw += StringPrintf("part %s %d %d %s %s %" PRIu64 " %" PRIu64 "\n",
+                    it.first.c_str(), part.number, part.mbrType,
+                    encode(part.typeGuid).c_str(), encode(part.partGuid).c_str(),
+                    part.firstLba, part.lastLba);
+        }
+    }
+    for (const auto& it : sFilesystems) {
+        raw += StringPrintf("fs %s %s %s %s\n", it.first.c_str(),
+                encode(it.second.fsType).c_str(), encode(it.second.fsUuid).c_str(),
+                encode(it.second.fsLabel).c_str());
+    }
+
+    struct stat sb;
+    bool persistent = !stat(kCacheDir, &sb) && S_ISDIR(sb.st_mode);
+    const char* path = persistent ? kCachePath : kVolatileCachePath;
+    const char* tempPath = persistent ? kCacheTempPath : kVolatileCacheTempPath;
+    if (!WriteStringToFile(raw, tempPath, 0600, 0, 0) || rename(tempPath, path) != 0) {
+        PLOG(WARNING) << "Failed to write " << path;
+        unlink(tempPath);
+        return;
+    }
+    if (persistent) {
+        // Whatever was kept before /data came up has been folded in
+        unlink(kVolatileCachePath);
+    }
+}
+
+std::string GetProbeCacheKey(const std::string& sysPath, const std::string& devPath) {
+    int fd = open(devPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << devPath;
+        return "";
+    }
+    uint64_t size = 0;
+    char buf[kKeyBytes];
+    bool ok = ioctl(fd, BLKGETSIZE64, &size) == 0
+            && TEMP_FAILURE_RETRY(pread(fd, buf, sizeof(buf), 0)) == (ssize_t) sizeof(buf);
+    close(fd);
+    if (!ok) {
+        return "";
+    }
+    return StringPrintf("%s:%" PRIu64 ":%08x", sysPath.c_str(), size, Crc32(buf, sizeof(buf)));
+}
+
+bool LookupCachedPartitions(const std::string& key, PartitionTable& table) {
+    std::lock_guard<std::mutex> lock(sLock);
+    loadLocked();
+    auto it = sDisks.find(key);
+    if (it == sDisks.end()) {
+        return false;
+    }
+    table = it->second.table;
+    return true;
+}
+
+void StoreCachedPartitions(const std::string& key, const PartitionTable& table) {
+    // Media without a table might still grow a backup GPT at its end, and
+    // logical partitions chain through sectors of their own; neither would
+    // change the key, so only tables held entirely within it are kept
+    if (table.type == PartitionTable::Type::kUnknown) return;
+    for (const auto& part : table.partitions) {
+        if (table.type == PartitionTable::Type::kMbr && part.number > kMaxPrimaryNumber) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(sLock);
+    loadLocked();
+    while (sDisks.size() >= kMaxDisks && sDisks.find(key) == sDisks.end()) {
+        auto oldest = sDisks.begin();
+        for (auto it = sDisks.begin(); it != sDisks.end(); ++it) {
+            if (it->second.time < oldest->second.time) oldest = it;
+        }
+        std::string prefix(oldest->first + "#");
+        for (auto it = sFilesystems.begin(); it != sFilesystems.end();) {
+            it = android::base::StartsWith(it->first, prefix.c_str())
+                    ? sFilesystems.erase(it) : std::next(it);
+        }
+        sDisks.erase(oldest);
+    }
+    CachedDisk& disk = sDisks[key];
+    disk.time = time(nullptr);
+    disk.table = table;
+    saveLocked();
+}
+
+void RegisterCachedPartition(dev_t device, const std::string& key, int number) {
+    std::lock_guard<std::mutex> lock(sLock);
+    sRegistered[device] = StringPrintf("%s#%d", key.c_str(), number);
+}
+
+bool LookupCachedFilesystem(dev_t device, std::string& fsType, std::string& fsUuid,
+        std::string& fsLabel) {
+    std::lock_guard<std::mutex> lock(sLock);
+    auto reg = sRegistered.find(device);
+    if (reg == sRegistered.end()) {
+        return false;
+    }
+    loadLocked();
+    auto it = sFilesystems.find(reg->second);
+    if (it == sFilesystems.end()) {
+        return false;
+    }
+    fsType = it->second.fsType;
+    fsUuid = it->second.fsUuid;
+    fsLabel = it->second.fsLabel;
+    return true;
+}
+
+void StoreCachedFilesystem(dev_t device, const std::string& fsType,
+        const std::string& fsUuid, const std::string& fsLabel) {
+    std::lock_guard<std::mutex> lock(sLock);
+    loadLocked();
+    auto reg = sRegistered.find(device);
+    if (reg == sRegistered.end() || sBootId.empty()) {
+        return;
+    }
+    CachedFilesystem& fs = sFilesystems[reg->second];
+    fs.fsType = fsType;
+    fs.fsUuid = fsUuid;
+    fs.fsLabel = fsLabel;
+    saveLocked();
+}
+
+void ForgetCachedFilesystem(dev_t device) {
+    std::lock_guard<std::mutex> lock(sLock);
+    auto reg = sRegistered.find(device);
+    if (reg == sRegistered.end()) {
+        return;
+    }
+    loadLocked();
+    bool changed = sFilesystems.erase(reg->second) > 0;
+    sRegistered.erase(reg);
+    if (changed) {
+        saveLocked();
+    }
+}
+
+}  // namespace vold
+}  // namespace android
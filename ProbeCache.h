@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_PROBE_CACHE_H
+#define ANDROID_VOLD_PROBE_CACHE_H
+
+#include "PartitionTable.h"
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Probe results that outlive vold, so that a restarted vold can bring
+ * unchanged media back without walking partition entries or reading
+ * superblocks again. Kept in /data/misc/vold, or on tmpfs until /data is
+ * available.
+ *
+ * Disks are keyed by sysfs path, size, and a CRC of their first sectors,
+ * which hold the MBR, or the GPT header with its disk GUID and the CRC of
+ * its entries, so repartitioning or swapping the media misses the cache.
+ */
+
+/* Returns the key for the disk, or an empty string if it can't be read */
+std::string GetProbeCacheKey(const std::string& sysPath, const std::string& devPath);
+
+/* Fills table from the cache, returning false on a miss */
+bool LookupCachedPartitions(const std::string& key, PartitionTable& table);
+
+/* Records table for the disk, unless it's one that can't be validated */
+void StoreCachedPartitions(const std::string& key, const PartitionTable& table);
+
+/*
+ * Ties a partition device to its place on the disk, so that probes of its
+ * filesystem are recorded. Filesystems can change without touching the
+ * partition table, so these results only hold for the current boot, where
+ * any change in between was seen through InvalidateMetadata().
+ */
+void RegisterCachedPartition(dev_t device, const std::string& key, int number);
+
+/* Fills in an earlier probe of a registered device, returning false on a miss */
+bool LookupCachedFilesystem(dev_t device, std::string& fsType, std::string& fsUuid,
+        std::string& fsLabel);
+
+void StoreCachedFilesystem(dev_t device, const std::string& fsType,
+        const std::string& fsUuid, const std::string& fsLabel);
+
+/* Drops the device's probe results and its registration */
+void ForgetCachedFilesystem(dev_t device);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
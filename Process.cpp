@@ -25,12 +25,27 @@
 #include <stdlib.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <signal.h>
 
+#include <algorithm>
+#include <mutex>
+
+#include <utils/Timers.h>
+
 #define LOG_TAG "ProcessKiller"
 #include <cutils/log.h>
 
 #include "Process.h"
+#include "WorkerPool.h"
+
+static const size_t kKillScanThreads = 4;
+static const size_t kMapsReadSize = 16 * 1024;
+
+/* Matches the historical 20 polls of 20ms each per signaled process */
+static const int kDefaultKillTimeoutMs = 400;
+static const int kMinBackoffMs = 1;
+static const int kMaxBackoffMs = 100;
 
 int Process::readSymLink(const char *path, char *link, size_t max) {
     struct stat s;
@@ -174,67 +189,313 @@ extern "C" void vold_killProcessesWithOpenFiles(const char *path, int signal) {
 	Process::killProcessesWithOpenFiles(path, signal);
 }
 
-/*
- * Hunt down processes that have files open at the given mount point.
- */
-int Process::killProcessesWithOpenFiles(const char *path, int signal) {
-    int count = 0;
-    DIR* dir;
+bool Process::checkFdsAt(int pidFd, const char* prefix, char* link, size_t max) {
+    int fd = openat(pidFd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return false;
+    }
+
+    bool found = false;
     struct dirent* de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.') continue;
+        ssize_t len = readlinkat(dirfd(dir), de->d_name, link, max - 1);
+        if (len <= 0) continue;
+        link[len] = '\0';
+        if (pathMatchesMountPoint(link, prefix)) {
+            found = true;
+            break;
+        }
+    }
+    closedir(dir);
+    return found;
+}
 
-    if (!(dir = opendir("/proc"))) {
-        SLOGE("opendir failed (%s)", strerror(errno));
-        return count;
+bool Process::checkMapsAt(int pidFd, const char* prefix, std::string& buffer,
+        std::string& heldPath) {
+    int fd = openat(pidFd, "maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // Slurp the whole file into the reused buffer and walk it in place
+    size_t size = 0;
+    while (true) {
+        if (buffer.size() < size + kMapsReadSize) {
+            buffer.resize(size + kMapsReadSize);
+        }
+        ssize_t len = TEMP_FAILURE_RETRY(read(fd, &buffer[size], kMapsReadSize));
+        if (len <= 0) break;
+        size += len;
+    }
+    close(fd);
+
+    const char* cur = buffer.data();
+    const char* end = cur + size;
+    while (cur < end) {
+        const char* eol = static_cast<const char*>(memchr(cur, '\n', end - cur));
+        if (!eol) eol = end;
+        const char* path = static_cast<const char*>(memchr(cur, '/', eol - cur));
+        if (path) {
+            heldPath.assign(path, eol - path);
+            if (pathMatchesMountPoint(heldPath.c_str(), prefix)) {
+                return true;
+            }
+        }
+        cur = eol + 1;
+    }
+    return false;
+}
+
+bool Process::inspect(int procFd, pid_t pid, const char* prefix, std::string& buffer,
+        Info& info) {
+    char name[32];
+    char link[PATH_MAX];
+    struct stat sb;
+
+    snprintf(name, sizeof(name), "%d", pid);
+    int pidFd = openat(procFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pidFd < 0) {
+        return false;
+    }
+    if (fstat(pidFd, &sb) != 0) {
+        close(pidFd);
+        return false;
+    }
+
+    info.pid = pid;
+    info.uid = sb.st_uid;
+    info.mntNamespace = (fstatat(pidFd, "ns/mnt", &sb, 0) == 0) ? sb.st_ino : 0;
+    info.holds = Holds::kNone;
+    info.name.clear();
+    info.heldPath.clear();
+
+    if (prefix == NULL) {
+        close(pidFd);
+        return true;
+    }
+
+    if (checkFdsAt(pidFd, prefix, link, sizeof(link))) {
+        info.holds = Holds::kOpenFile;
+        info.heldPath = link;
+    } else if (checkMapsAt(pidFd, prefix, buffer, info.heldPath)) {
+        info.holds = Holds::kFileMap;
+    } else {
+        static const struct {
+            const char* name;
+            Holds holds;
+        } kLinks[] = {
+            { "cwd", Holds::kCwd },
+            { "root", Holds::kRoot },
+            { "exe", Holds::kExe },
+        };
+        for (const auto& l : kLinks) {
+            ssize_t len = readlinkat(pidFd, l.name, link, sizeof(link) - 1);
+            if (len <= 0) continue;
+            link[len] = '\0';
+            if (pathMatchesMountPoint(link, prefix)) {
+                info.holds = l.holds;
+                info.heldPath = link;
+                break;
+            }
+        }
     }
 
+    if (info.holds != Holds::kNone) {
+        int fd = openat(pidFd, "cmdline", O_RDONLY | O_CLOEXEC);
+        ssize_t len = (fd < 0) ? -1 : TEMP_FAILURE_RETRY(read(fd, link, sizeof(link) - 1));
+        if (len > 0) {
+            link[len] = '\0';
+            info.name = link;
+        } else {
+            info.name = "???";
+        }
+        if (fd >= 0) close(fd);
+    }
+    close(pidFd);
+    return info.holds != Holds::kNone;
+}
+
+int Process::scan(std::vector<Info>& processes, const char* prefix, size_t threads,
+        const char* procRoot) {
+    processes.clear();
+
+    int procFd = open(procRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procFd < 0) {
+        SLOGE("open %s failed (%s)", procRoot, strerror(errno));
+        return -1;
+    }
+    DIR* dir = fdopendir(dup(procFd));
+    if (!dir) {
+        SLOGE("opendir failed (%s)", strerror(errno));
+        close(procFd);
+        return -1;
+    }
+    std::vector<pid_t> pids;
+    struct dirent* de;
     while ((de = readdir(dir))) {
         int pid = getPid(de->d_name);
-        char name[PATH_MAX];
+        if (pid > 0) {
+            pids.push_back(pid);
+        }
+    }
+    closedir(dir);
 
-        if (pid == -1)
-            continue;
-        getProcessName(pid, name, sizeof(name));
+    if (threads <= 1 || pids.size() < threads) {
+        std::string buffer;
+        Info info;
+        for (pid_t pid : pids) {
+            if (inspect(procFd, pid, prefix, buffer, info)) {
+                processes.push_back(info);
+            }
+        }
+    } else {
+        std::mutex lock;
+        size_t shard = (pids.size() + threads - 1) / threads;
+        android::vold::WorkerPool pool(threads);
+        for (size_t start = 0; start < pids.size(); start += shard) {
+            size_t end = std::min(start + shard, pids.size());
+            pool.enqueue([&, start, end] {
+                std::string buffer;
+                std::vector<Info> found;
+                Info info;
+                for (size_t i = start; i < end; i++) {
+                    if (inspect(procFd, pids[i], prefix, buffer, info)) {
+                        found.push_back(info);
+                    }
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                processes.insert(processes.end(), found.begin(), found.end());
+            });
+        }
+        pool.wait();
+    }
+
+    close(procFd);
+    return 0;
+}
+
+int Process::waitForExit(std::vector<pid_t> pids, int timeoutMs) {
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC)
+            + milliseconds_to_nanoseconds(timeoutMs);
+
+#ifdef __NR_pidfd_open
+    // Prefer sleeping in poll() until the kernel tells us each pid is gone
+    std::vector<struct pollfd> fds;
+    bool supported = true;
+    for (pid_t pid : pids) {
+        int fd = syscall(__NR_pidfd_open, pid, 0);
+        if (fd >= 0) {
+            fds.push_back({ fd, POLLIN, 0 });
+        } else if (errno != ESRCH) {
+            supported = false;
+            break;
+        }
+    }
+    if (supported) {
+        while (!fds.empty()) {
+            nsecs_t remaining = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (remaining <= 0) break;
+            int res = poll(fds.data(), fds.size(), ns2ms(remaining) + 1);
+            if (res < 0 && errno != EINTR) break;
+            for (auto it = fds.begin(); it != fds.end();) {
+                if (it->revents) {
+                    close(it->fd);
+                    it = fds.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (const auto& pfd : fds) {
+            close(pfd.fd);
+        }
+        return fds.size();
+    }
+    for (const auto& pfd : fds) {
+        close(pfd.fd);
+    }
+#endif
+
+    // Otherwise probe with a bounded exponential backoff
+    int backoffMs = kMinBackoffMs;
+    while (true) {
+        pids.erase(std::remove_if(pids.begin(), pids.end(), [](pid_t pid) {
+            return kill(pid, 0) == -1 && errno == ESRCH;
+        }), pids.end());
+
+        nsecs_t remaining = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        if (pids.empty() || remaining <= 0) break;
+        usleep(std::min(milliseconds_to_nanoseconds(backoffMs), remaining) / 1000);
+        backoffMs = std::min(backoffMs * 2, kMaxBackoffMs);
+    }
+    return pids.size();
+}
+
+int Process::killProcessesWithOpenFiles(const char *path, int signal) {
+    return killProcessesWithOpenFiles(path, signal, kDefaultKillTimeoutMs);
+}
+
+/*
+ * Hunt down processes that have files open at the given mount point.
+ */
+int Process::killProcessesWithOpenFiles(const char *path, int signal, int timeoutMs) {
+    int count = 0;
+    std::vector<Info> processes;
+    std::vector<pid_t> signaled;
+
+    if (scan(processes, path, kKillScanThreads) != 0) {
+        return count;
+    }
 
-        char openfile[PATH_MAX];
+    for (const auto& info : processes) {
+        int pid = info.pid;
+        const char* name = info.name.c_str();
 
-        if (checkFileDescriptorSymLinks(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open file %s", name, pid, openfile);
-        } else if (checkFileMaps(pid, path, openfile, sizeof(openfile))) {
-            SLOGE("Process %s (%d) has open filemap for %s", name, pid, openfile);
-        } else if (checkSymLink(pid, path, "cwd")) {
+        switch (info.holds) {
+        case Holds::kOpenFile:
+            SLOGE("Process %s (%d) has open file %s", name, pid, info.heldPath.c_str());
+            break;
+        case Holds::kFileMap:
+            SLOGE("Process %s (%d) has open filemap for %s", name, pid, info.heldPath.c_str());
+            break;
+        case Holds::kCwd:
             SLOGE("Process %s (%d) has cwd within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "root")) {
+            break;
+        case Holds::kRoot:
             SLOGE("Process %s (%d) has chroot within %s", name, pid, path);
-        } else if (checkSymLink(pid, path, "exe")) {
+            break;
+        case Holds::kExe:
             SLOGE("Process %s (%d) has executable path within %s", name, pid, path);
-        } else {
+            break;
+        case Holds::kNone:
             continue;
         }
 
         if (signal != 0) {
             SLOGW("Sending %s to process %d", strsignal(signal), pid);
-            int ret = kill(pid, signal);
-            if (ret) {//send signal failed
-                    count++;
-            } else {//send signal success, wait finish
-                    char pidname[PATH_MAX];
-                    int  cnt=0;
-                    sprintf(pidname, "/proc/%d", pid);
-#define RETRY_COUNT 20
-                    //check if pid exist by opendir
-                    while(opendir(pidname) && cnt < RETRY_COUNT) {
-                        usleep(20000);
-                        cnt++;
-                    };
-                    if (cnt >= RETRY_COUNT) {
-                        count++;
-                        SLOGW("%d failed to kill",pid);
-                    } else {
-                        SLOGW("%d kill successfully", pid);
-                    }
+            if (kill(pid, signal)) {
+                count++;
+            } else {
+                signaled.push_back(pid);
             }
         }
     }
-    closedir(dir);
+
+    if (!signaled.empty()) {
+        int remaining = waitForExit(signaled, timeoutMs);
+        if (remaining > 0) {
+            SLOGW("%d of %zu processes still running after %s", remaining,
+                    signaled.size(), strsignal(signal));
+        } else {
+            SLOGW("All %zu processes exited after %s", signaled.size(), strsignal(signal));
+        }
+        count += remaining;
+    }
     return count;
 }
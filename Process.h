@@ -19,9 +19,54 @@
 
 #ifdef __cplusplus
 
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
 class Process {
 public:
+    /* What ties a process to the prefix passed to scan() */
+    enum class Holds {
+        kNone,
+        kOpenFile,
+        kFileMap,
+        kCwd,
+        kRoot,
+        kExe,
+    };
+
+    struct Info {
+        pid_t pid;
+        uid_t uid;
+        /* Inode of /proc/<pid>/ns/mnt, equal for processes sharing a namespace */
+        ino_t mntNamespace;
+        /* Only filled in when the process holds something under the prefix */
+        std::string name;
+        Holds holds;
+        std::string heldPath;
+    };
+
+    /*
+     * Takes a snapshot of running processes in a single pass over /proc.
+     * When prefix is non-NULL, only processes holding an open file, file
+     * mapping, cwd, root or executable under it are returned. With more
+     * than one thread, pids are inspected in parallel. A procRoot other
+     * than /proc scans a synthetic tree laid out the same way.
+     */
+    static int scan(std::vector<Info>& processes, const char* prefix = NULL,
+            size_t threads = 1, const char* procRoot = "/proc");
+
+    /*
+     * Signals every process holding something under path, then waits up
+     * to timeoutMs for them to exit. Returns how many could not be
+     * signaled or are still alive when the wait ends.
+     */
+    static int killProcessesWithOpenFiles(const char *path, int signal, int timeoutMs);
     static int killProcessesWithOpenFiles(const char *path, int signal);
+
+    /* Waits up to timeoutMs for pids to exit, returning how many are left */
+    static int waitForExit(std::vector<pid_t> pids, int timeoutMs);
     static int getPid(const char *s);
     static int checkSymLink(int pid, const char *path, const char *name);
     static int checkFileMaps(int pid, const char *path);
@@ -30,6 +75,11 @@ public:
     static int checkFileDescriptorSymLinks(int pid, const char *mountPoint, char *openFilename, size_t max);
     static void getProcessName(int pid, char *buffer, size_t max);
 private:
+    static bool inspect(int procFd, pid_t pid, const char* prefix, std::string& buffer,
+            Info& info);
+    static bool checkFdsAt(int pidFd, const char* prefix, char* link, size_t max);
+    static bool checkMapsAt(int pidFd, const char* prefix, std::string& buffer,
+            std::string& heldPath);
     static int readSymLink(const char *path, char *link, size_t max);
     static int pathMatchesMountPoint(const char *path, const char *mountPoint);
 };
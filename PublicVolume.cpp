@@ -19,16 +19,22 @@
 #include "fs/F2fs.h"
 #include "fs/Iso9660.h"
 #include "fs/Ntfs.h"
+#include "fs/Sdcardfs.h"
 #include "fs/Vfat.h"
+#include "EventBatch.h"
+#include "FsProbe.h"
+#include "OperationStats.h"
 #include "PublicVolume.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
+#include "cryptfs.h"
 
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
 #include <cutils/fs.h>
 #include <private/android_filesystem_config.h>
+#include <utils/Trace.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
@@ -54,29 +60,116 @@ PublicVolume::PublicVolume(dev_t device, const std::string& nickname,
                 const std::string& fstype /* = "" */,
                 const std::string& mntopts /* = "" */) :
         VolumeBase(Type::kPublic), mDevice(device), mFusePid(0),
-        mFsType(fstype), mFsLabel(nickname), mMntOpts(mntopts) {
+        mFsType(fstype), mFsLabel(nickname), mMntOpts(mntopts),
+        mMediaClass(CRYPT_MEDIA_INTERNAL) {
     setId(StringPrintf("public:%u_%u", major(device), minor(device)));
     mDevPath = StringPrintf("/dev/block/vold/%s", getId().c_str());
 }
 
 PublicVolume::~PublicVolume() {
+    cancelPrecheck();
 }
 
 status_t PublicVolume::readMetadata() {
     status_t res = ReadMetadataUntrusted(mDevPath, mFsType, mFsUuid, mFsLabel);
+    publishMetadata();
+    return res;
+}
 
+void PublicVolume::publishMetadata() {
     // iso9660 has no UUID, we use label as UUID
     if ((mFsType == "iso9660" || mFsType == "udf") && mFsUuid.empty() && !mFsLabel.empty()) {
         std::replace(mFsLabel.begin(), mFsLabel.end(), ' ', '_');
         mFsUuid = mFsLabel;
     }
 
+    ScopedEventBatch batch;
     notifyEvent(ResponseCode::VolumeFsTypeChanged, mFsType);
     notifyEvent(ResponseCode::VolumeFsUuidChanged, mFsUuid);
     notifyEvent(ResponseCode::VolumeFsLabelChanged, mFsLabel);
+}
+
+void PublicVolume::doReplay() {
+    publishMetadata();
+}
+
+bool PublicVolume::isMountAlive() {
+    if (mFusePid > 0 && !IsChildRunning(mFusePid)) {
+        mFusePid = 0;
+        return false;
+    }
+    return true;
+}
+
+int PublicVolume::checkFilesystem(const std::string& fsType, const std::string& devPath,
+        const std::string& target) {
+    OperationTimer timer("fsck", fsType);
+    int res = 0;
+    if (fsType == "exfat") {
+        res = exfat::Check(devPath);
+    } else if (fsType == "ext4") {
+        res = ext4::Check(devPath, target, false);
+    } else if (fsType == "f2fs") {
+        res = f2fs::Check(devPath, false);
+    } else if (fsType == "ntfs") {
+        res = ntfs::Check(devPath);
+    } else if (fsType == "vfat") {
+        res = vfat::Check(devPath);
+    }
+    timer.setResult(res == 0);
     return res;
 }
 
+/*
+ * Probes and checks the filesystem on the shared disk pool as soon as
+ * the volume appears, so that cards inserted together are checked in
+ * parallel instead of one by one as the framework mounts them. Events
+ * are still sent from doMount(), in the usual order.
+ */
+void PublicVolume::startPrecheck() {
+    auto promise = std::make_shared<std::promise<Precheck>>();
+    mPrecheck = promise->get_future();
+
+    std::string devPath(mDevPath);
+    std::string fsType(mFsType);
+    std::string fsLabel(mFsLabel);
+    std::string id(getId());
+    VolumeManager::Instance()->queueDiskTask(getDiskId(),
+            [promise, devPath, fsType, fsLabel, id] {
+        Precheck result;
+        result.fsType = fsType;
+        result.fsLabel = fsLabel;
+        result.checked = false;
+        result.checkResult = 0;
+        ReadMetadataUntrusted(devPath, result.fsType, result.fsUuid, result.fsLabel);
+
+        // ext4 needs its final mount point to check, so it's left for doMount()
+        const std::string& type = result.fsType;
+        if (type == "exfat" || type == "f2fs" || type == "ntfs" || type == "vfat") {
+            std::string reason;
+            if (NeedsFilesystemCheck(devPath, type, result.fsUuid, reason)) {
+                LOG(INFO) << id << " checking " << type << " in background: " << reason;
+                result.checkResult = checkFilesystem(type, devPath, "");
+                if (result.checkResult == 0) {
+                    RecordFilesystemCheck(type, result.fsUuid);
+                }
+            } else {
+                LOG(INFO) << id << " skipping " << type << " check: " << reason;
+            }
+            result.checked = true;
+        }
+        promise->set_value(result);
+    });
+}
+
+void PublicVolume::cancelPrecheck() {
+    // The device node must outlive any background check using it
+    if (mPrecheck.valid()) {
+        mPrecheck.wait();
+        mPrecheck = std::future<Precheck>();
+    }
+}
+
 status_t PublicVolume::initAsecStage() {
     std::string legacyPath(mRawPath + "/android_secure");
     std::string securePath(mRawPath + "/.android_secure");
@@ -105,16 +198,36 @@ status_t PublicVolume::doCreate() {
     if (mFsLabel.size() > 0) {
         notifyEvent(ResponseCode::VolumeFsLabelChanged, mFsLabel);
     }
-    return CreateDeviceNode(mDevPath, mDevice);
+    status_t res = CreateDeviceNode(mDevPath, mDevice);
+    // Silent volumes are about to be formatted, so don't bother
+    if (res == OK && !getSilent()) {
+        startPrecheck();
+    }
+    return res;
 }
 
 status_t PublicVolume::doDestroy() {
+    cancelPrecheck();
+    InvalidateMetadata(mDevice);
     return DestroyDeviceNode(mDevPath);
 }
 
 status_t PublicVolume::doMount() {
+    ATRACE_NAME("PublicVolume::doMount");
     // TODO: expand to support mounting other filesystems
-    readMetadata();
+    bool checked = false;
+    int ret = 0;
+    if (mPrecheck.valid()) {
+        Precheck precheck = mPrecheck.get();
+        mFsType = precheck.fsType;
+        mFsUuid = precheck.fsUuid;
+        mFsLabel = precheck.fsLabel;
+        publishMetadata();
+        checked = precheck.checked;
+        ret = precheck.checkResult;
+    } else {
+        readMetadata();
+    }
 
     if (!IsFilesystemSupported(mFsType)) {
         LOG(ERROR) << getId() << " unsupported filesystem " << mFsType;
@@ -153,17 +266,20 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
-    int ret = 0;
-    if (mFsType == "exfat") {
-        ret = exfat::Check(mDevPath);
-    } else if (mFsType == "ext4") {
-        ret = ext4::Check(mDevPath, mRawPath, false);
-    } else if (mFsType == "f2fs") {
-        ret = f2fs::Check(mDevPath, false);
-    } else if (mFsType == "ntfs") {
-        ret = ntfs::Check(mDevPath);
-    } else if (mFsType == "vfat") {
-        ret = vfat::Check(mDevPath);
+    std::string reason;
+    if (checked) {
+        // Already checked in the background, ret holds the result
+    } else if (mFsType == "ext4" || mFsType == "exfat" || mFsType == "f2fs"
+            || mFsType == "ntfs" || mFsType == "vfat") {
+        if (NeedsFilesystemCheck(mDevPath, mFsType, mFsUuid, reason)) {
+            LOG(INFO) << getId() << " checking filesystem: " << reason;
+            ret = checkFilesystem(mFsType, mDevPath, mRawPath);
+            if (ret == 0) {
+                RecordFilesystemCheck(mFsType, mFsUuid);
+            }
+        } else {
+            LOG(INFO) << getId() << " skipping filesystem check: " << reason;
+        }
     } else if (mFsType != "iso9660" && mFsType != "udf") {
         LOG(WARNING) << getId() << " unsupported filesystem check, skipping";
     }
@@ -172,14 +288,15 @@ status_t PublicVolume::doMount() {
         return -EIO;
     }
 
+    MountProfile profile(GetMountProfile(mMediaClass, mFsType, false));
     if (mFsType == "exfat") {
         ret = exfat::Mount(mDevPath, mRawPath, false, false, false,
                 AID_MEDIA_RW, AID_MEDIA_RW, 0007);
     } else if (mFsType == "ext4") {
         ret = ext4::Mount(mDevPath, mRawPath, false, false, true, mMntOpts,
-                false, true);
+                false, true, profile);
     } else if (mFsType == "f2fs") {
-        ret = f2fs::Mount(mDevPath, mRawPath, mMntOpts, false, true);
+        ret = f2fs::Mount(mDevPath, mRawPath, mMntOpts, false, true, profile);
     } else if (mFsType == "iso9660" || mFsType == "udf") {
         ret = iso9660::Mount(mDevPath, mRawPath,
                 AID_MEDIA_RW, AID_MEDIA_RW, mFsType.c_str());
@@ -188,7 +305,7 @@ status_t PublicVolume::doMount() {
                 AID_MEDIA_RW, AID_MEDIA_RW, 0007, true);
     } else if (mFsType == "vfat") {
         ret = vfat::Mount(mDevPath, mRawPath, false, false, false,
-                AID_MEDIA_RW, AID_MEDIA_RW, 0007, true);
+                AID_MEDIA_RW, AID_MEDIA_RW, 0007, true, profile);
     } else {
         ret = ::mount(mDevPath.c_str(), mRawPath.c_str(), mFsType.c_str(), 0, NULL);
     }
@@ -219,44 +336,64 @@ status_t PublicVolume::doMount() {
         return -errno;
     }
 
-    dev_t before = GetDevice(mFuseFull);
-
-    if (!(mFusePid = fork())) {
-        if (getMountFlags() & MountFlags::kPrimary) {
-            if (execl(kFusePath, kFusePath,
-                    "-u", "1023", // AID_MEDIA_RW
-                    "-g", "1023", // AID_MEDIA_RW
-                    "-U", std::to_string(getMountUserId()).c_str(),
-                    "-w",
-                    mRawPath.c_str(),
-                    stableName.c_str(),
-                    NULL)) {
-                PLOG(ERROR) << "Failed to exec";
-            }
-        } else {
-            if (execl(kFusePath, kFusePath,
-                    "-u", "1023", // AID_MEDIA_RW
-                    "-g", "1023", // AID_MEDIA_RW
-                    "-U", std::to_string(getMountUserId()).c_str(),
-                    mRawPath.c_str(),
-                    stableName.c_str(),
-                    NULL)) {
-                PLOG(ERROR) << "Failed to exec";
+    if (sdcardfs::IsSupported() && sdcardfs::MountViews(mRawPath, mFuseDefault, mFuseRead,
+            mFuseWrite, mFuseFull, getMountUserId(), false,
+            getMountFlags() & MountFlags::kPrimary) == OK) {
+        LOG(INFO) << getId() << " serving " << mRawPath << " through sdcardfs";
+        return OK;
+    }
+    LOG(INFO) << getId() << " serving " << mRawPath << " through FUSE";
+
+    status_t res;
+    {
+        ATRACE_NAME("PublicVolume fuse startup");
+        std::vector<std::string> fusePaths = { mFuseDefault, mFuseRead, mFuseWrite, mFuseFull };
+        std::vector<dev_t> before;
+        for (auto& path : fusePaths) {
+            before.push_back(GetDevice(path));
+        }
+
+        if (!(mFusePid = fork())) {
+            if (getMountFlags() & MountFlags::kPrimary) {
+                if (execl(kFusePath, kFusePath,
+                        "-u", "1023", // AID_MEDIA_RW
+                        "-g", "1023", // AID_MEDIA_RW
+                        "-U", std::to_string(getMountUserId()).c_str(),
+                        "-w",
+                        mRawPath.c_str(),
+                        stableName.c_str(),
+                        NULL)) {
+                    PLOG(ERROR) << "Failed to exec";
+                }
+            } else {
+                if (execl(kFusePath, kFusePath,
+                        "-u", "1023", // AID_MEDIA_RW
+                        "-g", "1023", // AID_MEDIA_RW
+                        "-U", std::to_string(getMountUserId()).c_str(),
+                        mRawPath.c_str(),
+                        stableName.c_str(),
+                        NULL)) {
+                    PLOG(ERROR) << "Failed to exec";
+                }
             }
+
+            LOG(ERROR) << "FUSE exiting";
+            _exit(1);
         }
 
-        LOG(ERROR) << "FUSE exiting";
-        _exit(1);
-    }
+        if (mFusePid == -1) {
+            PLOG(ERROR) << getId() << " failed to fork";
+            return -errno;
+        }
 
-    if (mFusePid == -1) {
-        PLOG(ERROR) << getId() << " failed to fork";
-        return -errno;
+        res = WaitForMounts(mFusePid, fusePaths, before, GetFuseTimeoutMs());
     }
-
-    while (before == GetDevice(mFuseFull)) {
-        LOG(VERBOSE) << "Waiting for FUSE to spin up...";
-        usleep(50000); // 50ms
+    if (res != OK) {
+        // Daemon is already reaped; tear down whatever it left behind
+        LOG(ERROR) << getId() << " FUSE failed to spin up";
+        mFusePid = 0;
+        doUnmount();
+        return res;
     }
 
     return OK;
@@ -268,37 +405,60 @@ status_t PublicVolume::doUnmount(bool detach /* = false */) {
     // ENOTCONN until the unmount completes. This is an exotic and unusual
     // error code and might cause broken behaviour in applications.
     KillProcessesUsingPath(getPath());
+    stopFuse();
+
+    ForceUnmount(mRawPath, detach);
+    rmdir(mRawPath.c_str());
+    mRawPath.clear();
+
+    return OK;
+}
 
+/* Takes down everything apps reach the volume through, but not the raw mount */
+void PublicVolume::stopFuse() {
 #ifndef MINIVOLD
-    ForceUnmount(kAsecPath);
+    if (!mFuseDefault.empty()) {
+        ForceUnmount(kAsecPath);
 
-    ForceUnmount(mFuseDefault);
-    ForceUnmount(mFuseRead);
-    ForceUnmount(mFuseWrite);
-    ForceUnmount(mFuseFull);
+        ForceUnmount(mFuseDefault);
+        ForceUnmount(mFuseRead);
+        ForceUnmount(mFuseWrite);
+        ForceUnmount(mFuseFull);
+    }
 #endif
 
-    ForceUnmount(mRawPath, detach);
-
     if (mFusePid > 0) {
         kill(mFusePid, SIGTERM);
         TEMP_FAILURE_RETRY(waitpid(mFusePid, nullptr, 0));
         mFusePid = 0;
     }
 
-    rmdir(mFuseDefault.c_str());
-    rmdir(mFuseRead.c_str());
-    rmdir(mFuseWrite.c_str());
-    rmdir(mFuseFull.c_str());
-    rmdir(mRawPath.c_str());
+    if (!mFuseDefault.empty()) {
+        rmdir(mFuseDefault.c_str());
+        rmdir(mFuseRead.c_str());
+        rmdir(mFuseWrite.c_str());
+        rmdir(mFuseFull.c_str());
+    }
 
     mFuseDefault.clear();
     mFuseRead.clear();
     mFuseWrite.clear();
     mFuseFull.clear();
-    mRawPath.clear();
+}
 
-    return OK;
+status_t PublicVolume::doHide(bool mounted) {
+    // Nothing to copy from unless the raw filesystem is already up
+    if (!mounted) {
+        return -EOPNOTSUPP;
+    }
+    KillProcessesUsingPath(getPath());
+    stopFuse();
+    return setInternalPath(mRawPath);
+}
+
+status_t PublicVolume::doUnhide() {
+    // The framework remounts from scratch, so drop the raw mount too
+    return doUnmount();
 }
 
 status_t PublicVolume::doFormat(const std::string& fsType) {
@@ -309,23 +469,29 @@ status_t PublicVolume::doFormat(const std::string& fsType) {
         return -EINVAL;
     }
 
-    if (WipeBlockDevice(mDevPath) != OK) {
+    cancelPrecheck();
+    InvalidateMetadata(mDevice);
+
+    if (WipeBlockDevice(mDevPath, [this](int percent) {
+        notifyEvent(ResponseCode::VolumeWipeProgress, StringPrintf("%d", percent));
+    }) != OK) {
         LOG(WARNING) << getId() << " failed to wipe";
     }
 
+    FlashGeometry geometry(GetFlashGeometry(mDevice));
     int ret = 0;
     if (fsType == "auto") {
-        ret = vfat::Format(mDevPath, 0);
+        ret = vfat::Format(mDevPath, 0, geometry);
     } else if (fsType == "exfat") {
         ret = exfat::Format(mDevPath);
     } else if (fsType == "ext4") {
         ret = ext4::Format(mDevPath, 0, mRawPath);
     } else if (fsType == "f2fs") {
-        ret = f2fs::Format(mDevPath);
+        ret = f2fs::Format(mDevPath, geometry);
     } else if (fsType == "ntfs") {
         ret = ntfs::Format(mDevPath, 0);
     } else if (fsType == "vfat") {
-        ret = vfat::Format(mDevPath, 0);
+        ret = vfat::Format(mDevPath, 0, geometry);
     } else {
         LOG(ERROR) << getId() << " unrecognized filesystem " << fsType;
         ret = -1;
@@ -21,6 +21,8 @@
 
 #include <cutils/multiuser.h>
 
+#include <future>
+
 namespace android {
 namespace vold {
 
@@ -43,17 +45,41 @@ public:
                     const std::string& mntopts = "", const std::string& fstype = "");
     virtual ~PublicVolume();
 
+    /* CRYPT_MEDIA_* class of the disk, which picks the mount profile */
+    void setMediaClass(int mediaClass) { mMediaClass = mediaClass; }
+
 protected:
     status_t doCreate() override;
     status_t doDestroy() override;
     status_t doMount() override;
     status_t doUnmount(bool detach = false) override;
     status_t doFormat(const std::string& fsType) override;
+    status_t doHide(bool mounted) override;
+    status_t doUnhide() override;
+    void doReplay() override;
+    bool isMountAlive() override;
 
     status_t readMetadata();
+    void publishMetadata();
     status_t initAsecStage();
 
 private:
+    /* Outcome of probing and checking the filesystem in the background */
+    struct Precheck {
+        std::string fsType;
+        std::string fsUuid;
+        std::string fsLabel;
+        bool checked;
+        int checkResult;
+    };
+
+    void startPrecheck();
+    void cancelPrecheck();
+    /* ext4 is checked at its mount point, so it needs target */
+    static int checkFilesystem(const std::string& fsType, const std::string& devPath,
+            const std::string& target);
+    void stopFuse();
+
     /* Kernel device representing partition */
     dev_t mDevice;
     /* Block device path */
@@ -77,6 +103,11 @@ private:
     std::string mFsLabel;
     /* Mount options */
     std::string mMntOpts;
+    /* CRYPT_MEDIA_* class of the underlying disk */
+    int mMediaClass;
+
+    /* Pending background probe and check, consumed by the next mount */
+    std::future<Precheck> mPrecheck;
 
     DISALLOW_COPY_AND_ASSIGN(PublicVolume);
 };
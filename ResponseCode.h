@@ -80,11 +80,20 @@ public:
     static const int VolumeFsLabelChanged = 654;
     static const int VolumePathChanged = 655;
     static const int VolumeInternalPathChanged = 656;
+    static const int VolumeWipeProgress = 657;
     static const int VolumeDestroyed = 659;
 
     static const int MoveStatus = 660;
     static const int BenchmarkResult = 661;
     static const int TrimResult = 662;
+    static const int BenchmarkLatency = 663;
+    static const int BenchmarkVerdict = 664;
+    static const int GcResult = 665;
+    static const int TrimDecision = 666;
+    static const int StorageWear = 667;
+    static const int TrimRate = 668;
+
+    static const int EncryptionProgress = 670;
 
     static int convertFromErrno();
 };
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Scrypt.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <utils/Trace.h>
+
+/* Vector lanes are available to the compiler on these targets */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__SSE2__)
+#define SCRYPT_HAVE_SIMD 1
+#else
+#define SCRYPT_HAVE_SIMD 0
+#endif
+
+namespace {
+
+/* Concurrent ROMix lanes are limited so their scratch fits in this much */
+constexpr uint64_t kMaxParallelBytes = 256 * 1024 * 1024;
+
+/* Blocks are 16 words; BlockMix works on 2r of them */
+constexpr size_t kBlockWords = 16;
+
+inline uint32_t le32dec(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+inline void le32enc(uint8_t* p, uint32_t x) {
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+inline uint32_t rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+void blkxor(uint32_t* dest, const uint32_t* src, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        dest[i] ^= src[i];
+    }
+}
+
+/* Reference Salsa20/8 over a block in natural word order */
+void salsa20_8(uint32_t B[kBlockWords]) {
+    uint32_t x[kBlockWords];
+    memcpy(x, B, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        x[4] ^= rotl(x[0] + x[12], 7);   x[8] ^= rotl(x[4] + x[0], 9);
+        x[12] ^= rotl(x[8] + x[4], 13);  x[0] ^= rotl(x[12] + x[8], 18);
+        x[9] ^= rotl(x[5] + x[1], 7);    x[13] ^= rotl(x[9] + x[5], 9);
+        x[1] ^= rotl(x[13] + x[9], 13);  x[5] ^= rotl(x[1] + x[13], 18);
+        x[14] ^= rotl(x[10] + x[6], 7);  x[2] ^= rotl(x[14] + x[10], 9);
+        x[6] ^= rotl(x[2] + x[14], 13);  x[10] ^= rotl(x[6] + x[2], 18);
+        x[3] ^= rotl(x[15] + x[11], 7);  x[7] ^= rotl(x[3] + x[15], 9);
+        x[11] ^= rotl(x[7] + x[3], 13);  x[15] ^= rotl(x[11] + x[7], 18);
+
+        x[1] ^= rotl(x[0] + x[3], 7);    x[2] ^= rotl(x[1] + x[0], 9);
+        x[3] ^= rotl(x[2] + x[1], 13);   x[0] ^= rotl(x[3] + x[2], 18);
+        x[6] ^= rotl(x[5] + x[4], 7);    x[7] ^= rotl(x[6] + x[5], 9);
+        x[4] ^= rotl(x[7] + x[6], 13);   x[5] ^= rotl(x[4] + x[7], 18);
+        x[11] ^= rotl(x[10] + x[9], 7);  x[8] ^= rotl(x[11] + x[10], 9);
+        x[9] ^= rotl(x[8] + x[11], 13);  x[10] ^= rotl(x[9] + x[8], 18);
+        x[12] ^= rotl(x[15] + x[14], 7); x[13] ^= rotl(x[12] + x[15], 9);
+        x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+    }
+    for (size_t i = 0; i < kBlockWords; i++) {
+        B[i] += x[i];
+    }
+}
+
+void blockmix_salsa8(const uint32_t* in, uint32_t* out, uint32_t r) {
+    uint32_t X[kBlockWords];
+    memcpy(X, &in[(2 * r - 1) * kBlockWords], sizeof(X));
+    for (size_t i = 0; i < 2 * r; i++) {
+        blkxor(X, &in[i * kBlockWords], kBlockWords);
+        salsa20_8(X);
+        // Even blocks go to the first half of the output, odd to the second
+        memcpy(&out[((i / 2) + (i & 1) * r) * kBlockWords], X, sizeof(X));
+    }
+}
+
+#if SCRYPT_HAVE_SIMD
+typedef uint32_t v4u __attribute__((vector_size(16)));
+
+inline v4u vrotl(v4u x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+/*
+ * Salsa20/8 with each block held as four vectors of diagonals, so every
+ * quarter-round step is one vector op. Position i of a shuffled block holds
+ * natural word (i * 5) % 16, i.e. (x0 x5 x10 x15) (x4 x9 x14 x3)
+ * (x8 x13 x2 x7) (x12 x1 x6 x11).
+ */
+void salsa20_8_simd(v4u B[4]) {
+    v4u X0 = B[0], X1 = B[1], X2 = B[2], X3 = B[3];
+    for (int i = 0; i < 8; i += 2) {
+        // Columns
+        X1 ^= vrotl(X0 + X3, 7);
+        X2 ^= vrotl(X1 + X0, 9);
+        X3 ^= vrotl(X2 + X1, 13);
+        X0 ^= vrotl(X3 + X2, 18);
+        X1 = __builtin_shufflevector(X1, X1, 3, 0, 1, 2);
+        X2 = __builtin_shufflevector(X2, X2, 2, 3, 0, 1);
+        X3 = __builtin_shufflevector(X3, X3, 1, 2, 3, 0);
+        // Rows
+        X3 ^= vrotl(X0 + X1, 7);
+        X2 ^= vrotl(X3 + X0, 9);
+        X1 ^= vrotl(X2 + X3, 13);
+        X0 ^= vrotl(X1 + X2, 18);
+        X1 = __builtin_shufflevector(X1, X1, 1, 2, 3, 0);
+        X2 = __builtin_shufflevector(X2, X2, 2, 3, 0, 1);
+        X3 = __builtin_shufflevector(X3, X3, 3, 0, 1, 2);
+    }
+    B[0] += X0;
+    B[1] += X1;
+    B[2] += X2;
+    B[3] += X3;
+}
+
+void blockmix_salsa8_simd(const uint32_t* in, uint32_t* out, uint32_t r) {
+    const v4u* vin = reinterpret_cast<const v4u*>(in);
+    v4u* vout = reinterpret_cast<v4u*>(out);
+    v4u X[4];
+    for (int k = 0; k < 4; k++) {
+        X[k] = vin[(2 * r - 1) * 4 + k];
+    }
+    for (size_t i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 4; k++) {
+            X[k] ^= vin[i * 4 + k];
+        }
+        salsa20_8_simd(X);
+        size_t o = ((i / 2) + (i & 1) * r) * 4;
+        for (int k = 0; k < 4; k++) {
+            vout[o + k] = X[k];
+        }
+    }
+}
+#endif
+
+bool useSimd() {
+#if !SCRYPT_HAVE_SIMD
+    return false;
+#elif defined(__arm__)
+    // 32-bit ARM builds may run on cores without NEON
+    return getauxval(AT_HWCAP) & HWCAP_NEON;
+#else
+    return true;
+#endif
+}
+
+typedef void (*BlockMixFn)(const uint32_t* in, uint32_t* out, uint32_t r);
+
+/* Word order within blocks as the chosen BlockMix expects it */
+inline size_t wordIndex(size_t i, bool shuffled) {
+    return shuffled ? (i & ~(kBlockWords - 1)) | (((i & (kBlockWords - 1)) * 5) % kBlockWords)
+            : i;
+}
+
+/* ROMix one 128r-byte lane of B in place, with V and XY as scratch */
+void smix(uint8_t* B, uint32_t r, uint64_t N, uint32_t* V, uint32_t* XY, bool simd) {
+    const size_t words = 32 * r;
+    uint32_t* X = XY;
+    uint32_t* Y = XY + words;
+    BlockMixFn blockmix = blockmix_salsa8;
+#if SCRYPT_HAVE_SIMD
+    if (simd) blockmix = blockmix_salsa8_simd;
+#endif
+
+    for (size_t i = 0; i < words; i++) {
+        X[i] = le32dec(&B[wordIndex(i, simd) * 4]);
+    }
+
+    // Natural words 0 and 1 of the last block; word 1 sits at 13 shuffled
+    const size_t lo = (2 * r - 1) * kBlockWords;
+    const size_t hi = lo + (simd ? 13 : 1);
+
+    for (uint64_t i = 0; i < N; i += 2) {
+        memcpy(&V[i * words], X, words * 4);
+        blockmix(X, Y, r);
+        memcpy(&V[(i + 1) * words], Y, words * 4);
+        blockmix(Y, X, r);
+    }
+    for (uint64_t i = 0; i < N; i += 2) {
+        uint64_t j = (X[lo] | ((uint64_t) X[hi] << 32)) & (N - 1);
+        blkxor(X, &V[j * words], words);
+        blockmix(X, Y, r);
+        j = (Y[lo] | ((uint64_t) Y[hi] << 32)) & (N - 1);
+        blkxor(Y, &V[j * words], words);
+        blockmix(Y, X, r);
+    }
+
+    for (size_t i = 0; i < words; i++) {
+        le32enc(&B[wordIndex(i, simd) * 4], X[i]);
+    }
+}
+
+/* Runs every stride'th lane starting at first; false if out of memory */
+bool smixLanes(uint8_t* B, uint32_t r, uint64_t N, uint32_t p, uint32_t first,
+        uint32_t stride, bool simd) {
+    const size_t laneBytes = 128 * r;
+    const size_t vBytes = laneBytes * N;
+    void* V;
+    void* XY;
+    // Aligned for the vector loads in BlockMix
+    if (posix_memalign(&V, 64, vBytes) != 0) {
+        return false;
+    }
+    if (posix_memalign(&XY, 64, laneBytes * 2) != 0) {
+        free(V);
+        return false;
+    }
+    for (uint32_t i = first; i < p; i += stride) {
+        smix(&B[i * laneBytes], r, N, static_cast<uint32_t*>(V), static_cast<uint32_t*>(XY),
+                simd);
+    }
+    OPENSSL_cleanse(V, vBytes);
+    OPENSSL_cleanse(XY, laneBytes * 2);
+    free(V);
+    free(XY);
+    return true;
+}
+
+}  // namespace
+
+int vold_scrypt(const uint8_t* passwd, size_t passwdlen, const uint8_t* salt, size_t saltlen,
+        uint64_t N, uint32_t r, uint32_t p, uint8_t* buf, size_t buflen) {
+    ATRACE_NAME("scrypt");
+    // Same limits as crypto_scrypt()
+    if (buflen > (((uint64_t) 1 << 32) - 1) * 32) {
+        errno = EFBIG;
+        return -1;
+    }
+    if ((uint64_t) r * (uint64_t) p >= (1 << 30)) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (r == 0 || p == 0 || N < 2 || (N & (N - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((r > SIZE_MAX / 128 / p) || (N > SIZE_MAX / 128 / r)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    const size_t laneBytes = 128 * r;
+    std::vector<uint8_t> B(laneBytes * p);
+    if (!PKCS5_PBKDF2_HMAC(reinterpret_cast<const char*>(passwd), passwdlen, salt, saltlen, 1,
+            EVP_sha256(), B.size(), B.data())) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool simd = useSimd();
+    uint64_t vBytes = (uint64_t) laneBytes * N;
+    uint32_t threads = std::min<uint64_t>(p, std::max(1u, std::thread::hardware_concurrency()));
+    threads = std::max<uint64_t>(1, std::min<uint64_t>(threads, kMaxParallelBytes / vBytes));
+
+    bool ok = true;
+    if (threads == 1) {
+        ok = smixLanes(B.data(), r, N, p, 0, 1, simd);
+    } else {
+        std::vector<std::thread> workers;
+        std::vector<char> results(threads);
+        for (uint32_t t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                results[t] = smixLanes(B.data(), r, N, p, t, threads, simd);
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        ok = std::all_of(results.begin(), results.end(), [](char res) { return res; });
+    }
+
+    if (ok && !PKCS5_PBKDF2_HMAC(reinterpret_cast<const char*>(passwd), passwdlen, B.data(),
+            B.size(), 1, EVP_sha256(), buflen, buf)) {
+        errno = EINVAL;
+        ok = false;
+    } else if (!ok) {
+        errno = ENOMEM;
+    }
+    OPENSSL_cleanse(B.data(), B.size());
+    return ok ? 0 : -1;
+}
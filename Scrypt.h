@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SCRYPT_H
+#define ANDROID_VOLD_SCRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+/*
+ * Drop-in replacement for crypto_scrypt() producing identical output.
+ * BlockMix uses a NEON/SSE2 Salsa20/8 core when the CPU has one, and the
+ * p independent ROMix lanes run on separate threads as far as cores and
+ * memory allow. Returns 0 on success, or -1 with errno set.
+ */
+int vold_scrypt(const uint8_t* passwd, size_t passwdlen, const uint8_t* salt, size_t saltlen,
+        uint64_t N, uint32_t r, uint32_t p, uint8_t* buf, size_t buflen);
+
+__END_DECLS
+
+#endif
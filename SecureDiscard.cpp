@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2015 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SecureDiscard.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <mntent.h>
+
+#include <android-base/logging.h>
+
+#include <AutoCloseFD.h>
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+
+namespace android {
+namespace vold {
+
+namespace {
+
+constexpr uint32_t max_extents = 32;
+
+/* Manual overwrite goes through a buffer this large, aligned for O_DIRECT */
+constexpr size_t zero_buffer_size = 1 << 20;
+constexpr size_t zero_buffer_align = 4096;
+
+struct Range {
+    uint64_t start;
+    uint64_t length;
+};
+
+std::unique_ptr<struct fiemap> path_fiemap(const std::string &path, uint32_t extent_count);
+bool check_fiemap(const struct fiemap &fiemap, const std::string &path);
+std::unique_ptr<struct fiemap> alloc_fiemap(uint32_t extent_count);
+std::vector<Range> merge_extents(const struct fiemap &fiemap);
+std::string block_device_for_path(const std::string &path);
+bool discard_range(int fd, const std::string &block_device, const Range &range);
+bool overwrite_with_zeros(int fd, const std::string &block_device, const Range &range);
+
+}
+
+// Destroy all content in "path", if it's small enough.
+bool SecureDiscardPath(const std::string &path) {
+    auto fiemap = path_fiemap(path, max_extents);
+    if (!fiemap || !check_fiemap(*fiemap, path)) {
+        return false;
+    }
+    auto block_device = block_device_for_path(path);
+    if (block_device.empty()) {
+        return false;
+    }
+    AutoCloseFD fs_fd(block_device, O_RDWR | O_LARGEFILE);
+    if (!fs_fd) {
+        PLOG(ERROR) << "Failed to open device " << block_device;
+        return false;
+    }
+    for (auto const &range: merge_extents(*fiemap)) {
+        if (!discard_range(fs_fd.get(), block_device, range)) return false;
+    }
+    return true;
+}
+
+namespace {
+
+// Read the file's FIEMAP
+std::unique_ptr<struct fiemap> path_fiemap(const std::string &path, uint32_t extent_count)
+{
+    AutoCloseFD fd(path);
+    if (!fd) {
+        if (errno == ENOENT) {
+            PLOG(DEBUG) << "Unable to open " << path;
+        } else {
+            PLOG(ERROR) << "Unable to open " << path;
+        }
+        return nullptr;
+    }
+    auto fiemap = alloc_fiemap(extent_count);
+    if (ioctl(fd.get(), FS_IOC_FIEMAP, fiemap.get()) != 0) {
+        PLOG(ERROR) << "Unable to FIEMAP " << path;
+        return nullptr;
+    }
+    auto mapped = fiemap->fm_mapped_extents;
+    if (mapped < 1 || mapped > extent_count) {
+        LOG(ERROR) << "Extent count not in bounds 1 <= " << mapped << " <= " << extent_count
+            << " in " << path;
+        return nullptr;
+    }
+    return fiemap;
+}
+
+// Ensure that the FIEMAP covers the file and is OK to discard
+bool check_fiemap(const struct fiemap &fiemap, const std::string &path) {
+    auto mapped = fiemap.fm_mapped_extents;
+    if (!(fiemap.fm_extents[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST)) {
+        LOG(ERROR) << "Extent " << mapped -1 << " was not the last in " << path;
+        return false;
+    }
+    for (uint32_t i = 0; i < mapped; i++) {
+        auto flags = fiemap.fm_extents[i].fe_flags;
+        if (flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_NOT_ALIGNED)) {
+            LOG(ERROR) << "Extent " << i << " has unexpected flags " << flags << ": " << path;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<struct fiemap> alloc_fiemap(uint32_t extent_count)
+{
+    size_t allocsize = offsetof(struct fiemap, fm_extents[extent_count]);
+    std::unique_ptr<struct fiemap> res(new (::operator new (allocsize)) struct fiemap);
+    memset(res.get(), 0, allocsize);
+    res->fm_start = 0;
+    res->fm_length = UINT64_MAX;
+    res->fm_flags = 0;
+    res->fm_extent_count = extent_count;
+    res->fm_mapped_extents = 0;
+    return res;
+}
+
+// Coalesce physically adjacent extents so each range costs one ioctl
+std::vector<Range> merge_extents(const struct fiemap &fiemap) {
+    std::vector<Range> ranges;
+    for (uint32_t i = 0; i < fiemap.fm_mapped_extents; i++) {
+        auto const &extent = fiemap.fm_extents[i];
+        if (!ranges.empty() && ranges.back().start + ranges.back().length == extent.fe_physical) {
+            ranges.back().length += extent.fe_length;
+        } else {
+            ranges.push_back({extent.fe_physical, extent.fe_length});
+        }
+    }
+    return ranges;
+}
+
+// Given a file path, look for the corresponding block device in /proc/mount
+std::string block_device_for_path(const std::string &path)
+{
+    std::unique_ptr<FILE, int(*)(FILE*)> mnts(setmntent("/proc/mounts", "re"), endmntent);
+    if (!mnts) {
+        PLOG(ERROR) << "Unable to open /proc/mounts";
+        return "";
+    }
+    std::string result;
+    size_t best_length = 0;
+    struct mntent *mnt; // getmntent returns a thread local, so it's safe.
+    while ((mnt = getmntent(mnts.get())) != nullptr) {
+        auto l = strlen(mnt->mnt_dir);
+        if (l > best_length &&
+            path.size() > l &&
+            path[l] == '/' &&
+            path.compare(0, l, mnt->mnt_dir) == 0) {
+                result = mnt->mnt_fsname;
+                best_length = l;
+        }
+    }
+    if (result.empty()) {
+        LOG(ERROR) <<"Didn't find a mountpoint to match path " << path;
+        return "";
+    }
+    LOG(DEBUG) << "For path " << path << " block device is " << result;
+    return result;
+}
+
+// Try the strongest erase the device offers, falling back step by step
+bool discard_range(int fd, const std::string &block_device, const Range &range) {
+    uint64_t args[2] = {range.start, range.length};
+    if (ioctl(fd, BLKSECDISCARD, args) == 0) {
+        return true;
+    }
+    PLOG(DEBUG) << "Unable to BLKSECDISCARD " << range.length << " bytes on " << block_device;
+
+    args[0] = range.start;
+    args[1] = range.length;
+    if (ioctl(fd, BLKZEROOUT, args) == 0) {
+        LOG(DEBUG) << "Used BLKZEROOUT";
+    } else {
+        PLOG(DEBUG) << "Unable to BLKZEROOUT " << range.length << " bytes on " << block_device;
+        if (!overwrite_with_zeros(fd, block_device, range)) return false;
+        LOG(DEBUG) << "Used zero overwrite";
+    }
+
+    // The data is gone already; this just lets the flash reclaim the blocks
+    args[0] = range.start;
+    args[1] = range.length;
+    if (ioctl(fd, BLKDISCARD, args) == -1) {
+        PLOG(DEBUG) << "Unable to BLKDISCARD after zeroing";
+    }
+    return true;
+}
+
+bool overwrite_with_zeros(int fd, const std::string &block_device, const Range &range) {
+    void* raw;
+    if (posix_memalign(&raw, zero_buffer_align, zero_buffer_size) != 0) {
+        LOG(ERROR) << "Unable to allocate zero buffer";
+        return false;
+    }
+    std::unique_ptr<void, void(*)(void*)> buf(raw, free);
+    memset(buf.get(), 0, zero_buffer_size);
+
+    // Bypass the page cache when the range allows it, so the zeroes
+    // actually reach the device
+    bool aligned = !(range.start % zero_buffer_align) && !(range.length % zero_buffer_align);
+    AutoCloseFD direct_fd(block_device, O_WRONLY | O_LARGEFILE | O_DIRECT);
+    int wfd = (aligned && direct_fd) ? direct_fd.get() : fd;
+
+    uint64_t offset = range.start;
+    uint64_t remaining = range.length;
+    while (remaining > 0) {
+        size_t wlen = static_cast<size_t>(std::min(static_cast<uint64_t>(zero_buffer_size),
+                remaining));
+        auto written = TEMP_FAILURE_RETRY(pwrite64(wfd, buf.get(), wlen, offset));
+        if (written < 1) {
+            PLOG(ERROR) << "Write of zeroes failed";
+            return false;
+        }
+        offset += written;
+        remaining -= written;
+    }
+    if (fdatasync(wfd) != 0) {
+        PLOG(ERROR) << "Unable to sync zero overwrite";
+        return false;
+    }
+    return true;
+}
+
+}
+
+}  // namespace vold
+}  // namespace android
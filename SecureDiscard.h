@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SECURE_DISCARD_H
+#define ANDROID_VOLD_SECURE_DISCARD_H
+
+#include <string>
+
+namespace android {
+namespace vold {
+
+/*
+ * Destroys the on-disk contents of the file at path. The file's extents
+ * are merged into as few ranges as possible, and each range gets
+ * BLKSECDISCARD, or else BLKZEROOUT followed by BLKDISCARD. Writing
+ * zeroes by hand is the last resort. The file itself is left in place.
+ */
+bool SecureDiscardPath(const std::string& path);
+
+}  // namespace vold
+}  // namespace android
+
+#endif
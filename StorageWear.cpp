@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StorageWear.h"
+#include "ResponseCode.h"
+#include "VolumeManager.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <cutils/properties.h>
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+using android::base::Trim;
+
+namespace android {
+namespace vold {
+
+/* Minutes between StorageWear broadcasts; 0 disables them */
+static const char* kWearReportProp = "persist.vold.wear_report_min";
+static const int kWearReportDefault = 6 * 60;
+
+/* Bounds the walk through stacked devices, e.g. dm-crypt on a partition */
+static const int kMaxDeviceDepth = 8;
+
+/* Field of /sys/block/<dev>/stat counting sectors written */
+static const int kStatWriteSectors = 6;
+static const uint64_t kStatSectorSize = 512;
+
+struct AmpEntry {
+    uint64_t runs = 0;
+    uint64_t logicalBytes = 0;
+    uint64_t physicalBytes = 0;
+};
+
+static std::mutex sAmpLock;
+static std::map<std::string, AmpEntry> sAmp;
+
+std::string GetPhysicalDevice(const std::string& path) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb)) {
+        return path;
+    }
+    dev_t dev = S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev;
+
+    std::string sysPath(StringPrintf("/sys/dev/block/%u:%u", major(dev), minor(dev)));
+    for (int depth = 0; depth < kMaxDeviceDepth; depth++) {
+        char real[PATH_MAX];
+        if (!realpath(sysPath.c_str(), real)) break;
+        std::string dir(real);
+
+        // Follow stacked devices down to what they're built on
+        std::string slave;
+        DIR* slaves = opendir((dir + "/slaves").c_str());
+        if (slaves) {
+            struct dirent* ent;
+            while ((ent = readdir(slaves)) != nullptr) {
+                if (ent->d_name[0] != '.') {
+                    slave = ent->d_name;
+                    break;
+                }
+            }
+            closedir(slaves);
+        }
+        if (!slave.empty()) {
+            sysPath = "/sys/class/block/" + slave;
+            continue;
+        }
+
+        // Partitions share a request queue with their disk
+        if (!access((dir + "/partition").c_str(), F_OK)) {
+            dir = dir.substr(0, dir.rfind('/'));
+        }
+        return dir;
+    }
+    return StringPrintf("%u:%u", major(dev), minor(dev));
+}
+
+/* Sectors the disk at sysPath has written since boot, or -1 */
+static int64_t readWriteSectors(const std::string& sysPath) {
+    std::string stat;
+    if (!ReadFileToString(sysPath + "/stat", &stat)) {
+        return -1;
+    }
+    std::vector<std::string> fields;
+    for (const auto& field : android::base::Split(Trim(stat), " ")) {
+        if (!field.empty()) fields.push_back(field);
+    }
+    if (fields.size() <= kStatWriteSectors) {
+        return -1;
+    }
+    return strtoll(fields[kStatWriteSectors].c_str(), nullptr, 10);
+}
+
+/* Raw sysfs value with spaces turned into commas, or "-" */
+static std::string readWear(const std::string& path) {
+    std::string value;
+    if (!ReadFileToString(path, &value)) {
+        return "-";
+    }
+    value = Trim(value);
+    std::replace(value.begin(), value.end(), ' ', ',');
+    return value.empty() ? "-" : value;
+}
+
+static std::string getDiskWear(const std::string& id, const std::string& sysPath) {
+    int64_t sectors = readWriteSectors(sysPath);
+    return StringPrintf("disk %s %" PRId64 " %s %s", id.c_str(),
+            (sectors < 0) ? -1 : (int64_t) (sectors * kStatSectorSize),
+            readWear(sysPath + "/device/life_time").c_str(),
+            readWear(sysPath + "/device/pre_eol_info").c_str());
+}
+
+/* KiB written over the lifetime of the filesystem mounted at path, or -1 */
+static int64_t readLifetimeKb(const std::string& path) {
+    struct stat sb;
+    char real[PATH_MAX];
+    if (stat(path.c_str(), &sb) || !realpath(StringPrintf("/sys/dev/block/%u:%u",
+            major(sb.st_dev), minor(sb.st_dev)).c_str(), real)) {
+        return -1;
+    }
+    std::string name(real);
+    name = name.substr(name.rfind('/') + 1);
+    for (const char* fs : { "ext4", "f2fs" }) {
+        std::string value;
+        if (ReadFileToString(StringPrintf("/sys/fs/%s/%s/lifetime_write_kbytes",
+                fs, name.c_str()), &value)) {
+            return strtoll(value.c_str(), nullptr, 10);
+        }
+    }
+    return -1;
+}
+
+WriteAmpMeter::WriteAmpMeter(const char* op, const std::string& path) :
+        mOp(op), mDevice(GetPhysicalDevice(path)), mFinished(false) {
+    mStartSectors = readWriteSectors(mDevice);
+}
+
+void WriteAmpMeter::finish(uint64_t logicalBytes) {
+    if (mFinished) return;
+    mFinished = true;
+    int64_t endSectors = readWriteSectors(mDevice);
+    if (mStartSectors < 0 || endSectors < mStartSectors) {
+        return;
+    }
+    uint64_t physicalBytes = (endSectors - mStartSectors) * kStatSectorSize;
+    LOG(INFO) << mOp << " wrote " << logicalBytes << " bytes; " << mDevice << " wrote "
+            << physicalBytes << " bytes";
+
+    std::lock_guard<std::mutex> lock(sAmpLock);
+    auto& entry = sAmp[mOp];
+    entry.runs++;
+    entry.logicalBytes += logicalBytes;
+    entry.physicalBytes += physicalBytes;
+}
+
+std::vector<std::string> GetStorageWear() {
+    std::vector<std::string> res;
+    VolumeManager* vm = VolumeManager::Instance();
+
+    // Internal storage isn't a Disk, so it's found through /data
+    std::string internal(GetPhysicalDevice("/data"));
+    res.push_back(getDiskWear("internal", internal));
+    for (const auto& disk : vm->getDiskSysPaths()) {
+        res.push_back(getDiskWear(disk.first, disk.second));
+    }
+
+    std::list<std::string> paths { "/data" };
+    std::list<std::string> privateIds;
+    vm->listVolumes(VolumeBase::Type::kPrivate, privateIds);
+    for (const auto& id : privateIds) {
+        auto vol = vm->findVolume(id);
+        if (vol != nullptr && vol->getState() == VolumeBase::State::kMounted) {
+            paths.push_back(vol->getPath());
+        }
+    }
+    for (const auto& path : paths) {
+        res.push_back(StringPrintf("fs %s %" PRId64, path.c_str(), readLifetimeKb(path)));
+    }
+
+    std::lock_guard<std::mutex> lock(sAmpLock);
+    for (const auto& it : sAmp) {
+        res.push_back(StringPrintf("amp %s %" PRIu64 " %" PRIu64 " %" PRIu64, it.first.c_str(),
+                it.second.runs, it.second.logicalBytes, it.second.physicalBytes));
+    }
+    return res;
+}
+
+void StartWearReporting() {
+    int minutes = property_get_int32(kWearReportProp, kWearReportDefault);
+    if (minutes <= 0) {
+        return;
+    }
+    std::thread([minutes]() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::minutes(minutes));
+            for (const auto& line : GetStorageWear()) {
+                VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+                        ResponseCode::StorageWear, line.c_str(), false);
+            }
+        }
+    }).detach();
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_STORAGE_WEAR_H
+#define ANDROID_VOLD_STORAGE_WEAR_H
+
+#include "Utils.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace android {
+namespace vold {
+
+/*
+ * Returns the sysfs directory of the disk backing path, which is either
+ * a mounted filesystem or a block device, so that partitions of one disk,
+ * and anything stacked on top of them, give the same answer. Falls back
+ * to something else unique to the device when sysfs can't tell.
+ */
+std::string GetPhysicalDevice(const std::string& path);
+
+/*
+ * Measures write amplification of one run of an operation such as "move"
+ * or "encrypt": how many bytes the disk under path physically wrote while
+ * the operation wrote logicalBytes. Other writers to the same disk are
+ * counted too, so single runs are noisy and the totals are what matter.
+ */
+class WriteAmpMeter {
+public:
+    WriteAmpMeter(const char* op, const std::string& path);
+
+    /* Records the run; later calls are ignored */
+    void finish(uint64_t logicalBytes);
+
+private:
+    const char* mOp;
+    std::string mDevice;
+    int64_t mStartSectors;
+    bool mFinished;
+
+    DISALLOW_COPY_AND_ASSIGN(WriteAmpMeter);
+};
+
+/*
+ * One line per disk as "disk <id> <written bytes> <life_time> <pre_eol>",
+ * where eMMC wear is given as the raw sysfs values or "-" elsewhere; one
+ * per mounted filesystem as "fs <path> <lifetime written KiB>"; and one
+ * per operation as "amp <op> <runs> <logical bytes> <physical bytes>".
+ */
+std::vector<std::string> GetStorageWear();
+
+/* Broadcasts GetStorageWear() as StorageWear every persist.vold.wear_report_min */
+void StartWearReporting();
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -16,10 +16,14 @@
 
 #include "TrimTask.h"
 #include "Benchmark.h"
+#include "BenchmarkHistory.h"
+#include "OperationStats.h"
+#include "StorageWear.h"
 #include "Utils.h"
 #include "VolumeManager.h"
 #include "ResponseCode.h"
 
+#include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
 #include <cutils/properties.h>
@@ -27,26 +31,73 @@
 #include <private/android_filesystem_config.h>
 #include <hardware_legacy/power.h>
 
-#include <dirent.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include <limits.h>
+#include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
 /* From a would-be kernel header */
 #define FIDTRIM         _IOWR('f', 128, struct fstrim_range)    /* Deep discard trim */
 
+/* From fs/f2fs/f2fs.h in the kernel */
+#define F2FS_IOCTL_MAGIC            0xf5
+#define F2FS_IOC_GARBAGE_COLLECT    _IOW(F2FS_IOCTL_MAGIC, 6, __u32)
+
+#ifndef F2FS_SUPER_MAGIC
+#define F2FS_SUPER_MAGIC 0xF2F52010
+#endif
+
 #define BENCHMARK_ENABLED 1
 
+using android::base::ReadFileToString;
 using android::base::StringPrintf;
+using android::base::WriteStringToFile;
 
 namespace android {
 namespace vold {
 
 static const char* kWakeLock = "TrimTask";
 
-TrimTask::TrimTask(int flags) : mFlags(flags) {
+/* Trim window size in MiB; 0 trims each filesystem with a single call */
+static const char* kTrimChunkProp = "persist.vold.trim_chunk_mb";
+/* Smallest free extent worth discarding, in KiB */
+static const char* kTrimMinlenProp = "persist.vold.trim_minlen_kb";
+static const char* kTrimCheckpointDir = "/data/misc/vold/trim";
+/* Free space that must appear since the last trim before trimming again, in MiB */
+static const char* kTrimMinFreedProp = "persist.vold.trim_min_freed_mb";
+static const int kTrimMinFreedDefault = 256;
+/* Days after which a filesystem is trimmed however little was freed */
+static const char* kTrimMaxAgeProp = "persist.vold.trim_max_days";
+static const int kTrimMaxAgeDefault = 7;
+
+/* Bounds of the adaptive discard rate for chunked trims, in bytes per second */
+static const uint64_t kTrimMinRate = 16 * 1024 * 1024;
+static const uint64_t kTrimStartRate = 256 * 1024 * 1024;
+
+/* Seconds of f2fs garbage collection per filesystem and run; 0 disables it */
+static const char* kGcBudgetProp = "persist.vold.f2fs_gc_sec";
+static const int kGcBudgetDefault = 60;
+/* Sections collected between checks that the device is still idle */
+static const int kGcBurstSections = 8;
+/* Fewer dirty segments than this aren't worth collecting */
+static const int kGcMinDirtySegments = 64;
+/* Accounted against the throttle for each section collected */
+static const uint64_t kGcSectionBytes = 2 * 1024 * 1024;
+
+static std::mutex sActiveLock;
+static std::set<TrimTask*> sActive;
+
+TrimTask::TrimTask(int flags) : mFlags(flags), mCancelled(false) {
     // Collect both fstab and vold volumes
     addFromFstab();
 
@@ -57,10 +108,15 @@ TrimTask::TrimTask(int flags) : mFlags(flags) {
         auto vol = vm->findVolume(id);
         if (vol != nullptr && vol->getState() == VolumeBase::State::kMounted) {
             mPaths.push_back(vol->getPath());
+            mBenchmarkKeys[vol->getPath()] = vm->getBenchmarkKey(id);
         }
     }
 }
 
+TrimTask::TrimTask(int flags, const std::string& path) : mFlags(flags), mCancelled(false) {
+    mPaths.push_back(path);
+}
+
 TrimTask::~TrimTask() {
 }
 
@@ -94,6 +150,9 @@ void TrimTask::addFromFstab() {
         }
 
         mPaths.push_back(fstab->recs[i].mount_point);
+        if (!strcmp(fstab->recs[i].mount_point, "/data")) {
+            mBenchmarkKeys["/data"] = kBenchmarkInternalKey;
+        }
         prev_rec = &fstab->recs[i];
     }
     fs_mgr_free_fstab(fstab);
@@ -111,21 +170,392 @@ static void notifyResult(const std::string& path, int64_t bytes, int64_t delta)
             ResponseCode::TrimResult, res.c_str(), false);
 }
 
+/* Rate limit in KiB/s a chunked trim is running at, next to each TrimResult */
+static void notifyRate(const std::string& path, uint64_t rate) {
+    std::string res(path + " " + std::to_string(rate / 1024));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::TrimRate, res.c_str(), false);
+}
+
+static std::string getCheckpointPath(const std::string& path) {
+    std::string name(path);
+    std::replace(name.begin(), name.end(), '/', '_');
+    return StringPrintf("%s/%s", kTrimCheckpointDir, name.c_str());
+}
+
+/* What the last full trim of a filesystem left behind */
+struct TrimHistory {
+    /* Wall clock time the trim finished, in seconds */
+    int64_t time;
+    uint64_t freeBytes;
+    uint64_t trimmedBytes;
+};
+
+static std::string getHistoryPath(const std::string& path) {
+    return getCheckpointPath(path) + ".last";
+}
+
+static bool readHistory(const std::string& path, TrimHistory& history) {
+    std::string saved;
+    if (!ReadFileToString(getHistoryPath(path), &saved)) {
+        return false;
+    }
+    long long time;
+    unsigned long long freeBytes, trimmedBytes;
+    if (sscanf(saved.c_str(), "%lld %llu %llu", &time, &freeBytes, &trimmedBytes) != 3) {
+        return false;
+    }
+    history.time = time;
+    history.freeBytes = freeBytes;
+    history.trimmedBytes = trimmedBytes;
+    return true;
+}
+
+/* Remembers free space right after a full trim, to judge the next one by */
+static void recordTrim(int fd, const std::string& path, uint64_t trimmedBytes) {
+    struct statvfs sb;
+    if (fstatvfs(fd, &sb) || PrepareDir(kTrimCheckpointDir, 0700, AID_ROOT, AID_ROOT) != OK) {
+        return;
+    }
+    std::string history(StringPrintf("%lld %llu %llu", (long long) time(nullptr),
+            (unsigned long long) sb.f_bfree * sb.f_frsize, (unsigned long long) trimmedBytes));
+    if (!WriteStringToFile(history, getHistoryPath(path))) {
+        PLOG(WARNING) << "Failed to save trim history for " << path;
+    }
+}
+
+/*
+ * Decides whether path is worth trimming on this run, returning in
+ * *reclaimable the bytes freed since the last full trim. Filesystems
+ * without history, with an unfinished chunked pass, or not trimmed for
+ * persist.vold.trim_max_days are always trimmed, as are all of them for
+ * deep trims. The decision is broadcast as a TrimDecision.
+ */
+bool TrimTask::shouldTrim(const std::string& path, uint64_t* reclaimable) {
+    *reclaimable = 0;
+    struct statvfs sb;
+    if (statvfs(path.c_str(), &sb)) {
+        // Left for trimPath() to report
+        return true;
+    }
+    uint64_t freeBytes = (uint64_t) sb.f_bfree * sb.f_frsize;
+    *reclaimable = freeBytes;
+
+    bool run = true;
+    TrimHistory last;
+    if (!(mFlags & Flags::kDeepTrim) && access(getCheckpointPath(path).c_str(), F_OK)
+            && readHistory(path, last)) {
+        *reclaimable = (freeBytes > last.freeBytes) ? freeBytes - last.freeBytes : 0;
+        uint64_t minFreed = (uint64_t) std::max(0,
+                property_get_int32(kTrimMinFreedProp, kTrimMinFreedDefault)) * 1024 * 1024;
+        int64_t maxAge = (int64_t) property_get_int32(kTrimMaxAgeProp, kTrimMaxAgeDefault)
+                * 24 * 60 * 60;
+        int64_t age = time(nullptr) - last.time;
+        run = (*reclaimable >= minFreed) || (age < 0) || (age >= maxAge);
+        LOG(INFO) << (run ? "Trimming " : "Skipping trim of ") << path << ": "
+                << *reclaimable / (1024 * 1024) << "MiB freed in " << age / (60 * 60)
+                << "h since the last trim, which discarded "
+                << last.trimmedBytes / (1024 * 1024) << "MiB";
+    }
+
+    std::string res(path + " " + (run ? "run" : "skip") + " " + std::to_string(*reclaimable));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::TrimDecision, res.c_str(), false);
+    return run;
+}
+
+void TrimTask::cancelAll() {
+    std::lock_guard<std::mutex> lock(sActiveLock);
+    for (auto task : sActive) {
+        task->mCancelled = true;
+    }
+}
+
 void TrimTask::run() {
     acquire_wake_lock(PARTIAL_WAKE_LOCK, kWakeLock);
+    {
+        std::lock_guard<std::mutex> lock(sActiveLock);
+        sActive.insert(this);
+    }
+    mThrottle.reset(new IoThrottle(kTrimMinRate, kTrimStartRate));
 
+    // Trims on the same device serialize in the kernel anyway, so only
+    // separate physical devices are trimmed concurrently
+    std::map<std::string, uint64_t> reclaimable;
+    std::map<std::string, std::list<std::string>> devices;
     for (auto path : mPaths) {
-        LOG(DEBUG) << "Starting trim of " << path;
+        // Skipped filesystems still get their garbage collected
+        if (!shouldTrim(path, &reclaimable[path])) {
+            mSkipped.insert(path);
+        }
+        devices[GetPhysicalDevice(path)].push_back(path);
+    }
+    // On each device, the paths with the most freed space go first
+    for (auto& device : devices) {
+        device.second.sort([&reclaimable](const std::string& a, const std::string& b) {
+            return reclaimable[a] > reclaimable[b];
+        });
+    }
+
+    std::list<std::thread> threads;
+    {
+        // The trim threads inherit background priority from us
+        ScopedBackgroundIo background;
+        for (const auto& device : devices) {
+            LOG(DEBUG) << "Maintaining " << device.second.size() << " paths on " << device.first;
+            threads.push_back(std::thread(&TrimTask::trimPaths, this, device.second));
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sActiveLock);
+        sActive.erase(this);
+    }
+    release_wake_lock(kWakeLock);
+}
+
+/* Size of the block device under the filesystem open at fd, or 0 */
+static uint64_t getBackingBytes(int fd) {
+    struct stat sb;
+    std::string sectors;
+    if (fstat(fd, &sb) || !ReadFileToString(StringPrintf("/sys/dev/block/%u:%u/size",
+            major(sb.st_dev), minor(sb.st_dev)), &sectors)) {
+        return 0;
+    }
+    return strtoull(sectors.c_str(), nullptr, 10) * 512;
+}
+
+/*
+ * Trims the filesystem in bounded windows, so that no single ioctl blocks
+ * for long and the task can stop between windows. The end of the last
+ * finished window is persisted, and the next run picks up from there.
+ */
+status_t TrimTask::trimChunked(int fd, const std::string& path, uint64_t chunkBytes,
+        uint64_t* trimmed) {
+    *trimmed = 0;
+    struct statvfs sb;
+    if (fstatvfs(fd, &sb)) {
+        PLOG(WARNING) << "Failed to stat " << path;
+        status_t res = -errno;
+        notifyResult(path, -1, -1);
+        return res;
+    }
+    // f_blocks leaves out overhead like ext4's metadata, which still takes
+    // up block addresses, so windows run to the end of the backing device;
+    // past the filesystem's real end the kernel answers EINVAL
+    uint64_t fsBytes = (uint64_t) sb.f_blocks * sb.f_frsize;
+    uint64_t endBytes = std::max(fsBytes, getBackingBytes(fd));
+    uint64_t minlen = (uint64_t) property_get_int32(kTrimMinlenProp, 0) * 1024;
 
-        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
-        if (fd < 0) {
-            PLOG(WARNING) << "Failed to open " << path;
+    std::string checkpoint(getCheckpointPath(path));
+    bool persist = (PrepareDir(kTrimCheckpointDir, 0700, AID_ROOT, AID_ROOT) == OK);
+
+    uint64_t offset = 0;
+    std::string saved;
+    if (persist && ReadFileToString(checkpoint, &saved)) {
+        offset = strtoull(saved.c_str(), nullptr, 10);
+        if (offset >= endBytes) {
+            offset = 0;
+        } else if (offset > 0) {
+            LOG(INFO) << "Resuming trim of " << path << " at " << offset;
+        }
+    }
+
+    uint64_t total = 0;
+    nsecs_t totalStart = systemTime(SYSTEM_TIME_BOOTTIME);
+    while (offset < endBytes) {
+        if (mCancelled) {
+            LOG(INFO) << "Trim of " << path << " cancelled at " << offset;
+            return -ECANCELED;
+        }
+
+        struct fstrim_range range;
+        memset(&range, 0, sizeof(range));
+        range.start = offset;
+        range.len = std::min(chunkBytes, endBytes - offset);
+        range.minlen = minlen;
+
+        nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+        if (ioctl(fd, (mFlags & Flags::kDeepTrim) ? FIDTRIM : FITRIM, &range)) {
+            if (errno == EINVAL && offset >= fsBytes) {
+                break;
+            }
+            PLOG(WARNING) << "Trim failed on " << path << " at " << offset;
+            status_t res = -errno;
+            notifyResult(path, -1, -1);
+            return res;
+        }
+        nsecs_t delta = systemTime(SYSTEM_TIME_BOOTTIME) - start;
+        notifyResult(path, range.len, delta);
+        uint64_t rate = mThrottle->getRate();
+        if (rate) {
+            notifyRate(path, rate);
+        }
+        total += range.len;
+        *trimmed = total;
+        mThrottle->throttle(range.len);
+
+        offset += std::min(chunkBytes, endBytes - offset);
+        if (persist && !WriteStringToFile(std::to_string(offset), checkpoint)) {
+            PLOG(WARNING) << "Failed to save trim checkpoint for " << path;
+        }
+    }
+
+    // Finished a full pass; the next run starts over
+    if (persist) {
+        unlink(checkpoint.c_str());
+    }
+    recordTrim(fd, path, total);
+    LOG(INFO) << "Trimmed " << total << " bytes on " << path << " in "
+            << nanoseconds_to_milliseconds(systemTime(SYSTEM_TIME_BOOTTIME) - totalStart)
+            << "ms";
+    return OK;
+}
+
+/* Reads a segment count from /sys/fs/f2fs/<dev>/, or returns -1 */
+static int64_t readF2fsStat(const std::string& sysPath, const char* name) {
+    std::string value;
+    if (!ReadFileToString(sysPath + "/" + name, &value)) {
+        return -1;
+    }
+    return strtoll(value.c_str(), nullptr, 10);
+}
+
+/* Returns /sys/fs/f2fs/<dev> for the filesystem open at fd */
+static std::string getF2fsSysPath(int fd) {
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        return "";
+    }
+    char real[PATH_MAX];
+    std::string devPath(StringPrintf("/sys/dev/block/%u:%u", major(sb.st_dev), minor(sb.st_dev)));
+    if (!realpath(devPath.c_str(), real)) {
+        return "";
+    }
+    std::string dev(real);
+    return "/sys/fs/f2fs/" + dev.substr(dev.rfind('/') + 1);
+}
+
+bool TrimTask::canCollectGarbage() {
+    return !mCancelled && !mThrottle->isContended() && IsScreenOff() && IsCharging();
+}
+
+/*
+ * Runs f2fs garbage collection in bursts of a few sections while the
+ * device is idle and charging, so that the dirty segments left behind by
+ * overwrites are folded into free ones now rather than by foreground
+ * collection once free space runs out. Collection stops as soon as the
+ * screen comes on, the charger is pulled or other I/O starts stalling, and
+ * the segments reclaimed are reported in a GcResult.
+ */
+void TrimTask::collectGarbage(int fd, const std::string& path) {
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) || sfs.f_type != F2FS_SUPER_MAGIC) {
+        return;
+    }
+    int budget = property_get_int32(kGcBudgetProp, kGcBudgetDefault);
+    if (budget <= 0) {
+        return;
+    }
+    if (!canCollectGarbage()) {
+        LOG(DEBUG) << "Skipping garbage collection of " << path << " while in use";
+        return;
+    }
+
+    std::string sysPath(getF2fsSysPath(fd));
+    int64_t freeBefore = readF2fsStat(sysPath, "free_segments");
+    int64_t dirty = readF2fsStat(sysPath, "dirty_segments");
+    if (dirty >= 0 && dirty < kGcMinDirtySegments) {
+        LOG(DEBUG) << "Only " << dirty << " dirty segments on " << path;
+        return;
+    }
+
+    OperationTimer timer("gc", path);
+    WriteAmpMeter amp("gc", path);
+    int sections = 0;
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+    nsecs_t deadline = start + seconds_to_nanoseconds(budget);
+    bool done = false;
+    while (!done && canCollectGarbage() && systemTime(SYSTEM_TIME_BOOTTIME) < deadline) {
+        for (int i = 0; i < kGcBurstSections; i++) {
+            // Synchronous, so each call collects one victim section
+            __u32 sync = 1;
+            if (ioctl(fd, F2FS_IOC_GARBAGE_COLLECT, &sync)) {
+                // Nothing left to collect shows up as EINVAL or ENODATA
+                if (errno != EINVAL && errno != ENODATA && errno != EAGAIN) {
+                    PLOG(WARNING) << "Garbage collection failed on " << path;
+                }
+                done = true;
+                break;
+            }
+            sections++;
+            mThrottle->throttle(kGcSectionBytes);
+        }
+        dirty = readF2fsStat(sysPath, "dirty_segments");
+        if (dirty >= 0 && dirty < kGcMinDirtySegments) {
+            done = true;
+        }
+    }
+    nsecs_t delta = systemTime(SYSTEM_TIME_BOOTTIME) - start;
+
+    int64_t freeAfter = readF2fsStat(sysPath, "free_segments");
+    int64_t reclaimed = (freeBefore >= 0 && freeAfter >= 0)
+            ? std::max<int64_t>(0, freeAfter - freeBefore) : -1;
+    LOG(INFO) << "Collected " << sections << " sections on " << path << ", reclaiming "
+            << reclaimed << " segments in " << nanoseconds_to_milliseconds(delta) << "ms";
+    std::string res(path + " " + std::to_string(reclaimed) + " " + std::to_string(delta));
+    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(
+            ResponseCode::GcResult, res.c_str(), false);
+    amp.finish(0);
+    timer.setResult(OK);
+}
+
+void TrimTask::trimPaths(const std::list<std::string>& paths) {
+    for (auto path : paths) {
+        if (mCancelled) {
+            LOG(INFO) << "Trim cancelled before " << path;
+            if (!mSkipped.count(path)) {
+                notifyResult(path, -1, -1);
+            }
             continue;
         }
+        trimPath(path);
+    }
+}
+
+void TrimTask::trimPath(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        PLOG(WARNING) << "Failed to open " << path;
+        return;
+    }
+
+    // Collecting first leaves more free segments for the trim to discard
+    collectGarbage(fd, path);
+    if (mSkipped.count(path)) {
+        close(fd);
+        return;
+    }
+
+    LOG(DEBUG) << "Starting trim of " << path;
+    OperationTimer timer("trim", path);
+    WriteAmpMeter amp("trim", path);
 
+    uint64_t chunkBytes = (uint64_t) property_get_int32(kTrimChunkProp, 0) * 1024 * 1024;
+    if (chunkBytes > 0) {
+        uint64_t trimmed;
+        status_t res = trimChunked(fd, path, chunkBytes, &trimmed);
+        amp.finish(trimmed);
+        timer.setResult(res);
+        close(fd);
+    } else {
         struct fstrim_range range;
         memset(&range, 0, sizeof(range));
         range.len = ULLONG_MAX;
+        range.minlen = (uint64_t) property_get_int32(kTrimMinlenProp, 0) * 1024;
 
         nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
         if (ioctl(fd, (mFlags & Flags::kDeepTrim) ? FIDTRIM : FITRIM, &range)) {
@@ -136,19 +566,21 @@ void TrimTask::run() {
             LOG(INFO) << "Trimmed " << range.len << " bytes on " << path
                     << " in " << nanoseconds_to_milliseconds(delta) << "ms";
             notifyResult(path, range.len, delta);
+            recordTrim(fd, path, range.len);
+            amp.finish(range.len);
+            timer.setResult(OK);
         }
         close(fd);
+    }
 
-        if (mFlags & Flags::kBenchmarkAfter) {
+    if ((mFlags & Flags::kBenchmarkAfter) && !mCancelled) {
 #if BENCHMARK_ENABLED
-            BenchmarkPrivate(path);
+        auto key = mBenchmarkKeys.find(path);
+        BenchmarkPrivate(path, (key != mBenchmarkKeys.end()) ? key->second : "");
 #else
-            LOG(DEBUG) << "Benchmark disabled";
+        LOG(DEBUG) << "Benchmark disabled";
 #endif
-        }
     }
-
-    release_wake_lock(kWakeLock);
 }
 
 }  // namespace vold
@@ -17,10 +17,16 @@
 #ifndef ANDROID_VOLD_TRIM_TASK_H
 #define ANDROID_VOLD_TRIM_TASK_H
 
+#include "BackgroundIo.h"
 #include "Utils.h"
 
+#include <atomic>
 #include <thread>
 #include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
 
 namespace android {
 namespace vold {
@@ -28,6 +34,8 @@ namespace vold {
 class TrimTask {
 public:
     TrimTask(int flags);
+    /* Trims just the filesystem mounted at path */
+    TrimTask(int flags, const std::string& path);
     virtual ~TrimTask();
 
     enum Flags {
@@ -37,13 +45,31 @@ public:
 
     void start();
 
+    /* Stops every running trim once its current ioctl returns */
+    static void cancelAll();
+
 private:
     int mFlags;
     std::list<std::string> mPaths;
+    /* Benchmark history key for each path, where the media is known */
+    std::map<std::string, std::string> mBenchmarkKeys;
     std::thread mThread;
+    std::atomic<bool> mCancelled;
+    /* Paths only garbage collected this run, since trimming them isn't worth it */
+    std::set<std::string> mSkipped;
+    /* Paces chunked trims across all devices */
+    std::unique_ptr<IoThrottle> mThrottle;
 
     void addFromFstab();
+    bool shouldTrim(const std::string& path, uint64_t* reclaimable);
     void run();
+    void trimPaths(const std::list<std::string>& paths);
+    void trimPath(const std::string& path);
+    void collectGarbage(int fd, const std::string& path);
+    bool canCollectGarbage();
+    /* Sets *trimmed to the bytes discarded so far, even when stopping early */
+    status_t trimChunked(int fd, const std::string& path, uint64_t chunkBytes,
+            uint64_t* trimmed);
 
     DISALLOW_COPY_AND_ASSIGN(TrimTask);
 };
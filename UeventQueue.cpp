@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UeventQueue.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+
+static const nsecs_t kMsToNs = 1000000;
+
+UeventQueue::UeventQueue(std::function<void(const BlockEvent&)> dispatch) :
+        mDispatch(dispatch), mWakeFd(-1), mStopping(false), mHead(0), mTail(0),
+        mLastSeqnum(-1), mReceived(0), mDispatched(0), mCoalesced(0), mDebounced(0),
+        mOverflows(0), mDropped(0), mLost(0), mHighWater(0) {
+}
+
+UeventQueue::~UeventQueue() {
+    stop();
+}
+
+status_t UeventQueue::start() {
+    mWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (mWakeFd == -1) {
+        PLOG(ERROR) << "Failed to create uevent wake fd";
+        return -errno;
+    }
+    mStopping = false;
+    mThread = std::thread(&UeventQueue::run, this);
+    return OK;
+}
+
+status_t UeventQueue::stop() {
+    if (!mThread.joinable()) {
+        return OK;
+    }
+    mStopping = true;
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(mWakeFd, &one, sizeof(one)));
+    mThread.join();
+    close(mWakeFd);
+    mWakeFd = -1;
+    return OK;
+}
+
+void UeventQueue::push(NetlinkEvent* evt) {
+    // Every uevent takes the next kernel sequence number, so a gap means
+    // the socket overflowed before we could read it
+    const char* seqnum = evt->findParam("SEQNUM");
+    if (seqnum != nullptr) {
+        int64_t seq = strtoll(seqnum, nullptr, 10);
+        if (mLastSeqnum >= 0 && seq > mLastSeqnum + 1) {
+            LOG(WARNING) << "Lost " << (seq - mLastSeqnum - 1) << " uevents before " << seq;
+            mLost += seq - mLastSeqnum - 1;
+        }
+        mLastSeqnum = seq;
+    }
+
+    const char* subsys = evt->getSubsystem();
+    if (subsys == nullptr || strcmp(subsys, "block")) {
+        return;
+    }
+
+    const char* path = evt->findParam("DEVPATH");
+    const char* devType = evt->findParam("DEVTYPE");
+    const char* major = evt->findParam("MAJOR");
+    const char* minor = evt->findParam("MINOR");
+
+    BlockEvent event;
+    event.action = evt->getAction();
+    event.path = path ? path : "";
+    event.devType = devType ? devType : "";
+    event.device = makedev(major ? atoi(major) : 0, minor ? atoi(minor) : 0);
+    mReceived++;
+
+    if (!tryPush(std::move(event))) {
+        // Give the dispatcher a chance to catch up before giving up
+        mOverflows++;
+        int waitedMs = 0;
+        while (!tryPush(std::move(event))) {
+            if (waitedMs++ >= kMaxPushWaitMs) {
+                LOG(ERROR) << "Uevent queue full; dropping " << event.path;
+                mDropped++;
+                return;
+            }
+            usleep(1000);
+        }
+    }
+
+    uint64_t one = 1;
+    TEMP_FAILURE_RETRY(write(mWakeFd, &one, sizeof(one)));
+}
+
+bool UeventQueue::tryPush(BlockEvent&& event) {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    size_t tail = mTail.load(std::memory_order_acquire);
+    if (head - tail >= kRingSize) {
+        return false;
+    }
+    mRing[head % kRingSize] = std::move(event);
+    mHead.store(head + 1, std::memory_order_release);
+
+    size_t depth = head + 1 - tail;
+    if (depth > mHighWater) {
+        mHighWater = depth;
+    }
+    return true;
+}
+
+void UeventQueue::drain() {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    size_t head = mHead.load(std::memory_order_acquire);
+    if (tail == head) {
+        return;
+    }
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    while (tail != head) {
+        coalesce(std::move(mRing[tail % kRingSize]), now);
+        tail++;
+        mTail.store(tail, std::memory_order_release);
+    }
+}
+
+void UeventQueue::coalesce(BlockEvent&& event, nsecs_t now) {
+    switch (event.action) {
+    case NetlinkEvent::Action::kChange: {
+        for (auto& pending : mPending) {
+            if (pending.event.device == event.device
+                    && pending.event.action == NetlinkEvent::Action::kChange) {
+                pending.event = std::move(event);
+                pending.readyTime = now + kChangeDebounceMs * kMsToNs;
+                mDebounced++;
+                return;
+            }
+        }
+        mPending.push_back({ std::move(event), now + kChangeDebounceMs * kMsToNs });
+        return;
+    }
+    case NetlinkEvent::Action::kRemove: {
+        // Nothing queued behind a remove matters anymore, and if we never
+        // dispatched the add either, the device was never seen at all
+        bool sawAdd = false;
+        auto i = mPending.begin();
+        while (i != mPending.end()) {
+            if (i->event.device == event.device
+                    && (sawAdd || i->event.action != NetlinkEvent::Action::kRemove)) {
+                sawAdd |= (i->event.action == NetlinkEvent::Action::kAdd);
+                i = mPending.erase(i);
+                mCoalesced++;
+            } else {
+                ++i;
+            }
+        }
+        if (sawAdd) {
+            mCoalesced++;
+            return;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    mPending.push_back({ std::move(event), now });
+}
+
+void UeventQueue::run() {
+    while (!mStopping) {
+        drain();
+
+        // Dispatch one event at a time, so anything that arrives in the
+        // meantime still gets a chance to coalesce with what's left
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        nsecs_t nextReady = -1;
+        bool dispatched = false;
+        for (auto i = mPending.begin(); i != mPending.end(); ++i) {
+            if (i->readyTime <= now) {
+                BlockEvent event(std::move(i->event));
+                mPending.erase(i);
+                mDispatch(event);
+                mDispatched++;
+                dispatched = true;
+                break;
+            }
+            if (nextReady == -1 || i->readyTime < nextReady) {
+                nextReady = i->readyTime;
+            }
+        }
+        if (dispatched) {
+            continue;
+        }
+
+        struct pollfd fd = { mWakeFd, POLLIN, 0 };
+        int timeoutMs = (nextReady == -1) ? -1
+                : static_cast<int>((nextReady - now + kMsToNs - 1) / kMsToNs);
+        if (TEMP_FAILURE_RETRY(poll(&fd, 1, timeoutMs)) > 0) {
+            uint64_t count;
+            TEMP_FAILURE_RETRY(read(mWakeFd, &count, sizeof(count)));
+        }
+    }
+}
+
+std::vector<std::string> UeventQueue::getStats() {
+    std::vector<std::string> res;
+    res.push_back(StringPrintf("received %" PRIu64 " dispatched %" PRIu64
+            " coalesced %" PRIu64 " debounced %" PRIu64,
+            mReceived.load(), mDispatched.load(), mCoalesced.load(), mDebounced.load()));
+    res.push_back(StringPrintf("overflows %" PRIu64 " dropped %" PRIu64 " lost %" PRIu64
+            " depth %zu/%zu", mOverflows.load(), mDropped.load(), mLost.load(),
+            mHighWater.load(), kRingSize));
+    return res;
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_UEVENT_QUEUE_H
+#define ANDROID_VOLD_UEVENT_QUEUE_H
+
+#include "Utils.h"
+
+#include <sysutils/NetlinkEvent.h>
+#include <utils/Timers.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace android {
+namespace vold {
+
+/* The parts of a block uevent that VolumeManager acts on */
+struct BlockEvent {
+    NetlinkEvent::Action action;
+    std::string path;
+    std::string devType;
+    dev_t device;
+};
+
+/*
+ * Decouples uevent reception from processing. The netlink listener thread
+ * only copies each block event into a bounded single-producer,
+ * single-consumer ring, so it can keep draining the socket while a
+ * dispatcher thread probes disks. Before dispatching, the backlog is
+ * coalesced: an add and remove of the same device that were never
+ * dispatched cancel out, and bursts of change events for one device
+ * (as seen while it's being partitioned) collapse into a single change
+ * once the device has been quiet for kChangeDebounceMs.
+ */
+class UeventQueue {
+public:
+    UeventQueue(std::function<void(const BlockEvent&)> dispatch);
+    virtual ~UeventQueue();
+
+    status_t start();
+    status_t stop();
+
+    /* Called only from the netlink listener thread */
+    void push(NetlinkEvent* evt);
+
+    std::vector<std::string> getStats();
+
+private:
+    static const size_t kRingSize = 1024;
+    static const int kChangeDebounceMs = 250;
+    static const int kMaxPushWaitMs = 1000;
+
+    struct Pending {
+        BlockEvent event;
+        nsecs_t readyTime;
+    };
+
+    std::function<void(const BlockEvent&)> mDispatch;
+    std::thread mThread;
+    int mWakeFd;
+    std::atomic<bool> mStopping;
+
+    BlockEvent mRing[kRingSize];
+    /* Next slot the producer fills and the consumer empties */
+    std::atomic<size_t> mHead;
+    std::atomic<size_t> mTail;
+
+    /* Only touched by the dispatcher thread */
+    std::deque<Pending> mPending;
+
+    /* Only touched by the listener thread */
+    int64_t mLastSeqnum;
+
+    std::atomic<uint64_t> mReceived;
+    std::atomic<uint64_t> mDispatched;
+    std::atomic<uint64_t> mCoalesced;
+    std::atomic<uint64_t> mDebounced;
+    std::atomic<uint64_t> mOverflows;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mLost;
+    std::atomic<size_t> mHighWater;
+
+    bool tryPush(BlockEvent&& event);
+    void drain();
+    void coalesce(BlockEvent&& event, nsecs_t now);
+    void run();
+
+    DISALLOW_COPY_AND_ASSIGN(UeventQueue);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
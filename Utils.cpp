@@ -15,12 +15,16 @@
  */
 
 #include "sehandle.h"
+#include "FsProbe.h"
+#include "ProbeCache.h"
 #include "Utils.h"
 #include "Process.h"
+#include "WorkerPool.h"
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include "fs/Exfat.h"
 #include "fs/Ntfs.h"
 
@@ -28,18 +32,29 @@
 #include <cutils/properties.h>
 #include <cutils/probe_module.h>
 #include <private/android_filesystem_config.h>
-#include <logwrap/logwrap.h>
 
+#include <utils/Timers.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <dirent.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <linux/quota.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
 
 #ifndef UMOUNT_NOFOLLOW
 #define UMOUNT_NOFOLLOW    0x00000008  /* Don't follow symlink on umount */
@@ -65,6 +80,31 @@ static const char* kKeyPath = "/data/misc/vold";
 
 static const char* kProcFilesystems = "/proc/filesystems";
 
+static const size_t kExecReadSize = 4096;
+/* Lines longer than this are handed over in pieces */
+static const size_t kExecMaxLineLength = 4096;
+
+static const size_t kTreeSizeThreads = 4;
+static const size_t kDirentBufferSize = 32 * 1024;
+
+static const char* kQuotaSizingProp = "persist.vold.quota_sizing";
+static const char* kProcSelfMountInfo = "/proc/self/mountinfo";
+
+static const size_t kRestoreconThreads = 4;
+
+static const char* kSigintTimeoutProp = "persist.vold.kill_sigint_ms";
+static const char* kSigtermTimeoutProp = "persist.vold.kill_sigterm_ms";
+static const char* kSigkillTimeoutProp = "persist.vold.kill_sigkill_ms";
+/* Upper bound per stage; matches the fixed sleep used historically */
+static const int kDefaultKillTimeoutMs = 5000;
+
+static const char* kFuseTimeoutProp = "persist.vold.fuse_timeout_ms";
+static const int kDefaultFuseTimeoutMs = 10000;
+
+static const char* kProcSelfMounts = "/proc/self/mounts";
+/* Without a pidfd, child death is only noticed at this cadence */
+static const int kMountDeathCheckMs = 250;
+
 status_t CreateDeviceNode(const std::string& path, dev_t dev) {
     const char* cpath = path.c_str();
     status_t res = 0;
@@ -142,47 +182,49 @@ status_t ForceUnmount(const std::string& path, bool detach /* = false */) {
     // we start sending signals
     sleep(5);
 
-    Process::killProcessesWithOpenFiles(cpath, SIGINT);
-    sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
+    static const int kSignals[] = { SIGINT, SIGTERM, SIGKILL };
+    for (int signal : kSignals) {
+        Process::killProcessesWithOpenFiles(cpath, signal, GetKillTimeoutMs(signal));
+        if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
+            return OK;
+        }
     }
 
-    Process::killProcessesWithOpenFiles(cpath, SIGTERM);
-    sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
-    }
+    return -errno;
+}
 
-    Process::killProcessesWithOpenFiles(cpath, SIGKILL);
-    sleep(5);
-    if (!umount2(cpath, UMOUNT_NOFOLLOW) || errno == EINVAL || errno == ENOENT) {
-        return OK;
+int GetKillTimeoutMs(int signal) {
+    const char* prop;
+    switch (signal) {
+    case SIGINT: prop = kSigintTimeoutProp; break;
+    case SIGTERM: prop = kSigtermTimeoutProp; break;
+    default: prop = kSigkillTimeoutProp; break;
     }
+    return property_get_int32(prop, kDefaultKillTimeoutMs);
+}
 
-    return -errno;
+int GetFuseTimeoutMs() {
+    return property_get_int32(kFuseTimeoutProp, kDefaultFuseTimeoutMs);
 }
 
 status_t KillProcessesUsingPath(const std::string& path) {
+    ATRACE_CALL();
     const char* cpath = path.c_str();
-    if (Process::killProcessesWithOpenFiles(cpath, SIGINT) == 0) {
+
+    // Each stage ends as soon as every signaled process has exited
+    if (Process::killProcessesWithOpenFiles(cpath, SIGINT, GetKillTimeoutMs(SIGINT)) == 0) {
         return OK;
     }
-    sleep(5);
-
-    if (Process::killProcessesWithOpenFiles(cpath, SIGTERM) == 0) {
+    if (Process::killProcessesWithOpenFiles(cpath, SIGTERM, GetKillTimeoutMs(SIGTERM)) == 0) {
         return OK;
     }
-    sleep(5);
-
-    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL) == 0) {
+    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL, GetKillTimeoutMs(SIGKILL)) == 0) {
         return OK;
     }
-    sleep(5);
 
     // Send SIGKILL a second time to determine if we've
     // actually killed everyone with open files
-    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL) == 0) {
+    if (Process::killProcessesWithOpenFiles(cpath, SIGKILL, GetKillTimeoutMs(SIGKILL)) == 0) {
         return OK;
     }
     PLOG(ERROR) << "Failed to kill processes using " << path;
@@ -197,7 +239,7 @@ status_t BindMount(const std::string& source, const std::string& target) {
     return OK;
 }
 
-static status_t readMetadata(const std::string& path, std::string& fsType,
+static status_t readMetadataBlkid(const std::string& path, std::string& fsType,
         std::string& fsUuid, std::string& fsLabel, bool untrusted) {
 #ifdef MINIVOLD
     char *val = NULL;
@@ -257,6 +299,72 @@ static status_t readMetadata(const std::string& path, std::string& fsType,
     return OK;
 }
 
+/*
+ * Probe results are kept per device until InvalidateMetadata(), so that
+ * mounting the same volume again doesn't hit the media or fork blkid.
+ */
+struct CachedMetadata {
+    std::string fsType;
+    std::string fsUuid;
+    std::string fsLabel;
+};
+
+static std::mutex sMetadataLock;
+static std::unordered_map<dev_t, CachedMetadata> sMetadataCache;
+
+static dev_t getBlockDevice(const std::string& path) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb) || !S_ISBLK(sb.st_mode)) {
+        return 0;
+    }
+    return sb.st_rdev;
+}
+
+static status_t readMetadata(const std::string& path, std::string& fsType,
+        std::string& fsUuid, std::string& fsLabel, bool untrusted) {
+    ATRACE_NAME("ReadMetadata");
+    dev_t device = getBlockDevice(path);
+    if (device) {
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        auto it = sMetadataCache.find(device);
+        if (it != sMetadataCache.end()) {
+            const CachedMetadata& cached = it->second;
+            if (!cached.fsType.empty()) fsType = cached.fsType;
+            if (!cached.fsUuid.empty()) fsUuid = cached.fsUuid;
+            if (!cached.fsLabel.empty()) fsLabel = cached.fsLabel;
+            return OK;
+        }
+    }
+
+    // Results from before a vold restart are as good as our own, otherwise
+    // probe natively first, only forking blkid for filesystems we don't know
+    CachedMetadata result;
+    if (!device || !LookupCachedFilesystem(device, result.fsType, result.fsUuid,
+            result.fsLabel)) {
+        status_t res = ProbeFilesystem(path, result.fsType, result.fsUuid, result.fsLabel);
+        if (res == OK && result.fsType.empty()) {
+            res = readMetadataBlkid(path, result.fsType, result.fsUuid, result.fsLabel,
+                    untrusted);
+        }
+        if (res != OK) {
+            return res;
+        }
+        if (device) {
+            StoreCachedFilesystem(device, result.fsType, result.fsUuid, result.fsLabel);
+        }
+    }
+
+    if (!result.fsType.empty()) fsType = result.fsType;
+    if (!result.fsUuid.empty()) fsUuid = result.fsUuid;
+    if (!result.fsLabel.empty()) fsLabel = result.fsLabel;
+
+    if (device) {
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        sMetadataCache[device] = result;
+    }
+    return OK;
+}
+
 status_t ReadMetadata(const std::string& path, std::string& fsType,
         std::string& fsUuid, std::string& fsLabel) {
     return readMetadata(path, fsType, fsUuid, fsLabel, false);
@@ -267,34 +375,119 @@ status_t ReadMetadataUntrusted(const std::string& path, std::string& fsType,
     return readMetadata(path, fsType, fsUuid, fsLabel, true);
 }
 
-status_t ForkExecvp(const std::vector<std::string>& args) {
-    return ForkExecvp(args, nullptr);
+void InvalidateMetadata(dev_t device) {
+    {
+        std::lock_guard<std::mutex> lock(sMetadataLock);
+        sMetadataCache.erase(device);
+    }
+    ForgetCachedFilesystem(device);
 }
 
-status_t ForkExecvp(const std::vector<std::string>& args, security_context_t context) {
-    size_t argc = args.size();
-    char** argv = (char**) calloc(argc, sizeof(char*));
-    for (size_t i = 0; i < argc; i++) {
-        argv[i] = (char*) args[i].c_str();
+void InvalidateMetadata(const std::string& path) {
+    dev_t device = getBlockDevice(path);
+    if (device) {
+        InvalidateMetadata(device);
+    }
+}
+
+static void logArgs(const std::vector<std::string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
         if (i == 0) {
             LOG(VERBOSE) << args[i];
         } else {
             LOG(VERBOSE) << "    " << args[i];
         }
     }
+}
+
+/*
+ * Starts args directly with vfork(), without going through a shell. The
+ * child's stdout and stderr are pointed at the given fds, or closed when
+ * they're -1; stdin is always closed.
+ */
+static pid_t spawnChild(const std::vector<std::string>& args, security_context_t context,
+        int outFd, int errFd) {
+    size_t argc = args.size();
+    char** argv = (char**) calloc(argc + 1, sizeof(char*));
+    for (size_t i = 0; i < argc; i++) {
+        argv[i] = (char*) args[i].c_str();
+    }
 
     if (setexeccon(context)) {
         LOG(ERROR) << "Failed to setexeccon";
         abort();
     }
-    status_t res = android_fork_execvp(argc, argv, NULL, false, true);
+    pid_t pid = vfork();
+    if (pid == 0) {
+        // Only async-signal-safe calls until exec, since we share memory
+        close(STDIN_FILENO);
+        if (outFd >= 0) {
+            dup2(outFd, STDOUT_FILENO);
+        } else {
+            close(STDOUT_FILENO);
+        }
+        if (errFd >= 0) {
+            dup2(errFd, STDERR_FILENO);
+        } else {
+            close(STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int saved = errno;
     if (setexeccon(nullptr)) {
         LOG(ERROR) << "Failed to setexeccon";
         abort();
     }
 
     free(argv);
-    return res;
+    errno = saved;
+    if (pid == -1) {
+        PLOG(ERROR) << "Failed to exec " << args[0];
+    }
+    return pid;
+}
+
+static status_t exitStatus(const std::string& name, int status) {
+    if (WIFEXITED(status)) {
+        if (WEXITSTATUS(status) == 127) {
+            LOG(ERROR) << name << " could not be executed";
+        } else if (WEXITSTATUS(status) != 0) {
+            LOG(VERBOSE) << name << " exited with status " << WEXITSTATUS(status);
+        }
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        LOG(ERROR) << name << " terminated by signal " << WTERMSIG(status);
+    }
+    return -ECHILD;
+}
+
+bool IsChildRunning(pid_t pid) {
+    int status;
+    pid_t res = TEMP_FAILURE_RETRY(waitpid(pid, &status, WNOHANG));
+    if (res == 0) {
+        return true;
+    }
+    if (res == pid) {
+        exitStatus(StringPrintf("pid %d", pid), status);
+    }
+    return false;
+}
+
+status_t ForkExecvp(const std::vector<std::string>& args) {
+    return ForkExecvp(args, nullptr);
+}
+
+status_t ForkExecvp(const std::vector<std::string>& args, security_context_t context) {
+    // Same as logwrap: child output goes to the log under its own name
+    const std::string& name = args[0];
+    return ForkExecvp(args, [&](int stream, const std::string& line) {
+        if (stream == STDERR_FILENO) {
+            LOG(WARNING) << name << ": " << line;
+        } else {
+            LOG(INFO) << name << ": " << line;
+        }
+    }, context);
 }
 
 status_t ForkExecvp(const std::vector<std::string>& args,
@@ -304,89 +497,147 @@ status_t ForkExecvp(const std::vector<std::string>& args,
 
 status_t ForkExecvp(const std::vector<std::string>& args,
         std::vector<std::string>& output, security_context_t context) {
-    std::string cmd;
-    for (size_t i = 0; i < args.size(); i++) {
-        cmd += args[i] + " ";
-        if (i == 0) {
-            LOG(VERBOSE) << args[i];
+    output.clear();
+    const std::string& name = args[0];
+    return ForkExecvp(args, [&](int stream, const std::string& line) {
+        if (stream == STDOUT_FILENO) {
+            LOG(VERBOSE) << line;
+            output.push_back(line);
         } else {
-            LOG(VERBOSE) << "    " << args[i];
+            LOG(WARNING) << name << ": " << line;
         }
-    }
-    output.clear();
+    }, context);
+}
 
-    if (setexeccon(context)) {
-        LOG(ERROR) << "Failed to setexeccon";
-        abort();
-    }
-    FILE* fp = popen(cmd.c_str(), "r");
-    if (setexeccon(nullptr)) {
-        LOG(ERROR) << "Failed to setexeccon";
-        abort();
-    }
+status_t ForkExecvp(const std::vector<std::string>& args, const ExecLineCallback& onLine,
+        security_context_t context, int timeoutMs) {
+    const std::string& name = args[0];
+    logArgs(args);
 
-    if (!fp) {
-        PLOG(ERROR) << "Failed to popen " << cmd;
+    int outPipe[2];
+    int errPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC)) {
+        PLOG(ERROR) << "Failed to create pipe";
         return -errno;
     }
-    char line[1024];
-    while (fgets(line, sizeof(line), fp) != nullptr) {
-        LOG(VERBOSE) << line;
-        output.push_back(std::string(line));
-    }
-    if (pclose(fp) != 0) {
-        PLOG(ERROR) << "Failed to pclose " << cmd;
+    if (pipe2(errPipe, O_CLOEXEC)) {
+        PLOG(ERROR) << "Failed to create pipe";
+        close(outPipe[0]);
+        close(outPipe[1]);
         return -errno;
     }
 
-    return OK;
-}
+    pid_t pid = spawnChild(args, context, outPipe[1], errPipe[1]);
+    int saved = errno;
+    close(outPipe[1]);
+    close(errPipe[1]);
+    if (pid == -1) {
+        close(outPipe[0]);
+        close(errPipe[0]);
+        return -saved;
+    }
 
-pid_t ForkExecvpAsync(const std::vector<std::string>& args) {
-    size_t argc = args.size();
-    char** argv = (char**) calloc(argc + 1, sizeof(char*));
-    for (size_t i = 0; i < argc; i++) {
-        argv[i] = (char*) args[i].c_str();
-        if (i == 0) {
-            LOG(VERBOSE) << args[i];
-        } else {
-            LOG(VERBOSE) << "    " << args[i];
+    // Hand over complete lines as soon as they arrive on either stream
+    struct pollfd fds[2] = { { outPipe[0], POLLIN, 0 }, { errPipe[0], POLLIN, 0 } };
+    const int streams[2] = { STDOUT_FILENO, STDERR_FILENO };
+    std::string partial[2];
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + milliseconds_to_nanoseconds(timeoutMs);
+    bool timedOut = false;
+    char buf[kExecReadSize];
+
+    int openCount = 2;
+    while (openCount > 0) {
+        int waitMs = -1;
+        if (timeoutMs > 0) {
+            nsecs_t remaining = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (remaining <= 0) {
+                timedOut = true;
+                break;
+            }
+            waitMs = ns2ms(remaining) + 1;
         }
-    }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
+        int res = poll(fds, 2, waitMs);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            PLOG(ERROR) << "Failed to poll " << name;
+            break;
+        }
 
-        if (execvp(argv[0], argv)) {
-            PLOG(ERROR) << "Failed to exec";
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+
+            ssize_t n = TEMP_FAILURE_RETRY(read(fds[i].fd, buf, sizeof(buf)));
+            if (n > 0) {
+                partial[i].append(buf, n);
+                size_t start = 0;
+                size_t end;
+                while ((end = partial[i].find('\n', start)) != std::string::npos) {
+                    onLine(streams[i], partial[i].substr(start, end - start));
+                    start = end + 1;
+                }
+                partial[i].erase(0, start);
+                if (partial[i].size() >= kExecMaxLineLength) {
+                    onLine(streams[i], partial[i]);
+                    partial[i].clear();
+                }
+            } else {
+                if (!partial[i].empty()) {
+                    onLine(streams[i], partial[i]);
+                    partial[i].clear();
+                }
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                openCount--;
+            }
         }
+    }
 
-        _exit(1);
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
     }
 
-    if (pid == -1) {
-        PLOG(ERROR) << "Failed to exec";
+    if (timedOut) {
+        LOG(ERROR) << name << " timed out after " << timeoutMs << "ms; killing";
+        kill(pid, SIGKILL);
     }
 
-    free(argv);
-    return pid;
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid) {
+        PLOG(ERROR) << "Failed to wait for " << name;
+        return -errno;
+    }
+    if (timedOut) {
+        return -ETIMEDOUT;
+    }
+    return exitStatus(name, status);
+}
+
+pid_t ForkExecvpAsync(const std::vector<std::string>& args) {
+    logArgs(args);
+    return spawnChild(args, nullptr, -1, -1);
 }
 
 status_t ReadRandomBytes(size_t bytes, std::string& out) {
-    out.clear();
+    out.assign(bytes, '\0');
+    status_t res = ReadRandomBytes(bytes, &out[0]);
+    if (res != OK) {
+        out.clear();
+    }
+    return res;
+}
 
+status_t ReadRandomBytes(size_t bytes, char* out) {
     int fd = TEMP_FAILURE_RETRY(open("/dev/urandom", O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
     if (fd == -1) {
         return -errno;
     }
 
-    char buf[BUFSIZ];
-    size_t n;
-    while ((n = TEMP_FAILURE_RETRY(read(fd, &buf[0], std::min(sizeof(buf), bytes)))) > 0) {
-        out.append(buf, n);
+    ssize_t n;
+    while (bytes > 0 && (n = TEMP_FAILURE_RETRY(read(fd, out, bytes))) > 0) {
+        out += n;
         bytes -= n;
     }
     close(fd);
@@ -467,10 +718,9 @@ uint64_t GetFreeBytes(const std::string& path) {
 
 // TODO: borrowed from frameworks/native/libs/diskusage/ which should
 // eventually be migrated into system/
-static int64_t stat_size(struct stat *s) {
-    int64_t blksize = s->st_blksize;
+static int64_t stat_size(int64_t blocks, int64_t blksize) {
     // count actual blocks used instead of nominal file size
-    int64_t size = s->st_blocks * 512;
+    int64_t size = blocks * 512;
 
     if (blksize) {
         /* round up to filesystem block size */
@@ -480,70 +730,200 @@ static int64_t stat_size(struct stat *s) {
     return size;
 }
 
-// TODO: borrowed from frameworks/native/libs/diskusage/ which should
-// eventually be migrated into system/
-int64_t calculate_dir_size(int dfd) {
-    int64_t size = 0;
+#if defined(__NR_statx) && defined(STATX_BLOCKS)
+static std::atomic<bool> sStatxSupported(true);
+#endif
+
+/* Returns the on-disk size of the given entry, asking only for block counts */
+static int64_t entry_size(int dfd, const char* name) {
+#if defined(__NR_statx) && defined(STATX_BLOCKS)
+    if (sStatxSupported) {
+        struct statx sx;
+        if (syscall(__NR_statx, dfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                STATX_BLOCKS, &sx) == 0) {
+            return stat_size(sx.stx_blocks, sx.stx_blksize);
+        } else if (errno != ENOSYS) {
+            return 0;
+        }
+        sStatxSupported = false;
+    }
+#endif
     struct stat s;
-    DIR *d;
-    struct dirent *de;
+    if (fstatat(dfd, name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
+        return stat_size(s.st_blocks, s.st_blksize);
+    }
+    return 0;
+}
 
-    d = fdopendir(dfd);
-    if (d == NULL) {
-        close(dfd);
-        return 0;
+/* Finds the device node holding the filesystem under path, as quotactl() wants it */
+static std::string findQuotaDevice(const std::string& path) {
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0) {
+        return "";
+    }
+    std::string mountInfo;
+    if (!ReadFileToString(kProcSelfMountInfo, &mountInfo)) {
+        return "";
     }
 
-    while ((de = readdir(d))) {
-        const char *name = de->d_name;
-        if (fstatat(dfd, name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
-            size += stat_size(&s);
+    // id parent major:minor root mountpoint options [tags...] - fstype source superoptions
+    std::string devNum(StringPrintf("%u:%u", major(sb.st_dev), minor(sb.st_dev)));
+    for (const auto& line : android::base::Split(mountInfo, "\n")) {
+        auto fields = android::base::Split(line, " ");
+        if (fields.size() < 3 || fields[2] != devNum) continue;
+        auto sep = std::find(fields.begin() + 3, fields.end(), "-");
+        if (std::distance(sep, fields.end()) < 3) continue;
+        if (android::base::StartsWith(sep[2], "/dev/")) {
+            return sep[2];
         }
-        if (de->d_type == DT_DIR) {
-            int subfd;
+    }
+    return "";
+}
 
-            /* always skip "." and ".." */
-            if (name[0] == '.') {
-                if (name[1] == 0)
-                    continue;
-                if ((name[1] == '.') && (name[2] == 0))
-                    continue;
-            }
+status_t GetQuotaBytes(const std::string& path, int type, uint32_t id, uint64_t& bytes) {
+    std::string device(findQuotaDevice(path));
+    if (device.empty()) {
+        return -ENODEV;
+    }
+    struct if_dqblk dq;
+    memset(&dq, 0, sizeof(dq));
+    if (syscall(__NR_quotactl, QCMD(Q_GETQUOTA, type), device.c_str(), id, &dq) != 0) {
+        // ESRCH means that kind of quota isn't enabled on this filesystem
+        return -errno;
+    }
+    if (!(dq.dqb_valid & QIF_SPACE)) {
+        return -ENODATA;
+    }
+    bytes = dq.dqb_curspace;
+    return OK;
+}
+
+/*
+ * Sizes the tree at dirfd from its project quota, which only works when the
+ * root carries a project id of its own that everything below inherits.
+ */
+static status_t getProjectTreeBytes(int dirfd, const std::string& path, uint64_t& bytes) {
+#if defined(FS_IOC_FSGETXATTR) && defined(FS_XFLAG_PROJINHERIT) && defined(PRJQUOTA)
+    struct fsxattr fsx;
+    if (ioctl(dirfd, FS_IOC_FSGETXATTR, &fsx) != 0) {
+        return -errno;
+    }
+    if (fsx.fsx_projid == 0 || !(fsx.fsx_xflags & FS_XFLAG_PROJINHERIT)) {
+        return -ENOENT;
+    }
+    return GetQuotaBytes(path, PRJQUOTA, fsx.fsx_projid, bytes);
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+struct TreeSizeContext {
+    int rootFd;
+    std::atomic<uint64_t> bytes;
+    WorkerPool pool;
+
+    TreeSizeContext(int rootFd) : rootFd(rootFd), bytes(0), pool(kTreeSizeThreads) {}
+};
+
+/*
+ * Sizes one directory, handing each subdirectory back to the pool so that
+ * idle threads pick up whatever part of the tree is left. Queued work is
+ * kept as paths rather than open fds to keep descriptor usage bounded.
+ */
+static void sizeDir(TreeSizeContext* ctx, const std::string& path) {
+    int dfd = path.empty() ? dup(ctx->rootFd) : openat(ctx->rootFd, path.c_str(),
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0) {
+        return;
+    }
 
-            subfd = openat(dfd, name, O_RDONLY | O_DIRECTORY);
-            if (subfd >= 0) {
-                size += calculate_dir_size(subfd);
+    uint64_t size = 0;
+    std::vector<char> buf(kDirentBufferSize);
+    int len;
+    while ((len = syscall(__NR_getdents64, dfd, buf.data(), buf.size())) > 0) {
+        for (int off = 0; off < len;) {
+            auto ent = reinterpret_cast<struct linux_dirent64*>(buf.data() + off);
+            off += ent->d_reclen;
+
+            const char* name = ent->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+            size += entry_size(dfd, name);
+            if (ent->d_type == DT_DIR) {
+                std::string childPath(path.empty() ? name : path + "/" + name);
+                ctx->pool.enqueue([ctx, childPath] { sizeDir(ctx, childPath); });
             }
         }
     }
-    closedir(d);
-    return size;
+    close(dfd);
+    ctx->bytes += size;
 }
 
 uint64_t GetTreeBytes(const std::string& path) {
-    int dirfd = open(path.c_str(), O_DIRECTORY, O_RDONLY);
+    int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     if (dirfd < 0) {
         PLOG(WARNING) << "Failed to open " << path;
         return -1;
-    } else {
-        uint64_t res = calculate_dir_size(dirfd);
+    }
+
+    uint64_t res;
+    if (property_get_bool(kQuotaSizingProp, true)
+            && getProjectTreeBytes(dirfd, path, res) == OK) {
         close(dirfd);
         return res;
     }
+
+    // The directory itself counts, like it used to with readdir() returning "."
+    res = entry_size(dirfd, ".");
+    {
+        TreeSizeContext ctx(dirfd);
+        ctx.pool.enqueue([&ctx] { sizeDir(&ctx, ""); });
+        ctx.pool.wait();
+        res += ctx.bytes;
+    }
+    close(dirfd);
+    return res;
+}
+
+uint64_t EstimateTreeBytes(const std::string& path) {
+    // Trees like media keep every file in one group, whose quota is much
+    // closer than the usage of the whole filesystem
+    struct stat st;
+    uint64_t bytes;
+    if (property_get_bool(kQuotaSizingProp, true)
+            && stat(path.c_str(), &st) == 0 && st.st_gid != AID_ROOT
+            && GetQuotaBytes(path, GRPQUOTA, st.st_gid, bytes) == OK) {
+        return bytes;
+    }
+
+    struct statvfs sb;
+    if (statvfs(path.c_str(), &sb) == 0) {
+        return (uint64_t) (sb.f_blocks - sb.f_bfree) * sb.f_bsize;
+    } else {
+        return -1;
+    }
 }
 
 bool IsFilesystemSupported(const std::string& fsType) {
+    if (IsKernelFilesystemSupported(fsType)) {
+        return true;
+    }
+    if (fsType == "ntfs" && IsKernelFilesystemSupported("ntfs3")) {
+        return true;
+    }
+    // Without a kernel driver these are mounted through FUSE helpers
+    return (fsType == "exfat" || fsType == "ntfs") && IsKernelFilesystemSupported("fuse");
+}
+
+bool IsKernelFilesystemSupported(const std::string& fsType) {
     std::string supported;
     if (!ReadFileToString(kProcFilesystems, &supported)) {
         PLOG(ERROR) << "Failed to read supported filesystems";
         return false;
     }
 
-    /* fuse filesystems */
-    supported.append("fuse\tntfs\n"
-                     "fuse\texfat\n");
-
-    if (supported.find(fsType + "\n") != std::string::npos) {
+    // Each line is an optional "nodev", a tab, then the name
+    if (supported.find("\t" + fsType + "\n") != std::string::npos) {
         return true;
     }
 
@@ -554,37 +934,113 @@ bool IsFilesystemSupported(const std::string& fsType) {
     return !access(supported.c_str(), F_OK);
 }
 
-status_t WipeBlockDevice(const std::string& path) {
-    status_t res = -1;
-    const char* c_path = path.c_str();
-    unsigned long nr_sec = 0;
-    unsigned long long range[2];
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+
+/* Keeps individual ioctls short enough to report progress and retry */
+static const uint64_t kWipeMaxChunkBytes = 256 * 1024 * 1024;
+static const size_t kWipeMaxThreads = 4;
 
-    int fd = TEMP_FAILURE_RETRY(open(c_path, O_RDWR | O_CLOEXEC));
-    if (fd == -1) {
-        PLOG(ERROR) << "Failed to open " << path;
-        goto done;
+static uint64_t readQueueAttr(dev_t device, const char* attr) {
+    // Partitions don't have their own queue; it lives on the parent disk
+    std::string base = StringPrintf("/sys/dev/block/%u:%u", major(device), minor(device));
+    std::string value;
+    if (!ReadFileToString(StringPrintf("%s/queue/%s", base.c_str(), attr), &value)
+            && !ReadFileToString(StringPrintf("%s/../queue/%s", base.c_str(), attr), &value)) {
+        return 0;
     }
+    return strtoull(value.c_str(), nullptr, 10);
+}
 
-    if ((ioctl(fd, BLKGETSIZE, &nr_sec)) == -1) {
-        PLOG(ERROR) << "Failed to determine size of " << path;
-        goto done;
+bool IsDiscardSupported(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1 || !S_ISBLK(st.st_mode)) {
+        return false;
     }
+    return readQueueAttr(st.st_rdev, "discard_max_bytes") > 0;
+}
 
-    range[0] = 0;
-    range[1] = (unsigned long long) nr_sec * 512;
+status_t WipeBlockDevice(const std::string& path, const WipeProgressCallback& onProgress) {
+    return WipeBlockDevice(path, UINT64_MAX, onProgress);
+}
 
-    LOG(INFO) << "About to discard " << range[1] << " on " << path;
-    if (ioctl(fd, BLKDISCARD, &range) == 0) {
-        LOG(INFO) << "Discard success on " << path;
-        res = 0;
-    } else {
-        PLOG(ERROR) << "Discard failure on " << path;
+status_t WipeBlockDevice(const std::string& path, uint64_t length,
+        const WipeProgressCallback& onProgress) {
+    int rawFd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    if (rawFd == -1) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return -errno;
     }
+    ScopedFd fd(rawFd);
 
-done:
-    close(fd);
-    return res;
+    struct stat st;
+    uint64_t size;
+    if (fstat(fd.get(), &st) == -1 || ioctl(fd.get(), BLKGETSIZE64, &size) == -1) {
+        PLOG(ERROR) << "Failed to determine size of " << path;
+        return -errno;
+    }
+    size = std::min(size, length);
+
+    uint64_t granularity = std::max(readQueueAttr(st.st_rdev, "discard_granularity"),
+            (uint64_t) 512);
+    uint64_t maxBytes = readQueueAttr(st.st_rdev, "discard_max_bytes");
+    if (maxBytes == 0) {
+        LOG(WARNING) << path << " doesn't support discard";
+        return -EOPNOTSUPP;
+    }
+    uint64_t chunk = std::min(maxBytes, kWipeMaxChunkBytes);
+    chunk = std::max(chunk - (chunk % granularity), granularity);
+    size_t threads = std::max((size_t) 1, std::min(kWipeMaxThreads,
+            (size_t) readQueueAttr(st.st_rdev, "nr_requests")));
+
+    LOG(INFO) << "About to discard " << size << " on " << path << " in " << chunk
+            << " byte chunks across " << threads << " threads";
+
+    std::mutex lock;
+    uint64_t doneBytes = 0;
+    int lastPercent = -1;
+    std::atomic<int> zeroedChunks(0);
+    std::atomic<int> failedChunks(0);
+    {
+        WorkerPool pool(threads);
+        for (uint64_t offset = 0; offset < size; offset += chunk) {
+            uint64_t len = std::min(chunk, size - offset);
+            pool.enqueue([&, offset, len]() {
+                uint64_t range[2] = { offset, len };
+                if (ioctl(fd.get(), BLKDISCARD, &range) == -1) {
+                    range[0] = offset;
+                    range[1] = len;
+                    if (ioctl(fd.get(), BLKZEROOUT, &range) == 0) {
+                        zeroedChunks++;
+                    } else {
+                        PLOG(ERROR) << "Failed to wipe " << len << " at " << offset
+                                << " on " << path;
+                        failedChunks++;
+                    }
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                doneBytes += len;
+                int percent = doneBytes * 100 / size;
+                if (onProgress && percent != lastPercent) {
+                    lastPercent = percent;
+                    onProgress(percent);
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    if (zeroedChunks > 0) {
+        LOG(WARNING) << "Zeroed " << zeroedChunks << " chunks that refused discard on " << path;
+    }
+    if (failedChunks > 0) {
+        LOG(ERROR) << "Discard failure on " << path;
+        return -EIO;
+    }
+    LOG(INFO) << "Discard success on " << path;
+    return OK;
 }
 
 static bool isValidFilename(const std::string& name) {
@@ -600,6 +1056,10 @@ std::string BuildKeyPath(const std::string& partGuid) {
     return StringPrintf("%s/expand_%s.key", kKeyPath, partGuid.c_str());
 }
 
+std::string BuildKeyOptionsPath(const std::string& partGuid) {
+    return StringPrintf("%s/expand_%s.opts", kKeyPath, partGuid.c_str());
+}
+
 std::string BuildDataSystemLegacyPath(userid_t userId) {
     return StringPrintf("%s/system/users/%u", BuildDataPath(nullptr).c_str(), userId);
 }
@@ -680,15 +1140,138 @@ dev_t GetDevice(const std::string& path) {
     }
 }
 
+static std::string buildQueueAttributePath(dev_t device, const std::string& name) {
+    std::string path(StringPrintf("/sys/dev/block/%u:%u/queue/%s",
+            major(device), minor(device), name.c_str()));
+    if (access(path.c_str(), F_OK) && errno == ENOENT) {
+        // Partitions share the queue of the disk they live on
+        path = StringPrintf("/sys/dev/block/%u:%u/../queue/%s",
+                major(device), minor(device), name.c_str());
+    }
+    return path;
+}
+
+status_t ReadBlockQueueAttribute(dev_t device, const std::string& name, std::string& value) {
+    std::string path(buildQueueAttributePath(device, name));
+    if (!ReadFileToString(path, &value)) {
+        PLOG(WARNING) << "Failed to read " << path;
+        return -errno;
+    }
+    value = android::base::Trim(value);
+    return OK;
+}
+
+status_t WriteBlockQueueAttribute(dev_t device, const std::string& name,
+        const std::string& value) {
+    std::string path(buildQueueAttributePath(device, name));
+    if (!android::base::WriteStringToFile(value, path)) {
+        PLOG(WARNING) << "Failed to write " << value << " to " << path;
+        return -errno;
+    }
+    return OK;
+}
+
+/* Erase units outside this range are firmware making numbers up */
+static const uint64_t kMinEraseBytes = 64 * 1024;
+static const uint64_t kMaxEraseBytes = 64 * 1024 * 1024;
+
+static uint64_t readSysfsNumber(const std::string& path) {
+    std::string tmp;
+    if (!ReadFileToString(path, &tmp)) {
+        return 0;
+    }
+    return strtoull(tmp.c_str(), nullptr, 10);
+}
+
+FlashGeometry GetFlashGeometry(dev_t device) {
+    FlashGeometry res = { 0, 0 };
+    std::string base(StringPrintf("/sys/dev/block/%u:%u", major(device), minor(device)));
+    std::string disk(base);
+    if (access((base + "/partition").c_str(), F_OK) == 0) {
+        res.offsetBytes = readSysfsNumber(base + "/start") * 512;
+        disk = base + "/..";
+    }
+
+    uint64_t candidates[] = {
+        readSysfsNumber(disk + "/device/preferred_erase_size"),
+        readSysfsNumber(disk + "/queue/discard_granularity"),
+        readSysfsNumber(disk + "/queue/optimal_io_size"),
+    };
+    for (uint64_t bytes : candidates) {
+        if (bytes >= kMinEraseBytes && bytes <= kMaxEraseBytes
+                && (bytes & (bytes - 1)) == 0 && bytes > res.eraseBytes) {
+            res.eraseBytes = bytes;
+        }
+    }
+    return res;
+}
+
+static bool allMounted(const std::vector<std::string>& paths, const std::vector<dev_t>& before) {
+    for (size_t i = 0; i < paths.size(); i++) {
+        struct stat sb;
+        if (stat(paths[i].c_str(), &sb) || sb.st_dev == before[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+status_t WaitForMounts(pid_t pid, const std::vector<std::string>& paths,
+        const std::vector<dev_t>& before, int timeoutMs) {
+    ATRACE_CALL();
+    // The kernel flags this fd with POLLPRI whenever our mount table
+    // changes, so each new mount wakes us immediately
+    int rawFd = TEMP_FAILURE_RETRY(open(kProcSelfMounts, O_RDONLY | O_CLOEXEC));
+    if (rawFd == -1) {
+        PLOG(ERROR) << "Failed to open " << kProcSelfMounts;
+        return -errno;
+    }
+    ScopedFd mountsFd(rawFd);
+
+    int pidfd = -1;
+#ifdef __NR_pidfd_open
+    pidfd = syscall(__NR_pidfd_open, pid, 0);
+#endif
+    ScopedFd childFd(pidfd);
+
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + milliseconds_to_nanoseconds(timeoutMs);
+    while (!allMounted(paths, before)) {
+        int status;
+        if (TEMP_FAILURE_RETRY(waitpid(pid, &status, WNOHANG)) == pid) {
+            LOG(ERROR) << "pid " << pid << " exited before mounting " << paths.back();
+            return -ECHILD;
+        }
+
+        int remainingMs = ns2ms(deadline - systemTime(SYSTEM_TIME_MONOTONIC));
+        if (remainingMs <= 0) {
+            LOG(ERROR) << "Timed out after " << timeoutMs << "ms waiting for pid " << pid
+                    << " to mount " << paths.back();
+            kill(pid, SIGKILL);
+            TEMP_FAILURE_RETRY(waitpid(pid, nullptr, 0));
+            return -ETIMEDOUT;
+        }
+
+        struct pollfd pfds[2] = {
+            { mountsFd.get(), POLLPRI, 0 },
+            { childFd.get(), POLLIN, 0 },
+        };
+        int waitMs = (pidfd >= 0) ? remainingMs : std::min(remainingMs, kMountDeathCheckMs);
+        if (poll(pfds, (pidfd >= 0) ? 2 : 1, waitMs) == -1 && errno != EINTR) {
+            PLOG(ERROR) << "Failed to poll " << kProcSelfMounts;
+            return -errno;
+        }
+    }
+    return OK;
+}
+
 std::string DefaultFstabPath() {
     char hardware[PROPERTY_VALUE_MAX];
     property_get("ro.hardware", hardware, "");
     return StringPrintf("/fstab.%s", hardware);
 }
 
-status_t RestoreconRecursive(const std::string& path) {
-    LOG(VERBOSE) << "Starting restorecon of " << path;
-
+/* Asks init to relabel; only used when we have no file contexts ourselves */
+static status_t RestoreconViaInit(const std::string& path) {
     // TODO: find a cleaner way of waiting for restorecon to finish
     const char* cpath = path.c_str();
     property_set("selinux.restorecon_recursive", "");
@@ -702,9 +1285,69 @@ status_t RestoreconRecursive(const std::string& path) {
         }
         usleep(100000); // 100ms
     }
+    return OK;
+}
+
+status_t RestoreconRecursive(const std::string& path, bool skipUnchanged) {
+    ATRACE_CALL();
+    LOG(VERBOSE) << "Starting restorecon of " << path;
+    if (!sehandle) {
+        RestoreconViaInit(path);
+        LOG(VERBOSE) << "Finished restorecon of " << path;
+        return OK;
+    }
+
+    // main() handed our sehandle to libselinux, so these calls reuse it.
+    // Without FORCE, libselinux skips any tree whose stored file_contexts
+    // digest still matches.
+    unsigned int flags = skipUnchanged ? 0 : SELINUX_ANDROID_RESTORECON_FORCE;
+    if (selinux_android_restorecon(path.c_str(), flags) != 0) {
+        PLOG(ERROR) << "Failed to restorecon " << path;
+        return -errno;
+    }
+
+    std::unique_ptr<DIR, int (*)(DIR*)> dirp(opendir(path.c_str()), closedir);
+    if (!dirp) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return -errno;
+    }
+
+    // Walk each top-level subtree on its own thread; files directly
+    // under the root are cheap enough to label inline
+    std::atomic<int> failed(0);
+    {
+        WorkerPool pool(std::min(kRestoreconThreads,
+                (size_t) std::max(1u, std::thread::hardware_concurrency())));
+        struct dirent* ent;
+        while ((ent = readdir(dirp.get())) != nullptr) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+            std::string child(path + "/" + ent->d_name);
+            bool isDir = (ent->d_type == DT_DIR);
+            if (ent->d_type == DT_UNKNOWN) {
+                // Some filesystems don't fill in d_type, so ask the inode
+                struct stat sb;
+                isDir = fstatat(dirfd(dirp.get()), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+                        && S_ISDIR(sb.st_mode);
+            }
+            if (!isDir) {
+                if (selinux_android_restorecon(child.c_str(), flags) != 0) {
+                    PLOG(WARNING) << "Failed to restorecon " << child;
+                    failed++;
+                }
+                continue;
+            }
+            pool.enqueue([child, flags, &failed]() {
+                if (selinux_android_restorecon(child.c_str(),
+                        flags | SELINUX_ANDROID_RESTORECON_RECURSE) != 0) {
+                    PLOG(WARNING) << "Failed to restorecon " << child;
+                    failed++;
+                }
+            });
+        }
+    }
 
     LOG(VERBOSE) << "Finished restorecon of " << path;
-    return OK;
+    return failed ? -EIO : OK;
 }
 
 status_t SaneReadLinkAt(int dirfd, const char* path, char* buf, size_t bufsiz) {
@@ -21,6 +21,7 @@
 #include <cutils/multiuser.h>
 #include <selinux/selinux.h>
 
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -34,6 +35,15 @@
 
 struct DIR;
 
+/* Record layout returned by getdents64(), which bionic doesn't declare */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
 namespace android {
 namespace vold {
 
@@ -55,6 +65,12 @@ status_t ForceUnmount(const std::string& path, bool detach = false);
 /* Kills any processes using given path */
 status_t KillProcessesUsingPath(const std::string& path);
 
+/* Returns how long to wait for processes to exit after the given signal */
+int GetKillTimeoutMs(int signal);
+
+/* Returns how long to wait for a FUSE daemon to mount all its views */
+int GetFuseTimeoutMs();
+
 /* Creates bind mount from source to target */
 status_t BindMount(const std::string& source, const std::string& target);
 
@@ -66,6 +82,10 @@ status_t ReadMetadata(const std::string& path, std::string& fsType,
 status_t ReadMetadataUntrusted(const std::string& path, std::string& fsType,
         std::string& fsUuid, std::string& fsLabel);
 
+/* Drops any cached metadata for the given device, e.g. after it changed */
+void InvalidateMetadata(dev_t device);
+void InvalidateMetadata(const std::string& path);
+
 /* Returns either WEXITSTATUS() status, or a negative errno */
 status_t ForkExecvp(const std::vector<std::string>& args);
 status_t ForkExecvp(const std::vector<std::string>& args, security_context_t context);
@@ -75,9 +95,25 @@ status_t ForkExecvp(const std::vector<std::string>& args,
 status_t ForkExecvp(const std::vector<std::string>& args,
         std::vector<std::string>& output, security_context_t context);
 
+/* Receives each line a child prints, from STDOUT_FILENO or STDERR_FILENO */
+typedef std::function<void(int stream, const std::string& line)> ExecLineCallback;
+
+/*
+ * Executes args directly, without a shell, handing each line of output to
+ * onLine as it arrives. When timeoutMs is positive, the child is killed
+ * once it runs that long and -ETIMEDOUT is returned.
+ */
+status_t ForkExecvp(const std::vector<std::string>& args, const ExecLineCallback& onLine,
+        security_context_t context, int timeoutMs = -1);
+
 pid_t ForkExecvpAsync(const std::vector<std::string>& args);
 
+/* Checks whether the given child is still running, reaping it if not */
+bool IsChildRunning(pid_t pid);
+
 status_t ReadRandomBytes(size_t bytes, std::string& out);
+/* Fills the caller's buffer directly, for key material that mustn't be copied */
+status_t ReadRandomBytes(size_t bytes, char* out);
 
 /* Converts hex string to raw bytes, ignoring [ :-] */
 status_t HexToStr(const std::string& hex, std::string& str);
@@ -87,14 +123,37 @@ status_t StrToHex(const std::string& str, std::string& hex);
 status_t NormalizeHex(const std::string& in, std::string& out);
 
 uint64_t GetFreeBytes(const std::string& path);
+/* Returns bytes charged to id under the given USRQUOTA, GRPQUOTA or PRJQUOTA
+ * on the filesystem holding path, or -ESRCH when that quota isn't enabled */
+status_t GetQuotaBytes(const std::string& path, int type, uint32_t id, uint64_t& bytes);
+/* Returns exact bytes used by the tree at path, from its project quota when
+ * the root has an inherited project id, otherwise walking it in parallel */
 uint64_t GetTreeBytes(const std::string& path);
+/* Returns a quick estimate for GetTreeBytes() from quota or filesystem counters */
+uint64_t EstimateTreeBytes(const std::string& path);
 
+/* True when vold can mount fsType, natively or through a FUSE helper */
 bool IsFilesystemSupported(const std::string& fsType);
+/* True when the kernel has a driver for fsType, built in or as a module */
+bool IsKernelFilesystemSupported(const std::string& fsType);
+/* True when the block device at path accepts discard requests */
+bool IsDiscardSupported(const std::string& path);
 
-/* Wipes contents of block device at given path */
-status_t WipeBlockDevice(const std::string& path);
+typedef std::function<void(int percent)> WipeProgressCallback;
+
+/*
+ * Wipes contents of block device at given path, discarding it in chunks
+ * sized from the queue limits and zeroing any chunk that refuses discard.
+ * Progress is reported as a percentage from the worker threads.
+ */
+status_t WipeBlockDevice(const std::string& path,
+        const WipeProgressCallback& onProgress = nullptr);
+/* Same, stopping after the first length bytes so a trailing footer survives */
+status_t WipeBlockDevice(const std::string& path, uint64_t length,
+        const WipeProgressCallback& onProgress = nullptr);
 
 std::string BuildKeyPath(const std::string& partGuid);
+std::string BuildKeyOptionsPath(const std::string& partGuid);
 
 std::string BuildDataSystemLegacyPath(userid_t userid);
 std::string BuildDataSystemCePath(userid_t userid);
@@ -112,9 +171,46 @@ std::string BuildDataUserDePath(const char* volumeUuid, userid_t userid);
 
 dev_t GetDevice(const std::string& path);
 
+/*
+ * Reads or writes an attribute under /sys/block/<dev>/queue for the given
+ * block device, using the whole disk's queue when device is a partition.
+ */
+status_t ReadBlockQueueAttribute(dev_t device, const std::string& name, std::string& value);
+status_t WriteBlockQueueAttribute(dev_t device, const std::string& name,
+        const std::string& value);
+
+/* Flash layout behind a block device, in bytes */
+struct FlashGeometry {
+    /* Erase block or allocation unit size, or 0 when nothing's reported */
+    uint64_t eraseBytes;
+    /* Where the device starts on its disk, when it's a partition */
+    uint64_t offsetBytes;
+};
+
+/*
+ * Reads the flash geometry of the given block device from the SD card's
+ * preferred_erase_size and the queue's discard_granularity and
+ * optimal_io_size, picking the largest plausible unit.
+ */
+FlashGeometry GetFlashGeometry(dev_t device);
+
+/*
+ * Waits for the child pid to mount something over each of the given paths,
+ * as seen by st_dev moving away from the matching before value. Wakes on
+ * mount table changes rather than polling. Fails fast when the child
+ * exits, and kills it once timeoutMs passes.
+ */
+status_t WaitForMounts(pid_t pid, const std::vector<std::string>& paths,
+        const std::vector<dev_t>& before, int timeoutMs);
+
 std::string DefaultFstabPath();
 
-status_t RestoreconRecursive(const std::string& path);
+/*
+ * Relabels path and everything below it in-process, walking top-level
+ * subtrees in parallel. With skipUnchanged, subtrees whose recorded
+ * file_contexts digest is current are left alone.
+ */
+status_t RestoreconRecursive(const std::string& path, bool skipUnchanged = false);
 
 status_t SaneReadLinkAt(int dirfd, const char* path, char* buf, size_t bufsiz);
 
@@ -16,6 +16,26 @@
 
 #include "VoldCommand.h"
 
+#include <android-base/stringprintf.h>
+
+#include <errno.h>
+
 VoldCommand::VoldCommand(const char *cmd) :
               FrameworkCommand(cmd)  {
 }
+
+QueuedReply::QueuedReply(SocketClient *cli, int cmdNum) :
+        mClient(cli), mCmdNum(cmdNum) {
+}
+
+QueuedReply::~QueuedReply() {
+    mClient->decRef();
+}
+
+int QueuedReply::sendMsg(int code, const char *msg, bool addErrno) {
+    // Same "<code> <cmdNum> <msg>" framing the client itself would produce
+    int savedErrno = errno;
+    std::string tagged(android::base::StringPrintf("%d %s", mCmdNum, msg));
+    errno = savedErrno;
+    return mClient->sendMsg(code, tagged.c_str(), addErrno, false);
+}
@@ -18,6 +18,7 @@
 #define _VOLD_COMMAND_H
 
 #include <sysutils/FrameworkCommand.h>
+#include <sysutils/SocketClient.h>
 
 class VoldCommand : public FrameworkCommand {
 public:
@@ -25,4 +26,30 @@ public:
     virtual ~VoldCommand() {}
 };
 
+/*
+ * Where a command that finishes off the listener thread sends its replies.
+ * They go out through the client the command came from, so they stay
+ * serialized with its other replies and with broadcasts, but carry the
+ * sequence number the command arrived with instead of the client's latest.
+ * Takes over a reference the caller already holds on the client.
+ */
+class QueuedReply {
+public:
+    QueuedReply(SocketClient *cli, int cmdNum);
+    ~QueuedReply();
+
+    int sendMsg(int code, const char *msg, bool addErrno);
+
+    int getCmdNum() const { return mCmdNum; }
+    uid_t getUid() const { return mClient->getUid(); }
+    int getSocket() const { return mClient->getSocket(); }
+
+private:
+    SocketClient *mClient;
+    int mCmdNum;
+
+    QueuedReply(const QueuedReply&) = delete;
+    QueuedReply& operator=(const QueuedReply&) = delete;
+};
+
 #endif
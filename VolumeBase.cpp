@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include "EventBatch.h"
+#include "OperationStats.h"
 #include "Utils.h"
 #include "VolumeBase.h"
 #include "VolumeManager.h"
@@ -21,6 +23,7 @@
 
 #include <android-base/stringprintf.h>
 #include <android-base/logging.h>
+#include <utils/Timers.h>
 
 #include <fcntl.h>
 #include <stdlib.h>
@@ -37,7 +40,7 @@ namespace vold {
 
 VolumeBase::VolumeBase(Type type) :
         mType(type), mMountFlags(0), mMountUserId(-1), mCreated(false), mState(
-                State::kUnmounted), mSilent(false) {
+                State::kUnmounted), mSilent(false), mHidden(false), mSilentBeforeHide(false) {
 }
 
 VolumeBase::~VolumeBase() {
@@ -56,6 +59,7 @@ status_t VolumeBase::setDiskId(const std::string& diskId) {
     }
 
     mDiskId = diskId;
+    mHostDiskId = diskId;
     return OK;
 }
 
@@ -133,25 +137,32 @@ status_t VolumeBase::setInternalPath(const std::string& internalPath) {
 
 void VolumeBase::notifyEvent(int event) {
     if (mSilent) return;
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            getId().c_str(), false);
+    SendBroadcast(event, getId());
 }
 
 void VolumeBase::notifyEvent(int event, const std::string& value) {
     if (mSilent) return;
-    VolumeManager::Instance()->getBroadcaster()->sendBroadcast(event,
-            StringPrintf("%s %s", getId().c_str(), value.c_str()).c_str(), false);
+    SendBroadcast(event, StringPrintf("%s %s", getId().c_str(), value.c_str()));
 }
 
 void VolumeBase::addVolume(const std::shared_ptr<VolumeBase>& volume) {
+    volume->mHostDiskId = mHostDiskId;
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     mVolumes.push_back(volume);
 }
 
 void VolumeBase::removeVolume(const std::shared_ptr<VolumeBase>& volume) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     mVolumes.remove(volume);
 }
 
+std::list<std::shared_ptr<VolumeBase>> VolumeBase::getVolumes() {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
+    return mVolumes;
+}
+
 std::shared_ptr<VolumeBase> VolumeBase::findVolume(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mVolumesLock);
     for (auto vol : mVolumes) {
         if (vol->getId() == id) {
             return vol;
@@ -166,6 +177,8 @@ status_t VolumeBase::create() {
     }
 
     mCreated = true;
+    ScopedEventBatch batch;
+    VolumeManager::Instance()->registerVolume(shared_from_this());
     notifyEvent(ResponseCode::VolumeCreated,
             StringPrintf("%d \"%s\" \"%s\"", mType, mDiskId.c_str(), mPartGuid.c_str()));
     status_t res = doCreate();
@@ -192,6 +205,11 @@ status_t VolumeBase::destroy() {
     notifyEvent(ResponseCode::VolumeDestroyed);
     status_t res = doDestroy();
     mCreated = false;
+    VolumeManager::Instance()->unregisterVolume(this);
+    if (mHidden) {
+        mHidden = false;
+        mSilent = mSilentBeforeHide;
+    }
     return res;
 }
 
@@ -205,8 +223,10 @@ status_t VolumeBase::mount() {
         return -EBUSY;
     }
 
+    OperationTimer timer("mount", getId());
     setState(State::kChecking);
     status_t res = doMount();
+    timer.setResult(res);
     if (res == OK) {
         setState(State::kMounted);
     } else {
@@ -222,20 +242,142 @@ status_t VolumeBase::unmount(bool detach /* = false */) {
         return -EBUSY;
     }
 
+    OperationTimer timer("unmount", getId());
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
     setState(State::kEjecting);
-    for (auto vol : mVolumes) {
+    std::list<std::shared_ptr<VolumeBase>> volumes;
+    {
+        std::lock_guard<std::mutex> lock(mVolumesLock);
+        volumes.swap(mVolumes);
+    }
+    for (auto vol : volumes) {
         if (vol->destroy()) {
             LOG(WARNING) << getId() << " failed to destroy " << vol->getId()
                     << " stacked above";
         }
     }
-    mVolumes.clear();
 
     status_t res = doUnmount(detach);
+    timer.setResult(res);
     setState(State::kUnmounted);
+    LOG(INFO) << getId() << " unmounted in "
+            << nanoseconds_to_milliseconds(systemTime(SYSTEM_TIME_BOOTTIME) - start) << "ms";
     return res;
 }
 
+status_t VolumeBase::hide() {
+    if (mHidden) {
+        return OK;
+    }
+    if (!mCreated || !getVolumes().empty() || ((mState != State::kMounted)
+            && (mState != State::kUnmounted) && (mState != State::kUnmountable))) {
+        LOG(WARNING) << getId() << " hide requires state mounted or unmounted, nothing stacked";
+        return -EBUSY;
+    }
+
+    bool mounted = (mState == State::kMounted);
+    State prior = mState;
+    // Quietly enter checking, so doHide() may publish the internal path
+    mState = State::kChecking;
+    status_t res = doHide(mounted);
+    if (res != OK) {
+        mState = prior;
+        return res;
+    }
+
+    // Mirror the events destroy() would have sent, then go quiet
+    if (mounted) {
+        setState(State::kEjecting);
+        setState(State::kUnmounted);
+        notifyEvent(ResponseCode::VolumeStateChanged, StringPrintf("%d", State::kBadRemoval));
+    } else {
+        setState(State::kUnmounted);
+        notifyEvent(ResponseCode::VolumeStateChanged, StringPrintf("%d", State::kRemoved));
+    }
+    notifyEvent(ResponseCode::VolumeDestroyed);
+    mSilentBeforeHide = mSilent;
+    mSilent = true;
+    mHidden = true;
+    return OK;
+}
+
+status_t VolumeBase::unhide() {
+    if (!mHidden) {
+        return OK;
+    }
+    status_t res = doUnhide();
+    mHidden = false;
+    mSilent = mSilentBeforeHide;
+    notifyEvent(ResponseCode::VolumeCreated,
+            StringPrintf("%d \"%s\" \"%s\"", mType, mDiskId.c_str(), mPartGuid.c_str()));
+    setState(State::kUnmounted);
+    return res;
+}
+
+status_t VolumeBase::doHide(bool /* mounted */) {
+    return -EOPNOTSUPP;
+}
+
+status_t VolumeBase::doUnhide() {
+    return OK;
+}
+
+bool VolumeBase::isConsistent() {
+    if (!mCreated) {
+        return false;
+    }
+    if (mHidden) {
+        return true;
+    }
+    switch (mState) {
+    case State::kUnmounted:
+    case State::kUnmountable:
+        break;
+    case State::kMounted:
+        if (!isMountAlive()) {
+            LOG(WARNING) << getId() << " lost the daemon serving its mount";
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+    for (auto vol : getVolumes()) {
+        if (!vol->isConsistent()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void VolumeBase::replay() {
+    if (mSilent) return;
+
+    ScopedEventBatch batch;
+    notifyEvent(ResponseCode::VolumeCreated,
+            StringPrintf("%d \"%s\" \"%s\"", mType, mDiskId.c_str(), mPartGuid.c_str()));
+    doReplay();
+    if (mState == State::kMounted) {
+        if (!mPath.empty()) {
+            notifyEvent(ResponseCode::VolumePathChanged, mPath);
+        }
+        if (!mInternalPath.empty()) {
+            notifyEvent(ResponseCode::VolumeInternalPathChanged, mInternalPath);
+        }
+    }
+    notifyEvent(ResponseCode::VolumeStateChanged, StringPrintf("%d", mState));
+    for (auto vol : getVolumes()) {
+        vol->replay();
+    }
+}
+
+void VolumeBase::doReplay() {
+}
+
+bool VolumeBase::isMountAlive() {
+    return true;
+}
+
 status_t VolumeBase::format(const std::string& fsType) {
     if (mState == State::kMounted) {
         unmount();
@@ -246,8 +388,10 @@ status_t VolumeBase::format(const std::string& fsType) {
         return -EBUSY;
     }
 
+    OperationTimer timer("format", getId());
     setState(State::kFormatting);
     status_t res = doFormat(fsType);
+    timer.setResult(res);
     setState(State::kUnmounted);
     return res;
 }
@@ -24,6 +24,8 @@
 
 #include <sys/types.h>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 
 namespace android {
@@ -43,7 +45,7 @@ namespace vold {
  * When an unmount is requested, the volume recursively unmounts any stacked
  * volumes and removes any bind mounts before finally unmounting itself.
  */
-class VolumeBase {
+class VolumeBase : public std::enable_shared_from_this<VolumeBase> {
 public:
     virtual ~VolumeBase();
 
@@ -76,6 +78,8 @@ public:
 
     const std::string& getId() { return mId; }
     const std::string& getDiskId() { return mDiskId; }
+    /* Disk this volume, or the volume it's stacked on, lives on */
+    const std::string& getHostDiskId() { return mHostDiskId; }
     const std::string& getPartGuid() { return mPartGuid; }
     Type getType() { return mType; }
     int getMountFlags() { return mMountFlags; }
@@ -89,7 +93,10 @@ public:
     status_t setMountFlags(int mountFlags);
     status_t setMountUserId(userid_t mountUserId);
     status_t setSilent(bool silent);
+    bool getSilent() { return mSilent; }
 
+    /* Snapshot of the volumes currently stacked on this one */
+    std::list<std::shared_ptr<VolumeBase>> getVolumes();
     void addVolume(const std::shared_ptr<VolumeBase>& volume);
     void removeVolume(const std::shared_ptr<VolumeBase>& volume);
 
@@ -101,6 +108,28 @@ public:
     status_t unmount(bool detach = false);
     status_t format(const std::string& fsType);
 
+    /*
+     * Takes the volume away from userspace for a short maintenance window,
+     * such as a move, without a destroy/create cycle. Only what apps see is
+     * torn down; getInternalPath() stays valid and the volume goes silent.
+     * The framework sees the same events as destroy(). Volumes that can't
+     * do this return -EOPNOTSUPP.
+     */
+    status_t hide();
+    /* Announces a hidden volume again as newly created and unmounted */
+    status_t unhide();
+    bool isHidden() { return mHidden; }
+
+    /*
+     * Whether this volume, and everything stacked on it, has settled in a
+     * state that can be handed to a freshly connected framework as is:
+     * created, not in the middle of a transition, and with any mount still
+     * backed by a live daemon.
+     */
+    bool isConsistent();
+    /* Sends the events a framework needs to rebuild this volume's state */
+    void replay();
+
 protected:
     explicit VolumeBase(Type type);
 
@@ -109,6 +138,14 @@ protected:
     virtual status_t doMount() = 0;
     virtual status_t doUnmount(bool detach = false) = 0;
     virtual status_t doFormat(const std::string& fsType);
+    /* Tears down userspace access, and publishes the internal path */
+    virtual status_t doHide(bool mounted);
+    /* Releases whatever doHide() left in place before the next mount */
+    virtual status_t doUnhide();
+    /* Re-sends any volume-specific metadata during replay() */
+    virtual void doReplay();
+    /* Checks that whatever serves the mount is still running */
+    virtual bool isMountAlive();
 
     status_t setId(const std::string& id);
     status_t setPath(const std::string& path);
@@ -122,6 +159,7 @@ private:
     std::string mId;
     /* ID that uniquely references parent disk while alive */
     std::string mDiskId;
+    std::string mHostDiskId;
     /* Partition GUID of this volume */
     std::string mPartGuid;
     /* Volume type */
@@ -140,9 +178,13 @@ private:
     std::string mInternalPath;
     /* Flag indicating that volume should emit no events */
     bool mSilent;
+    /* Flag indicating volume is hidden, and mSilent before it was */
+    bool mHidden;
+    bool mSilentBeforeHide;
 
-    /* Volumes stacked on top of this volume */
+    /* Volumes stacked on top of this volume, guarded by mVolumesLock */
     std::list<std::shared_ptr<VolumeBase>> mVolumes;
+    std::mutex mVolumesLock;
 
     void setState(State state);
 
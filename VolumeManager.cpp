@@ -14,10 +14,11 @@
  * limitations under the License.
  */
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fts.h>
+#include <inttypes.h>
 #include <mntent.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,14 +32,24 @@
 
 #include <linux/kdev_t.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <set>
+#include <thread>
+
 #define LOG_TAG "Vold"
 
 #include <openssl/md5.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <cutils/fs.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <selinux/android.h>
 
@@ -47,16 +58,22 @@
 #include <private/android_filesystem_config.h>
 
 #include "Benchmark.h"
+#include "BenchmarkHistory.h"
+#include "DiskMatcher.h"
 #include "EmulatedVolume.h"
 #include "VolumeManager.h"
+#include "MountNamespace.h"
 #include "NetlinkManager.h"
+#include "OperationStats.h"
 #include "ResponseCode.h"
 #include "Loop.h"
 #include "fs/Ext4.h"
 #include "fs/Vfat.h"
 #include "Utils.h"
 #include "Devmapper.h"
+#include "DmControl.h"
 #include "Process.h"
+#include "StorageWear.h"
 #include "Asec.h"
 #include "VoldUtil.h"
 #include "cryptfs.h"
@@ -90,6 +107,22 @@ const char *VolumeManager::LOOPDIR           = "/mnt/obb";
 
 static const char* kUserMountPath = "/mnt/user";
 
+static const size_t kDiskPoolThreads = 4;
+/* Threads chowning the subtrees of an ASEC in parallel */
+static const size_t kAsecFixupThreads = 4;
+
+/* Bounds how long shutdown and unmountAll wait on all volumes together */
+static const char* kShutdownTimeoutProp = "persist.vold.shutdown_timeout_ms";
+static const int kDefaultShutdownTimeoutMs = 15000;
+
+/* Lets reset() keep settled disks and volumes, only replaying their events */
+static const char* kIncrementalResetProp = "persist.vold.incremental_reset";
+
+static const char* kObbDirectIoProp = "persist.vold.obb_direct_io";
+static const char* kObbReadAheadProp = "persist.vold.obb_read_ahead_kb";
+/* OBBs are mostly large assets read front to back */
+static const int kDefaultObbReadAheadKb = 512;
+
 /* writes superblock at end of file or device given by name */
 static int writeSuperBlock(const char* name, struct asec_superblock *sb, unsigned int numImgSectors) {
     int sbfd = open(name, O_RDWR | O_CLOEXEC);
@@ -178,17 +211,10 @@ static int setupDevMapperDevice(char* buffer, size_t len, const char* loopDevice
 
 static void waitForDevMapper(const char *dmDevice) {
     /*
-     * Wait for the device mapper node to be created. Sometimes it takes a
-     * while. Wait for up to 1 second. We could also inspect incoming uevents,
-     * but that would take more effort.
+     * Devmapper creates the node itself, so this only waits out the mapping
+     * becoming openable. Give it up to 1 second.
      */
-    int tries = 25;
-    while (tries--) {
-        if (!access(dmDevice, F_OK) || errno != ENOENT) {
-            break;
-        }
-        usleep(40 * 1000);
-    }
+    dm_wait_for_device(dmDevice, 1000);
 }
 
 VolumeManager *VolumeManager::sInstance = NULL;
@@ -201,16 +227,17 @@ VolumeManager *VolumeManager::Instance() {
 
 VolumeManager::VolumeManager() {
     mDebug = false;
-    mActiveContainers = new AsecIdCollection();
     mBroadcaster = NULL;
+    mCryptBroadcaster = NULL;
     mUmsSharingCount = 0;
     mSavedDirtyRatio = -1;
     // set dirty ratio to 0 when UMS is active
     mUmsDirtyRatio = 0;
+    mDiskPool.reset(new android::vold::WorkerPool(kDiskPoolThreads));
+    setDisks(std::make_shared<DiskList>());
 }
 
 VolumeManager::~VolumeManager() {
-    delete mActiveContainers;
 }
 
 char *VolumeManager::asecHash(const char *id, char *buffer, size_t len) {
@@ -262,6 +289,24 @@ int VolumeManager::start() {
             new android::vold::EmulatedVolume("/data/media"));
     mInternalEmulated->create();
 
+    // Virtual block devices never match a DiskSource, so their events can
+    // be rejected by major alone
+    std::string devices;
+    if (android::base::ReadFileToString("/proc/devices", &devices)) {
+        bool block = false;
+        for (const auto& line : android::base::Split(devices, "\n")) {
+            int major;
+            char name[32];
+            if (line == "Block devices:") {
+                block = true;
+            } else if (block && sscanf(line.c_str(), "%d %31s", &major, name) == 2
+                    && (!strcmp(name, "loop") || !strcmp(name, "device-mapper")
+                            || !strcmp(name, "ramdisk") || !strcmp(name, "zram"))) {
+                mVirtualMajors.insert(major);
+            }
+        }
+    }
+
     return 0;
 }
 
@@ -272,59 +317,71 @@ int VolumeManager::stop() {
     return 0;
 }
 
-void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
+void VolumeManager::handleBlockEvent(const android::vold::BlockEvent& evt) {
     std::lock_guard<std::mutex> lock(mLock);
 
+    const std::string& eventPath = evt.path;
+    const std::string& devType = evt.devType;
+    dev_t device = evt.device;
+    int major = major(device);
+    int minor = minor(device);
+
     if (mDebug) {
         LOG(VERBOSE) << "----------------";
-        LOG(VERBOSE) << "handleBlockEvent with action " << (int) evt->getAction();
-        evt->dump();
+        LOG(VERBOSE) << "handleBlockEvent with action " << (int) evt.action << " for "
+                << eventPath << " (" << devType << " " << major << ":" << minor << ")";
     }
 
-    std::string eventPath(evt->findParam("DEVPATH")?evt->findParam("DEVPATH"):"");
-    std::string devType(evt->findParam("DEVTYPE")?evt->findParam("DEVTYPE"):"");
+    // Whatever was on the device before may be gone now, partitions included
+    if (evt.action == NetlinkEvent::Action::kChange
+            || evt.action == NetlinkEvent::Action::kRemove) {
+        android::vold::InvalidateMetadata(device);
+    }
 
     if (devType != "disk") return;
 
-    int major = atoi(evt->findParam("MAJOR"));
-    int minor = atoi(evt->findParam("MINOR"));
-    dev_t device = makedev(major, minor);
-
-    switch (evt->getAction()) {
+    switch (evt.action) {
     case NetlinkEvent::Action::kAdd: {
-        for (auto source : mDiskSources) {
-            if (source->matches(eventPath)) {
-                // For now, assume that MMC and virtio-blk (the latter is
-                // emulator-specific; see Disk.cpp for details) devices are SD,
-                // and that everything else is USB
-                int flags = source->getFlags();
-                if (major == android::vold::Disk::kMajorBlockMmc
-                        || android::vold::Disk::isVirtioBlkDevice(major)) {
-                    flags |= android::vold::Disk::Flags::kSd;
-                } else if (major == android::vold::Disk::kMajorBlockCdrom) {
-                    flags |= android::vold::Disk::Flags::kCdrom;
-                } else {
-                    flags |= android::vold::Disk::Flags::kUsb;
-                }
-
-                android::vold::Disk* disk = (source->getPartNum() == -1) ?
-                        new android::vold::Disk(eventPath, device,
-                                source->getNickname(), flags) :
-                        new android::vold::DiskPartition(eventPath, device,
-                                source->getNickname(), flags,
-                                source->getPartNum(),
-                                source->getFsType(), source->getMntOpts());
-                disk->create();
-                mDisks.push_back(std::shared_ptr<android::vold::Disk>(disk));
-                break;
+        if (mVirtualMajors.count(major)) break;
+        int index = mDiskMatcher.match(eventPath);
+        if (index != -1) {
+            auto source = mDiskSources[index];
+            // For now, assume that MMC and virtio-blk (the latter is
+            // emulator-specific; see Disk.cpp for details) devices are SD,
+            // and that everything else is USB
+            int flags = source->getFlags();
+            if (major == android::vold::Disk::kMajorBlockMmc
+                    || android::vold::Disk::isVirtioBlkDevice(major)) {
+                flags |= android::vold::Disk::Flags::kSd;
+            } else if (major == android::vold::Disk::kMajorBlockCdrom) {
+                flags |= android::vold::Disk::Flags::kCdrom;
+            } else {
+                flags |= android::vold::Disk::Flags::kUsb;
             }
+
+            android::vold::Disk* disk = (source->getPartNum() == -1) ?
+                    new android::vold::Disk(eventPath, device,
+                            source->getNickname(), flags) :
+                    new android::vold::DiskPartition(eventPath, device,
+                            source->getNickname(), flags,
+                            source->getPartNum(),
+                            source->getFsType(), source->getMntOpts());
+            // Publish before creating, so commands for its volumes find
+            // the disk and wait for create() to finish on its lock
+            auto shared = std::shared_ptr<android::vold::Disk>(disk);
+            std::lock_guard<std::mutex> diskLock(shared->getLock());
+            auto disks = std::make_shared<DiskList>(*getDisks());
+            disks->push_back(shared);
+            setDisks(disks);
+            shared->create();
         }
         break;
     }
     case NetlinkEvent::Action::kChange: {
         LOG(DEBUG) << "Disk at " << major << ":" << minor << " changed";
-        for (auto disk : mDisks) {
+        for (auto disk : *getDisks()) {
             if (disk->getDevice() == device) {
+                std::lock_guard<std::mutex> diskLock(disk->getLock());
                 disk->readMetadata();
                 disk->readPartitions();
             }
@@ -332,19 +389,23 @@ void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
         break;
     }
     case NetlinkEvent::Action::kRemove: {
-        auto i = mDisks.begin();
-        while (i != mDisks.end()) {
+        auto disks = std::make_shared<DiskList>(*getDisks());
+        auto i = disks->begin();
+        while (i != disks->end()) {
             if ((*i)->getDevice() == device) {
+                std::lock_guard<std::mutex> diskLock((*i)->getLock());
                 (*i)->destroy();
-                i = mDisks.erase(i);
+                forgetDiskTasks((*i)->getId());
+                i = disks->erase(i);
             } else {
                 ++i;
             }
         }
+        setDisks(disks);
         break;
     }
     default: {
-        LOG(WARNING) << "Unexpected block event action " << (int) evt->getAction();
+        LOG(WARNING) << "Unexpected block event action " << (int) evt.action;
         break;
     }
     }
@@ -352,46 +413,111 @@ void VolumeManager::handleBlockEvent(NetlinkEvent *evt) {
 
 void VolumeManager::addDiskSource(const std::shared_ptr<DiskSource>& diskSource) {
     mDiskSources.push_back(diskSource);
+    mDiskMatcher.add(diskSource->getSysPattern());
+
+    // Keep rejecting virtual devices by major only while no pattern could
+    // claim one of them
+    if (!mVirtualMajors.empty() && mDiskMatcher.mayMatchUnder("/devices/virtual/")) {
+        for (const char* name : { "loop0", "dm-0", "ram0", "zram0" }) {
+            if (diskSource->matches(StringPrintf("/devices/virtual/block/%s", name))) {
+                LOG(INFO) << "Disk source " << diskSource->getSysPattern()
+                        << " matches virtual devices";
+                mVirtualMajors.clear();
+                break;
+            }
+        }
+    }
 }
 
-std::shared_ptr<android::vold::Disk> VolumeManager::findDisk(const std::string& id) {
-    for (auto disk : mDisks) {
-        if (disk->getId() == id) {
-            return disk;
-        }
+bool VolumeManager::matchesDiskSource(const std::string& sysPath) {
+    return mDiskMatcher.match(sysPath) != -1;
+}
+
+std::shared_ptr<const VolumeManager::DiskList> VolumeManager::getDisks() {
+    return std::atomic_load(&mDisks);
+}
+
+void VolumeManager::setDisks(const std::shared_ptr<const DiskList>& disks) {
+    std::atomic_store(&mDisks, disks);
+
+    // Disks come and go rarely enough to simply rebuild their index
+    std::lock_guard<std::mutex> lock(mIndexLock);
+    mDiskIndex.clear();
+    for (auto disk : *disks) {
+        mDiskIndex[disk->getId()] = disk;
     }
-    return nullptr;
 }
 
-std::shared_ptr<android::vold::VolumeBase> VolumeManager::findVolume(const std::string& id) {
-    if (mInternalEmulated->getId() == id) {
-        return mInternalEmulated;
+void VolumeManager::registerVolume(const std::shared_ptr<android::vold::VolumeBase>& vol) {
+    std::lock_guard<std::mutex> lock(mIndexLock);
+    mVolumeIndex[vol->getId()] = { vol, vol->getHostDiskId() };
+}
+
+void VolumeManager::unregisterVolume(android::vold::VolumeBase* vol) {
+    std::lock_guard<std::mutex> lock(mIndexLock);
+    auto i = mVolumeIndex.find(vol->getId());
+    // Leave any newer volume that has since taken the same id alone
+    if (i != mVolumeIndex.end()) {
+        auto current = i->second.volume.lock();
+        if (current == nullptr || current.get() == vol) {
+            mVolumeIndex.erase(i);
+        }
     }
-    for (auto disk : mDisks) {
-        auto vol = disk->findVolume(id);
-        if (vol != nullptr) {
-            return vol;
+}
+
+std::mutex& VolumeManager::getVolumeLock(
+        const std::shared_ptr<android::vold::VolumeBase>& vol) {
+    std::string hostDiskId;
+    {
+        std::lock_guard<std::mutex> lock(mIndexLock);
+        auto i = mVolumeIndex.find(vol->getId());
+        if (i != mVolumeIndex.end() && i->second.volume.lock() == vol) {
+            hostDiskId = i->second.hostDiskId;
         }
     }
-    return nullptr;
+    auto disk = hostDiskId.empty() ? nullptr : findDisk(hostDiskId);
+    return (disk != nullptr) ? disk->getLock() : mInternalLock;
+}
+
+std::shared_ptr<android::vold::Disk> VolumeManager::findDisk(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mIndexLock);
+    auto i = mDiskIndex.find(id);
+    return (i != mDiskIndex.end()) ? i->second.lock() : nullptr;
+}
+
+std::shared_ptr<android::vold::VolumeBase> VolumeManager::findVolume(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mIndexLock);
+    auto i = mVolumeIndex.find(id);
+    return (i != mVolumeIndex.end()) ? i->second.volume.lock() : nullptr;
 }
 
 void VolumeManager::listVolumes(android::vold::VolumeBase::Type type,
         std::list<std::string>& list) {
     list.clear();
-    for (auto disk : mDisks) {
+    for (auto disk : *getDisks()) {
         disk->listVolumes(type, list);
     }
 }
 
-nsecs_t VolumeManager::benchmarkPrivate(const std::string& id) {
+nsecs_t VolumeManager::benchmarkVolume(const std::string& id,
+        android::vold::BenchmarkProfile* profile) {
     std::string path;
+    bool isPrivate = true;
+    std::shared_ptr<android::vold::VolumeBase> vol;
+    std::unique_lock<std::mutex> volumeLock;
     if (id == "private" || id == "null") {
         path = "/data";
     } else {
-        auto vol = findVolume(id);
-        if (vol != nullptr && vol->getState() == android::vold::VolumeBase::State::kMounted) {
-            path = vol->getPath();
+        vol = findVolume(id);
+        if (vol != nullptr) {
+            // Keep the volume mounted until we're done measuring it
+            volumeLock = std::unique_lock<std::mutex>(getVolumeLock(vol));
+        }
+        if (vol != nullptr && vol == findVolume(id)
+                && vol->getState() == android::vold::VolumeBase::State::kMounted) {
+            // Measure the filesystem itself rather than any FUSE view over it
+            path = vol->getInternalPath().empty() ? vol->getPath() : vol->getInternalPath();
+            isPrivate = (vol->getType() == android::vold::VolumeBase::Type::kPrivate);
         }
     }
 
@@ -400,7 +526,49 @@ nsecs_t VolumeManager::benchmarkPrivate(const std::string& id) {
         return -1;
     }
 
-    return android::vold::BenchmarkPrivate(path);
+    return android::vold::BenchmarkVolume(path, isPrivate, profile, getBenchmarkKey(id));
+}
+
+std::string VolumeManager::getBenchmarkKey(const std::string& id) {
+    if (id == "private" || id == "null") {
+        return android::vold::kBenchmarkInternalKey;
+    }
+    auto vol = findVolume(id);
+    if (vol == nullptr) {
+        return "";
+    }
+    auto disk = findDisk(vol->getDiskId());
+    if (disk == nullptr) {
+        return "";
+    }
+
+    // Stable across reinsertion: the label is the manufacturer and the
+    // partition GUID survives until the media is repartitioned
+    std::string key(disk->getLabel());
+    for (auto& c : key) {
+        if (!isalnum(c) && c != '-' && c != '.') c = '_';
+    }
+    key += StringPrintf(":%" PRIu64, disk->getSize());
+    if (!vol->getPartGuid().empty()) {
+        key += ":" + vol->getPartGuid();
+    }
+    return key;
+}
+
+std::vector<std::string> VolumeManager::getQueueTuning() {
+    std::vector<std::string> res;
+    for (const auto& disk : *getDisks()) {
+        res.push_back(disk->getId() + " " + disk->getQueueTuning());
+    }
+    return res;
+}
+
+std::vector<std::pair<std::string, std::string>> VolumeManager::getDiskSysPaths() {
+    std::vector<std::pair<std::string, std::string>> res;
+    for (const auto& disk : *getDisks()) {
+        res.push_back(std::make_pair(disk->getId(), disk->getSysPath()));
+    }
+    return res;
 }
 
 int VolumeManager::forgetPartition(const std::string& partGuid) {
@@ -415,6 +583,10 @@ int VolumeManager::forgetPartition(const std::string& partGuid) {
         LOG(ERROR) << "Failed to unlink " << keyPath;
         return -1;
     }
+    std::string optionsPath = android::vold::BuildKeyOptionsPath(normalizedGuid);
+    if (unlink(optionsPath.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Failed to unlink " << optionsPath;
+    }
 
     return 0;
 }
@@ -442,11 +614,13 @@ int VolumeManager::linkPrimary(userid_t userId) {
 }
 
 int VolumeManager::onUserAdded(userid_t userId, int userSerialNumber) {
+    std::lock_guard<std::mutex> lock(mUserLock);
     mAddedUsers[userId] = userSerialNumber;
     return 0;
 }
 
 int VolumeManager::onUserRemoved(userid_t userId) {
+    std::lock_guard<std::mutex> lock(mUserLock);
     mAddedUsers.erase(userId);
     return 0;
 }
@@ -458,6 +632,7 @@ int VolumeManager::onUserStarted(userid_t userId) {
     std::string path(StringPrintf("%s/%d", kUserMountPath, userId));
     fs_prepare_dir(path.c_str(), 0777, AID_ROOT, AID_ROOT);
 
+    std::lock_guard<std::mutex> lock(mUserLock);
     mStartedUsers.insert(userId);
     if (mPrimary) {
         linkPrimary(userId);
@@ -466,11 +641,13 @@ int VolumeManager::onUserStarted(userid_t userId) {
 }
 
 int VolumeManager::onUserStopped(userid_t userId) {
+    std::lock_guard<std::mutex> lock(mUserLock);
     mStartedUsers.erase(userId);
     return 0;
 }
 
 int VolumeManager::setPrimary(const std::shared_ptr<android::vold::VolumeBase>& vol) {
+    std::lock_guard<std::mutex> lock(mUserLock);
     mPrimary = vol;
     for (userid_t userId : mStartedUsers) {
         linkPrimary(userId);
@@ -481,9 +658,11 @@ int VolumeManager::setPrimary(const std::shared_ptr<android::vold::VolumeBase>&
 static int unmount_tree(const char* path) {
     size_t path_len = strlen(path);
 
-    FILE* fp = setmntent("/proc/mounts", "r");
+    // /proc/mounts follows the main thread, which may be in another namespace
+    std::string mounts(StringPrintf("/proc/self/task/%d/mounts", gettid()));
+    FILE* fp = setmntent(mounts.c_str(), "r");
     if (fp == NULL) {
-        ALOGE("Error opening /proc/mounts: %s", strerror(errno));
+        ALOGE("Error opening %s: %s", mounts.c_str(), strerror(errno));
         return -errno;
     }
 
@@ -508,139 +687,271 @@ static int unmount_tree(const char* path) {
 
 int VolumeManager::remountUid(uid_t uid, const std::string& mode) {
     LOG(DEBUG) << "Remounting " << uid << " as mode " << mode;
+    android::vold::OperationTimer timer("remountUid", mode);
 
-    DIR* dir;
-    struct dirent* de;
-    char rootName[PATH_MAX];
+    std::vector<Process::Info> processes;
     char pidName[PATH_MAX];
-    int pidFd;
-    int nsFd;
-    struct stat sb;
-    pid_t child;
 
-    if (!(dir = opendir("/proc"))) {
-        PLOG(ERROR) << "Failed to opendir";
+    if (Process::scan(processes) != 0) {
+        PLOG(ERROR) << "Failed to scan processes";
         return -1;
     }
 
-    // Figure out root namespace to compare against below
-    if (android::vold::SaneReadLinkAt(dirfd(dir), "1/ns/mnt", rootName, PATH_MAX) == -1) {
-        PLOG(ERROR) << "Failed to readlink";
-        closedir(dir);
+    // Root namespace to compare against below
+    ino_t rootNamespace = android::vold::GetRootMountNamespace();
+    if (rootNamespace == 0) {
+        LOG(ERROR) << "Failed to find root namespace";
         return -1;
     }
 
-    // Poke through all running PIDs look for apps running as UID
-    while ((de = readdir(dir))) {
-        pidFd = -1;
-        nsFd = -1;
-
-        pidFd = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-        if (pidFd < 0) {
-            goto next;
-        }
-        if (fstat(pidFd, &sb) != 0) {
-            PLOG(WARNING) << "Failed to stat " << de->d_name;
-            goto next;
-        }
-        if (sb.st_uid != uid) {
-            goto next;
+    // Poke through all running PIDs look for apps running as UID, keeping
+    // one representative per namespace since processes of the same app
+    // often share one. The namespace is held open from here on, so a pid
+    // reused since the scan can't send us into someone else's.
+    std::unordered_map<ino_t, std::pair<int, pid_t>> namespaces;
+    for (const auto& info : processes) {
+        if (info.uid != uid) {
+            continue;
         }
 
         // Matches so far, but refuse to touch if in root namespace
-        LOG(DEBUG) << "Found matching PID " << de->d_name;
-        if (android::vold::SaneReadLinkAt(pidFd, "ns/mnt", pidName, PATH_MAX) == -1) {
-            PLOG(WARNING) << "Failed to read namespace for " << de->d_name;
-            goto next;
+        LOG(DEBUG) << "Found matching PID " << info.pid;
+        if (info.mntNamespace == 0) {
+            LOG(WARNING) << "Failed to read namespace for " << info.pid;
+            continue;
         }
-        if (!strcmp(rootName, pidName)) {
+        if (info.mntNamespace == rootNamespace) {
             LOG(WARNING) << "Skipping due to root namespace";
-            goto next;
+            continue;
+        }
+        if (namespaces.find(info.mntNamespace) != namespaces.end()) {
+            continue;
         }
 
-        // We purposefully leave the namespace open across the fork
-        nsFd = openat(pidFd, "ns/mnt", O_RDONLY);
+        snprintf(pidName, sizeof(pidName), "/proc/%d", info.pid);
+        int pidFd = open(pidName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (pidFd < 0) {
+            PLOG(WARNING) << "Failed to open " << pidName;
+            continue;
+        }
+        struct stat sb;
+        int nsFd = -1;
+        if (fstat(pidFd, &sb) == 0 && sb.st_uid == uid) {
+            nsFd = openat(pidFd, "ns/mnt", O_RDONLY | O_CLOEXEC);
+        }
+        close(pidFd);
         if (nsFd < 0) {
-            PLOG(WARNING) << "Failed to open namespace for " << de->d_name;
-            goto next;
+            LOG(WARNING) << "Process " << info.pid << " changed since scan; skipping";
+            continue;
         }
-
-        if (!(child = fork())) {
-            if (setns(nsFd, CLONE_NEWNS) != 0) {
-                PLOG(ERROR) << "Failed to setns for " << de->d_name;
-                _exit(1);
-            }
-
+        if (fstat(nsFd, &sb) != 0 || sb.st_ino != info.mntNamespace) {
+            LOG(WARNING) << "Namespace of " << info.pid << " changed since scan; skipping";
+            close(nsFd);
+            continue;
+        }
+        namespaces.emplace(info.mntNamespace, std::make_pair(nsFd, info.pid));
+    }
+
+    std::string storageSource;
+    if (mode == "default") {
+        storageSource = "/mnt/runtime/default";
+    } else if (mode == "read") {
+        storageSource = "/mnt/runtime/read";
+    } else if (mode == "write") {
+        storageSource = "/mnt/runtime/write";
+    } else if (mode == "full") {
+        storageSource = "/mnt/runtime/full";
+    }
+    userid_t user_id = multiuser_get_user_id(uid);
+    std::string userSource(StringPrintf("/mnt/user/%d", user_id));
+
+    // Remount every namespace concurrently on the helper threads, then
+    // collect the results
+    std::vector<std::pair<std::future<status_t>, pid_t>> children;
+    for (const auto& ns : namespaces) {
+        int nsFd = ns.second.first;
+        pid_t pid = ns.second.second;
+
+        children.emplace_back(android::vold::PostInMountNamespace(nsFd,
+                [storageSource, userSource, pid]() -> status_t {
             unmount_tree("/storage");
 
-            std::string storageSource;
-            if (mode == "default") {
-                storageSource = "/mnt/runtime/default";
-            } else if (mode == "read") {
-                storageSource = "/mnt/runtime/read";
-            } else if (mode == "write") {
-                storageSource = "/mnt/runtime/write";
-            } else if (mode == "full") {
-                storageSource = "/mnt/runtime/full";
-            } else {
+            if (storageSource.empty()) {
                 // Sane default of no storage visible
-                _exit(0);
+                return android::OK;
             }
             if (TEMP_FAILURE_RETRY(mount(storageSource.c_str(), "/storage",
                     NULL, MS_BIND | MS_REC | MS_SLAVE, NULL)) == -1) {
                 PLOG(ERROR) << "Failed to mount " << storageSource << " for "
-                        << de->d_name;
-                _exit(1);
+                        << pid;
+                return -errno;
             }
 
             // Mount user-specific symlink helper into place
-            userid_t user_id = multiuser_get_user_id(uid);
-            std::string userSource(StringPrintf("/mnt/user/%d", user_id));
             if (TEMP_FAILURE_RETRY(mount(userSource.c_str(), "/storage/self",
                     NULL, MS_BIND, NULL)) == -1) {
                 PLOG(ERROR) << "Failed to mount " << userSource << " for "
-                        << de->d_name;
-                _exit(1);
+                        << pid;
+                return -errno;
             }
+            return android::OK;
+        }), pid);
+        close(nsFd);
+    }
 
-            _exit(0);
+    for (auto& child : children) {
+        if (child.first.get() != android::OK) {
+            LOG(WARNING) << "Failed to remount namespace of " << child.second;
         }
+    }
+    LOG(DEBUG) << "Remounted " << children.size() << " namespaces for " << uid;
+    timer.setResult(true);
+    return 0;
+}
 
-        if (child == -1) {
-            PLOG(ERROR) << "Failed to fork";
-            goto next;
-        } else {
-            TEMP_FAILURE_RETRY(waitpid(child, nullptr, 0));
+void VolumeManager::queueDiskTask(const std::string& diskId, std::function<void()> job) {
+    std::lock_guard<std::mutex> lock(mDiskTaskLock);
+    auto& queue = mDiskTasks[diskId];
+    queue.jobs.push_back(std::move(job));
+    queue.removed = false;
+    if (!queue.running) {
+        queue.running = true;
+        mDiskPool->enqueue(std::bind(&VolumeManager::runDiskTasks, this, diskId));
+    }
+}
+
+void VolumeManager::runDiskTasks(const std::string& diskId) {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::lock_guard<std::mutex> lock(mDiskTaskLock);
+            auto& queue = mDiskTasks[diskId];
+            if (queue.jobs.empty()) {
+                if (queue.removed) {
+                    mDiskTasks.erase(diskId);
+                } else {
+                    queue.running = false;
+                }
+                return;
+            }
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
         }
+        job();
+    }
+}
 
-next:
-        close(nsFd);
-        close(pidFd);
+void VolumeManager::forgetDiskTasks(const std::string& diskId) {
+    std::lock_guard<std::mutex> lock(mDiskTaskLock);
+    auto it = mDiskTasks.find(diskId);
+    if (it == mDiskTasks.end()) return;
+    if (it->second.running) {
+        // Dropped by runDiskTasks() once what's already queued is done
+        it->second.removed = true;
+    } else {
+        mDiskTasks.erase(it);
     }
-    closedir(dir);
-    return 0;
+}
+
+bool VolumeManager::runOnAllVolumes(const char* what, const std::function<void()>& internalOp,
+        const std::function<void(const std::shared_ptr<android::vold::Disk>&)>& diskOp) {
+    // Workers can outlive a missed deadline, so they share the bookkeeping
+    struct State {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::set<std::string> busy;
+    };
+    auto state = std::make_shared<State>();
+    nsecs_t start = systemTime(SYSTEM_TIME_BOOTTIME);
+
+    auto run = [state, what, start](const std::string& name, std::function<void()> op) {
+        {
+            std::lock_guard<std::mutex> lock(state->lock);
+            state->busy.insert(name);
+        }
+        std::thread([state, what, start, name, op]() {
+            op();
+            LOG(INFO) << what << " " << name << " finished after "
+                    << nanoseconds_to_milliseconds(systemTime(SYSTEM_TIME_BOOTTIME) - start)
+                    << "ms";
+            std::lock_guard<std::mutex> lock(state->lock);
+            state->busy.erase(name);
+            state->cond.notify_all();
+        }).detach();
+    };
+
+    if (mInternalEmulated != nullptr) {
+        run(mInternalEmulated->getId(), [this, internalOp]() {
+            std::lock_guard<std::mutex> lock(mInternalLock);
+            internalOp();
+        });
+    }
+    // Volumes stack only within a disk, so disks never wait on each other
+    for (auto disk : *getDisks()) {
+        run(disk->getId(), [disk, diskOp]() {
+            std::lock_guard<std::mutex> lock(disk->getLock());
+            diskOp(disk);
+        });
+    }
+
+    int timeoutMs = property_get_int32(kShutdownTimeoutProp, kDefaultShutdownTimeoutMs);
+    std::unique_lock<std::mutex> lock(state->lock);
+    if (!state->cond.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+            [&]() { return state->busy.empty(); })) {
+        for (const auto& name : state->busy) {
+            LOG(ERROR) << what << " " << name << " still busy after " << timeoutMs << "ms";
+        }
+        return false;
+    }
+    return true;
 }
 
 int VolumeManager::reset() {
-    // Tear down all existing disks/volumes and start from a blank slate so
-    // newly connected framework hears all events.
-    mInternalEmulated->destroy();
-    mInternalEmulated->create();
-    for (auto disk : mDisks) {
-        disk->destroy();
-        disk->create();
+    // Newly connected framework needs to hear about every disk and volume.
+    // Anything that has settled is simply replayed; only what's mid-way
+    // through a transition, or lost its FUSE daemon, starts from scratch.
+    std::lock_guard<std::mutex> lock(mLock);
+    bool incremental = property_get_bool(kIncrementalResetProp, true);
+    int replayed = 0;
+    int recreated = 0;
+    {
+        std::lock_guard<std::mutex> internalLock(mInternalLock);
+        if (incremental && mInternalEmulated->isConsistent()) {
+            mInternalEmulated->replay();
+            replayed++;
+        } else {
+            mInternalEmulated->destroy();
+            mInternalEmulated->create();
+            recreated++;
+        }
     }
+    for (auto disk : *getDisks()) {
+        std::lock_guard<std::mutex> diskLock(disk->getLock());
+        if (incremental && disk->isConsistent()) {
+            disk->replay();
+            replayed++;
+        } else {
+            disk->destroy();
+            disk->create();
+            recreated++;
+        }
+    }
+    LOG(INFO) << "Reset replayed " << replayed << " and recreated " << recreated
+            << " disks and volumes";
+    std::lock_guard<std::mutex> userLock(mUserLock);
     mAddedUsers.clear();
     mStartedUsers.clear();
     return 0;
 }
 
 int VolumeManager::shutdown() {
-    mInternalEmulated->destroy();
-    for (auto disk : mDisks) {
+    std::lock_guard<std::mutex> lock(mLock);
+    runOnAllVolumes("Shutdown of", [this]() {
+        mInternalEmulated->destroy();
+    }, [](const std::shared_ptr<android::vold::Disk>& disk) {
         disk->destroy();
-    }
-    mDisks.clear();
+    });
+    setDisks(std::make_shared<DiskList>());
     return 0;
 }
 
@@ -648,12 +959,11 @@ int VolumeManager::unmountAll() {
     std::lock_guard<std::mutex> lock(mLock);
 
     // First, try gracefully unmounting all known devices
-    if (mInternalEmulated != nullptr) {
+    bool finished = runOnAllVolumes("Unmount of", [this]() {
         mInternalEmulated->unmount();
-    }
-    for (auto disk : mDisks) {
+    }, [](const std::shared_ptr<android::vold::Disk>& disk) {
         disk->unmountAll();
-    }
+    });
 
     // Worst case we might have some stale mounts lurking around, so
     // force unmount those just to be safe.
@@ -675,15 +985,29 @@ int VolumeManager::unmountAll() {
     }
     endmntent(fp);
 
+    // Past the deadline, detach instead of waiting out whoever is stuck
     for (auto path : toUnmount) {
         SLOGW("Tearing down stale mount %s", path.c_str());
-        android::vold::ForceUnmount(path);
+        android::vold::ForceUnmount(path, !finished);
     }
 
+    // Every container lived under /mnt, so none of them survived the above
+    mActiveContainers.clear();
+
     return 0;
 }
 
 int VolumeManager::getObbMountPath(const char *sourceFile, char *mountPath, int mountPathLen) {
+    auto it = mActiveContainers.find(sourceFile);
+    if (it != mActiveContainers.end() && it->second->type == OBB) {
+        if (strlcpy(mountPath, it->second->mountPoint.c_str(), mountPathLen)
+                >= (size_t) mountPathLen) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
     char idHash[33];
     if (!asecHash(sourceFile, idHash, sizeof(idHash))) {
         SLOGE("Hash of '%s' failed (%s)", sourceFile, strerror(errno));
@@ -950,11 +1274,14 @@ int VolumeManager::createAsec(const char *id, unsigned long numSectors, const ch
                 close(dirfd);
             }
         }
+        addContainer(id, ASEC, idHash, loopDevice, cleanupDm ? dmDevice : nullptr,
+                mountPoint, ownerUid);
     } else {
         SLOGI("Created raw secure container %s (no filesystem)", id);
+        addContainer(id, ASEC, idHash, loopDevice, cleanupDm ? dmDevice : nullptr,
+                nullptr, ownerUid);
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
     return 0;
 }
 
@@ -1161,6 +1488,103 @@ int VolumeManager::finalizeAsec(const char *id) {
     return 0;
 }
 
+/* State shared by the threads fixing up one ASEC */
+struct AsecFixup {
+    AsecFixup(gid_t gid, const char* privateFile, dev_t dev, android::vold::WorkerPool* pool) :
+            gid(gid), privateFile(privateFile), dev(dev), pool(pool), failed(false), changed(0) {}
+
+    gid_t gid;
+    const char* privateFile;
+    /* Device of the ASEC, which isn't left while walking */
+    dev_t dev;
+    android::vold::WorkerPool* pool;
+    std::atomic<bool> failed;
+    std::atomic<int> changed;
+};
+
+/*
+ * Gives one entry the owner, mode and label of ASEC contents. Owner and
+ * mode are only written where they differ; the label is always restored.
+ */
+static void fixupAsecEntry(AsecFixup* ctx, int dirfd, const char* name, const std::string& path,
+        const struct stat& st) {
+    /*
+     * There can only be one file marked as private right now.
+     * This should be more robust, but it satisfies the requirements
+     * we have for right now.
+     */
+    const bool privateFile = !strcmp(name, ctx->privateFile);
+    const gid_t gid = privateFile ? ctx->gid : AID_SYSTEM;
+    mode_t mode = st.st_mode & 07777;
+    if (S_ISDIR(st.st_mode)) {
+        mode = 0777;
+    } else if (S_ISREG(st.st_mode)) {
+        mode = privateFile ? 0640 : 0644;
+    }
+    if (st.st_uid != AID_SYSTEM || st.st_gid != gid || (st.st_mode & 07777) != mode) {
+        if (fchownat(dirfd, name, AID_SYSTEM, gid, AT_SYMLINK_NOFOLLOW)) {
+            SLOGE("Couldn't chown %s: %s", path.c_str(), strerror(errno));
+            ctx->failed = true;
+        }
+        // Symlinks have no mode of their own; chown may have cleared setuid bits
+        if (!S_ISLNK(st.st_mode) && fchmodat(dirfd, name, mode, 0)) {
+            SLOGE("Couldn't chmod %s: %s", path.c_str(), strerror(errno));
+            ctx->failed = true;
+        }
+        ctx->changed++;
+    }
+
+    // Labels go stale on their own, e.g. across a policy update
+    if (selinux_android_restorecon(path.c_str(), 0) < 0) {
+        SLOGE("restorecon failed for %s: %s\n", path.c_str(), strerror(errno));
+        ctx->failed = true;
+    }
+}
+
+/*
+ * Fixes up everything in one directory of an ASEC, handing each
+ * subdirectory to the pool so that independent subtrees are done in
+ * parallel. Directories are queued by path, so a wide tree can't run
+ * the process out of descriptors.
+ */
+static void fixupAsecDir(AsecFixup* ctx, const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        SLOGE("Couldn't open directory %s: %s", path.c_str(), strerror(errno));
+        ctx->failed = true;
+        return;
+    }
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(fdopendir(fd), closedir);
+    if (!dir) {
+        SLOGE("Couldn't read directory %s: %s", path.c_str(), strerror(errno));
+        close(fd);
+        ctx->failed = true;
+        return;
+    }
+
+    struct dirent* ent;
+    while ((ent = readdir(dir.get())) != nullptr) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        std::string child(path + "/" + ent->d_name);
+        struct stat st;
+        if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            SLOGE("Couldn't stat %s: %s", child.c_str(), strerror(errno));
+            ctx->failed = true;
+            continue;
+        }
+        // We don't care about the lost+found directory, though whatever
+        // fsck left in it is fixed up like everything else
+        if (strcmp(ent->d_name, "lost+found")) {
+            fixupAsecEntry(ctx, fd, ent->d_name, child, st);
+        }
+        if (S_ISDIR(st.st_mode) && st.st_dev == ctx->dev) {
+            ctx->pool->enqueue(std::bind(&fixupAsecDir, ctx, child));
+        }
+    }
+}
+
 int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* filename) {
     char asecFileName[255];
     char loopDevice[255];
@@ -1220,57 +1644,29 @@ int VolumeManager::fixupAsecPermissions(const char *id, gid_t gid, const char* f
         return -1;
     }
 
-    char *paths[] = { mountPoint, NULL };
-
-    FTS *fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR | FTS_XDEV, NULL);
-    if (fts) {
+    struct stat st;
+    if (lstat(mountPoint, &st)) {
+        SLOGE("Couldn't stat %s: %s", mountPoint, strerror(errno));
+        result |= -1;
+    } else {
         // Traverse the entire hierarchy and chown to system UID.
-        for (FTSENT *ftsent = fts_read(fts); ftsent != NULL; ftsent = fts_read(fts)) {
-            // We don't care about the lost+found directory.
-            if (!strcmp(ftsent->fts_name, "lost+found")) {
-                continue;
-            }
-
-            /*
-             * There can only be one file marked as private right now.
-             * This should be more robust, but it satisfies the requirements
-             * we have for right now.
-             */
-            const bool privateFile = !strcmp(ftsent->fts_name, filename);
-
-            int fd = open(ftsent->fts_accpath, O_NOFOLLOW | O_CLOEXEC);
-            if (fd < 0) {
-                SLOGE("Couldn't open file %s: %s", ftsent->fts_accpath, strerror(errno));
-                result = -1;
-                continue;
-            }
-
-            result |= fchown(fd, AID_SYSTEM, privateFile? gid : AID_SYSTEM);
-
-            if (ftsent->fts_info & FTS_D) {
-                result |= fchmod(fd, 0777);
-            } else if (ftsent->fts_info & FTS_F) {
-                result |= fchmod(fd, privateFile ? 0640 : 0644);
-            }
-
-            if (selinux_android_restorecon(ftsent->fts_path, 0) < 0) {
-                SLOGE("restorecon failed for %s: %s\n", ftsent->fts_path, strerror(errno));
-                result |= -1;
-            }
-
-            close(fd);
+        android::vold::WorkerPool pool(kAsecFixupThreads);
+        AsecFixup ctx(gid, filename, st.st_dev, &pool);
+        fixupAsecEntry(&ctx, AT_FDCWD, mountPoint, mountPoint, st);
+        pool.enqueue(std::bind(&fixupAsecDir, &ctx, std::string(mountPoint)));
+        pool.wait();
+        if (ctx.failed) {
+            result |= -1;
+        }
+        if (mDebug) {
+            SLOGD("Fixed %d entries in ASEC %s", ctx.changed.load(), id);
         }
-        fts_close(fts);
 
         // Finally make the directory readable by everyone.
-        int dirfd = open(mountPoint, O_DIRECTORY | O_CLOEXEC);
-        if (dirfd < 0 || fchmod(dirfd, 0777)) {
+        if (chmod(mountPoint, 0777)) {
             SLOGE("Couldn't change owner of existing directory %s: %s", mountPoint, strerror(errno));
             result |= -1;
         }
-        close(dirfd);
-    } else {
-        result |= -1;
     }
 
     result |= android::vold::ext4::Mount(loopDevice, mountPoint,
@@ -1391,6 +1787,14 @@ int VolumeManager::unmountAsec(const char *id, bool force) {
 }
 
 int VolumeManager::unmountObb(const char *fileName, bool force) {
+    auto it = mActiveContainers.find(fileName);
+    if (it != mActiveContainers.end() && it->second->type == OBB) {
+        // Copies, since a successful unmount drops the entry
+        std::string hash(it->second->hash);
+        std::string mountPoint(it->second->mountPoint);
+        return unmountLoopImage(fileName, hash.c_str(), fileName, mountPoint.c_str(), force);
+    }
+
     char mountPoint[255];
 
     char idHash[33];
@@ -1464,35 +1868,35 @@ int VolumeManager::unmountLoopImage(const char *id, const char *idHash,
         SLOGE("Timed out trying to rmdir %s (%s)", mountPoint, strerror(errno));
     }
 
-    for (i=1; i <= UNMOUNT_RETRIES; i++) {
-        if (Devmapper::destroy(idHash) && errno != ENXIO) {
-            SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
-            usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
-            continue;
-        } else {
-          break;
+    // Known containers say exactly what to tear down; anything else (such
+    // as a mount we lost track of) falls back to asking the kernel
+    auto it = mActiveContainers.find(id);
+    bool known = (it != mActiveContainers.end());
+    if (!known) {
+        SLOGW("Container %s missing from index", id);
+    }
+
+    if (!known || !it->second->dmDevice.empty()) {
+        for (i=1; i <= UNMOUNT_RETRIES; i++) {
+            if (Devmapper::destroy(idHash) && errno != ENXIO) {
+                SLOGE("Failed to destroy devmapper instance (%s)", strerror(errno));
+                usleep(UNMOUNT_SLEEP_BETWEEN_RETRY_MS);
+                continue;
+            } else {
+              break;
+            }
         }
     }
 
     char loopDevice[255];
-    if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
+    if (known) {
+        Loop::destroyByDevice(it->second->loopDevice.c_str());
+        mActiveContainers.erase(it);
+    } else if (!Loop::lookupActive(idHash, loopDevice, sizeof(loopDevice))) {
         Loop::destroyByDevice(loopDevice);
     } else {
         SLOGW("Failed to find loop device for {%s} (%s)", fileName, strerror(errno));
     }
-
-    AsecIdCollection::iterator it;
-    for (it = mActiveContainers->begin(); it != mActiveContainers->end(); ++it) {
-        ContainerData* cd = *it;
-        if (!strcmp(cd->id, id)) {
-            free(*it);
-            mActiveContainers->erase(it);
-            break;
-        }
-    }
-    if (it == mActiveContainers->end()) {
-        SLOGW("mActiveContainers is inconsistent!");
-    }
     return 0;
 }
 
@@ -1725,13 +2129,47 @@ int VolumeManager::mountAsec(const char *id, const char *key, int ownerUid, bool
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(id), ASEC));
+    addContainer(id, ASEC, idHash, loopDevice, cleanupDm ? dmDevice : nullptr,
+            mountPoint, ownerUid);
     if (mDebug) {
         SLOGD("ASEC %s mounted", id);
     }
     return 0;
 }
 
+/*
+ * Returns the largest loop block size the OBB image can live with. A plain
+ * image carries a FAT filesystem whose sectors can't be smaller than the
+ * device blocks; an encrypted one can't be read here, so stays at 512.
+ */
+static unsigned int getObbMaxBlockSize(const char *img, const char *key) {
+    unsigned int res = 512;
+    if (strcmp(key, "none")) {
+        return res;
+    }
+    int fd = open(img, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return res;
+    }
+    uint8_t bytesPerSector[2];
+    if (pread(fd, bytesPerSector, sizeof(bytesPerSector), 11) == sizeof(bytesPerSector)) {
+        unsigned int size = bytesPerSector[0] | (bytesPerSector[1] << 8);
+        if (size >= 512 && size <= 4096 && (size & (size - 1)) == 0) {
+            res = size;
+        }
+    }
+    close(fd);
+    return res;
+}
+
+static void setReadAhead(const char *blkDevice, int readAheadKb) {
+    struct stat st;
+    if (stat(blkDevice, &st) == 0 && S_ISBLK(st.st_mode)) {
+        android::vold::WriteBlockQueueAttribute(st.st_rdev, "read_ahead_kb",
+                StringPrintf("%d", readAheadKb));
+    }
+}
+
 /**
  * Mounts an image file <code>img</code>.
  */
@@ -1760,6 +2198,14 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
     if (setupLoopDevice(loopDevice, sizeof(loopDevice), img, idHash, mDebug))
         return -1;
 
+    // Best effort; buffered loop I/O still works, just caches twice
+    if (property_get_bool(kObbDirectIoProp, true)) {
+        if (Loop::setDirectIo(loopDevice, img, getObbMaxBlockSize(img, key)) == 0
+                && mDebug) {
+            SLOGD("Direct I/O enabled on %s", loopDevice);
+        }
+    }
+
     char dmDevice[255];
     bool cleanupDm = false;
     int fd;
@@ -1802,6 +2248,14 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
      */
     waitForDevMapper(dmDevice);
 
+    int readAheadKb = property_get_int32(kObbReadAheadProp, kDefaultObbReadAheadKb);
+    if (readAheadKb > 0) {
+        setReadAhead(loopDevice, readAheadKb);
+        if (cleanupDm) {
+            setReadAhead(dmDevice, readAheadKb);
+        }
+    }
+
     if (android::vold::vfat::Mount(dmDevice, mountPoint,
             true, false, true, 0, ownerGid, 0227, false)) {
         SLOGE("Image mount failed (%s)", strerror(errno));
@@ -1812,50 +2266,60 @@ int VolumeManager::mountObb(const char *img, const char *key, int ownerGid) {
         return -1;
     }
 
-    mActiveContainers->push_back(new ContainerData(strdup(img), OBB));
+    addContainer(img, OBB, idHash, loopDevice, cleanupDm ? dmDevice : nullptr,
+            mountPoint, ownerGid);
     if (mDebug) {
         SLOGD("Image %s mounted", img);
     }
     return 0;
 }
 
-int VolumeManager::listMountedObbs(SocketClient* cli) {
-    FILE *fp = setmntent("/proc/mounts", "r");
-    if (fp == NULL) {
-        SLOGE("Error opening /proc/mounts (%s)", strerror(errno));
-        return -1;
-    }
-
-    // Create a string to compare against that has a trailing slash
-    int loopDirLen = strlen(VolumeManager::LOOPDIR);
-    char loopDir[loopDirLen + 2];
-    strcpy(loopDir, VolumeManager::LOOPDIR);
-    loopDir[loopDirLen++] = '/';
-    loopDir[loopDirLen] = '\0';
-
-    mntent* mentry;
-    while ((mentry = getmntent(fp)) != NULL) {
-        if (!strncmp(mentry->mnt_dir, loopDir, loopDirLen)) {
-            int fd = open(mentry->mnt_fsname, O_RDONLY | O_CLOEXEC);
-            if (fd >= 0) {
-                struct loop_info64 li;
-                if (ioctl(fd, LOOP_GET_STATUS64, &li) >= 0) {
-                    cli->sendMsg(ResponseCode::AsecListResult,
-                            (const char*) li.lo_file_name, false);
-                }
-                close(fd);
-            }
+int VolumeManager::listMountedObbs(std::vector<std::string>& ids) {
+    for (const auto& entry : mActiveContainers) {
+        if (entry.second->type == OBB) {
+            ids.push_back(entry.first);
         }
     }
-    endmntent(fp);
     return 0;
 }
 
+void VolumeManager::addContainer(const char *id, container_type_t type, const char *hash,
+        const char *loopDevice, const char *dmDevice, const char *mountPoint, int owner) {
+    std::unique_ptr<ContainerData> cd(new ContainerData(id, type));
+    cd->hash = hash;
+    cd->loopDevice = loopDevice;
+    cd->dmDevice = dmDevice ? dmDevice : "";
+    cd->mountPoint = mountPoint ? mountPoint : "";
+    cd->owner = owner;
+    mActiveContainers[id] = std::move(cd);
+}
+
 extern "C" int vold_unmountAll(void) {
     VolumeManager *vm = VolumeManager::Instance();
     return vm->unmountAll();
 }
 
+extern "C" void vold_broadcastEncryptProgress(const char* message) {
+    SocketListener* broadcaster = VolumeManager::Instance()->getCryptBroadcaster();
+    if (broadcaster != nullptr) {
+        broadcaster->sendBroadcast(ResponseCode::EncryptionProgress, message, false);
+    }
+}
+
+extern "C" int vold_wipeBlockDevice(const char* path, uint64_t length) {
+    return android::vold::WipeBlockDevice(path, length);
+}
+
+extern "C" void* vold_startWriteAmp(const char* op, const char* path) {
+    return new android::vold::WriteAmpMeter(op, path);
+}
+
+extern "C" void vold_finishWriteAmp(void* meter, uint64_t logical_bytes) {
+    auto m = static_cast<android::vold::WriteAmpMeter*>(meter);
+    m->finish(logical_bytes);
+    delete m;
+}
+
 bool VolumeManager::isMountpointMounted(const char *mp)
 {
     FILE *fp = setmntent("/proc/mounts", "r");
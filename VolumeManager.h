@@ -19,50 +19,62 @@
 
 #include <pthread.h>
 #include <fnmatch.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
 
+#include <deque>
+#include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <cutils/multiuser.h>
-#include <utils/List.h>
 #include <utils/Timers.h>
 #include <sysutils/SocketListener.h>
 #include <sysutils/NetlinkEvent.h>
 
+#include "BenchmarkProfile.h"
 #include "Disk.h"
+#include "DiskMatcher.h"
 #include "DiskPartition.h"
+#include "UeventQueue.h"
 #include "VolumeBase.h"
+#include "WorkerPool.h"
 
 /* The length of an MD5 hash when encoded into ASCII hex characters */
 #define MD5_ASCII_LENGTH_PLUS_NULL ((MD5_DIGEST_LENGTH*2)+1)
 
 typedef enum { ASEC, OBB } container_type_t;
 
+/*
+ * Everything needed to tear down a mounted ASEC or OBB without going back
+ * to the kernel. dmDevice is empty for unencrypted containers, and
+ * mountPoint is empty for raw ASECs created without a filesystem.
+ */
 class ContainerData {
 public:
-    ContainerData(char* _id, container_type_t _type)
+    ContainerData(const std::string& _id, container_type_t _type)
             : id(_id)
             , type(_type)
+            , owner(-1)
     {}
 
-    ~ContainerData() {
-        if (id != NULL) {
-            free(id);
-            id = NULL;
-        }
-    }
-
-    char *id;
+    std::string id;
     container_type_t type;
+    std::string hash;
+    std::string loopDevice;
+    std::string dmDevice;
+    std::string mountPoint;
+    int owner;
 };
 
-typedef android::List<ContainerData*> AsecIdCollection;
+typedef std::unordered_map<std::string, std::unique_ptr<ContainerData>> AsecIdCollection;
 
 class VolumeManager {
 public:
@@ -75,8 +87,10 @@ private:
     static VolumeManager *sInstance;
 
     SocketListener        *mBroadcaster;
+    /* cryptd socket, which hears encryption progress */
+    SocketListener        *mCryptBroadcaster;
 
-    AsecIdCollection      *mActiveContainers;
+    AsecIdCollection       mActiveContainers;
     bool                   mDebug;
 
     // for adjusting /proc/sys/vm/dirty_ratio when UMS is active
@@ -87,13 +101,21 @@ private:
 public:
     virtual ~VolumeManager();
 
-    // TODO: pipe all requests through VM to avoid exposing this lock
-    std::mutex& getLock() { return mLock; }
+    /*
+     * Lock to hold while changing the state of vol: the lock of the disk
+     * it lives on, or one shared by volumes without a disk. Callers should
+     * look vol up again once they hold it, since it may have gone away.
+     */
+    std::mutex& getVolumeLock(const std::shared_ptr<android::vold::VolumeBase>& vol);
+
+    /* Keep the id index current; called by VolumeBase::create() and destroy() */
+    void registerVolume(const std::shared_ptr<android::vold::VolumeBase>& vol);
+    void unregisterVolume(android::vold::VolumeBase* vol);
 
     int start();
     int stop();
 
-    void handleBlockEvent(NetlinkEvent *evt);
+    void handleBlockEvent(const android::vold::BlockEvent& evt);
 
     class DiskSource {
     public:
@@ -109,6 +131,7 @@ public:
             return !fnmatch(mSysPattern.c_str(), sysPath.c_str(), 0);
         }
 
+        const std::string& getSysPattern() { return mSysPattern; }
         const std::string& getNickname() { return mNickname; }
         int getPartNum() { return mPartNum; }
         int getFlags() { return mFlags; }
@@ -125,13 +148,25 @@ public:
     };
 
     void addDiskSource(const std::shared_ptr<DiskSource>& diskSource);
+    /* True when a disk at sysPath (a DEVPATH) would be claimed by some source */
+    bool matchesDiskSource(const std::string& sysPath);
 
     std::shared_ptr<android::vold::Disk> findDisk(const std::string& id);
     std::shared_ptr<android::vold::VolumeBase> findVolume(const std::string& id);
 
     void listVolumes(android::vold::VolumeBase::Type type, std::list<std::string>& list);
 
-    nsecs_t benchmarkPrivate(const std::string& id);
+    /* Benchmark a mounted volume with the given profile, or the default workload */
+    nsecs_t benchmarkVolume(const std::string& id,
+            android::vold::BenchmarkProfile* profile = nullptr);
+    /* Identifies the media behind a volume in the benchmark history */
+    std::string getBenchmarkKey(const std::string& id);
+
+    /* One line per disk with the block queue settings applied to it */
+    std::vector<std::string> getQueueTuning();
+
+    /* Id and sysfs path of every disk */
+    std::vector<std::pair<std::string, std::string>> getDiskSysPaths();
 
     int forgetPartition(const std::string& partGuid);
 
@@ -144,6 +179,12 @@ public:
 
     int remountUid(uid_t uid, const std::string& mode);
 
+    /*
+     * Runs job on a shared bounded pool. Jobs queued for the same disk
+     * run one at a time, while independent disks proceed in parallel.
+     */
+    void queueDiskTask(const std::string& diskId, std::function<void()> job);
+
     /* Reset all internal state, typically during framework boot */
     int reset();
     /* Prepare for device shutdown, safely unmounting all devices */
@@ -178,7 +219,7 @@ public:
     int getAsecFilesystemPath(const char *id, char *buffer, int maxlen);
 
     /* Loopback images */
-    int listMountedObbs(SocketClient* cli);
+    int listMountedObbs(std::vector<std::string>& ids);
     int mountObb(const char *fileName, const char *key, int ownerUid);
     int unmountObb(const char *fileName, bool force);
     int getObbMountPath(const char *id, char *buffer, int maxlen);
@@ -191,6 +232,8 @@ public:
 
     void setBroadcaster(SocketListener *sl) { mBroadcaster = sl; }
     SocketListener *getBroadcaster() { return mBroadcaster; }
+    void setCryptBroadcaster(SocketListener *sl) { mCryptBroadcaster = sl; }
+    SocketListener *getCryptBroadcaster() { return mCryptBroadcaster; }
 
     static VolumeManager *Instance();
 
@@ -211,17 +254,64 @@ private:
     bool isMountpointMounted(const char *mp);
     bool isAsecInDirectory(const char *dir, const char *asec) const;
     bool isLegalAsecId(const char *id) const;
+    void addContainer(const char *id, container_type_t type, const char *hash,
+            const char *loopDevice, const char *dmDevice, const char *mountPoint, int owner);
 
     int linkPrimary(userid_t userId);
+    void runDiskTasks(const std::string& diskId);
+    /* Drops the task queue of a removed disk, once it has drained */
+    void forgetDiskTasks(const std::string& diskId);
+
+    /*
+     * Runs internalOp under the internal volume lock and diskOp on every
+     * disk under its own lock, all concurrently, waiting no longer than
+     * the shutdown deadline. Returns false if something was still busy.
+     */
+    bool runOnAllVolumes(const char* what, const std::function<void()>& internalOp,
+            const std::function<void(const std::shared_ptr<android::vold::Disk>&)>& diskOp);
 
+    typedef std::list<std::shared_ptr<android::vold::Disk>> DiskList;
+    /* Current disks; replaced wholesale, so readers never need a lock */
+    std::shared_ptr<const DiskList> getDisks();
+    void setDisks(const std::shared_ptr<const DiskList>& disks);
+
+    /* Serializes changes to the set of disks; taken before any disk lock */
     std::mutex mLock;
+    /* Volume lock for the internal emulated volume */
+    std::mutex mInternalLock;
+    /* Guards user bookkeeping and mPrimary; taken after any volume lock */
+    std::mutex mUserLock;
+
+    /* Indexed the same as the patterns in mDiskMatcher */
+    std::vector<std::shared_ptr<DiskSource>> mDiskSources;
+    android::vold::DiskMatcher mDiskMatcher;
+    /* Majors of loop, dm, ram and zram devices, which no source can claim */
+    std::unordered_set<int> mVirtualMajors;
+    std::shared_ptr<const DiskList> mDisks;
+
+    struct VolumeEntry {
+        std::weak_ptr<android::vold::VolumeBase> volume;
+        std::string hostDiskId;
+    };
 
-    std::list<std::shared_ptr<DiskSource>> mDiskSources;
-    std::list<std::shared_ptr<android::vold::Disk>> mDisks;
+    /* Every created volume and every known disk by id, guarded by mIndexLock */
+    std::unordered_map<std::string, VolumeEntry> mVolumeIndex;
+    std::unordered_map<std::string, std::weak_ptr<android::vold::Disk>> mDiskIndex;
+    std::mutex mIndexLock;
 
     std::unordered_map<userid_t, int> mAddedUsers;
     std::unordered_set<userid_t> mStartedUsers;
 
+    struct DiskTaskQueue {
+        std::deque<std::function<void()>> jobs;
+        bool running = false;
+        bool removed = false;
+    };
+
+    std::unique_ptr<android::vold::WorkerPool> mDiskPool;
+    std::mutex mDiskTaskLock;
+    std::unordered_map<std::string, DiskTaskQueue> mDiskTasks;
+
     std::shared_ptr<android::vold::VolumeBase> mInternalEmulated;
     std::shared_ptr<android::vold::VolumeBase> mPrimary;
 };
@@ -230,6 +320,14 @@ extern "C" {
 #endif /* __cplusplus */
 #define UNMOUNT_NOT_MOUNTED_ERR -2
     int vold_unmountAll(void);
+    /* Broadcasts EncryptionProgress to cryptd clients */
+    void vold_broadcastEncryptProgress(const char* message);
+    /* Discards the first length bytes of a block device, see WipeBlockDevice() */
+    int vold_wipeBlockDevice(const char* path, uint64_t length);
+    /* Starts a WriteAmpMeter for op on the disk under path */
+    void* vold_startWriteAmp(const char* op, const char* path);
+    /* Records and frees a meter from vold_startWriteAmp() */
+    void vold_finishWriteAmp(void* meter, uint64_t logical_bytes);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WorkerPool.h"
+
+namespace android {
+namespace vold {
+
+WorkerPool::WorkerPool(size_t threads, size_t maxQueued) :
+        mMaxQueued(maxQueued), mActive(0), mStopping(false) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        mThreads.push_back(std::thread(&WorkerPool::run, this));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mWorkCond.notify_all();
+    for (auto& thread : mThreads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::enqueue(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (mMaxQueued > 0) {
+        mSpaceCond.wait(lock, [this] { return mQueue.size() < mMaxQueued; });
+    }
+    mQueue.push_back(std::move(job));
+    lock.unlock();
+    mWorkCond.notify_one();
+}
+
+void WorkerPool::wait() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mIdleCond.wait(lock, [this] { return mQueue.empty() && mActive == 0; });
+}
+
+void WorkerPool::run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mWorkCond.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+        if (mQueue.empty()) {
+            // Only reached when stopping with nothing left to do
+            return;
+        }
+
+        std::function<void()> job = std::move(mQueue.front());
+        mQueue.pop_front();
+        mActive++;
+        lock.unlock();
+        mSpaceCond.notify_one();
+
+        job();
+
+        lock.lock();
+        mActive--;
+        if (mQueue.empty() && mActive == 0) {
+            mIdleCond.notify_all();
+        }
+    }
+}
+
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_WORKER_POOL_H
+#define ANDROID_VOLD_WORKER_POOL_H
+
+#include "Utils.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace vold {
+
+/*
+ * Small fixed-size pool of threads draining a FIFO of jobs. When
+ * maxQueued is non-zero, enqueue() blocks once that many jobs are
+ * waiting, so a fast producer can't run ahead of the workers.
+ */
+class WorkerPool {
+public:
+    WorkerPool(size_t threads, size_t maxQueued = 0);
+    virtual ~WorkerPool();
+
+    void enqueue(std::function<void()> job);
+
+    /* Blocks until every job enqueued so far has finished */
+    void wait();
+
+    size_t getThreadCount() const { return mThreads.size(); }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mWorkCond;
+    std::condition_variable mSpaceCond;
+    std::condition_variable mIdleCond;
+    std::deque<std::function<void()>> mQueue;
+    std::vector<std::thread> mThreads;
+    size_t mMaxQueued;
+    size_t mActive;
+    bool mStopping;
+
+    void run();
+
+    DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+}  // namespace vold
+}  // namespace android
+
+#endif
@@ -24,9 +24,13 @@ $ adb shell strace -p `pid zygote` -o /data/local/tmp/trace -f -ff -y -ttt -e tr
 $ adb pull /data/local/tmp/trace*
 $ python benchgen.py trace.*
 
+Alternatively emit a binary trace that vold replays without a rebuild:
+$ python benchgen.py --trace default.trace trace.*
+$ adb push default.trace /data/misc/vold/bench/
+
 """
 
-import re, sys, collections, traceback, argparse
+import re, sys, collections, traceback, argparse, struct
 
 from operator import itemgetter
 from collections import defaultdict
@@ -109,7 +113,13 @@ interesting = ["mmap2","read","write","pread64","pwrite64","fsync","fdatasync","
 
 re_event = re.compile(r"^([\d\.]+) (.+?)\((.+?)\) = (.+?)$")
 re_arg = re.compile(r'''((?:[^,"']|"[^"]*"|'[^']*')+)''')
-for fn in sys.argv[1:]:
+parser = argparse.ArgumentParser(description="Generates storage benchmark from strace output")
+parser.add_argument("--trace", metavar="OUT",
+                    help="write binary trace for runtime replay instead of BenchmarkGen.h")
+parser.add_argument("straces", nargs="+", help="per-thread strace output files")
+cmdline = parser.parse_args()
+
+for fn in cmdline.straces:
     with open(fn) as f:
         thread = int(fn.split(".")[-1])
         for line in f:
@@ -125,8 +135,93 @@ for fn in sys.argv[1:]:
             events.append(Event(thread, time, call, args, ret))
 
 
-with open("BenchmarkGen.h", 'w') as bench:
-    print >>bench, """/*
+events = sorted(events, key=lambda e: e.time)
+
+
+# Keep in sync with BenchmarkTrace.h
+OP_OPEN, OP_CLOSE, OP_READ, OP_WRITE, OP_PREAD, OP_PWRITE, OP_LSEEK, OP_FSYNC, OP_FDATASYNC = range(1, 10)
+OPEN_FLAGS = {
+    "O_WRONLY": 1,
+    "O_RDWR": 2,
+    "O_CREAT": 1 << 2,
+    "O_TRUNC": 1 << 3,
+    "O_APPEND": 1 << 4,
+    "O_SYNC": 1 << 5,
+    "O_DSYNC": 1 << 5,
+}
+WHENCE = { "SEEK_SET": 0, "SEEK_CUR": 1, "SEEK_END": 2 }
+
+def write_trace(path):
+    threads = {}
+    handles = {}
+    active = set()
+    ops = []
+    start = events[0].time if events else 0
+
+    def emit(e, op, handle, arg=0, count=0, offset=0):
+        thread = threads.setdefault(e.thread, len(threads))
+        handle = handles.setdefault(handle, len(handles))
+        usec = int(round((e.time - start) * 1000000))
+        ops.append(struct.pack("<BBHIIIqQ", op, 0, thread, handle, arg, count, offset, usec))
+
+    for e in events:
+        if e.call == "openat":
+            fd, f, handle = extract_file(e, e.ret)
+            if f:
+                active.add(handle)
+                flags = 0
+                for flag in e.args[2].split("|"):
+                    flags |= OPEN_FLAGS.get(flag.strip(), 0)
+                emit(e, OP_OPEN, handle, f.ident, 0, flags)
+            continue
+
+        if e.call == "mmap2":
+            fd, f, handle = extract_file(e, e.args[4])
+        else:
+            fd, f, handle = extract_file(e, e.args[0])
+        if handle not in active:
+            continue
+
+        if e.call == "close":
+            active.remove(handle)
+            emit(e, OP_CLOSE, handle)
+        elif e.call == "lseek":
+            emit(e, OP_LSEEK, handle, WHENCE.get(e.args[2], 0), 0, int(e.args[1]))
+        elif e.call == "_llseek":
+            emit(e, OP_LSEEK, handle, WHENCE.get(e.args[3], 0), 0, int(e.args[1]))
+        elif e.call in ("read", "write"):
+            count = min(int(e.args[2]), bufsize)
+            f.size += count
+            emit(e, OP_READ if e.call == "read" else OP_WRITE, handle, 0, count)
+        elif e.call in ("pread64", "pwrite64"):
+            f.size = max(f.size, int(e.args[2]) + int(e.args[3]))
+            count = min(int(e.args[2]), bufsize)
+            emit(e, OP_PREAD if e.call == "pread64" else OP_PWRITE, handle, 0, count, int(e.args[3]))
+        elif e.call == "fsync":
+            emit(e, OP_FSYNC, handle)
+        elif e.call == "fdatasync":
+            emit(e, OP_FDATASYNC, handle)
+        elif e.call == "mmap2":
+            count = min(int(e.args[1]), bufsize)
+            offset = int(e.args[5], 0)
+            f.size = max(f.size, count + offset)
+            emit(e, OP_PREAD, handle, 0, count, offset)
+
+    ordered = sorted(files.values(), key=lambda f: f.ident)
+    with open(path, "wb") as out:
+        out.write(struct.pack("<4sIIII", b"VBT1", len(ordered), len(handles),
+                              max(len(threads), 1), len(ops)))
+        for f in ordered:
+            out.write(struct.pack("<Q", f.size))
+        for op in ops:
+            out.write(op)
+
+
+if cmdline.trace:
+    write_trace(cmdline.trace)
+else:
+    with open("BenchmarkGen.h", 'w') as bench:
+        print >>bench, """/*
  * Copyright (C) 2015 The Android Open Source Project
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
@@ -167,99 +262,98 @@ namespace vold {
 static status_t BenchmarkRun() {
 """
 
-    print >>bench, "char* buf = (char*) malloc(%d);" % (bufsize)
-
-    nread = 0
-    nwrite = 0
-    nsync = 0
-    events = sorted(events, key=lambda e: e.time)
-    active = set()
-    defined = set()
-    for e in events:
-        if e.call == "openat":
-            fd, f, handle = extract_file(e, e.ret)
-            if f:
-                active.add(handle)
-                if handle not in defined:
-                    print >>bench, "int ",
-                    defined.add(handle)
-                print >>bench, '%s = TEMP_FAILURE_RETRY(open("file%s", %s));' % (handle, f.ident, e.args[2])
-
-        elif e.call == "close":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                active.remove(handle)
-                print >>bench, 'close(%s);' % (handle)
-
-        elif e.call == "lseek":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                print >>bench, 'TEMP_FAILURE_RETRY(lseek(%s, %s, %s));' % (handle, e.args[1], e.args[2])
-
-        elif e.call == "_llseek":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                print >>bench, 'TEMP_FAILURE_RETRY(lseek(%s, %s, %s));' % (handle, e.args[1], e.args[3])
-
-        elif e.call == "read":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                # TODO: track actual file size instead of guessing
-                count = min(int(e.args[2]), bufsize)
-                f.size += count
-                print >>bench, 'TEMP_FAILURE_RETRY(read(%s, buf, %d));' % (handle, count)
-                nread += 1
-
-        elif e.call == "write":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                # TODO: track actual file size instead of guessing
-                count = min(int(e.args[2]), bufsize)
-                f.size += count
-                print >>bench, 'TEMP_FAILURE_RETRY(write(%s, buf, %d));' % (handle, count)
-                nwrite += 1
-
-        elif e.call == "pread64":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                f.size = max(f.size, int(e.args[2]) + int(e.args[3]))
-                count = min(int(e.args[2]), bufsize)
-                print >>bench, 'TEMP_FAILURE_RETRY(pread(%s, buf, %d, %s));' % (handle, count, e.args[3])
-                nread += 1
-
-        elif e.call == "pwrite64":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                f.size = max(f.size, int(e.args[2]) + int(e.args[3]))
-                count = min(int(e.args[2]), bufsize)
-                print >>bench, 'TEMP_FAILURE_RETRY(pwrite(%s, buf, %d, %s));' % (handle, count, e.args[3])
-                nwrite += 1
-
-        elif e.call == "fsync":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                print >>bench, 'TEMP_FAILURE_RETRY(fsync(%s));' % (handle)
-                nsync += 1
-
-        elif e.call == "fdatasync":
-            fd, f, handle = extract_file(e, e.args[0])
-            if handle in active:
-                print >>bench, 'TEMP_FAILURE_RETRY(fdatasync(%s));' % (handle)
-                nsync += 1
-
-        elif e.call == "mmap2":
-            fd, f, handle = extract_file(e, e.args[4])
-            if handle in active:
-                count = min(int(e.args[1]), bufsize)
-                offset = int(e.args[5], 0)
-                f.size = max(f.size, count + offset)
-                print >>bench, 'TEMP_FAILURE_RETRY(pread(%s, buf, %s, %s)); // mmap2' % (handle, count, offset)
-                nread += 1
-
-    for handle in active:
-        print >>bench, 'close(%s);' % (handle)
-
-    print >>bench, """
+        print >>bench, "char* buf = (char*) malloc(%d);" % (bufsize)
+
+        nread = 0
+        nwrite = 0
+        nsync = 0
+        active = set()
+        defined = set()
+        for e in events:
+            if e.call == "openat":
+                fd, f, handle = extract_file(e, e.ret)
+                if f:
+                    active.add(handle)
+                    if handle not in defined:
+                        print >>bench, "int ",
+                        defined.add(handle)
+                    print >>bench, '%s = TEMP_FAILURE_RETRY(open("file%s", %s));' % (handle, f.ident, e.args[2])
+
+            elif e.call == "close":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    active.remove(handle)
+                    print >>bench, 'close(%s);' % (handle)
+
+            elif e.call == "lseek":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    print >>bench, 'TEMP_FAILURE_RETRY(lseek(%s, %s, %s));' % (handle, e.args[1], e.args[2])
+
+            elif e.call == "_llseek":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    print >>bench, 'TEMP_FAILURE_RETRY(lseek(%s, %s, %s));' % (handle, e.args[1], e.args[3])
+
+            elif e.call == "read":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    # TODO: track actual file size instead of guessing
+                    count = min(int(e.args[2]), bufsize)
+                    f.size += count
+                    print >>bench, 'TEMP_FAILURE_RETRY(read(%s, buf, %d));' % (handle, count)
+                    nread += 1
+
+            elif e.call == "write":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    # TODO: track actual file size instead of guessing
+                    count = min(int(e.args[2]), bufsize)
+                    f.size += count
+                    print >>bench, 'TEMP_FAILURE_RETRY(write(%s, buf, %d));' % (handle, count)
+                    nwrite += 1
+
+            elif e.call == "pread64":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    f.size = max(f.size, int(e.args[2]) + int(e.args[3]))
+                    count = min(int(e.args[2]), bufsize)
+                    print >>bench, 'TEMP_FAILURE_RETRY(pread(%s, buf, %d, %s));' % (handle, count, e.args[3])
+                    nread += 1
+
+            elif e.call == "pwrite64":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    f.size = max(f.size, int(e.args[2]) + int(e.args[3]))
+                    count = min(int(e.args[2]), bufsize)
+                    print >>bench, 'TEMP_FAILURE_RETRY(pwrite(%s, buf, %d, %s));' % (handle, count, e.args[3])
+                    nwrite += 1
+
+            elif e.call == "fsync":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    print >>bench, 'TEMP_FAILURE_RETRY(fsync(%s));' % (handle)
+                    nsync += 1
+
+            elif e.call == "fdatasync":
+                fd, f, handle = extract_file(e, e.args[0])
+                if handle in active:
+                    print >>bench, 'TEMP_FAILURE_RETRY(fdatasync(%s));' % (handle)
+                    nsync += 1
+
+            elif e.call == "mmap2":
+                fd, f, handle = extract_file(e, e.args[4])
+                if handle in active:
+                    count = min(int(e.args[1]), bufsize)
+                    offset = int(e.args[5], 0)
+                    f.size = max(f.size, count + offset)
+                    print >>bench, 'TEMP_FAILURE_RETRY(pread(%s, buf, %s, %s)); // mmap2' % (handle, count, offset)
+                    nread += 1
+
+        for handle in active:
+            print >>bench, 'close(%s);' % (handle)
+
+        print >>bench, """
 free(buf);
 return 0;
 }
@@ -296,10 +390,10 @@ static status_t BenchmarkCreate() {
 status_t res = 0;
 res |= CreateFile("stub", 0);
 """
-    for f in files.values():
-        print >>bench, 'res |= CreateFile("file%s", %d);' % (f.ident, f.size)
+        for f in files.values():
+            print >>bench, 'res |= CreateFile("file%s", %d);' % (f.ident, f.size)
 
-    print >>bench, """
+        print >>bench, """
 return res;
 }
 
@@ -307,16 +401,16 @@ static status_t BenchmarkDestroy() {
 status_t res = 0;
 res |= unlink("stub");
 """
-    for f in files.values():
-        print >>bench, 'res |= unlink("file%s");' % (f.ident)
+        for f in files.values():
+            print >>bench, 'res |= unlink("file%s");' % (f.ident)
 
-    print >>bench, """
+        print >>bench, """
 return res;
 }
 
 static std::string BenchmarkIdent() {"""
-    print >>bench, """return "r%d:w%d:s%d";""" % (nread, nwrite, nsync)
-    print >>bench, """}
+        print >>bench, """return "r%d:w%d:s%d";""" % (nread, nwrite, nsync)
+        print >>bench, """}
 
 }  // namespace vold
 }  // namespace android
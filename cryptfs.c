@@ -33,6 +33,7 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <sys/param.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/mount.h>
 #include <openssl/evp.h>
@@ -49,18 +50,20 @@
 #define LOG_TAG "Cryptfs"
 #include "cutils/log.h"
 #include "cutils/properties.h"
+#include "cutils/trace.h"
 #include "cutils/android_reboot.h"
 #include "hardware_legacy/power.h"
 #include <logwrap/logwrap.h>
 #include "ScryptParameters.h"
 #include "VolumeManager.h"
 #include "VoldUtil.h"
-#include "crypto_scrypt.h"
+#include "Scrypt.h"
 #include "Ext4Crypt.h"
 #include "ext4_utils.h"
 #include "f2fs_sparseblock.h"
 #include "CheckBattery.h"
 #include "Process.h"
+#include "DmControl.h"
 
 #include <bootloader_message/bootloader_message.h>
 #include <hardware/keymaster0.h>
@@ -92,7 +95,11 @@
 #define EXT4_FS 1
 #define F2FS_FS 2
 
-#define TABLE_LOAD_RETRIES 10
+/* How long a table load waits for its backing device, and in what steps */
+#define TABLE_LOAD_TIMEOUT_MS 5000
+#define TABLE_LOAD_WAIT_MS 500
+/* First sleep between loads refused while the device itself is ready */
+#define TABLE_LOAD_BACKOFF_MS 50
 
 #define RSA_KEY_SIZE 2048
 #define RSA_KEY_SIZE_BYTES (RSA_KEY_SIZE / 8)
@@ -104,10 +111,18 @@
 
 char *me = "cryptfs";
 
-static unsigned char saved_master_key[KEY_LEN_BYTES];
+static unsigned char saved_master_key[MAX_KEY_LEN];
 static char *saved_mount_point;
 static int  master_key_saved = 0;
 static struct crypt_persist_data *persist_data = NULL;
+/* Set whenever persist_data differs from what was last saved */
+static int persist_dirty = 0;
+
+/* Open addressed hash from key to entry number, rebuilt when persist_data
+ * is replaced or compacted. Sized to at least twice the entry count. */
+static int *persist_index = NULL;
+static unsigned int persist_index_size = 0;
+static const struct crypt_persist_data *persist_index_data = NULL;
 
 static int previous_type;
 
@@ -261,7 +276,17 @@ static const char* kMkF2fsPath = "/system/bin/mkfs.f2fs";
 #endif
 
 #ifndef MINIVOLD // no HALs in recovery...
-static int keymaster_init(keymaster0_device_t **keymaster0_dev,
+/*
+ * The keymaster device, opened on first use and then kept open so that a
+ * password check pays only for signing, not for setting up a TEE session.
+ * At most one of the two is set. keymaster_lock is held for as long as a
+ * caller uses the device, since keymaster0 HALs needn't be reentrant.
+ */
+static pthread_mutex_t keymaster_lock = PTHREAD_MUTEX_INITIALIZER;
+static keymaster0_device_t *keymaster0_handle = NULL;
+static keymaster1_device_t *keymaster1_handle = NULL;
+
+static int keymaster_open(keymaster0_device_t **keymaster0_dev,
                           keymaster1_device_t **keymaster1_dev)
 {
     int rc;
@@ -299,6 +324,32 @@ err:
     *keymaster1_dev = NULL;
     return rc;
 }
+
+/* Takes keymaster_lock and hands out the shared device, opening it if
+ * needed. A failed open is retried on the next call. On success, release
+ * the device with keymaster_put(). */
+static int keymaster_get(keymaster0_device_t **keymaster0_dev,
+                         keymaster1_device_t **keymaster1_dev)
+{
+    pthread_mutex_lock(&keymaster_lock);
+    if (!keymaster0_handle && !keymaster1_handle) {
+        int rc = keymaster_open(&keymaster0_handle, &keymaster1_handle);
+        if (rc) {
+            pthread_mutex_unlock(&keymaster_lock);
+            *keymaster0_dev = NULL;
+            *keymaster1_dev = NULL;
+            return rc;
+        }
+    }
+    *keymaster0_dev = keymaster0_handle;
+    *keymaster1_dev = keymaster1_handle;
+    return 0;
+}
+
+static void keymaster_put(void)
+{
+    pthread_mutex_unlock(&keymaster_lock);
+}
 #endif
 
 /* Should we use keymaster? */
@@ -311,10 +362,9 @@ static int keymaster_check_compatibility()
     keymaster1_device_t *keymaster1_dev = 0;
     int rc = 0;
 
-    if (keymaster_init(&keymaster0_dev, &keymaster1_dev)) {
+    if (keymaster_get(&keymaster0_dev, &keymaster1_dev)) {
         SLOGE("Failed to init keymaster");
-        rc = -1;
-        goto out;
+        return -1;
     }
 
     if (keymaster1_dev) {
@@ -341,12 +391,7 @@ static int keymaster_check_compatibility()
     }
 
 out:
-    if (keymaster1_dev) {
-        keymaster1_close(keymaster1_dev);
-    }
-    if (keymaster0_dev) {
-        keymaster0_close(keymaster0_dev);
-    }
+    keymaster_put();
     return rc;
 #endif
 }
@@ -366,7 +411,7 @@ static int keymaster_create_key(struct crypt_mnt_ftr *ftr)
         return 0;
     }
 
-    if (keymaster_init(&keymaster0_dev, &keymaster1_dev)) {
+    if (keymaster_get(&keymaster0_dev, &keymaster1_dev)) {
         SLOGE("Failed to init keymaster");
         return -1;
     }
@@ -423,7 +468,7 @@ static int keymaster_create_key(struct crypt_mnt_ftr *ftr)
             goto out;
         }
     } else {
-        SLOGE("Cryptfs bug: keymaster_init succeeded but didn't initialize a device");
+        SLOGE("Cryptfs bug: keymaster_get succeeded but didn't initialize a device");
         rc = -1;
         goto out;
     }
@@ -438,10 +483,7 @@ static int keymaster_create_key(struct crypt_mnt_ftr *ftr)
     ftr->keymaster_blob_size = key_size;
 
 out:
-    if (keymaster0_dev)
-        keymaster0_close(keymaster0_dev);
-    if (keymaster1_dev)
-        keymaster1_close(keymaster1_dev);
+    keymaster_put();
     free(key);
     return rc;
 #endif
@@ -460,10 +502,9 @@ static int keymaster_sign_object(struct crypt_mnt_ftr *ftr,
     int rc = 0;
     keymaster0_device_t *keymaster0_dev = 0;
     keymaster1_device_t *keymaster1_dev = 0;
-    if (keymaster_init(&keymaster0_dev, &keymaster1_dev)) {
+    if (keymaster_get(&keymaster0_dev, &keymaster1_dev)) {
         SLOGE("Failed to init keymaster");
-        rc = -1;
-        goto out;
+        return -1;
     }
 
     unsigned char to_sign[RSA_KEY_SIZE_BYTES];
@@ -570,17 +611,13 @@ static int keymaster_sign_object(struct crypt_mnt_ftr *ftr,
         *signature = (uint8_t*)tmp_sig.data;
         *signature_size = tmp_sig.data_length;
     } else {
-        SLOGE("Cryptfs bug: keymaster_init succeded but didn't initialize a device.");
+        SLOGE("Cryptfs bug: keymaster_get succeeded but didn't initialize a device.");
         rc = -1;
         goto out;
     }
 
     out:
-        if (keymaster1_dev)
-            keymaster1_close(keymaster1_dev);
-        if (keymaster0_dev)
-            keymaster0_close(keymaster0_dev);
-
+        keymaster_put();
         return rc;
 #endif
 }
@@ -628,20 +665,6 @@ static void cryptfs_reboot(enum RebootType rt)
     return;
 }
 
-static void ioctl_init(struct dm_ioctl *io, size_t dataSize, const char *name, unsigned flags)
-{
-    memset(io, 0, dataSize);
-    io->data_size = dataSize;
-    io->data_start = sizeof(struct dm_ioctl);
-    io->version[0] = 4;
-    io->version[1] = 0;
-    io->version[2] = 0;
-    io->flags = flags;
-    if (name) {
-        strlcpy(io->name, name, sizeof(io->name));
-    }
-}
-
 /**
  * Gets the default device scrypt parameters for key derivation time tuning.
  * The parameters should lead to about one second derivation time for the
@@ -759,6 +782,40 @@ static void set_ftr_sha(struct crypt_mnt_ftr *crypt_ftr)
     SHA256_Final(crypt_ftr->sha256, &c);
 }
 
+/* The footer as last read or written, already validated and upgraded, so
+ * polling entry points don't go back to the metadata partition each time.
+ * Only put_crypt_ftr_and_key() changes the footer, and it keeps this current.
+ */
+static pthread_mutex_t crypt_ftr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct crypt_mnt_ftr crypt_ftr_cache;
+static int crypt_ftr_cache_valid = 0;
+/* Whether the cached footer's sha256 matched when it was read */
+static int crypt_ftr_cache_sha_ok = 0;
+
+static void compute_ftr_sha(const struct crypt_mnt_ftr *crypt_ftr, __le8 *sha256)
+{
+    struct crypt_mnt_ftr copy;
+    memcpy(&copy, crypt_ftr, sizeof(copy));
+    set_ftr_sha(&copy);
+    memcpy(sha256, copy.sha256, sizeof(copy.sha256));
+}
+
+static void cache_crypt_ftr(const struct crypt_mnt_ftr *crypt_ftr, int sha_ok)
+{
+    pthread_mutex_lock(&crypt_ftr_cache_lock);
+    memcpy(&crypt_ftr_cache, crypt_ftr, sizeof(crypt_ftr_cache));
+    crypt_ftr_cache_sha_ok = sha_ok;
+    crypt_ftr_cache_valid = 1;
+    pthread_mutex_unlock(&crypt_ftr_cache_lock);
+}
+
+static void invalidate_crypt_ftr_cache(void)
+{
+    pthread_mutex_lock(&crypt_ftr_cache_lock);
+    crypt_ftr_cache_valid = 0;
+    pthread_mutex_unlock(&crypt_ftr_cache_lock);
+}
+
 /* key or salt can be NULL, in which case just skip writing that value.  Useful to
  * update the failed mount count but not change the key.
  */
@@ -775,6 +832,8 @@ static int put_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   struct stat statbuf;
 
   set_ftr_sha(crypt_ftr);
+  /* Whatever happens below, the old copy no longer describes the disk */
+  invalidate_crypt_ftr_cache();
 
   if (get_crypt_ftr_info(&fname, &starting_off)) {
     SLOGE("Unable to get crypt_ftr_info\n");
@@ -810,6 +869,7 @@ static int put_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   }
 
   /* Success! */
+  cache_crypt_ftr(crypt_ftr, 1);
   rc = 0;
 
 errout:
@@ -820,10 +880,21 @@ errout:
 
 static bool check_ftr_sha(const struct crypt_mnt_ftr *crypt_ftr)
 {
-    struct crypt_mnt_ftr copy;
-    memcpy(&copy, crypt_ftr, sizeof(copy));
-    set_ftr_sha(&copy);
-    return memcmp(copy.sha256, crypt_ftr->sha256, sizeof(copy.sha256)) == 0;
+    __le8 sha256[SHA256_DIGEST_LENGTH];
+    bool res;
+
+    /* The hash was already checked when the cached copy was read */
+    pthread_mutex_lock(&crypt_ftr_cache_lock);
+    if (crypt_ftr_cache_valid
+            && !memcmp(&crypt_ftr_cache, crypt_ftr, sizeof(crypt_ftr_cache))) {
+        res = crypt_ftr_cache_sha_ok;
+        pthread_mutex_unlock(&crypt_ftr_cache_lock);
+        return res;
+    }
+    pthread_mutex_unlock(&crypt_ftr_cache_lock);
+
+    compute_ftr_sha(crypt_ftr, sha256);
+    return memcmp(sha256, crypt_ftr->sha256, sizeof(sha256)) == 0;
 }
 
 static inline int unix_read(int  fd, void*  buff, int  len)
@@ -912,6 +983,7 @@ static void upgrade_crypt_ftr(int fd, struct crypt_mnt_ftr *crypt_ftr, off64_t o
     }
 }
 
+static int is_cipher_keysize(unsigned int keysize);
 
 static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
 {
@@ -921,6 +993,15 @@ static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   int rc = -1;
   char *fname = NULL;
   struct stat statbuf;
+  __le8 sha256[SHA256_DIGEST_LENGTH];
+
+  pthread_mutex_lock(&crypt_ftr_cache_lock);
+  if (crypt_ftr_cache_valid) {
+    memcpy(crypt_ftr, &crypt_ftr_cache, sizeof(*crypt_ftr));
+    pthread_mutex_unlock(&crypt_ftr_cache_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&crypt_ftr_cache_lock);
 
   if (get_crypt_ftr_info(&fname, &starting_off)) {
     SLOGE("Unable to get crypt_ftr_info\n");
@@ -969,6 +1050,16 @@ static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
           crypt_ftr->minor_version, CURRENT_MINOR_VERSION);
   }
 
+  /* Master key buffers hold MAX_KEY_LEN, and only our ciphers' sizes are written */
+  if (crypt_ftr->keysize == 0 || crypt_ftr->keysize > MAX_KEY_LEN
+      || !is_cipher_keysize(crypt_ftr->keysize)) {
+    SLOGE("Bad key size %u in real block device footer\n", crypt_ftr->keysize);
+    goto errout;
+  }
+
+  /* Check the hash as read, before any upgrade below changes the footer */
+  compute_ftr_sha(crypt_ftr, sha256);
+
   /* If this is a verion 1.0 crypt_ftr, make it a 1.1 crypt footer, and update the
    * copy on disk before returning.
    */
@@ -977,6 +1068,7 @@ static int get_crypt_ftr_and_key(struct crypt_mnt_ftr *crypt_ftr)
   }
 
   /* Success! */
+  cache_crypt_ftr(crypt_ftr, !memcmp(sha256, crypt_ftr->sha256, sizeof(sha256)));
   rc = 0;
 
 errout:
@@ -1100,6 +1192,19 @@ err:
     return -1;
 }
 
+/*
+ * Swaps in persistent data without touching storage, taking ownership of
+ * pdata, so the field lookup path can be benchmarked on its own.
+ */
+void cryptfs_replace_persist_data(struct crypt_persist_data *pdata)
+{
+    free(persist_data);
+    persist_data = pdata;
+    persist_dirty = 0;
+    /* pdata may well reuse the freed address, so force a rebuild */
+    persist_index_data = NULL;
+}
+
 static int save_persistent_data(void)
 {
     struct crypt_mnt_ftr crypt_ftr;
@@ -1193,6 +1298,7 @@ static int save_persistent_data(void)
     }
 
     /* Success */
+    persist_dirty = 0;
     free(pdata);
     close(fd);
     return 0;
@@ -1228,20 +1334,25 @@ static void convert_key_to_hex_ascii(const unsigned char *master_key,
 
 static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
         const unsigned char *master_key, const char *real_blk_name,
-        const char *name, int fd, const char *extra_params) {
-  _Alignas(struct dm_ioctl) char buffer[DM_CRYPT_BUF_SIZE];
+        const char *name, const char *extra_params) {
   struct dm_ioctl *io;
+  char *buffer;
   struct dm_target_spec *tgt;
   char *crypt_params;
   char master_key_ascii[129]; /* Large enough to hold 512 bit key and null */
-  int i;
+  int waited_ms = 0;
+  int backoff_ms = TABLE_LOAD_BACKOFF_MS;
+  int tries = 0;
+  int rc;
 
-  io = (struct dm_ioctl *) buffer;
+  if ((io = dm_get_buffer(DM_CRYPT_BUF_SIZE, name, 0)) == NULL) {
+    return -1;
+  }
+  buffer = (char *) io;
 
   /* Load the mapping table for this device */
   tgt = (struct dm_target_spec *) &buffer[sizeof(struct dm_ioctl)];
 
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
   io->target_count = 1;
   tgt->status = 0;
   tgt->sector_start = 0;
@@ -1266,7 +1377,7 @@ static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
 #endif
 
   snprintf(crypt_params,
-           sizeof(buffer)-sizeof(struct dm_ioctl)-sizeof(struct dm_target_spec),
+           io->data_size-sizeof(struct dm_ioctl)-sizeof(struct dm_target_spec),
            "%s %s 0 %s 0 %s 0",
            crypt_ftr->crypto_type_name, master_key_ascii,
            real_blk_name, extra_params);
@@ -1278,39 +1389,52 @@ static int load_crypto_mapping_table(struct crypt_mnt_ftr *crypt_ftr,
   crypt_params = (char *) (((unsigned long)crypt_params + 7) & ~8); /* Align to an 8 byte boundary */
   tgt->next = crypt_params - buffer;
 
-  for (i = 0; i < TABLE_LOAD_RETRIES; i++) {
-    if (! ioctl(fd, DM_TABLE_LOAD, io)) {
+  memset(master_key_ascii, 0, sizeof(master_key_ascii));
+
+  /* A load only fails transiently while the backing device is still coming
+   * up, so wait for that instead of sleeping a fixed time between tries */
+  while (1) {
+    tries++;
+    if (!(rc = dm_control_ioctl(DM_TABLE_LOAD, &io))) {
       break;
     }
-    usleep(500000);
+    if ((errno != ENXIO && errno != ENODEV && errno != ENOENT && errno != EBUSY)
+        || waited_ms >= TABLE_LOAD_TIMEOUT_MS) {
+      SLOGE("Cannot load dm-crypt table for %s: %s\n", name, strerror(errno));
+      break;
+    }
+    waited_ms += TABLE_LOAD_WAIT_MS;
+    if (!dm_wait_for_device(real_blk_name, TABLE_LOAD_WAIT_MS)) {
+      /* The device is free but the load is still refused, so back off
+       * rather than spin on the ioctl */
+      usleep(backoff_ms * 1000);
+      backoff_ms = (backoff_ms * 2 < TABLE_LOAD_WAIT_MS) ? backoff_ms * 2 : TABLE_LOAD_WAIT_MS;
+    }
   }
+  dm_put_buffer(io);
 
-  if (i == TABLE_LOAD_RETRIES) {
-    /* We failed to load the table, return an error */
-    return -1;
-  } else {
-    return i + 1;
-  }
+  return rc ? -1 : tries;
 }
 
-static int get_dm_crypt_version(int fd, const char *name,  int *version)
+static int get_dm_crypt_version(const char *name,  int *version)
 {
-    char buffer[DM_CRYPT_BUF_SIZE];
     struct dm_ioctl *io;
     struct dm_target_versions *v;
+    int rc = -1;
 
-    io = (struct dm_ioctl *) buffer;
-
-    ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+    if ((io = dm_get_buffer(DM_CRYPT_BUF_SIZE, name, 0)) == NULL) {
+        return -1;
+    }
 
-    if (ioctl(fd, DM_LIST_VERSIONS, io)) {
+    if (dm_control_ioctl(DM_LIST_VERSIONS, &io)) {
+        dm_put_buffer(io);
         return -1;
     }
 
     /* Iterate over the returned versions, looking for name of "crypt".
      * When found, get and return the version.
      */
-    v = (struct dm_target_versions *) &buffer[sizeof(struct dm_ioctl)];
+    v = (struct dm_target_versions *) (((char *) io) + sizeof(struct dm_ioctl));
     while (v->next) {
         if (! strcmp(v->name, "crypt")) {
 
@@ -1318,53 +1442,176 @@ static int get_dm_crypt_version(int fd, const char *name,  int *version)
             version[0] = v->version[0];
             version[1] = v->version[1];
             version[2] = v->version[2];
-            return 0;
+            rc = 0;
+            break;
         }
         v = (struct dm_target_versions *)(((char *)v) + v->next);
     }
 
-    return -1;
+    dm_put_buffer(io);
+    return rc;
 }
 
-static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
+/* Options of live dm-crypt mappings, kept so dump can report them */
+#define MAX_CRYPT_OPTS_RECORDS 8
+struct crypt_opts_record {
+  char name[64];
+  char params[128];
+};
+static struct crypt_opts_record crypt_opts_records[MAX_CRYPT_OPTS_RECORDS];
+static pthread_mutex_t crypt_opts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_crypt_opts(const char *name, const char *params)
+{
+  int i;
+  int slot = -1;
+
+  pthread_mutex_lock(&crypt_opts_lock);
+  for (i = 0; i < MAX_CRYPT_OPTS_RECORDS; i++) {
+    if (!strcmp(crypt_opts_records[i].name, name)) {
+      slot = i;
+      break;
+    }
+    if (slot < 0 && crypt_opts_records[i].name[0] == '\0') {
+      slot = i;
+    }
+  }
+  if (slot >= 0) {
+    if (params) {
+      strlcpy(crypt_opts_records[slot].name, name, sizeof(crypt_opts_records[slot].name));
+      strlcpy(crypt_opts_records[slot].params, params,
+              sizeof(crypt_opts_records[slot].params));
+    } else if (!strcmp(crypt_opts_records[slot].name, name)) {
+      memset(&crypt_opts_records[slot], 0, sizeof(crypt_opts_records[slot]));
+    }
+  }
+  pthread_mutex_unlock(&crypt_opts_lock);
+}
+
+static int dm_crypt_version_at_least(const int *version, int major, int minor)
+{
+  return version[0] > major || (version[0] == major && version[1] >= minor);
+}
+
+/*
+ * Builds the optional dm-crypt arguments for a mapping over the given kind
+ * of media, limited to what the loaded crypt target understands. Fails if
+ * the volume needs a sector size the kernel can't do, since mapping it
+ * with 512 byte sectors instead would present garbage.
+ */
+static int get_crypt_opt_params(const char *name, int media_class,
+        int sector_size, char *params, size_t len)
+{
+  int version[3] = { 0, 0, 0 };
+  char opts[128] = "";
+  char sector_opt[32];
+  int count = 0;
+
+  if (get_dm_crypt_version(name, version)) {
+    SLOGW("Cannot determine dm-crypt version; using no options\n");
+  }
+
+  /* Support for allow_discards was added in version 1.11.0 */
+  if (dm_crypt_version_at_least(version, 1, 11)) {
+    strlcat(opts, " allow_discards", sizeof(opts));
+    count++;
+  }
+
+  /* Fast internal and virtual media gain nothing from dm-crypt bouncing
+   * work to other CPUs and sorting writes; slow removable media still
+   * benefit from the sorting. Both options arrived in version 1.14.0 */
+  if ((media_class == CRYPT_MEDIA_INTERNAL || media_class == CRYPT_MEDIA_VIRTIO)
+      && dm_crypt_version_at_least(version, 1, 14)) {
+    strlcat(opts, " same_cpu_crypt submit_from_crypt_cpus", sizeof(opts));
+    count += 2;
+  }
+
+  /* Larger crypto sectors arrived in version 1.17.0 */
+  if (sector_size > 512) {
+    if (!dm_crypt_version_at_least(version, 1, 17)) {
+      SLOGE("dm-crypt %d.%d.%d cannot use %d byte sectors\n",
+            version[0], version[1], version[2], sector_size);
+      return -1;
+    }
+    snprintf(sector_opt, sizeof(sector_opt), " sector_size:%d", sector_size);
+    strlcat(opts, sector_opt, sizeof(opts));
+    count++;
+  }
+
+  if (count > 0) {
+    snprintf(params, len, "%d%s", count, opts);
+  } else {
+    params[0] = '\0';
+  }
+  return 0;
+}
+
+/*
+ * Largest crypto sector size we can ask dm-crypt for, for callers choosing
+ * the layout of a new volume.
+ */
+int cryptfs_max_sector_size(void)
+{
+  int version[3];
+  int res = 512;
+
+  if (!get_dm_crypt_version("", version) && dm_crypt_version_at_least(version, 1, 17)) {
+    res = 4096;
+  }
+  return res;
+}
+
+/*
+ * Describes the options of the index'th live mapping as "name: params".
+ * Returns -1 once index is past the end.
+ */
+int cryptfs_get_crypt_opts(int index, char *out, int len)
+{
+  int i;
+  int seen = 0;
+  int res = -1;
+
+  pthread_mutex_lock(&crypt_opts_lock);
+  for (i = 0; i < MAX_CRYPT_OPTS_RECORDS; i++) {
+    if (crypt_opts_records[i].name[0] == '\0') continue;
+    if (seen++ == index) {
+      snprintf(out, len, "%s: %s", crypt_opts_records[i].name,
+               crypt_opts_records[i].params[0] ? crypt_opts_records[i].params : "none");
+      res = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&crypt_opts_lock);
+  return res;
+}
+
+static int create_crypto_blk_dev_opts(struct crypt_mnt_ftr *crypt_ftr,
         const unsigned char *master_key, const char *real_blk_name,
-        char *crypto_blk_name, const char *name) {
-  char buffer[DM_CRYPT_BUF_SIZE];
-  struct dm_ioctl *io;
-  unsigned int minor;
-  int fd=0;
-  int err;
+        char *crypto_blk_name, const char *name, int media_class, int sector_size) {
+  struct dm_ioctl *io = NULL;
   int retval = -1;
-  int version[3];
-  char *extra_params;
+  char opt_params[160];
+  char record[160];
+  const char *extra_params;
   int load_count;
 #ifdef CONFIG_HW_DISK_ENCRYPTION
   char encrypted_state[PROPERTY_VALUE_MAX] = {0};
   char progress[PROPERTY_VALUE_MAX] = {0};
 #endif
 
-  if ((fd = open("/dev/device-mapper", O_RDWR|O_CLOEXEC)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
+  if ((io = dm_get_buffer(sizeof(struct dm_ioctl), name, 0)) == NULL) {
     goto errout;
   }
-
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  err = ioctl(fd, DM_DEV_CREATE, io);
-  if (err) {
+  if (dm_control_ioctl(DM_DEV_CREATE, &io)) {
     SLOGE("Cannot create dm-crypt device %s: %s\n", name, strerror(errno));
     goto errout;
   }
 
-  /* Get the device status, in particular, the name of it's device file */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_STATUS, io)) {
-    SLOGE("Cannot retrieve dm-crypt device status\n");
+  /* The reply carries the device number, so the node can be made right away */
+  if (dm_make_node(io->dev, crypto_blk_name, MAXPATHLEN)) {
+    SLOGE("Cannot create node for dm-crypt device %s: %s\n", name, strerror(errno));
     goto errout;
   }
-  minor = (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00);
-  snprintf(crypto_blk_name, MAXPATHLEN, "/dev/block/dm-%u", minor);
 
 #ifdef CONFIG_HW_DISK_ENCRYPTION
   if(is_hw_disk_encryption((char*)crypt_ftr->crypto_type_name)) {
@@ -1379,30 +1626,23 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
     } else
       extra_params = "fde_disabled";
   } else {
-    extra_params = "";
-    if (! get_dm_crypt_version(fd, name, version)) {
-      /* Support for allow_discards was added in version 1.11.0 */
-      if ((version[0] >= 2) ||
-          ((version[0] == 1) && (version[1] >= 11))) {
-          extra_params = "1 allow_discards";
-          SLOGI("Enabling support for allow_discards in dmcrypt.\n");
-      }
+    if (get_crypt_opt_params(name, media_class, sector_size,
+                             opt_params, sizeof(opt_params))) {
+      goto errout;
     }
+    extra_params = opt_params;
   }
 #else
-  extra_params = "";
-  if (! get_dm_crypt_version(fd, name, version)) {
-      /* Support for allow_discards was added in version 1.11.0 */
-      if ((version[0] >= 2) ||
-          ((version[0] == 1) && (version[1] >= 11))) {
-          extra_params = "1 allow_discards";
-          SLOGI("Enabling support for allow_discards in dmcrypt.\n");
-      }
+  if (get_crypt_opt_params(name, media_class, sector_size,
+                           opt_params, sizeof(opt_params))) {
+    goto errout;
   }
+  extra_params = opt_params;
 #endif
+  SLOGI("Using dm-crypt options \"%s\" for %s\n", extra_params, name);
 
   load_count = load_crypto_mapping_table(crypt_ftr, master_key, real_blk_name, name,
-                                         fd, extra_params);
+                                         extra_params);
   if (load_count < 0) {
       SLOGE("Cannot load dm-crypt mapping table.\n");
       goto errout;
@@ -1411,50 +1651,356 @@ static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
   }
 
   /* Resume this device to activate it */
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
+  dm_reset_buffer(io, name, 0);
 
-  if (ioctl(fd, DM_DEV_SUSPEND, io)) {
+  if (dm_control_ioctl(DM_DEV_SUSPEND, &io)) {
     SLOGE("Cannot resume the dm-crypt device\n");
     goto errout;
   }
 
+  /* Report the cipher too, since it now varies between mappings */
+  snprintf(record, sizeof(record), "%s %s", crypt_ftr->crypto_type_name, extra_params);
+  record_crypt_opts(name, record);
+
   /* We made it here with no errors.  Woot! */
   retval = 0;
 
 errout:
-  close(fd);   /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
+  dm_put_buffer(io);
 
   return retval;
 }
 
+static int create_crypto_blk_dev(struct crypt_mnt_ftr *crypt_ftr,
+        const unsigned char *master_key, const char *real_blk_name,
+        char *crypto_blk_name, const char *name) {
+  /* The on-disk format of existing FDE volumes fixes their sector size */
+  return create_crypto_blk_dev_opts(crypt_ftr, master_key, real_blk_name,
+                                    crypto_blk_name, name, CRYPT_MEDIA_INTERNAL, 0);
+}
+
 static int delete_crypto_blk_dev(char *name)
 {
-  int fd;
-  char buffer[DM_CRYPT_BUF_SIZE];
   struct dm_ioctl *io;
   int retval = -1;
 
-  if ((fd = open("/dev/device-mapper", O_RDWR|O_CLOEXEC)) < 0 ) {
-    SLOGE("Cannot open device-mapper\n");
+  if ((io = dm_get_buffer(sizeof(struct dm_ioctl), name, 0)) == NULL) {
     goto errout;
   }
-
-  io = (struct dm_ioctl *) buffer;
-
-  ioctl_init(io, DM_CRYPT_BUF_SIZE, name, 0);
-  if (ioctl(fd, DM_DEV_REMOVE, io)) {
+  if (dm_control_ioctl(DM_DEV_REMOVE, &io)) {
     SLOGE("Cannot remove dm-crypt device\n");
     goto errout;
   }
+  record_crypt_opts(name, NULL);
 
   /* We made it here with no errors.  Woot! */
   retval = 0;
 
 errout:
-  close(fd);    /* If fd is <0 from a failed open call, it's safe to just ignore the close error */
+  dm_put_buffer(io);
+
+  return retval;
+
+}
+
+/* dm-crypt ciphers worth considering for a new volume, default first */
+struct cipher_candidate {
+  const char *name;
+  const char *alg;      /* template the kernel registers in /proc/crypto */
+  int keysize;
+};
+static const struct cipher_candidate cipher_candidates[] = {
+  { "aes-cbc-essiv:sha256", "cbc(aes)", 16 },
+  { "aes-xts-plain64", "xts(aes)", 32 },
+};
+#define NUM_CIPHER_CANDIDATES (sizeof(cipher_candidates) / sizeof(cipher_candidates[0]))
+
+static int is_cipher_keysize(unsigned int keysize)
+{
+  size_t i;
+  for (i = 0; i < NUM_CIPHER_CANDIDATES; i++) {
+    if ((unsigned int) cipher_candidates[i].keysize == keysize) {
+      return 1;
+    }
+  }
+  return keysize == KEY_LEN_BYTES;
+}
+
+#define CIPHER_AUTOSELECT_PROP "persist.vold.cipher_autoselect"
+#define CIPHER_BENCH_ZERO_NAME "cipherbench_zero"
+#define CIPHER_BENCH_CRYPT_NAME "cipherbench_crypt"
+#define CIPHER_BENCH_BYTES (16 * 1024 * 1024)
+#define CIPHER_BENCH_SECTORS (CIPHER_BENCH_BYTES / 512)
+#define CIPHER_BENCH_CHUNK (1024 * 1024)
+/* Another cipher has to beat the default by this much to be chosen */
+#define CIPHER_BENCH_MARGIN_PCT 10
+#define NUM_MEDIA_CLASSES 4
+
+/* Results of the selection per media class, kept so dump can report them */
+struct cipher_bench_result {
+  int done;
+  int choice;
+  double mbps[NUM_CIPHER_CANDIDATES];
+  char driver[NUM_CIPHER_CANDIDATES][64];
+  int priority[NUM_CIPHER_CANDIDATES];
+};
+static struct cipher_bench_result cipher_bench_results[NUM_MEDIA_CLASSES];
+static pthread_mutex_t cipher_bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Finds the highest priority kernel driver registered for alg, which is
+ * the one dm-crypt ends up with. Leaves driver empty when none is loaded.
+ */
+static void get_crypto_driver(const char *alg, char *driver, int len, int *priority)
+{
+  char line[256];
+  char cur_driver[64] = "";
+  int match = 0;
+  FILE *fp;
+
+  driver[0] = '\0';
+  *priority = -1;
+  if ((fp = fopen("/proc/crypto", "re")) == NULL) {
+    SLOGW("Cannot open /proc/crypto: %s\n", strerror(errno));
+    return;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    char *value = strchr(line, ':');
+    if (value == NULL) continue;
+    value++;
+    while (*value == ' ') value++;
+    value[strcspn(value, "\n")] = '\0';
+
+    if (!strncmp(line, "name", 4)) {
+      match = !strcmp(value, alg);
+    } else if (match && !strncmp(line, "driver", 6)) {
+      strlcpy(cur_driver, value, sizeof(cur_driver));
+    } else if (match && !strncmp(line, "priority", 8)) {
+      int prio = atoi(value);
+      if (prio > *priority) {
+        *priority = prio;
+        strlcpy(driver, cur_driver, len);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+/*
+ * Creates a dm device of the given size backed by the zero target, so
+ * a crypt mapping on top costs nothing but the cipher itself.
+ */
+static int create_zero_blk_dev(const char *name, unsigned long sectors, __u64 *dev)
+{
+  struct dm_ioctl *io;
+  struct dm_target_spec *tgt;
+  int retval = -1;
+
+  if ((io = dm_get_buffer(DM_CRYPT_BUF_SIZE, name, 0)) == NULL) {
+    return -1;
+  }
+  if (dm_control_ioctl(DM_DEV_CREATE, &io)) {
+    SLOGE("Cannot create dm device %s: %s\n", name, strerror(errno));
+    goto errout;
+  }
+
+  dm_reset_buffer(io, name, 0);
+  io->target_count = 1;
+  tgt = (struct dm_target_spec *) (((char *) io) + sizeof(struct dm_ioctl));
+  tgt->sector_start = 0;
+  tgt->length = sectors;
+  strlcpy(tgt->target_type, "zero", DM_MAX_TYPE_NAME);
+  /* No parameters, just the terminating NUL, rounded up to 8 bytes */
+  tgt->next = sizeof(struct dm_target_spec) + 8;
+  if (dm_control_ioctl(DM_TABLE_LOAD, &io)) {
+    SLOGE("Cannot load zero table for %s: %s\n", name, strerror(errno));
+    goto errout;
+  }
+
+  dm_reset_buffer(io, name, 0);
+  if (dm_control_ioctl(DM_DEV_SUSPEND, &io)) {
+    SLOGE("Cannot resume %s: %s\n", name, strerror(errno));
+    goto errout;
+  }
+  *dev = io->dev;
+  retval = 0;
 
+errout:
+  dm_put_buffer(io);
   return retval;
+}
+
+static double elapsed_secs(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Times writing and reading back CIPHER_BENCH_BYTES through a scratch
+ * mapping of the candidate over backing, in MiB/s. Fails when the kernel
+ * can't set the cipher up or the I/O errors out.
+ */
+static int time_cipher(const struct cipher_candidate *c, const char *backing,
+                       int media_class, double *mbps)
+{
+  struct crypt_mnt_ftr ftr;
+  unsigned char key[MAX_KEY_LEN];
+  char crypto_blkdev[MAXPATHLEN];
+  char name[] = CIPHER_BENCH_CRYPT_NAME;
+  struct timespec start;
+  void *buf = NULL;
+  off64_t off;
+  int fd = -1;
+  int rc = -1;
+
+  memset(&ftr, 0, sizeof(ftr));
+  ftr.fs_size = CIPHER_BENCH_SECTORS;
+  ftr.keysize = c->keysize;
+  strlcpy((char *) ftr.crypto_type_name, c->name, MAX_CRYPTO_TYPE_NAME_LEN);
+
+  fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+  if (fd == -1 || read(fd, key, c->keysize) != c->keysize) {
+    SLOGE("Cannot read random key\n");
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  close(fd);
+  fd = -1;
+
+  if (create_crypto_blk_dev_opts(&ftr, key, backing, crypto_blkdev, name, media_class, 0)) {
+    SLOGW("Cannot map %s for benchmarking\n", c->name);
+    goto out;
+  }
+  memset(key, 0, sizeof(key));
+
+  if ((fd = open(crypto_blkdev, O_RDWR|O_DIRECT|O_CLOEXEC)) == -1) {
+    SLOGE("Cannot open %s: %s\n", crypto_blkdev, strerror(errno));
+    goto out;
+  }
+  if (posix_memalign(&buf, 4096, CIPHER_BENCH_CHUNK)) {
+    goto out;
+  }
+  memset(buf, 0x5a, CIPHER_BENCH_CHUNK);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (off = 0; off < CIPHER_BENCH_BYTES; off += CIPHER_BENCH_CHUNK) {
+    if (pwrite64(fd, buf, CIPHER_BENCH_CHUNK, off) != CIPHER_BENCH_CHUNK) {
+      SLOGE("Benchmark write with %s failed: %s\n", c->name, strerror(errno));
+      goto out;
+    }
+  }
+  for (off = 0; off < CIPHER_BENCH_BYTES; off += CIPHER_BENCH_CHUNK) {
+    if (pread64(fd, buf, CIPHER_BENCH_CHUNK, off) != CIPHER_BENCH_CHUNK) {
+      SLOGE("Benchmark read with %s failed: %s\n", c->name, strerror(errno));
+      goto out;
+    }
+  }
+  *mbps = (2.0 * CIPHER_BENCH_BYTES / (1024 * 1024)) / elapsed_secs(&start);
+  rc = 0;
+
+out:
+  memset(key, 0, sizeof(key));
+  free(buf);
+  if (fd != -1) close(fd);
+  /* Also cleans up a device whose table failed to load */
+  delete_crypto_blk_dev(name);
+  return rc;
+}
+
+/*
+ * Picks the dm-crypt cipher for a new volume on the given kind of media,
+ * timing each candidate on a scratch mapping over a zero target, so it
+ * works even while the real device is busy. The default is kept unless
+ * another cipher beats it by CIPHER_BENCH_MARGIN_PCT. Results are cached
+ * for the life of vold. Copies the name into cipher and returns the key
+ * length that cipher takes.
+ */
+int cryptfs_select_cipher(int media_class, char *cipher, int len)
+{
+  struct cipher_bench_result *res;
+  char zero_name[] = CIPHER_BENCH_ZERO_NAME;
+  char backing[32];
+  char autoselect[PROPERTY_VALUE_MAX];
+  __u64 zero_dev;
+  size_t i;
+  int choice = 0;
+
+  property_get(CIPHER_AUTOSELECT_PROP, autoselect, "1");
+  if (media_class < 0 || media_class >= NUM_MEDIA_CLASSES || !strcmp(autoselect, "0")) {
+    strlcpy(cipher, cipher_candidates[0].name, len);
+    return cipher_candidates[0].keysize;
+  }
+
+  pthread_mutex_lock(&cipher_bench_lock);
+  res = &cipher_bench_results[media_class];
+  if (!res->done) {
+    memset(res, 0, sizeof(*res));
+    if (create_zero_blk_dev(zero_name, CIPHER_BENCH_SECTORS, &zero_dev) == 0) {
+      /* Refer to the backing device by number, its node may not exist yet */
+      snprintf(backing, sizeof(backing), "%u:%u", (unsigned) ((zero_dev >> 8) & 0xfff),
+               (unsigned) ((zero_dev & 0xff) | ((zero_dev >> 12) & 0xfff00)));
+      for (i = 0; i < NUM_CIPHER_CANDIDATES; i++) {
+        if (time_cipher(&cipher_candidates[i], backing, media_class, &res->mbps[i])) {
+          res->mbps[i] = 0;
+        }
+        /* The mapping loaded the cipher, so its driver is listed now */
+        get_crypto_driver(cipher_candidates[i].alg, res->driver[i],
+                          sizeof(res->driver[i]), &res->priority[i]);
+      }
+      delete_crypto_blk_dev(zero_name);
+
+      for (i = 1; i < NUM_CIPHER_CANDIDATES; i++) {
+        if (res->mbps[i] > res->mbps[choice] * (100 + CIPHER_BENCH_MARGIN_PCT) / 100) {
+          choice = i;
+        }
+      }
+      res->choice = choice;
+    }
+    res->done = 1;
+    SLOGI("Selected %s for media class %d\n", cipher_candidates[res->choice].name,
+          media_class);
+  }
+  choice = res->choice;
+  pthread_mutex_unlock(&cipher_bench_lock);
+
+  strlcpy(cipher, cipher_candidates[choice].name, len);
+  return cipher_candidates[choice].keysize;
+}
 
+/*
+ * Describes the index'th selection result as "class N: cipher ..." or a
+ * candidate line under it. Returns -1 once index is past the end.
+ */
+int cryptfs_get_cipher_bench(int index, char *out, int len)
+{
+  int c;
+  size_t i;
+  int seen = 0;
+  int res = -1;
+
+  pthread_mutex_lock(&cipher_bench_lock);
+  for (c = 0; c < NUM_MEDIA_CLASSES && res != 0; c++) {
+    struct cipher_bench_result *r = &cipher_bench_results[c];
+    if (!r->done) continue;
+    if (seen++ == index) {
+      snprintf(out, len, "class %d: %s", c, cipher_candidates[r->choice].name);
+      res = 0;
+      break;
+    }
+    for (i = 0; i < NUM_CIPHER_CANDIDATES; i++) {
+      if (seen++ == index) {
+        snprintf(out, len, "  %s: %.1f MiB/s driver %s priority %d",
+                 cipher_candidates[i].name, r->mbps[i],
+                 r->driver[i][0] ? r->driver[i] : "none", r->priority[i]);
+        res = 0;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&cipher_bench_lock);
+  return res;
 }
 
 static int pbkdf2(const char *passwd, const unsigned char *salt,
@@ -1481,9 +2027,9 @@ static int scrypt(const char *passwd, const unsigned char *salt,
 
     /* Turn the password into a key and IV that can decrypt the master key */
     unsigned int keysize;
-    crypto_scrypt((const uint8_t*)passwd, strlen(passwd),
-                  salt, SALT_LEN, N, r, p, ikey,
-                  KEY_LEN_BYTES + IV_LEN_BYTES);
+    vold_scrypt((const uint8_t*)passwd, strlen(passwd),
+                salt, SALT_LEN, N, r, p, ikey,
+                KEY_LEN_BYTES + IV_LEN_BYTES);
 
    return 0;
 }
@@ -1502,9 +2048,9 @@ static int scrypt_keymaster(const char *passwd, const unsigned char *salt,
     int r = 1 << ftr->r_factor;
     int p = 1 << ftr->p_factor;
 
-    rc = crypto_scrypt((const uint8_t*)passwd, strlen(passwd),
-                       salt, SALT_LEN, N, r, p, ikey,
-                       KEY_LEN_BYTES + IV_LEN_BYTES);
+    rc = vold_scrypt((const uint8_t*)passwd, strlen(passwd),
+                     salt, SALT_LEN, N, r, p, ikey,
+                     KEY_LEN_BYTES + IV_LEN_BYTES);
 
     if (rc) {
         SLOGE("scrypt failed");
@@ -1517,8 +2063,8 @@ static int scrypt_keymaster(const char *passwd, const unsigned char *salt,
         return -1;
     }
 
-    rc = crypto_scrypt(signature, signature_size, salt, SALT_LEN,
-                       N, r, p, ikey, KEY_LEN_BYTES + IV_LEN_BYTES);
+    rc = vold_scrypt(signature, signature_size, salt, SALT_LEN,
+                     N, r, p, ikey, KEY_LEN_BYTES + IV_LEN_BYTES);
     free(signature);
 
     if (rc) {
@@ -1578,7 +2124,7 @@ static int encrypt_master_key(const char *passwd, const unsigned char *salt,
 
     /* Encrypt the master key */
     if (! EVP_EncryptUpdate(&e_ctx, encrypted_master_key, &encrypted_len,
-                            decrypted_master_key, KEY_LEN_BYTES)) {
+                            decrypted_master_key, crypt_ftr->keysize)) {
         SLOGE("EVP_EncryptUpdate failed\n");
         return -1;
     }
@@ -1587,7 +2133,7 @@ static int encrypt_master_key(const char *passwd, const unsigned char *salt,
         return -1;
     }
 
-    if (encrypted_len + final_len != KEY_LEN_BYTES) {
+    if (encrypted_len + final_len != (int) crypt_ftr->keysize) {
         SLOGE("EVP_Encryption length check failed with %d, %d bytes\n", encrypted_len, final_len);
         return -1;
     }
@@ -1601,20 +2147,20 @@ static int encrypt_master_key(const char *passwd, const unsigned char *salt,
     int r = 1 << crypt_ftr->r_factor;
     int p = 1 << crypt_ftr->p_factor;
 
-    rc = crypto_scrypt(ikey, KEY_LEN_BYTES,
-                       crypt_ftr->salt, sizeof(crypt_ftr->salt), N, r, p,
-                       crypt_ftr->scrypted_intermediate_key,
-                       sizeof(crypt_ftr->scrypted_intermediate_key));
+    rc = vold_scrypt(ikey, KEY_LEN_BYTES,
+                     crypt_ftr->salt, sizeof(crypt_ftr->salt), N, r, p,
+                     crypt_ftr->scrypted_intermediate_key,
+                     sizeof(crypt_ftr->scrypted_intermediate_key));
 
     if (rc) {
-      SLOGE("encrypt_master_key: crypto_scrypt failed");
+      SLOGE("encrypt_master_key: vold_scrypt failed");
     }
 
     return 0;
 }
 
 static int decrypt_master_key_aux(const char *passwd, unsigned char *salt,
-                                  unsigned char *encrypted_master_key,
+                                  unsigned char *encrypted_master_key, int keysize,
                                   unsigned char *decrypted_master_key,
                                   kdf_func kdf, void *kdf_params,
                                   unsigned char** intermediate_key,
@@ -1639,14 +2185,14 @@ static int decrypt_master_key_aux(const char *passwd, unsigned char *salt,
   EVP_CIPHER_CTX_set_padding(&d_ctx, 0); /* Turn off padding as our data is block aligned */
   /* Decrypt the master key */
   if (! EVP_DecryptUpdate(&d_ctx, decrypted_master_key, &decrypted_len,
-                            encrypted_master_key, KEY_LEN_BYTES)) {
+                            encrypted_master_key, keysize)) {
     return -1;
   }
   if (! EVP_DecryptFinal_ex(&d_ctx, decrypted_master_key + decrypted_len, &final_len)) {
     return -1;
   }
 
-  if (decrypted_len + final_len != KEY_LEN_BYTES) {
+  if (decrypted_len + final_len != keysize) {
     return -1;
   }
 
@@ -1687,7 +2233,7 @@ static int decrypt_master_key(const char *passwd, unsigned char *decrypted_maste
 
     get_kdf_func(crypt_ftr, &kdf, &kdf_params);
     ret = decrypt_master_key_aux(passwd, crypt_ftr->salt, crypt_ftr->master_key,
-                                 decrypted_master_key, kdf, kdf_params,
+                                 crypt_ftr->keysize, decrypted_master_key, kdf, kdf_params,
                                  intermediate_key, intermediate_key_size);
     if (ret != 0) {
         SLOGW("failure decrypting master key");
@@ -1699,7 +2245,7 @@ static int decrypt_master_key(const char *passwd, unsigned char *decrypted_maste
 static int create_encrypted_random_key(char *passwd, unsigned char *master_key, unsigned char *salt,
         struct crypt_mnt_ftr *crypt_ftr) {
     int fd;
-    unsigned char key_buf[KEY_LEN_BYTES];
+    unsigned char key_buf[MAX_KEY_LEN];
 
     /* Get some random bits for a key */
     fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
@@ -2045,8 +2591,8 @@ static int do_crypto_complete(char *mount_point)
 static int test_mount_hw_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
                                    char *passwd, char *mount_point, char *label)
 {
-  /* Allocate enough space for a 256 bit key, but we may use less */
-  unsigned char decrypted_master_key[32];
+  /* Allocate enough space for the largest key, but we may use less */
+  unsigned char decrypted_master_key[MAX_KEY_LEN];
   char crypto_blkdev[MAXPATHLEN];
   char real_blkdev[MAXPATHLEN];
   unsigned int orig_failed_decrypt_count;
@@ -2104,8 +2650,8 @@ static int test_mount_hw_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
 static int test_mount_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
                                    char *passwd, char *mount_point, char *label)
 {
-  /* Allocate enough space for a 256 bit key, but we may use less */
-  unsigned char decrypted_master_key[32];
+  /* Allocate enough space for the largest key, but we may use less */
+  unsigned char decrypted_master_key[MAX_KEY_LEN];
   char crypto_blkdev[MAXPATHLEN];
   char real_blkdev[MAXPATHLEN];
   char tmp_mount_point[64];
@@ -2146,10 +2692,10 @@ static int test_mount_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
   int r = 1 << crypt_ftr->r_factor;
   int p = 1 << crypt_ftr->p_factor;
 
-  rc = crypto_scrypt(intermediate_key, intermediate_key_size,
-                     crypt_ftr->salt, sizeof(crypt_ftr->salt),
-                     N, r, p, scrypted_intermediate_key,
-                     sizeof(scrypted_intermediate_key));
+  rc = vold_scrypt(intermediate_key, intermediate_key_size,
+                   crypt_ftr->salt, sizeof(crypt_ftr->salt),
+                   N, r, p, scrypted_intermediate_key,
+                   sizeof(scrypted_intermediate_key));
 
   // Does the key match the crypto footer?
   if (rc == 0 && memcmp(scrypted_intermediate_key,
@@ -2188,7 +2734,7 @@ static int test_mount_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
 
     /* Also save a the master key so we can reencrypted the key
      * the key when we want to change the password on it. */
-    memcpy(saved_master_key, decrypted_master_key, KEY_LEN_BYTES);
+    memcpy(saved_master_key, decrypted_master_key, crypt_ftr->keysize);
     saved_mount_point = strdup(mount_point);
     master_key_saved = 1;
     SLOGD("%s(): Master key saved\n", __FUNCTION__);
@@ -2243,7 +2789,8 @@ static int test_mount_encrypted_fs(struct crypt_mnt_ftr* crypt_ftr,
  * out_crypto_blkdev must be MAXPATHLEN.
  */
 int cryptfs_setup_ext_volume(const char* label, const char* real_blkdev,
-        const unsigned char* key, int keysize, char* out_crypto_blkdev) {
+        const char* cipher, const unsigned char* key, int keysize, int media_class,
+        int sector_size, char* out_crypto_blkdev) {
     int fd = open(real_blkdev, O_RDONLY|O_CLOEXEC);
     if (fd == -1) {
         SLOGE("Failed to open %s: %s", real_blkdev, strerror(errno));
@@ -2261,12 +2808,18 @@ int cryptfs_setup_ext_volume(const char* label, const char* real_blkdev,
 
     struct crypt_mnt_ftr ext_crypt_ftr;
     memset(&ext_crypt_ftr, 0, sizeof(ext_crypt_ftr));
+    /* The mapping must cover a whole number of crypto sectors */
+    if (sector_size > 512) {
+        nr_sec -= nr_sec % (sector_size / 512);
+    }
     ext_crypt_ftr.fs_size = nr_sec;
     ext_crypt_ftr.keysize = keysize;
-    strcpy((char*) ext_crypt_ftr.crypto_type_name, "aes-cbc-essiv:sha256");
+    /* Volumes adopted before cipher selection have no cipher recorded */
+    strlcpy((char*) ext_crypt_ftr.crypto_type_name,
+            (cipher && *cipher) ? cipher : cipher_candidates[0].name, MAX_CRYPTO_TYPE_NAME_LEN);
 
-    return create_crypto_blk_dev(&ext_crypt_ftr, key, real_blkdev,
-            out_crypto_blkdev, label);
+    return create_crypto_blk_dev_opts(&ext_crypt_ftr, key, real_blkdev,
+            out_crypto_blkdev, label, media_class, sector_size);
 }
 
 /*
@@ -2305,7 +2858,7 @@ int cryptfs_check_passwd_hw(char* passwd)
 {
     struct crypt_mnt_ftr crypt_ftr;
     int rc;
-    unsigned char master_key[KEY_LEN_BYTES];
+    unsigned char master_key[MAX_KEY_LEN];
 
     /* get key */
     if (get_crypt_ftr_and_key(&crypt_ftr)) {
@@ -2426,8 +2979,8 @@ int cryptfs_check_passwd(char *passwd)
 int cryptfs_verify_passwd(char *passwd)
 {
     struct crypt_mnt_ftr crypt_ftr;
-    /* Allocate enough space for a 256 bit key, but we may use less */
-    unsigned char decrypted_master_key[32];
+    /* Allocate enough space for the largest key, but we may use less */
+    unsigned char decrypted_master_key[MAX_KEY_LEN];
     char encrypted_state[PROPERTY_VALUE_MAX];
     int rc;
 
@@ -2523,8 +3076,16 @@ static int cryptfs_init_crypt_mnt_ftr(struct crypt_mnt_ftr *ftr)
     return 0;
 }
 
-static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
-{
+/*
+ * Makes an empty filesystem on the new mapping. The old contents are
+ * discarded straight on the real device first, since neither mkfs nor
+ * dm-crypt can be relied on to pass discards down, and only the range
+ * the filesystem covers goes so a footer past it survives. mkfs then
+ * only writes metadata: make_ext4fs leaves inode tables for the kernel's
+ * lazyinit thread, and mkfs.f2fs is told not to discard again.
+ */
+static int cryptfs_enable_wipe(char *crypto_blkdev, char *real_blkdev, off64_t size, int type)
+{
     const char *args[10];
     char size_str[32]; /* Must be large enough to hold a %lld and null byte */
     int num_args;
@@ -2532,6 +3093,19 @@ static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
     int tmp;
     int rc = -1;
 
+    if (type != EXT4_FS && type != F2FS_FS) {
+        SLOGE("cryptfs_enable_wipe(): unknown filesystem type %d\n", type);
+        return -1;
+    }
+
+    /* Not fatal: the new key already makes the old ciphertext unreadable */
+    tmp = vold_wipeBlockDevice(real_blkdev, (uint64_t) size * 512);
+    if (tmp == -EOPNOTSUPP) {
+        SLOGI("%s doesn't support discard; leaving old contents in place\n", real_blkdev);
+    } else if (tmp != 0) {
+        SLOGW("Failed to discard %s (%d); formatting anyway\n", real_blkdev, tmp);
+    }
+
     if (type == EXT4_FS) {
         args[0] = kMkExt4fsPath;
         args[1] = "-a";
@@ -2543,19 +3117,17 @@ static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
         num_args = 6;
         SLOGI("Making empty filesystem with command %s %s %s %s %s %s\n",
               args[0], args[1], args[2], args[3], args[4], args[5]);
-    } else if (type == F2FS_FS) {
+    } else {
         args[0] = kMkF2fsPath;
         args[1] = "-t";
-        args[2] = "-d1";
-        args[3] = crypto_blkdev;
+        args[2] = "0";
+        args[3] = "-d1";
+        args[4] = crypto_blkdev;
         snprintf(size_str, sizeof(size_str), "%" PRId64, size);
-        args[4] = size_str;
-        num_args = 5;
-        SLOGI("Making empty filesystem with command %s %s %s %s %s\n",
-              args[0], args[1], args[2], args[3], args[4]);
-    } else {
-        SLOGE("cryptfs_enable_wipe(): unknown filesystem type %d\n", type);
-        return -1;
+        args[5] = size_str;
+        num_args = 6;
+        SLOGI("Making empty filesystem with command %s %s %s %s %s %s\n",
+              args[0], args[1], args[2], args[3], args[4], args[5]);
     }
 
     tmp = android_fork_execvp(num_args, (char **)args, &status, false, true);
@@ -2583,14 +3155,374 @@ static int cryptfs_enable_wipe(char *crypto_blkdev, off64_t size, int type)
 #define CRYPT_SECTORS_PER_BUFSIZE (CRYPT_INPLACE_BUFSIZE / CRYPT_SECTOR_SIZE)
 #define CRYPT_SECTOR_SIZE 512
 
-/* aligned 32K writes tends to make flash happy.
- * SD card association recommends it.
+/* Inplace encryption copies extents of the real device onto the crypto
+ * device through a small pool of I/O threads. Each thread owns one
+ * buffer, so the queue depth is also the number of threads. Requests
+ * never cross a max I/O size boundary, which keeps them aligned to the
+ * flash erase block as long as the max I/O size is a multiple of it.
  */
 #ifndef CONFIG_HW_DISK_ENCRYPTION
-#define BLOCKS_AT_A_TIME 8
+#define CRYPT_INPLACE_DEFAULT_MAX_IO (2 * 1024 * 1024)
 #else
-#define BLOCKS_AT_A_TIME 1024
+#define CRYPT_INPLACE_DEFAULT_MAX_IO (4 * 1024 * 1024)
 #endif
+#define CRYPT_INPLACE_MAX_IO_PROP "vold.encrypt_max_io_kb"
+#define CRYPT_INPLACE_QUEUE_DEPTH_PROP "vold.encrypt_queue_depth"
+#define CRYPT_INPLACE_DEFAULT_QUEUE_DEPTH 4
+#define CRYPT_INPLACE_MAX_QUEUE_DEPTH 16
+#define CRYPT_INPLACE_STATUS_INTERVAL_MS 1000
+
+/* Produces the next byte extent to copy, in ascending order. Returns 1
+ * with an extent, 0 when there are no more, -1 on error. Always called
+ * with the pipeline lock held.
+ */
+typedef int (*inplace_next_extent_fn)(void* cookie, off64_t* offset, off64_t* len);
+
+/* Periodic status callback, called without the pipeline lock held */
+typedef void (*inplace_progress_fn)(void* cookie, off64_t done_bytes, off64_t done_upto);
+
+struct inplacePipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int realfd;
+    int cryptofd;
+    char* real_blkdev, * crypto_blkdev;
+    inplace_next_extent_fn next_extent;
+    void* cookie;
+    size_t max_io;
+    off64_t next;
+    off64_t end;
+    off64_t done_bytes;
+    off64_t in_flight[CRYPT_INPLACE_MAX_QUEUE_DEPTH];
+    int exhausted;
+    int running;
+    int stop;
+    int error;
+};
+
+struct inplaceWorker
+{
+    struct inplacePipeline* pipeline;
+    int slot;
+    char* buffer;
+};
+
+/* Everything before the returned offset has been written; caller holds lock */
+static off64_t pipeline_completed_upto(struct inplacePipeline const* p)
+{
+    off64_t upto = p->next;
+    int i;
+    for (i = 0; i < CRYPT_INPLACE_MAX_QUEUE_DEPTH; i++) {
+        if (p->in_flight[i] >= 0 && p->in_flight[i] < upto) {
+            upto = p->in_flight[i];
+        }
+    }
+    return upto;
+}
+
+/* Hands out the next request, refilling from the extent source as
+ * needed. Returns 0 when there is nothing left. Caller holds lock.
+ */
+static size_t pipeline_claim(struct inplacePipeline* p, off64_t* offset)
+{
+    off64_t boundary;
+    size_t len;
+
+    while (p->next >= p->end) {
+        off64_t ext_offset, ext_len;
+        int rc;
+
+        if (p->exhausted) {
+            return 0;
+        }
+        rc = p->next_extent(p->cookie, &ext_offset, &ext_len);
+        if (rc <= 0) {
+            if (rc < 0) {
+                p->error = 1;
+                p->stop = 1;
+            }
+            p->exhausted = 1;
+            return 0;
+        }
+        p->next = ext_offset;
+        p->end = ext_offset + ext_len;
+    }
+
+    boundary = (p->next / p->max_io + 1) * p->max_io;
+    len = MIN(boundary, p->end) - p->next;
+    *offset = p->next;
+    p->next += len;
+    return len;
+}
+
+static int copy_chunk(struct inplacePipeline const* p, char* buffer,
+                      size_t len, off64_t offset)
+{
+    size_t done;
+    ssize_t res;
+
+    for (done = 0; done < len; done += res) {
+        res = TEMP_FAILURE_RETRY(pread64(p->realfd, buffer + done, len - done,
+                                         offset + done));
+        if (res <= 0) {
+            SLOGE("Error reading real_blkdev %s for inplace encrypt at %" PRId64
+                  " (%s)", p->real_blkdev, offset + done, strerror(errno));
+            return -1;
+        }
+    }
+    for (done = 0; done < len; done += res) {
+        res = TEMP_FAILURE_RETRY(pwrite64(p->cryptofd, buffer + done, len - done,
+                                          offset + done));
+        if (res <= 0) {
+            SLOGE("Error writing crypto_blkdev %s for inplace encrypt at %" PRId64
+                  " (%s)", p->crypto_blkdev, offset + done, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void* inplace_worker(void* arg)
+{
+    struct inplaceWorker* w = (struct inplaceWorker*)arg;
+    struct inplacePipeline* p = w->pipeline;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        off64_t offset;
+        size_t len = pipeline_claim(p, &offset);
+        int rc;
+
+        if (len == 0) {
+            break;
+        }
+        p->in_flight[w->slot] = offset;
+        pthread_mutex_unlock(&p->lock);
+
+        ATRACE_BEGIN("inplace chunk");
+        rc = copy_chunk(p, w->buffer, len, offset);
+        ATRACE_END();
+
+        pthread_mutex_lock(&p->lock);
+        p->in_flight[w->slot] = -1;
+        if (rc) {
+            p->error = 1;
+            p->stop = 1;
+        } else {
+            p->done_bytes += len;
+        }
+    }
+    p->running--;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int get_inplace_property(const char* name, int def, int max)
+{
+    char value[PROPERTY_VALUE_MAX];
+    int res;
+
+    property_get(name, value, "");
+    res = atoi(value);
+    if (res <= 0) {
+        return def;
+    }
+    return MIN(res, max);
+}
+
+/* Copies every extent produced by next_extent from realfd to cryptofd.
+ * Progress and battery state are checked on a timer rather than per
+ * block. On return *done_upto holds the offset below which everything
+ * has been written, which is what checkpointing needs. Returns 0 when
+ * finished, 1 when stopped due to low battery, and -1 on error.
+ */
+static int encrypt_inplace_pipelined(int realfd, int cryptofd,
+                                     char* real_blkdev, char* crypto_blkdev,
+                                     inplace_next_extent_fn next_extent,
+                                     inplace_progress_fn progress,
+                                     void* cookie, off64_t* done_upto)
+{
+    struct inplacePipeline p;
+    struct inplaceWorker workers[CRYPT_INPLACE_MAX_QUEUE_DEPTH];
+    pthread_t threads[CRYPT_INPLACE_MAX_QUEUE_DEPTH];
+    int depth, started = 0, low_battery = 0;
+    int i;
+
+    depth = get_inplace_property(CRYPT_INPLACE_QUEUE_DEPTH_PROP,
+                                 CRYPT_INPLACE_DEFAULT_QUEUE_DEPTH,
+                                 CRYPT_INPLACE_MAX_QUEUE_DEPTH);
+
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.realfd = realfd;
+    p.cryptofd = cryptofd;
+    p.real_blkdev = real_blkdev;
+    p.crypto_blkdev = crypto_blkdev;
+    p.next_extent = next_extent;
+    p.cookie = cookie;
+    /* Round down to whole 4K blocks so requests stay block aligned */
+    p.max_io = (size_t)get_inplace_property(CRYPT_INPLACE_MAX_IO_PROP,
+                                            CRYPT_INPLACE_DEFAULT_MAX_IO / 1024,
+                                            64 * 1024) * 1024;
+    p.max_io = MAX(p.max_io / CRYPT_INPLACE_BUFSIZE, 1) * CRYPT_INPLACE_BUFSIZE;
+    for (i = 0; i < CRYPT_INPLACE_MAX_QUEUE_DEPTH; i++) {
+        p.in_flight[i] = -1;
+    }
+
+    SLOGI("Encrypting with %d requests of up to %zu bytes in flight", depth, p.max_io);
+
+    pthread_mutex_lock(&p.lock);
+    for (i = 0; i < depth; i++) {
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, CRYPT_INPLACE_BUFSIZE, p.max_io)) {
+            SLOGE("Failed to allocate inplace encryption buffer");
+            break;
+        }
+        workers[i].pipeline = &p;
+        workers[i].slot = i;
+        workers[i].buffer = buffer;
+        if (pthread_create(&threads[i], NULL, inplace_worker, &workers[i])) {
+            SLOGE("Failed to start inplace encryption thread");
+            free(buffer);
+            break;
+        }
+        started++;
+        p.running++;
+    }
+    if (started == 0) {
+        p.error = 1;
+    }
+
+    while (p.running > 0) {
+        struct timespec deadline;
+        off64_t done_bytes, upto;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CRYPT_INPLACE_STATUS_INTERVAL_MS / 1000;
+        deadline.tv_nsec += (CRYPT_INPLACE_STATUS_INTERVAL_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&p.cond, &p.lock, &deadline) != ETIMEDOUT) {
+            continue;
+        }
+
+        done_bytes = p.done_bytes;
+        upto = pipeline_completed_upto(&p);
+        pthread_mutex_unlock(&p.lock);
+
+        progress(cookie, done_bytes, upto);
+        if (!is_battery_ok_to_continue()) {
+            SLOGE("Stopping encryption due to low battery");
+            low_battery = 1;
+        }
+
+        pthread_mutex_lock(&p.lock);
+        if (low_battery) {
+            p.stop = 1;
+        }
+    }
+    *done_upto = pipeline_completed_upto(&p);
+    pthread_mutex_unlock(&p.lock);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        free(workers[i].buffer);
+    }
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+
+    if (p.error) {
+        return -1;
+    }
+    if (!p.exhausted || p.next < p.end) {
+        return low_battery ? 1 : -1;
+    }
+    progress(cookie, p.done_bytes, *done_upto);
+    return 0;
+}
+
+/* Progress goes to cryptd clients as a broadcast at most every
+ * CRYPT_PROGRESS_BROADCAST_MS. The properties the legacy encryption UI
+ * polls cost a round trip through init and wake every property watcher,
+ * so they're only refreshed every CRYPT_PROGRESS_PROP_MS.
+ */
+#define CRYPT_PROGRESS_BROADCAST_MS 500
+#define CRYPT_PROGRESS_PROP_MS 5000
+
+struct encryptProgress
+{
+    struct timespec last_broadcast;
+    struct timespec last_prop;
+    off64_t last_done_bytes;
+    int last_pct;
+    int last_remaining_time;
+};
+static struct encryptProgress encrypt_progress;
+
+static long elapsed_ms(const struct timespec* since, const struct timespec* now)
+{
+    return (now->tv_sec - since->tv_sec) * 1000 + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void reset_encrypt_progress(void)
+{
+    memset(&encrypt_progress, 0, sizeof(encrypt_progress));
+    encrypt_progress.last_pct = -1;
+    encrypt_progress.last_remaining_time = -1;
+}
+
+/* Publishes progress as bytes done and total, the rate since the last
+ * broadcast, the percentage and seconds remaining (-1 if unknown).
+ */
+static void publish_encrypt_progress(off64_t done_bytes, off64_t total_bytes, int pct,
+                                     int remaining_time)
+{
+    struct encryptProgress* p = &encrypt_progress;
+    struct timespec now;
+    char buf[128];
+    long ms;
+    int finished = total_bytes > 0 && done_bytes >= total_bytes;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = elapsed_ms(&p->last_broadcast, &now);
+    if (finished || p->last_broadcast.tv_sec == 0 || ms >= CRYPT_PROGRESS_BROADCAST_MS) {
+        off64_t kbps = 0;
+        if (p->last_broadcast.tv_sec != 0 && ms > 0 && done_bytes > p->last_done_bytes) {
+            kbps = (done_bytes - p->last_done_bytes) / ms * 1000 / 1024;
+        }
+        snprintf(buf, sizeof(buf), "%" PRId64 " %" PRId64 " %" PRId64 " %d %d",
+                 done_bytes, total_bytes, kbps, pct, remaining_time);
+        vold_broadcastEncryptProgress(buf);
+        p->last_broadcast = now;
+        p->last_done_bytes = done_bytes;
+    }
+
+    if (finished || p->last_prop.tv_sec == 0
+            || elapsed_ms(&p->last_prop, &now) >= CRYPT_PROGRESS_PROP_MS) {
+        if (pct != p->last_pct) {
+            snprintf(buf, sizeof(buf), "%d", pct);
+            property_set("vold.encrypt_progress", buf);
+            p->last_pct = pct;
+        }
+        if (remaining_time >= 0 && remaining_time != p->last_remaining_time) {
+            snprintf(buf, sizeof(buf), "%d", remaining_time);
+            property_set("vold.encrypt_time_remaining", buf);
+            p->last_remaining_time = remaining_time;
+        }
+        p->last_prop = now;
+    }
+}
+
+struct blockExtent
+{
+    off64_t offset;
+    off64_t len;
+};
 
 struct encryptGroupsData
 {
@@ -2601,22 +3533,20 @@ struct encryptGroupsData
     off64_t blocks_already_done, tot_numblocks;
     off64_t used_blocks_already_done, tot_used_blocks;
     char* real_blkdev, * crypto_blkdev;
-    int count;
-    off64_t offset;
-    char* buffer;
+    unsigned int block_size;
+    u8* block_bitmaps;
+    unsigned int cur_group;
+    unsigned int cur_block;
+    struct blockExtent* extents;
+    size_t num_extents, max_extents, next_extent;
     off64_t last_written_sector;
     int completed;
     time_t time_started;
     int remaining_time;
 };
 
-static void update_progress(struct encryptGroupsData* data, int is_used)
+static void report_progress(struct encryptGroupsData* data)
 {
-    data->blocks_already_done++;
-
-    if (is_used) {
-        data->used_blocks_already_done++;
-    }
     if (data->tot_used_blocks) {
         data->new_pct = data->used_blocks_already_done / data->one_pct;
     } else {
@@ -2624,10 +3554,7 @@ static void update_progress(struct encryptGroupsData* data, int is_used)
     }
 
     if (data->new_pct > data->cur_pct) {
-        char buf[8];
         data->cur_pct = data->new_pct;
-        snprintf(buf, sizeof(buf), "%" PRId64, data->cur_pct);
-        property_set("vold.encrypt_progress", buf);
     }
 
     if (data->cur_pct >= 5) {
@@ -2646,157 +3573,151 @@ static void update_progress(struct encryptGroupsData* data, int is_used)
             if (data->remaining_time == -1
                 || remaining_time < data->remaining_time
                 || remaining_time > data->remaining_time + 60) {
-                char buf[8];
-                snprintf(buf, sizeof(buf), "%d", remaining_time);
-                property_set("vold.encrypt_time_remaining", buf);
                 data->remaining_time = remaining_time;
             }
         }
     }
+
+    if (data->tot_used_blocks) {
+        publish_encrypt_progress(data->used_blocks_already_done * data->block_size,
+                                 data->tot_used_blocks * data->block_size,
+                                 data->cur_pct, data->remaining_time);
+    } else {
+        publish_encrypt_progress(data->blocks_already_done * CRYPT_INPLACE_BUFSIZE,
+                                 data->tot_numblocks * CRYPT_INPLACE_BUFSIZE,
+                                 data->cur_pct, data->remaining_time);
+    }
 }
 
-static void log_progress(struct encryptGroupsData const* data, bool completed)
+/* Only used blocks are copied, so progress is measured in used blocks */
+static void update_used_progress(void* cookie, off64_t done_bytes, off64_t done_upto)
 {
-    // Precondition - if completed data = 0 else data != 0
-
-    // Track progress so we can skip logging blocks
-    static off64_t offset = -1;
+    struct encryptGroupsData* data = (struct encryptGroupsData*)cookie;
 
-    // Need to close existing 'Encrypting from' log?
-    if (completed || (offset != -1 && data->offset != offset)) {
-        SLOGI("Encrypted to sector %" PRId64,
-              offset / info.block_size * CRYPT_SECTOR_SIZE);
-        offset = -1;
-    }
+    data->used_blocks_already_done = done_bytes / data->block_size;
+    data->last_written_sector = done_upto / CRYPT_SECTOR_SIZE - 1;
+    report_progress(data);
+}
 
-    // Need to start new 'Encrypting from' log?
-    if (!completed && offset != data->offset) {
-        SLOGI("Encrypting from sector %" PRId64,
-              data->offset / info.block_size * CRYPT_SECTOR_SIZE);
+static int group_block_used(struct encryptGroupsData const* data,
+                            unsigned int group, unsigned int block)
+{
+    if (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT) {
+        return 0;
     }
+    return bitmap_get_bit(data->block_bitmaps + (size_t)group * info.block_size, block);
+}
 
-    // Update offset
-    if (!completed) {
-        offset = data->offset + (off64_t)data->count * info.block_size;
-    }
+static unsigned int group_block_count(unsigned int group)
+{
+    u32 first_block = aux_info.first_data_block + group * info.blocks_per_group;
+    return min(info.blocks_per_group, aux_info.len_blocks - first_block);
 }
 
-static int flush_outstanding_data(struct encryptGroupsData* data)
+/* Walks the cached block bitmaps and returns maximal runs of used
+ * blocks. Runs continue across group boundaries, since groups are
+ * laid out back to back on disk.
+ */
+static int next_used_extent(void* cookie, off64_t* offset, off64_t* len)
 {
-    if (data->count == 0) {
+    struct encryptGroupsData* data = (struct encryptGroupsData*)cookie;
+    u64 start = 0, count = 0;
+
+    while (data->cur_group < aux_info.groups) {
+        unsigned int group = data->cur_group;
+        unsigned int block_count = group_block_count(group);
+
+        for (; data->cur_block < block_count; data->cur_block++) {
+            if (group_block_used(data, group, data->cur_block)) {
+                if (count == 0) {
+                    start = aux_info.first_data_block + (u64)group * info.blocks_per_group
+                            + data->cur_block;
+                }
+                count++;
+            } else if (count) {
+                goto found;
+            }
+        }
+
+        data->cur_group++;
+        data->cur_block = 0;
+    }
+
+    if (count == 0) {
         return 0;
     }
 
-    SLOGV("Copying %d blocks at offset %" PRIx64, data->count, data->offset);
+found:
+    *offset = (off64_t)start * info.block_size;
+    *len = (off64_t)count * info.block_size;
+    return 1;
+}
 
-    if (pread64(data->realfd, data->buffer,
-                info.block_size * data->count, data->offset)
-        <= 0) {
-        SLOGE("Error reading real_blkdev %s for inplace encrypt",
-              data->real_blkdev);
-        return -1;
-    }
+/* Reads every group's block bitmap up front, and counts exactly how many
+ * blocks will be copied so progress and time remaining stay accurate.
+ */
+static int read_block_bitmaps(struct encryptGroupsData* data)
+{
+    unsigned int group, block;
 
-    if (pwrite64(data->cryptofd, data->buffer,
-                 info.block_size * data->count, data->offset)
-        <= 0) {
-        SLOGE("Error writing crypto_blkdev %s for inplace encrypt",
-              data->crypto_blkdev);
+    data->block_bitmaps = malloc((size_t)aux_info.groups * info.block_size);
+    if (!data->block_bitmaps) {
+        SLOGE("failed to allocate block bitmaps");
         return -1;
-    } else {
-      log_progress(data, false);
     }
 
-    data->count = 0;
-    data->last_written_sector = (data->offset + data->count)
-                                / info.block_size * CRYPT_SECTOR_SIZE - 1;
+    data->tot_used_blocks = 0;
+    for (group = 0; group < aux_info.groups; ++group) {
+        u8* bitmap = data->block_bitmaps + (size_t)group * info.block_size;
+        off64_t offset = (u64)info.block_size
+                         * aux_info.bg_desc[group].bg_block_bitmap;
+        unsigned int block_count = group_block_count(group);
+
+        if (aux_info.bg_desc[group].bg_flags & EXT4_BG_BLOCK_UNINIT) {
+            continue;
+        }
+        if (pread64(data->realfd, bitmap, info.block_size, offset)
+                != (int)info.block_size) {
+            SLOGE("failed to read all of block group bitmap %d", group);
+            return -1;
+        }
+        for (block = 0; block < block_count; block++) {
+            data->tot_used_blocks += bitmap_get_bit(bitmap, block) ? 1 : 0;
+        }
+    }
     return 0;
 }
 
 static int encrypt_groups(struct encryptGroupsData* data)
 {
-    unsigned int i;
-    u8 *block_bitmap = 0;
-    unsigned int block;
-    off64_t ret;
+    off64_t done_upto = 0;
     int rc = -1;
 
-    data->buffer = malloc(info.block_size * BLOCKS_AT_A_TIME);
-    if (!data->buffer) {
-        SLOGE("Failed to allocate crypto buffer");
+    if (read_block_bitmaps(data)) {
         goto errout;
     }
-
-    block_bitmap = malloc(info.block_size);
-    if (!block_bitmap) {
-        SLOGE("failed to allocate block bitmap");
-        goto errout;
+    data->one_pct = data->tot_used_blocks / 100;
+    if (data->one_pct == 0) {
+        data->one_pct = 1;
     }
+    SLOGI("Encrypting %" PRId64 " used blocks in %d groups",
+          data->tot_used_blocks, aux_info.groups);
 
-    for (i = 0; i < aux_info.groups; ++i) {
-        SLOGI("Encrypting group %d", i);
-
-        u32 first_block = aux_info.first_data_block + i * info.blocks_per_group;
-        u32 block_count = min(info.blocks_per_group,
-                             aux_info.len_blocks - first_block);
-
-        off64_t offset = (u64)info.block_size
-                         * aux_info.bg_desc[i].bg_block_bitmap;
-
-        ret = pread64(data->realfd, block_bitmap, info.block_size, offset);
-        if (ret != (int)info.block_size) {
-            SLOGE("failed to read all of block group bitmap %d", i);
-            goto errout;
-        }
-
-        offset = (u64)info.block_size * first_block;
-
-        data->count = 0;
-
-        for (block = 0; block < block_count; block++) {
-            int used = (aux_info.bg_desc[i].bg_flags & EXT4_BG_BLOCK_UNINIT) ?
-                    0 : bitmap_get_bit(block_bitmap, block);
-            update_progress(data, used);
-            if (used) {
-                if (data->count == 0) {
-                    data->offset = offset;
-                }
-                data->count++;
-            } else {
-                if (flush_outstanding_data(data)) {
-                    goto errout;
-                }
-            }
-
-            offset += info.block_size;
-
-            /* Write data if we are aligned or buffer size reached */
-            if (offset % (info.block_size * BLOCKS_AT_A_TIME) == 0
-                || data->count == BLOCKS_AT_A_TIME) {
-                if (flush_outstanding_data(data)) {
-                    goto errout;
-                }
-            }
-
-            if (!is_battery_ok_to_continue()) {
-                SLOGE("Stopping encryption due to low battery");
-                rc = 0;
-                goto errout;
-            }
-
-        }
-        if (flush_outstanding_data(data)) {
-            goto errout;
-        }
+    rc = encrypt_inplace_pipelined(data->realfd, data->cryptofd,
+                                   data->real_blkdev, data->crypto_blkdev,
+                                   next_used_extent, update_used_progress,
+                                   data, &done_upto);
+    if (rc < 0) {
+        goto errout;
     }
-
-    data->completed = 1;
+    data->last_written_sector = done_upto / CRYPT_SECTOR_SIZE - 1;
+    SLOGI("Encrypted to sector %" PRId64, data->last_written_sector);
+    data->completed = (rc == 0);
     rc = 0;
 
 errout:
-    log_progress(0, true);
-    free(data->buffer);
-    free(block_bitmap);
+    free(data->block_bitmaps);
+    data->block_bitmaps = NULL;
     return rc;
 }
 
@@ -2807,7 +3728,6 @@ static int cryptfs_enable_inplace_ext4(char *crypto_blkdev,
                                        off64_t tot_size,
                                        off64_t previously_encrypted_upto)
 {
-    u32 i;
     struct encryptGroupsData data;
     int rc; // Can't initialize without causing warning -Wclobbered
 
@@ -2854,18 +3774,13 @@ static int cryptfs_enable_inplace_ext4(char *crypto_blkdev,
         goto errout;
     }
 
+    data.block_size = info.block_size;
     data.numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
     data.tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
     data.blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
 
     SLOGI("Encrypting ext4 filesystem in place...");
 
-    data.tot_used_blocks = data.numblocks;
-    for (i = 0; i < aux_info.groups; ++i) {
-      data.tot_used_blocks -= aux_info.bg_desc[i].bg_free_blocks_count;
-    }
-
-    data.one_pct = data.tot_used_blocks / 100;
     data.cur_pct = 0;
 
     struct timespec time_started = {0};
@@ -2892,52 +3807,51 @@ errout:
     return rc;
 }
 
-static void log_progress_f2fs(u64 block, bool completed)
+/* Coalesces each used block reported by the f2fs sparse iterator into
+ * the extent list, so the copy itself can run through the pipeline.
+ */
+static int collect_extent_f2fs(u64 pos, void *data)
 {
-    // Precondition - if completed data = 0 else data != 0
-
-    // Track progress so we can skip logging blocks
-    static u64 last_block = (u64)-1;
+    struct encryptGroupsData *priv_dat = (struct encryptGroupsData *)data;
+    off64_t offset = pos * CRYPT_INPLACE_BUFSIZE;
 
-    // Need to close existing 'Encrypting from' log?
-    if (completed || (last_block != (u64)-1 && block != last_block + 1)) {
-        SLOGI("Encrypted to block %" PRId64, last_block);
-        last_block = -1;
+    if (priv_dat->num_extents) {
+        struct blockExtent* last = &priv_dat->extents[priv_dat->num_extents - 1];
+        if (last->offset + last->len == offset) {
+            last->len += CRYPT_INPLACE_BUFSIZE;
+            return 0;
+        }
     }
 
-    // Need to start new 'Encrypting from' log?
-    if (!completed && (last_block == (u64)-1 || block != last_block + 1)) {
-        SLOGI("Encrypting from block %" PRId64, block);
+    if (priv_dat->num_extents == priv_dat->max_extents) {
+        size_t max_extents = priv_dat->max_extents ? priv_dat->max_extents * 2 : 1024;
+        struct blockExtent* extents = realloc(priv_dat->extents,
+                                              max_extents * sizeof(struct blockExtent));
+        if (!extents) {
+            SLOGE("Failed to allocate f2fs extent list");
+            return -1;
+        }
+        priv_dat->extents = extents;
+        priv_dat->max_extents = max_extents;
     }
 
-    // Update offset
-    if (!completed) {
-        last_block = block;
-    }
+    priv_dat->extents[priv_dat->num_extents].offset = offset;
+    priv_dat->extents[priv_dat->num_extents].len = CRYPT_INPLACE_BUFSIZE;
+    priv_dat->num_extents++;
+    return 0;
 }
 
-static int encrypt_one_block_f2fs(u64 pos, void *data)
+static int next_listed_extent(void* cookie, off64_t* offset, off64_t* len)
 {
-    struct encryptGroupsData *priv_dat = (struct encryptGroupsData *)data;
-
-    priv_dat->blocks_already_done = pos - 1;
-    update_progress(priv_dat, 1);
-
-    off64_t offset = pos * CRYPT_INPLACE_BUFSIZE;
-
-    if (pread64(priv_dat->realfd, priv_dat->buffer, CRYPT_INPLACE_BUFSIZE, offset) <= 0) {
-        SLOGE("Error reading real_blkdev %s for f2fs inplace encrypt", priv_dat->crypto_blkdev);
-        return -1;
-    }
+    struct encryptGroupsData* data = (struct encryptGroupsData*)cookie;
 
-    if (pwrite64(priv_dat->cryptofd, priv_dat->buffer, CRYPT_INPLACE_BUFSIZE, offset) <= 0) {
-        SLOGE("Error writing crypto_blkdev %s for f2fs inplace encrypt", priv_dat->crypto_blkdev);
-        return -1;
-    } else {
-        log_progress_f2fs(pos, false);
+    if (data->next_extent >= data->num_extents) {
+        return 0;
     }
-
-    return 0;
+    *offset = data->extents[data->next_extent].offset;
+    *len = data->extents[data->next_extent].len;
+    data->next_extent++;
+    return 1;
 }
 
 static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
@@ -2949,6 +3863,7 @@ static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
 {
     struct encryptGroupsData data;
     struct f2fs_info *f2fs_info = NULL;
+    off64_t done_upto = 0;
     int rc = ENABLE_INPLACE_ERR_OTHER;
     if (previously_encrypted_upto > *size_already_done) {
         SLOGD("Not fast encrypting since resuming part way through");
@@ -2975,50 +3890,92 @@ static int cryptfs_enable_inplace_f2fs(char *crypto_blkdev,
     if (!f2fs_info)
       goto errout;
 
+    data.block_size = f2fs_info->block_size;
     data.numblocks = size / CRYPT_SECTORS_PER_BUFSIZE;
     data.tot_numblocks = tot_size / CRYPT_SECTORS_PER_BUFSIZE;
     data.blocks_already_done = *size_already_done / CRYPT_SECTORS_PER_BUFSIZE;
 
     data.tot_used_blocks = get_num_blocks_used(f2fs_info);
 
-    data.one_pct = data.tot_used_blocks / 100;
+    data.one_pct = MAX(data.tot_used_blocks / 100, 1);
     data.cur_pct = 0;
     data.time_started = time(NULL);
     data.remaining_time = -1;
 
-    data.buffer = malloc(f2fs_info->block_size);
-    if (!data.buffer) {
-        SLOGE("Failed to allocate crypto buffer");
+    rc = run_on_used_blocks(data.blocks_already_done, f2fs_info, &collect_extent_f2fs, &data);
+    if (rc) {
+        SLOGE("Error in running over f2fs blocks");
+        rc = ENABLE_INPLACE_ERR_OTHER;
         goto errout;
     }
+    SLOGI("Encrypting %" PRId64 " used f2fs blocks in %zu extents",
+          data.tot_used_blocks, data.num_extents);
 
-    data.count = 0;
-
-    /* Currently, this either runs to completion, or hits a nonrecoverable error */
-    rc = run_on_used_blocks(data.blocks_already_done, f2fs_info, &encrypt_one_block_f2fs, &data);
-
-    if (rc) {
-        SLOGE("Error in running over f2fs blocks");
+    rc = encrypt_inplace_pipelined(data.realfd, data.cryptofd,
+                                   data.real_blkdev, data.crypto_blkdev,
+                                   next_listed_extent, update_used_progress,
+                                   &data, &done_upto);
+    if (rc < 0) {
+        SLOGE("Error encrypting f2fs extents");
         rc = ENABLE_INPLACE_ERR_OTHER;
         goto errout;
     }
 
-    *size_already_done += size;
+    /* Stopping early leaves a checkpoint that the full path resumes from */
+    *size_already_done += rc ? done_upto / CRYPT_SECTOR_SIZE - 1 : size;
     rc = 0;
 
 errout:
     if (rc)
         SLOGE("Failed to encrypt f2fs filesystem on %s", real_blkdev);
 
-    log_progress_f2fs(0, true);
     free(f2fs_info);
-    free(data.buffer);
+    free(data.extents);
     close(data.realfd);
     close(data.cryptofd);
 
     return rc;
 }
 
+struct fullRangeData
+{
+    off64_t offset, end;
+    int produced;
+    off64_t blocks_already_done, tot_numblocks;
+    off64_t one_pct, cur_pct;
+};
+
+static int next_full_extent(void* cookie, off64_t* offset, off64_t* len)
+{
+    struct fullRangeData* range = (struct fullRangeData*)cookie;
+
+    if (range->produced) {
+        return 0;
+    }
+    range->produced = 1;
+    *offset = range->offset;
+    *len = range->end - range->offset;
+    return 1;
+}
+
+static void update_full_progress(void* cookie, off64_t done_bytes, off64_t done_upto)
+{
+    struct fullRangeData* range = (struct fullRangeData*)cookie;
+    off64_t new_pct;
+    off64_t done_blocks = done_upto / CRYPT_INPLACE_BUFSIZE + range->blocks_already_done;
+
+    if (range->one_pct <= 0) {
+        return;
+    }
+    new_pct = done_blocks / range->one_pct;
+    if (new_pct > range->cur_pct) {
+        range->cur_pct = new_pct;
+    }
+    publish_encrypt_progress(done_blocks * CRYPT_INPLACE_BUFSIZE,
+                             range->tot_numblocks * CRYPT_INPLACE_BUFSIZE,
+                             range->cur_pct, -1);
+}
+
 static int cryptfs_enable_inplace_full(char *crypto_blkdev, char *real_blkdev,
                                        off64_t size, off64_t *size_already_done,
                                        off64_t tot_size,
@@ -3028,7 +3985,6 @@ static int cryptfs_enable_inplace_full(char *crypto_blkdev, char *real_blkdev,
     char *buf[CRYPT_INPLACE_BUFSIZE];
     int rc = ENABLE_INPLACE_ERR_OTHER;
     off64_t numblocks, i, remainder;
-    off64_t one_pct, cur_pct, new_pct;
     off64_t blocks_already_done, tot_numblocks;
 
     if ( (realfd = open(real_blkdev, O_RDONLY|O_CLOEXEC)) < 0) {
@@ -3043,7 +3999,8 @@ static int cryptfs_enable_inplace_full(char *crypto_blkdev, char *real_blkdev,
         return ENABLE_INPLACE_ERR_DEV;
     }
 
-    /* This is pretty much a simple loop of reading 4K, and writing 4K.
+    /* Unaligned leading and trailing sectors are copied one at a time, and
+     * the 4K aligned bulk is handed to the pipelined copier.
      * The size passed in is the number of 512 byte sectors in the filesystem.
      * So compute the number of whole 4K blocks we should read/write,
      * and the remainder.
@@ -3082,37 +4039,38 @@ static int cryptfs_enable_inplace_full(char *crypto_blkdev, char *real_blkdev,
         }
     }
 
-    one_pct = tot_numblocks / 100;
-    cur_pct = 0;
-    /* process the majority of the filesystem in blocks */
-    for (i/=CRYPT_SECTORS_PER_BUFSIZE; i<numblocks; i++) {
-        new_pct = (i + blocks_already_done) / one_pct;
-        if (new_pct > cur_pct) {
-            char buf[8];
-
-            cur_pct = new_pct;
-            snprintf(buf, sizeof(buf), "%" PRId64, cur_pct);
-            property_set("vold.encrypt_progress", buf);
-        }
-        if (unix_read(realfd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error reading real_blkdev %s for inplace encrypt", crypto_blkdev);
+    /* process the majority of the filesystem in large chunks */
+    i /= CRYPT_SECTORS_PER_BUFSIZE;
+    if (i < numblocks) {
+        struct fullRangeData range;
+        off64_t done_upto = 0;
+        int res;
+
+        range.offset = i * CRYPT_INPLACE_BUFSIZE;
+        range.end = numblocks * CRYPT_INPLACE_BUFSIZE;
+        range.produced = 0;
+        range.blocks_already_done = blocks_already_done;
+        range.tot_numblocks = tot_numblocks;
+        range.one_pct = tot_numblocks / 100;
+        range.cur_pct = 0;
+
+        res = encrypt_inplace_pipelined(realfd, cryptofd, real_blkdev, crypto_blkdev,
+                                        next_full_extent, update_full_progress,
+                                        &range, &done_upto);
+        if (res < 0) {
             goto errout;
-        }
-        if (unix_write(cryptofd, buf, CRYPT_INPLACE_BUFSIZE) <= 0) {
-            SLOGE("Error writing crypto_blkdev %s for inplace encrypt", crypto_blkdev);
-            goto errout;
-        } else {
-            SLOGD("Encrypted %d block at %" PRId64,
-                  CRYPT_SECTORS_PER_BUFSIZE,
-                  i * CRYPT_SECTORS_PER_BUFSIZE);
-        }
-
-       if (!is_battery_ok_to_continue()) {
-            SLOGE("Stopping encryption due to low battery");
-            *size_already_done += (i + 1) * CRYPT_SECTORS_PER_BUFSIZE - 1;
+        } else if (res > 0) {
+            *size_already_done += done_upto / CRYPT_SECTOR_SIZE - 1;
             rc = 0;
             goto errout;
         }
+        SLOGD("Encrypted %" PRId64 " sectors", done_upto / CRYPT_SECTOR_SIZE);
+    }
+
+    if (lseek64(realfd, numblocks * CRYPT_INPLACE_BUFSIZE, SEEK_SET) < 0
+            || lseek64(cryptofd, numblocks * CRYPT_INPLACE_BUFSIZE, SEEK_SET) < 0) {
+        SLOGE("Cannot seek to final sectors on %s", crypto_blkdev);
+        goto errout;
     }
 
     /* Do any remaining sectors */
@@ -3254,12 +4212,17 @@ static int cryptfs_enable_all_volumes(struct crypt_mnt_ftr *crypt_ftr, int how,
             SLOGE("cryptfs_enable: unsupported fs type %s\n", rec->fs_type);
             return -1;
         }
-        rc = cryptfs_enable_wipe(crypto_blkdev, crypt_ftr->fs_size, fs_type);
+        rc = cryptfs_enable_wipe(crypto_blkdev, real_blkdev, crypt_ftr->fs_size, fs_type);
     } else if (how == CRYPTO_ENABLE_INPLACE) {
+        void* amp = vold_startWriteAmp("encrypt", real_blkdev);
+        reset_encrypt_progress();
         rc = cryptfs_enable_inplace(crypto_blkdev, real_blkdev,
                                     crypt_ftr->fs_size, &cur_encryption_done,
                                     tot_encryption_size,
                                     previously_encrypted_upto);
+        vold_finishWriteAmp(amp, cur_encryption_done > previously_encrypted_upto
+                ? (uint64_t) (cur_encryption_done - previously_encrypted_upto) * CRYPT_SECTOR_SIZE
+                : 0);
 
         if (rc == ENABLE_INPLACE_ERR_DEV) {
             /* Hack for b/17898962 */
@@ -3274,7 +4237,8 @@ static int cryptfs_enable_all_volumes(struct crypt_mnt_ftr *crypt_ftr, int how,
         if (!rc && crypt_ftr->encrypted_upto == crypt_ftr->fs_size) {
             /* The inplace routine never actually sets the progress to 100% due
              * to the round down nature of integer division, so set it here */
-            property_set("vold.encrypt_progress", "100");
+            publish_encrypt_progress(tot_encryption_size * CRYPT_SECTOR_SIZE,
+                                     tot_encryption_size * CRYPT_SECTOR_SIZE, 100, 0);
         }
     } else {
         /* Shouldn't happen */
@@ -3290,7 +4254,7 @@ int cryptfs_enable_internal(char *howarg, int crypt_type, char *passwd,
 {
     int how = 0;
     char crypto_blkdev[MAXPATHLEN], real_blkdev[MAXPATHLEN];
-    unsigned char decrypted_master_key[KEY_LEN_BYTES];
+    unsigned char decrypted_master_key[MAX_KEY_LEN];
     int rc=-1, i;
     struct crypt_mnt_ftr crypt_ftr;
     struct crypt_persist_data *pdata;
@@ -3443,7 +4407,9 @@ int cryptfs_enable_internal(char *howarg, int crypt_type, char *passwd,
 #ifdef CONFIG_HW_DISK_ENCRYPTION
         strlcpy((char *)crypt_ftr.crypto_type_name, "aes-xts", MAX_CRYPTO_TYPE_NAME_LEN);
 #else
-        strlcpy((char *)crypt_ftr.crypto_type_name, "aes-cbc-essiv:sha256", MAX_CRYPTO_TYPE_NAME_LEN);
+        /* The master key is generated to the length the cipher needs */
+        crypt_ftr.keysize = cryptfs_select_cipher(CRYPT_MEDIA_INTERNAL,
+                (char *) crypt_ftr.crypto_type_name, MAX_CRYPTO_TYPE_NAME_LEN);
 #endif
 
         /* Make an encrypted master key */
@@ -3455,8 +4421,8 @@ int cryptfs_enable_internal(char *howarg, int crypt_type, char *passwd,
 
         /* Replace scrypted intermediate key if we are preparing for a reboot */
         if (onlyCreateHeader) {
-            unsigned char fake_master_key[KEY_LEN_BYTES];
-            unsigned char encrypted_fake_master_key[KEY_LEN_BYTES];
+            unsigned char fake_master_key[MAX_KEY_LEN];
+            unsigned char encrypted_fake_master_key[MAX_KEY_LEN];
             memset(fake_master_key, 0, sizeof(fake_master_key));
             encrypt_master_key(passwd, crypt_ftr.salt, fake_master_key,
                                encrypted_fake_master_key, &crypt_ftr, true);
@@ -3835,27 +4801,90 @@ static unsigned int persist_get_max_entries(int encrypted) {
     }
 }
 
-static int persist_get_key(const char *fieldname, char *value)
+static unsigned int persist_hash(const char *key)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < PROPERTY_KEY_MAX && key[i]; i++) {
+        hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void persist_index_add(const char *key, int entry)
+{
+    unsigned int slot = persist_hash(key) & (persist_index_size - 1);
+
+    while (persist_index[slot] != -1) {
+        slot = (slot + 1) & (persist_index_size - 1);
+    }
+    persist_index[slot] = entry;
+}
+
+static int persist_index_rebuild(void)
 {
+    unsigned int num = persist_data->persist_valid_entries;
+    unsigned int size = 16;
     unsigned int i;
 
-    if (persist_data == NULL) {
-        return -1;
+    while (size < 2 * (num + 1)) {
+        size <<= 1;
     }
-    for (i = 0; i < persist_data->persist_valid_entries; i++) {
-        if (!strncmp(persist_data->persist_entry[i].key, fieldname, PROPERTY_KEY_MAX)) {
-            /* We found it! */
-            strlcpy(value, persist_data->persist_entry[i].val, PROPERTY_VALUE_MAX);
-            return 0;
+    if (size != persist_index_size) {
+        int *index = realloc(persist_index, size * sizeof(*index));
+        if (index == NULL) {
+            return -1;
         }
+        persist_index = index;
+        persist_index_size = size;
+    }
+    memset(persist_index, 0xff, persist_index_size * sizeof(*persist_index));
+    for (i = 0; i < num; i++) {
+        persist_index_add(persist_data->persist_entry[i].key, i);
     }
+    persist_index_data = persist_data;
+    return 0;
+}
+
+/* Returns the entry number holding key, or -1 */
+static int persist_index_find(const char *key)
+{
+    unsigned int slot;
+    int entry;
 
+    if (persist_index_data != persist_data && persist_index_rebuild()) {
+        return -1;
+    }
+    slot = persist_hash(key) & (persist_index_size - 1);
+    while ((entry = persist_index[slot]) != -1) {
+        if (!strncmp(persist_data->persist_entry[entry].key, key, PROPERTY_KEY_MAX)) {
+            return entry;
+        }
+        slot = (slot + 1) & (persist_index_size - 1);
+    }
     return -1;
 }
 
+static int persist_get_key(const char *fieldname, char *value)
+{
+    int i;
+
+    if (persist_data == NULL) {
+        return -1;
+    }
+    i = persist_index_find(fieldname);
+    if (i < 0) {
+        return -1;
+    }
+    strlcpy(value, persist_data->persist_entry[i].val, PROPERTY_VALUE_MAX);
+    return 0;
+}
+
 static int persist_set_key(const char *fieldname, const char *value, int encrypted)
 {
-    unsigned int i;
+    int i;
     unsigned int num;
     unsigned int max_persistent_entries;
 
@@ -3863,25 +4892,32 @@ static int persist_set_key(const char *fieldname, const char *value, int encrypt
         return -1;
     }
 
-    max_persistent_entries = persist_get_max_entries(encrypted);
-
-    num = persist_data->persist_valid_entries;
-
-    for (i = 0; i < num; i++) {
-        if (!strncmp(persist_data->persist_entry[i].key, fieldname, PROPERTY_KEY_MAX)) {
-            /* We found an existing entry, update it! */
+    i = persist_index_find(fieldname);
+    if (i >= 0) {
+        /* We found an existing entry, update it if it changed */
+        if (strncmp(persist_data->persist_entry[i].val, value, PROPERTY_VALUE_MAX - 1)) {
             memset(persist_data->persist_entry[i].val, 0, PROPERTY_VALUE_MAX);
             strlcpy(persist_data->persist_entry[i].val, value, PROPERTY_VALUE_MAX);
-            return 0;
+            persist_dirty = 1;
         }
+        return 0;
     }
 
+    max_persistent_entries = persist_get_max_entries(encrypted);
+    num = persist_data->persist_valid_entries;
+
     /* We didn't find it, add it to the end, if there is room */
-    if (persist_data->persist_valid_entries < max_persistent_entries) {
+    if (num < max_persistent_entries) {
         memset(&persist_data->persist_entry[num], 0, sizeof(struct crypt_persist_entry));
         strlcpy(persist_data->persist_entry[num].key, fieldname, PROPERTY_KEY_MAX);
         strlcpy(persist_data->persist_entry[num].val, value, PROPERTY_VALUE_MAX);
         persist_data->persist_valid_entries++;
+        persist_dirty = 1;
+        if (2 * (num + 2) > persist_index_size) {
+            persist_index_rebuild();
+        } else {
+            persist_index_add(fieldname, num);
+        }
         return 0;
     }
 
@@ -3951,6 +4987,9 @@ static int persist_del_keys(const char *fieldname, unsigned index)
         persist_data->persist_valid_entries = j;
         // Zeroise the remaining entries
         memset(&persist_data->persist_entry[j], 0, (num - j) * sizeof(struct crypt_persist_entry));
+        // Entries moved, so the index has to follow
+        persist_index_data = NULL;
+        persist_dirty = 1;
         return PERSIST_DEL_KEY_OK;
     } else {
         // Did not find an entry matching the given fieldname
@@ -4043,36 +5082,14 @@ out:
     return rc;
 }
 
-/* Set the value of the specified field. */
-int cryptfs_setfield(const char *fieldname, const char *value)
+/* Updates the field in memory only; the caller saves persist_data */
+static int set_field(const char *fieldname, const char *value, int encrypted)
 {
-    if (e4crypt_is_native()) {
-        SLOGE("Cannot set field when file encrypted");
-        return -1;
-    }
-
-    char encrypted_state[PROPERTY_VALUE_MAX];
-    /* 0 is success, negative values are error */
-    int rc = CRYPTO_SETFIELD_ERROR_OTHER;
-    int encrypted = 0;
     unsigned int field_id;
     char temp_field[PROPERTY_KEY_MAX];
     unsigned int num_entries;
     unsigned int max_keylen;
 
-    if (persist_data == NULL) {
-        load_persistent_data();
-        if (persist_data == NULL) {
-            SLOGE("Setfield error, cannot load persistent data");
-            goto out;
-        }
-    }
-
-    property_get("ro.crypto.state", encrypted_state, "");
-    if (!strcmp(encrypted_state, "encrypted") ) {
-        encrypted = 1;
-    }
-
     // Compute the number of entries required to store value, each entry can store up to
     // (PROPERTY_VALUE_MAX - 1) chars
     if (strlen(value) == 0) {
@@ -4088,25 +5105,24 @@ int cryptfs_setfield(const char *fieldname, const char *value)
         max_keylen += 1 + log10(num_entries);
     }
     if (max_keylen > PROPERTY_KEY_MAX - 1) {
-        rc = CRYPTO_SETFIELD_ERROR_FIELD_TOO_LONG;
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_FIELD_TOO_LONG;
     }
 
     // Make sure we have enough space to write the new value
     if (persist_data->persist_valid_entries + num_entries - persist_count_keys(fieldname) >
         persist_get_max_entries(encrypted)) {
-        rc = CRYPTO_SETFIELD_ERROR_VALUE_TOO_LONG;
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_VALUE_TOO_LONG;
     }
 
-    // Now that we know persist_data has enough space for value, let's delete the old field first
-    // to make up space.
-    persist_del_keys(fieldname, 0);
+    // Only drop entries past the ones the new value needs, and update the
+    // rest in place, so setting a field to what it already holds leaves
+    // persist_data clean.
+    persist_del_keys(fieldname, num_entries);
 
     if (persist_set_key(fieldname, value, encrypted)) {
         // fail to set key, should not happen as we have already checked the available space
         SLOGE("persist_set_key() error during setfield()");
-        goto out;
+        return CRYPTO_SETFIELD_ERROR_OTHER;
     }
 
     for (field_id = 1; field_id < num_entries; field_id++) {
@@ -4115,12 +5131,70 @@ int cryptfs_setfield(const char *fieldname, const char *value)
         if (persist_set_key(temp_field, value + field_id * (PROPERTY_VALUE_MAX - 1), encrypted)) {
             // fail to set key, should not happen as we have already checked the available space.
             SLOGE("persist_set_key() error during setfield()");
+            return CRYPTO_SETFIELD_ERROR_OTHER;
+        }
+    }
+
+    return CRYPTO_SETFIELD_OK;
+}
+
+/* Set the values of the given fields, saving them once.  Either every
+ * field is set or, on error, none of them are. */
+int cryptfs_setfields(int count, const char **fieldnames, const char **values)
+{
+    if (e4crypt_is_native()) {
+        SLOGE("Cannot set field when file encrypted");
+        return -1;
+    }
+
+    char encrypted_state[PROPERTY_VALUE_MAX];
+    /* 0 is success, negative values are error */
+    int rc = CRYPTO_SETFIELD_ERROR_OTHER;
+    int encrypted = 0;
+    int was_dirty = persist_dirty;
+    struct crypt_persist_data *saved = NULL;
+    size_t saved_len;
+    int i;
+
+    if (persist_data == NULL) {
+        load_persistent_data();
+        if (persist_data == NULL) {
+            SLOGE("Setfield error, cannot load persistent data");
             goto out;
         }
     }
 
-    /* If we are running encrypted, save the persistent data now */
-    if (encrypted) {
+    property_get("ro.crypto.state", encrypted_state, "");
+    if (!strcmp(encrypted_state, "encrypted") ) {
+        encrypted = 1;
+    }
+
+    /* Keep a copy to roll back to if any field fails */
+    saved_len = sizeof(struct crypt_persist_data)
+            + persist_data->persist_valid_entries * sizeof(struct crypt_persist_entry);
+    saved = malloc(saved_len);
+    if (saved == NULL) {
+        goto out;
+    }
+    memcpy(saved, persist_data, saved_len);
+
+    for (i = 0; i < count; i++) {
+        rc = set_field(fieldnames[i], values[i], encrypted);
+        if (rc != CRYPTO_SETFIELD_OK) {
+            SLOGE("Setfield error on %s; rolling back", fieldnames[i]);
+            memset(persist_data->persist_entry, 0, persist_data->persist_valid_entries
+                    * sizeof(struct crypt_persist_entry));
+            memcpy(persist_data, saved, saved_len);
+            persist_index_data = NULL;
+            persist_dirty = was_dirty;
+            goto out;
+        }
+    }
+
+    /* If we are running encrypted, save the persistent data now, once,
+     * and only if something actually changed */
+    rc = CRYPTO_SETFIELD_ERROR_OTHER;
+    if (encrypted && persist_dirty) {
         if (save_persistent_data()) {
             SLOGE("Setfield error, cannot save persistent data");
             goto out;
@@ -4130,9 +5204,16 @@ int cryptfs_setfield(const char *fieldname, const char *value)
     rc = CRYPTO_SETFIELD_OK;
 
 out:
+    free(saved);
     return rc;
 }
 
+/* Set the value of the specified field. */
+int cryptfs_setfield(const char *fieldname, const char *value)
+{
+    return cryptfs_setfields(1, &fieldname, &value);
+}
+
 /* Checks userdata. Attempt to mount the volume if default-
  * encrypted.
  * On success trigger next init phase and return 0.
@@ -4268,10 +5349,10 @@ int cryptfs_get_master_key(struct crypt_mnt_ftr* ftr, const char* password,
 
     unsigned char scrypted_intermediate_key[sizeof(ftr->scrypted_intermediate_key)];
 
-    rc = crypto_scrypt(intermediate_key, intermediate_key_size,
-                       ftr->salt, sizeof(ftr->salt), N, r, p,
-                       scrypted_intermediate_key,
-                       sizeof(scrypted_intermediate_key));
+    rc = vold_scrypt(intermediate_key, intermediate_key_size,
+                     ftr->salt, sizeof(ftr->salt), N, r, p,
+                     scrypted_intermediate_key,
+                     sizeof(scrypted_intermediate_key));
 
     free(intermediate_key);
 
@@ -4296,3 +5377,39 @@ const char* cryptfs_get_file_encryption_mode()
     struct fstab_rec* rec = fs_mgr_get_entry_for_mount_point(fstab, DATA_MNT_POINT);
     return fs_mgr_get_file_encryption_mode(rec);
 }
+
+/*
+ * Whether the storage controller has an inline crypto engine that the
+ * kernel can program file-based encryption keys into.
+ */
+int cryptfs_has_inline_crypto(void)
+{
+#ifdef CONFIG_HW_DISK_ENCRYPTION
+    return is_ice_enabled();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Opens the keymaster device ahead of the first password check, so the
+ * user doesn't wait on TEE session setup at the lock screen. Only full
+ * disk encryption goes through the device held here.
+ */
+void cryptfs_prewarm_keymaster(void)
+{
+#ifndef MINIVOLD
+    keymaster0_device_t *keymaster0_dev;
+    keymaster1_device_t *keymaster1_dev;
+    struct fstab_rec* rec;
+
+    if (!fstab) return;
+    rec = fs_mgr_get_entry_for_mount_point(fstab, DATA_MNT_POINT);
+    if (!rec || !fs_mgr_is_encryptable(rec) || fs_mgr_is_file_encrypted(rec)) {
+        return;
+    }
+    if (keymaster_get(&keymaster0_dev, &keymaster1_dev) == 0) {
+        keymaster_put();
+    }
+#endif
+}
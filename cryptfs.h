@@ -226,6 +226,12 @@ struct crypt_persist_data {
 #define PERSIST_DEL_KEY_ERROR_OTHER       -1
 #define PERSIST_DEL_KEY_ERROR_NO_FIELD    -2
 
+/* Kind of media under a dm-crypt mapping; picks the mapping's tuning */
+#define CRYPT_MEDIA_INTERNAL 0
+#define CRYPT_MEDIA_SD       1
+#define CRYPT_MEDIA_USB      2
+#define CRYPT_MEDIA_VIRTIO   3
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -243,11 +249,18 @@ extern "C" {
   int cryptfs_changepw(int type, const char *currentpw, const char *newpw);
   int cryptfs_enable_default(char *flag, int no_ui);
   int cryptfs_setup_ext_volume(const char* label, const char* real_blkdev,
-          const unsigned char* key, int keysize, char* out_crypto_blkdev);
+          const char* cipher, const unsigned char* key, int keysize, int media_class,
+          int sector_size, char* out_crypto_blkdev);
   int cryptfs_revert_ext_volume(const char* label);
+  int cryptfs_max_sector_size(void);
+  int cryptfs_select_cipher(int media_class, char* cipher, int len);
+  int cryptfs_get_cipher_bench(int index, char* out, int len);
+  int cryptfs_get_crypt_opts(int index, char* out, int len);
   int cryptfs_enable_file();
   int cryptfs_getfield(const char *fieldname, char *value, int len);
   int cryptfs_setfield(const char *fieldname, const char *value);
+  int cryptfs_setfields(int count, const char **fieldnames, const char **values);
+  void cryptfs_replace_persist_data(struct crypt_persist_data *pdata);
   int cryptfs_mount_default_encrypted(void);
   int cryptfs_get_password_type(void);
   const char* cryptfs_get_password(void);
@@ -261,6 +274,8 @@ extern "C" {
   int cryptfs_set_password(struct crypt_mnt_ftr* ftr, const char* password,
                            const unsigned char* master_key);
   const char* cryptfs_get_file_encryption_mode();
+  int cryptfs_has_inline_crypto(void);
+  void cryptfs_prewarm_keymaster(void);
 
 #ifdef __cplusplus
 }
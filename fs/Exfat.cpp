@@ -19,10 +19,12 @@
 
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <utils/Trace.h>
 
 #include <vector>
 #include <string>
 
+#include <string.h>
 #include <sys/mount.h>
 
 using android::base::StringPrintf;
@@ -34,29 +36,33 @@ namespace exfat {
 #ifdef MINIVOLD
 static const char* kMkfsPath = "/sbin/mkfs.exfat";
 static const char* kFsckPath = "/sbin/fsck.exfat";
-#ifdef CONFIG_KERNEL_HAVE_EXFAT
-static const char* kMountPath = "/sbin/mount";
-#else
-static const char* kMountPath = "/sbin/mount.exfat";
-#endif
+static const char* kFuseMountPath = "/sbin/mount.exfat";
 #else
 static const char* kMkfsPath = "/system/bin/mkfs.exfat";
 static const char* kFsckPath = "/system/bin/fsck.exfat";
+static const char* kFuseMountPath = "/system/bin/mount.exfat";
+#endif
+
+static bool hasKernelDriver() {
 #ifdef CONFIG_KERNEL_HAVE_EXFAT
-static const char* kMountPath = "/system/bin/mount";
+    return true;
 #else
-static const char* kMountPath = "/system/bin/mount.exfat";
-#endif
+    return IsKernelFilesystemSupported("exfat");
 #endif
+}
+
+static bool hasFuseHelper() {
+    return access(kFuseMountPath, X_OK) == 0 && IsKernelFilesystemSupported("fuse");
+}
 
 bool IsSupported() {
     return access(kMkfsPath, X_OK) == 0
             && access(kFsckPath, X_OK) == 0
-            && access(kMountPath, X_OK) == 0
-            && IsFilesystemSupported("exfat");
+            && (hasKernelDriver() || hasFuseHelper());
 }
 
 status_t Check(const std::string& source) {
+    ATRACE_NAME("exfat::Check");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back(source);
@@ -65,29 +71,58 @@ status_t Check(const std::string& source) {
     return ForkExecvp(cmd, sFsckUntrustedContext);
 }
 
+static status_t mountKernel(const std::string& source, const std::string& target, bool ro,
+        bool remount, bool executable, int ownerUid, int ownerGid, int permMask) {
+    unsigned long flags = MS_NODEV | MS_NOSUID | MS_NOATIME;
+    flags |= (executable ? 0 : MS_NOEXEC);
+    flags |= (ro ? MS_RDONLY : 0);
+    flags |= (remount ? MS_REMOUNT : 0);
+
+    std::string data(StringPrintf("uid=%d,gid=%d,fmask=%o,dmask=%o,iocharset=utf8",
+            ownerUid, ownerGid, permMask, permMask));
+    if (!ro && IsDiscardSupported(source)) {
+        // Freed clusters reach the card right away; older drivers don't
+        // know the option, so it's dropped again if rejected
+        if (mount(source.c_str(), target.c_str(), "exfat", flags,
+                (data + ",discard").c_str()) == 0) {
+            return OK;
+        }
+        if (errno != EINVAL) {
+            return -errno;
+        }
+    }
+    if (mount(source.c_str(), target.c_str(), "exfat", flags, data.c_str())) {
+        return -errno;
+    }
+    return OK;
+}
+
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask) {
+    ATRACE_NAME("exfat::Mount");
+    if (hasKernelDriver()) {
+        status_t res = mountKernel(source, target, ro, remount, executable,
+                ownerUid, ownerGid, permMask);
+        if (res == OK || !hasFuseHelper()) {
+            return res;
+        }
+        LOG(WARNING) << "Kernel exfat failed to mount " << source << " (" << strerror(-res)
+                << "); falling back to FUSE";
+    }
+
     char mountData[255];
 
     const char* c_source = source.c_str();
     const char* c_target = target.c_str();
 
     sprintf(mountData,
-#ifdef CONFIG_KERNEL_HAVE_EXFAT
-            "noatime,nodev,nosuid,uid=%d,gid=%d,fmask=%o,dmask=%o,%s,%s",
-#else
             "noatime,nodev,nosuid,dirsync,uid=%d,gid=%d,fmask=%o,dmask=%o,%s,%s",
-#endif
             ownerUid, ownerGid, permMask, permMask,
             (executable ? "exec" : "noexec"),
             (ro ? "ro" : "rw"));
 
     std::vector<std::string> cmd;
-    cmd.push_back(kMountPath);
-#ifdef CONFIG_KERNEL_HAVE_EXFAT
-    cmd.push_back("-t");
-    cmd.push_back("exfat");
-#endif
+    cmd.push_back(kFuseMountPath);
     cmd.push_back("-o");
     cmd.push_back(mountData);
     cmd.push_back(c_source);
@@ -97,6 +132,7 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
 }
 
 status_t Format(const std::string& source) {
+    ATRACE_NAME("exfat::Format");
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
     cmd.push_back(source);
@@ -44,6 +44,7 @@
 #include <logwrap/logwrap.h>
 #include <private/android_filesystem_config.h>
 #include <selinux/selinux.h>
+#include <utils/Trace.h>
 
 #include "Ext4.h"
 #include "Utils.h"
@@ -72,6 +73,7 @@ bool IsSupported() {
 }
 
 status_t Check(const std::string& source, const std::string& target, bool trusted) {
+    ATRACE_NAME("ext4::Check");
     // The following is shamelessly borrowed from fs_mgr.c, so it should be
     // kept in sync with any changes over there.
 
@@ -134,7 +136,8 @@ status_t Check(const std::string& source, const std::string& target, bool truste
 
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, const std::string& opts /* = "" */,
-        bool trusted, bool portable) {
+        bool trusted, bool portable, const MountProfile& profile) {
+    ATRACE_NAME("ext4::Mount");
     int rc;
     unsigned long flags;
 
@@ -151,7 +154,6 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
 
     const char* c_source = source.c_str();
     const char* c_target = target.c_str();
-    const char* c_data = data.c_str();
 
     flags = MS_NOATIME | MS_NODEV | MS_NOSUID;
 
@@ -164,7 +166,7 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
     flags |= (ro ? MS_RDONLY : 0);
     flags |= (remount ? MS_REMOUNT : 0);
 
-    rc = mount(c_source, c_target, "ext4", flags, c_data);
+    rc = MountWithProfile(source, target, "ext4", flags, data, profile);
 
     if (portable && rc == 0) {
         chown(c_target, AID_MEDIA_RW, AID_MEDIA_RW);
@@ -174,13 +176,14 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
     if (rc && errno == EROFS) {
         SLOGE("%s appears to be a read only filesystem - retrying mount RO", c_source);
         flags |= MS_RDONLY;
-        rc = mount(c_source, c_target, "ext4", flags, c_data);
+        rc = MountWithProfile(source, target, "ext4", flags, data, profile);
     }
 
     return rc;
 }
 
 status_t Resize(const std::string& source, unsigned long numSectors) {
+    ATRACE_NAME("ext4::Resize");
     std::vector<std::string> cmd;
     cmd.push_back(kResizefsPath);
     cmd.push_back("-f");
@@ -192,6 +195,7 @@ status_t Resize(const std::string& source, unsigned long numSectors) {
 
 status_t Format(const std::string& source, unsigned long numSectors,
         const std::string& target) {
+    ATRACE_NAME("ext4::Format");
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
     cmd.push_back("-J");
@@ -17,6 +17,8 @@
 #ifndef ANDROID_VOLD_EXT4_H
 #define ANDROID_VOLD_EXT4_H
 
+#include "MountProfile.h"
+
 #include <utils/Errors.h>
 
 #include <string>
@@ -31,7 +33,8 @@ status_t Check(const std::string& source, const std::string& target,
         bool trusted);
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, const std::string& opts = "",
-        bool trusted = false, bool portable = false);
+        bool trusted = false, bool portable = false,
+        const MountProfile& profile = MountProfile());
 status_t Format(const std::string& source, unsigned long numSectors,
         const std::string& target);
 status_t Resize(const std::string& source, unsigned long numSectors);
@@ -20,10 +20,12 @@
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
 #include <private/android_filesystem_config.h>
+#include <utils/Trace.h>
 
 #include <vector>
 #include <string>
 
+#include <inttypes.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 
@@ -45,6 +47,9 @@ static const char* kMkfsPath = "/system/bin/make_f2fs";
 static const char* kFsckPath = "/system/bin/fsck.f2fs";
 #endif
 
+/* f2fs allocates in fixed 2MiB segments */
+static const uint64_t kSegmentBytes = 2 * 1024 * 1024;
+
 bool IsSupported() {
     return access(kMkfsPath, X_OK) == 0
             && access(kFsckPath, X_OK) == 0
@@ -52,6 +57,7 @@ bool IsSupported() {
 }
 
 status_t Check(const std::string& source, bool trusted) {
+    ATRACE_NAME("f2fs::Check");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back("-a");
@@ -61,7 +67,9 @@ status_t Check(const std::string& source, bool trusted) {
 }
 
 status_t Mount(const std::string& source, const std::string& target,
-        const std::string& opts /* = "" */, bool trusted, bool portable) {
+        const std::string& opts /* = "" */, bool trusted, bool portable,
+        const MountProfile& profile) {
+    ATRACE_NAME("f2fs::Mount");
     std::string data(opts);
 
     if (portable && is_selinux_enabled() > 0) {
@@ -71,9 +79,7 @@ status_t Mount(const std::string& source, const std::string& target,
         data += "context=u:object_r:sdcard_posix:s0";
     }
 
-    const char* c_source = source.c_str();
     const char* c_target = target.c_str();
-    const char* c_data = data.c_str();
 
     unsigned long flags = MS_NOATIME | MS_NODEV | MS_NOSUID;
 
@@ -82,7 +88,7 @@ status_t Mount(const std::string& source, const std::string& target,
         flags |= MS_DIRSYNC;
     }
 
-    int res = mount(c_source, c_target, "f2fs", flags, c_data);
+    int res = MountWithProfile(source, target, "f2fs", flags, data, profile);
 
     if (portable && res == 0) {
         chown(c_target, AID_MEDIA_RW, AID_MEDIA_RW);
@@ -92,7 +98,7 @@ status_t Mount(const std::string& source, const std::string& target,
     if (res != 0) {
         PLOG(ERROR) << "Failed to mount " << source;
         if (errno == EROFS) {
-            res = mount(c_source, c_target, "f2fs", flags | MS_RDONLY, c_data);
+            res = MountWithProfile(source, target, "f2fs", flags | MS_RDONLY, data, profile);
             if (res != 0) {
                 PLOG(ERROR) << "Failed to mount read-only " << source;
             }
@@ -102,9 +108,23 @@ status_t Mount(const std::string& source, const std::string& target,
     return res;
 }
 
-status_t Format(const std::string& source) {
+status_t Format(const std::string& source, const FlashGeometry& geometry, bool discard) {
+    ATRACE_NAME("f2fs::Format");
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
+
+    if (!discard) {
+        cmd.push_back("-t");
+        cmd.push_back("0");
+    }
+
+    // Line sections up with erase blocks, so the cleaner frees whole blocks
+    uint64_t segments = geometry.eraseBytes / kSegmentBytes;
+    if (segments > 1 && geometry.offsetBytes % geometry.eraseBytes == 0) {
+        cmd.push_back("-s");
+        cmd.push_back(StringPrintf("%" PRIu64, segments));
+    }
+
     cmd.push_back(source);
 
     return ForkExecvp(cmd);
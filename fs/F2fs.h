@@ -17,6 +17,9 @@
 #ifndef ANDROID_VOLD_F2FS_H
 #define ANDROID_VOLD_F2FS_H
 
+#include "MountProfile.h"
+#include "Utils.h"
+
 #include <utils/Errors.h>
 
 #include <string>
@@ -30,8 +33,13 @@ bool IsSupported();
 status_t Check(const std::string& source, bool trusted);
 status_t Mount(const std::string& source, const std::string& target,
         const std::string& opts = "", bool trusted = false,
-        bool portable = false);
-status_t Format(const std::string& source);
+        bool portable = false, const MountProfile& profile = MountProfile());
+/*
+ * Sizes sections to match the erase blocks in geometry, when known. Skips
+ * discarding the device first unless discard is set.
+ */
+status_t Format(const std::string& source,
+        const FlashGeometry& geometry = FlashGeometry(), bool discard = true);
 
 }  // namespace f2fs
 }  // namespace vold
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <sys/mount.h>
 #include <utils/Errors.h>
+#include <utils/Trace.h>
 #include "Iso9660.h"
 #include "Utils.h"
 
@@ -30,6 +31,7 @@ bool IsSupported() {
 
 status_t Mount(const std::string& source, const std::string& target,
         int ownerUid, int ownerGid, const char* type) {
+    ATRACE_NAME("iso9660::Mount");
     unsigned long flags;
     char mountData[256];
 
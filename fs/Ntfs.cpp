@@ -19,10 +19,12 @@
 
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
+#include <utils/Trace.h>
 
 #include <vector>
 #include <string>
 
+#include <string.h>
 #include <sys/mount.h>
 
 using android::base::StringPrintf;
@@ -34,29 +36,36 @@ namespace ntfs {
 #ifdef MINIVOLD
 static const char* kMkfsPath = "/sbin/mkfs.ntfs";
 static const char* kFsckPath = "/sbin/fsck.ntfs";
-#ifdef CONFIG_KERNEL_HAVE_NTFS
-static const char* kMountPath = "/sbin/mount";
-#else
-static const char* kMountPath = "/sbin/mount.ntfs";
-#endif
+static const char* kFuseMountPath = "/sbin/mount.ntfs";
 #else
 static const char* kMkfsPath = "/system/bin/mkfs.ntfs";
 static const char* kFsckPath = "/system/bin/fsck.ntfs";
+static const char* kFuseMountPath = "/system/bin/mount.ntfs";
+#endif
+
+/* The older in-kernel ntfs driver can't safely write, so only ntfs3 counts */
+static const char* kKernelType = "ntfs3";
+
+static bool hasKernelDriver() {
 #ifdef CONFIG_KERNEL_HAVE_NTFS
-static const char* kMountPath = "/system/bin/mount";
+    return true;
 #else
-static const char* kMountPath = "/system/bin/mount.ntfs";
-#endif
+    return IsKernelFilesystemSupported(kKernelType);
 #endif
+}
+
+static bool hasFuseHelper() {
+    return access(kFuseMountPath, X_OK) == 0 && IsKernelFilesystemSupported("fuse");
+}
 
 bool IsSupported() {
     return access(kMkfsPath, X_OK) == 0
             && access(kFsckPath, X_OK) == 0
-            && access(kMountPath, X_OK) == 0
-            && IsFilesystemSupported("ntfs");
+            && (hasKernelDriver() || hasFuseHelper());
 }
 
 status_t Check(const std::string& source) {
+    ATRACE_NAME("ntfs::Check");
     std::vector<std::string> cmd;
     cmd.push_back(kFsckPath);
     cmd.push_back("-n");
@@ -66,21 +75,53 @@ status_t Check(const std::string& source) {
     return ForkExecvp(cmd, sFsckUntrustedContext);
 }
 
+static status_t mountKernel(const std::string& source, const std::string& target, bool ro,
+        bool remount, bool executable, int ownerUid, int ownerGid, int permMask) {
+    unsigned long flags = MS_NODEV | MS_NOSUID | MS_NOATIME;
+    flags |= (executable ? 0 : MS_NOEXEC);
+    flags |= (ro ? MS_RDONLY : 0);
+    flags |= (remount ? MS_REMOUNT : 0);
+
+    // prealloc keeps large sequential writes, like video, in few extents
+    std::string data(StringPrintf("uid=%d,gid=%d,fmask=%o,dmask=%o,iocharset=utf8,prealloc",
+            ownerUid, ownerGid, permMask, permMask));
+    if (!ro && IsDiscardSupported(source)) {
+        if (mount(source.c_str(), target.c_str(), kKernelType, flags,
+                (data + ",discard").c_str()) == 0) {
+            return OK;
+        }
+        if (errno != EINVAL) {
+            return -errno;
+        }
+    }
+    if (mount(source.c_str(), target.c_str(), kKernelType, flags, data.c_str())) {
+        return -errno;
+    }
+    return OK;
+}
+
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask,
         bool createLost) {
+    ATRACE_NAME("ntfs::Mount");
+    if (hasKernelDriver()) {
+        status_t res = mountKernel(source, target, ro, remount, executable,
+                ownerUid, ownerGid, permMask);
+        if (res == OK || !hasFuseHelper()) {
+            return res;
+        }
+        LOG(WARNING) << "Kernel ntfs3 failed to mount " << source << " (" << strerror(-res)
+                << "); falling back to FUSE";
+    }
+
     char mountData[255];
 
     const char* c_source = source.c_str();
     const char* c_target = target.c_str();
 
     sprintf(mountData,
-#ifdef CONFIG_KERNEL_HAVE_NTFS
-            "uid=%d,gid=%d,fmask=%o,dmask=%o,nodev,nosuid",
-#else
             "utf8,uid=%d,gid=%d,fmask=%o,dmask=%o,"
             "shortname=mixed,nodev,nosuid,dirsync",
-#endif
             ownerUid, ownerGid, permMask, permMask);
 
     if (!executable)
@@ -91,11 +132,7 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
         strcat(mountData, ",remount");
 
     std::vector<std::string> cmd;
-    cmd.push_back(kMountPath);
-#ifdef CONFIG_KERNEL_HAVE_NTFS
-    cmd.push_back("-t");
-    cmd.push_back("ntfs3");
-#endif
+    cmd.push_back(kFuseMountPath);
     cmd.push_back("-o");
     cmd.push_back(mountData);
     cmd.push_back(c_source);
@@ -105,6 +142,7 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
 }
 
 status_t Format(const std::string& source, bool wipe) {
+    ATRACE_NAME("ntfs::Format");
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
     if (wipe)
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Sdcardfs.h"
+#include "Utils.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <cutils/properties.h>
+#include <private/android_filesystem_config.h>
+#include <utils/Trace.h>
+
+#include <vector>
+
+#include <sys/mount.h>
+
+using android::base::StringPrintf;
+
+namespace android {
+namespace vold {
+namespace sdcardfs {
+
+static const char* kSdcardfsProp = "persist.vold.sdcardfs";
+
+/* Owner of everything below the views, as passed to the daemon's -u/-g */
+static const uid_t kLowerUid = AID_MEDIA_RW;
+static const gid_t kLowerGid = AID_MEDIA_RW;
+
+bool IsSupported() {
+    return property_get_bool(kSdcardfsProp, true) && IsFilesystemSupported("sdcardfs");
+}
+
+static status_t mountView(const std::string& source, const std::string& target,
+        userid_t userId, bool multiUser, gid_t gid, int mask) {
+    std::string opts(StringPrintf("fsuid=%d,fsgid=%d,%smask=%d,userid=%d,gid=%d",
+            kLowerUid, kLowerGid, multiUser ? "multiuser," : "", mask, userId, gid));
+    if (mount(source.c_str(), target.c_str(), "sdcardfs",
+            MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_NOATIME, opts.c_str())) {
+        PLOG(WARNING) << "Failed to mount sdcardfs at " << target << " with " << opts;
+        return -errno;
+    }
+    return OK;
+}
+
+status_t MountViews(const std::string& source, const std::string& defaultPath,
+        const std::string& readPath, const std::string& writePath,
+        const std::string& fullPath, userid_t userId, bool multiUser, bool fullWrite) {
+    ATRACE_NAME("sdcardfs::MountViews");
+    struct View {
+        const std::string& path;
+        gid_t gid;
+        int mask;
+    };
+    // Same views the daemon derives for its default, read, write and full
+    // runtime mounts
+    const View views[] = {
+        { defaultPath, AID_SDCARD_RW, 0006 },
+        { readPath, AID_EVERYBODY, fullWrite ? 0027 : 0022 },
+        { writePath, AID_EVERYBODY, fullWrite ? 0007 : 0022 },
+        { fullPath, AID_EVERYBODY, 0007 },
+    };
+
+    std::vector<std::string> mounted;
+    for (const auto& view : views) {
+        status_t res = mountView(source, view.path, userId, multiUser, view.gid, view.mask);
+        if (res != OK) {
+            for (const auto& path : mounted) {
+                ForceUnmount(path);
+            }
+            return res;
+        }
+        mounted.push_back(view.path);
+    }
+    return OK;
+}
+
+}  // namespace sdcardfs
+}  // namespace vold
+}  // namespace android
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VOLD_SDCARDFS_H
+#define ANDROID_VOLD_SDCARDFS_H
+
+#include <utils/Errors.h>
+
+#include <string>
+
+#include <cutils/multiuser.h>
+
+namespace android {
+namespace vold {
+namespace sdcardfs {
+
+/* True when the kernel has sdcardfs and persist.vold.sdcardfs allows it */
+bool IsSupported();
+
+/*
+ * Stacks sdcardfs over source at each runtime view the sdcard daemon
+ * would otherwise serve, with the same ownership and permission masks.
+ * multiUser and fullWrite match the daemon's -m and -w flags. Anything
+ * already mounted is unmounted again if a later view fails.
+ */
+status_t MountViews(const std::string& source, const std::string& defaultPath,
+        const std::string& readPath, const std::string& writePath,
+        const std::string& fullPath, userid_t userId, bool multiUser, bool fullWrite);
+
+}  // namespace sdcardfs
+}  // namespace vold
+}  // namespace android
+
+#endif
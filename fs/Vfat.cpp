@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -42,6 +43,7 @@
 #include <cutils/log.h>
 #include <cutils/properties.h>
 #include <selinux/selinux.h>
+#include <utils/Trace.h>
 
 #include <logwrap/logwrap.h>
 
@@ -56,6 +58,11 @@ namespace vold {
 namespace vfat {
 
 static const char* kMkfsPath = "/system/bin/newfs_msdos";
+/* 32KiB clusters, as the SD specification asks for on SDHC cards */
+static const unsigned long kClusterSectors = 64;
+/* FAT32 wants at least 32 reserved sectors, and counts them in 16 bits */
+static const uint64_t kMinReservedSectors = 32;
+static const uint64_t kMaxReservedSectors = 0xffff;
 static const char* kFsckPath = "/system/bin/fsck_msdos";
 
 bool IsSupported() {
@@ -65,6 +72,7 @@ bool IsSupported() {
 }
 
 status_t Check(const std::string& source) {
+    ATRACE_NAME("vfat::Check");
     if (access(kFsckPath, X_OK)) {
         SLOGW("Skipping fs checks\n");
         return 0;
@@ -125,7 +133,8 @@ status_t Check(const std::string& source) {
 
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask,
-        bool createLost) {
+        bool createLost, const MountProfile& profile) {
+    ATRACE_NAME("vfat::Mount");
     int rc;
     unsigned long flags;
     char mountData[255];
@@ -143,12 +152,12 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
             "utf8,uid=%d,gid=%d,fmask=%o,dmask=%o,shortname=mixed",
             ownerUid, ownerGid, permMask, permMask);
 
-    rc = mount(c_source, c_target, "vfat", flags, mountData);
+    rc = MountWithProfile(source, target, "vfat", flags, mountData, profile);
 
     if (rc && errno == EROFS) {
         SLOGE("%s appears to be a read only filesystem - retrying mount RO", c_source);
         flags |= MS_RDONLY;
-        rc = mount(c_source, c_target, "vfat", flags, mountData);
+        rc = MountWithProfile(source, target, "vfat", flags, mountData, profile);
     }
 
     if (rc == 0 && createLost) {
@@ -169,7 +178,9 @@ status_t Mount(const std::string& source, const std::string& target, bool ro,
     return rc;
 }
 
-status_t Format(const std::string& source, unsigned long numSectors) {
+status_t Format(const std::string& source, unsigned long numSectors,
+        const FlashGeometry& geometry) {
+    ATRACE_NAME("vfat::Format");
     std::vector<std::string> cmd;
     cmd.push_back(kMkfsPath);
     cmd.push_back("-F");
@@ -177,8 +188,47 @@ status_t Format(const std::string& source, unsigned long numSectors) {
     cmd.push_back("-O");
     cmd.push_back("android");
     cmd.push_back("-c");
-    cmd.push_back("64");
-    cmd.push_back("-A");
+    cmd.push_back(StringPrintf("%lu", kClusterSectors));
+
+    uint64_t totalSectors = numSectors;
+    if (!totalSectors) {
+        int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        uint64_t bytes = 0;
+        if (fd != -1) {
+            if (ioctl(fd, BLKGETSIZE64, &bytes)) {
+                bytes = 0;
+            }
+            close(fd);
+        }
+        totalSectors = bytes / 512;
+    }
+
+    /*
+     * Start the data region on an erase block boundary, so every cluster
+     * sits inside a single block. That takes choosing the FAT size
+     * ourselves, sized for the most clusters that could ever fit, and
+     * padding the reserved area to make up the difference.
+     */
+    uint64_t eraseSectors = geometry.eraseBytes / 512;
+    uint64_t reserved = 0;
+    uint64_t fatSectors = 0;
+    if (eraseSectors && totalSectors) {
+        fatSectors = ((totalSectors / kClusterSectors + 2) * 4 + 511) / 512;
+        uint64_t used = geometry.offsetBytes / 512 + kMinReservedSectors + 2 * fatSectors;
+        reserved = kMinReservedSectors + (eraseSectors - used % eraseSectors) % eraseSectors;
+        if (reserved > kMaxReservedSectors || 2 * fatSectors + reserved >= totalSectors) {
+            reserved = 0;
+        }
+    }
+    if (reserved) {
+        SLOGI("Aligning FAT data region to %" PRIu64 " byte erase blocks", geometry.eraseBytes);
+        cmd.push_back("-r");
+        cmd.push_back(StringPrintf("%" PRIu64, reserved));
+        cmd.push_back("-a");
+        cmd.push_back(StringPrintf("%" PRIu64, fatSectors));
+    } else {
+        cmd.push_back("-A");
+    }
 
     if (numSectors) {
         cmd.push_back("-s");
@@ -17,6 +17,9 @@
 #ifndef ANDROID_VOLD_VFAT_H
 #define ANDROID_VOLD_VFAT_H
 
+#include "MountProfile.h"
+#include "Utils.h"
+
 #include <utils/Errors.h>
 
 #include <string>
@@ -30,8 +33,10 @@ bool IsSupported();
 status_t Check(const std::string& source);
 status_t Mount(const std::string& source, const std::string& target, bool ro,
         bool remount, bool executable, int ownerUid, int ownerGid, int permMask,
-        bool createLost);
-status_t Format(const std::string& source, unsigned long numSectors);
+        bool createLost, const MountProfile& profile = MountProfile());
+/* Aligns the data region to the erase blocks in geometry, when known */
+status_t Format(const std::string& source, unsigned long numSectors,
+        const FlashGeometry& geometry = FlashGeometry());
 
 }  // namespace vfat
 }  // namespace vold
@@ -21,6 +21,8 @@
 #include "CryptCommandListener.h"
 #endif
 #include "NetlinkManager.h"
+#include "OperationStats.h"
+#include "StorageWear.h"
 #include "cryptfs.h"
 #include "sehandle.h"
 
@@ -30,6 +32,7 @@
 #include <cutils/klog.h>
 #include <cutils/properties.h>
 #include <cutils/sockets.h>
+#include <utils/Timers.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,10 +43,18 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
 #include <fs_mgr.h>
 
-static int process_config(VolumeManager *vm, bool* has_adoptable);
-static void coldboot(const char *path);
+#include <memory>
+#include <thread>
+#include <vector>
+
+typedef std::vector<std::shared_ptr<VolumeManager::DiskSource>> DiskSourceList;
+
+static int process_config(DiskSourceList* sources, bool* has_adoptable);
+static void coldboot(VolumeManager *vm, const char *path);
 static void parse_args(int argc, char** argv);
 
 struct fstab *fstab;
@@ -56,7 +67,33 @@ struct selabel_handle *sehandle;
 
 using android::base::StringPrintf;
 
+static nsecs_t sLaunchTime;
+
+/*
+ * Times one phase of startup, logging how long it took and how far into
+ * startup it finished. Phases also show up in the operation stats.
+ */
+class StartupPhase {
+public:
+    StartupPhase(const char* name) : mName(name), mTimer("startup", name),
+            mStart(systemTime(SYSTEM_TIME_MONOTONIC)) {}
+
+    ~StartupPhase() {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        mTimer.setResult(true);
+        LOG(INFO) << "Startup phase " << mName << " took "
+                << nanoseconds_to_milliseconds(now - mStart) << "ms, done at "
+                << nanoseconds_to_milliseconds(now - sLaunchTime) << "ms";
+    }
+
+private:
+    const char* mName;
+    android::vold::OperationTimer mTimer;
+    nsecs_t mStart;
+};
+
 extern "C" int vold_main(int argc, char** argv) {
+    sLaunchTime = systemTime(SYSTEM_TIME_MONOTONIC);
     setenv("ANDROID_LOG_TAGS", "*:v", 1);
     android::base::InitLogging(argv, android::base::LogdLogger(android::base::SYSTEM));
 
@@ -114,44 +151,82 @@ extern "C" int vold_main(int argc, char** argv) {
 #endif
     vm->setBroadcaster((SocketListener *) cl);
     nm->setBroadcaster((SocketListener *) cl);
+#ifndef MINIVOLD
+    vm->setCryptBroadcaster((SocketListener *) ccl);
+#endif
 
-    if (vm->start()) {
-        PLOG(ERROR) << "Unable to start VolumeManager";
-        exit(1);
+    // Reading the fstab and kernel command line doesn't depend on anything
+    // VolumeManager::start() does, so it overlaps the unmount sweep
+    DiskSourceList sources;
+    bool has_adoptable = false;
+    int config_res = 0;
+    std::thread config([&sources, &has_adoptable, &config_res]() {
+        StartupPhase phase("config");
+        config_res = process_config(&sources, &has_adoptable);
+    });
+
+    {
+        StartupPhase phase("volumes");
+        if (vm->start()) {
+            PLOG(ERROR) << "Unable to start VolumeManager";
+            exit(1);
+        }
     }
 
-    bool has_adoptable;
-
-    if (process_config(vm, &has_adoptable)) {
-        PLOG(ERROR) << "Error reading configuration... continuing anyways";
+    config.join();
+    if (config_res) {
+        LOG(ERROR) << "Error reading configuration... continuing anyways";
     }
-
-    if (nm->start()) {
-        PLOG(ERROR) << "Unable to start NetlinkManager";
-        exit(1);
+    for (const auto& source : sources) {
+        vm->addDiskSource(source);
     }
 
-    coldboot("/sys/block");
-//    coldboot("/sys/class/switch");
+#ifndef MINIVOLD
+    // Needs the fstab, but nothing waits on it
+    std::thread(&cryptfs_prewarm_keymaster).detach();
+#endif
+
+    {
+        StartupPhase phase("netlink");
+        if (nm->start()) {
+            PLOG(ERROR) << "Unable to start NetlinkManager";
+            exit(1);
+        }
+    }
 
     /*
-     * Now that we're up, we can respond to commands
+     * Now that we're up, we can respond to commands. Disks show up later
+     * through the usual DiskCreated broadcasts, so the framework doesn't
+     * wait on SD card enumeration.
      */
-    if (cl->startListener()) {
-        PLOG(ERROR) << "Unable to start CommandListener";
-        exit(1);
-    }
+    {
+        StartupPhase phase("listeners");
+        if (cl->startListener()) {
+            PLOG(ERROR) << "Unable to start CommandListener";
+            exit(1);
+        }
 
 #ifndef MINIVOLD
-    if (ccl->startListener()) {
-        PLOG(ERROR) << "Unable to start CryptCommandListener";
-        exit(1);
-    }
+        if (ccl->startListener()) {
+            PLOG(ERROR) << "Unable to start CryptCommandListener";
+            exit(1);
+        }
 #endif
+    }
 
     // This call should go after listeners are started to avoid
     // a deadlock between vold and init (see b/34278978 for details)
     property_set("vold.has_adoptable", has_adoptable ? "1" : "0");
+    property_set("vold.ready", "1");
+    android::vold::StartWearReporting();
+
+    // Disks are probed on VolumeManager's disk pool as their add events
+    // come back, so this only replays the events
+    {
+        StartupPhase phase("coldboot");
+        coldboot(vm, "/sys/block");
+//        coldboot("/sys/class/switch");
+    }
 
     // Eventually we'll become the monitoring thread
     while(1) {
@@ -186,50 +261,49 @@ static void parse_args(int argc, char** argv) {
     CHECK(android::vold::sFsckUntrustedContext != nullptr);
 }
 
-static void do_coldboot(DIR *d, int lvl) {
-    struct dirent *de;
-    int dfd, fd;
-
-    dfd = dirfd(d);
-
-    fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
-    if(fd >= 0) {
-        write(fd, "add\n", 4);
-        close(fd);
+/*
+ * Only disks claimed by a DiskSource can ever become volumes, and their
+ * partitions are read from the disk itself, so ask the kernel to replay
+ * just those add events instead of every uevent under /sys/block.
+ */
+static void coldboot(VolumeManager *vm, const char *path) {
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(path), closedir);
+    if (!d) {
+        PLOG(ERROR) << "Failed to open " << path;
+        return;
     }
 
-    while((de = readdir(d))) {
-        DIR *d2;
-
+    int total = 0;
+    int triggered = 0;
+    struct dirent *de;
+    while ((de = readdir(d.get()))) {
         if (de->d_name[0] == '.')
             continue;
+        total++;
 
-        if (de->d_type != DT_DIR && lvl > 0)
+        // Each entry links to the device, whose path below /sys is DEVPATH
+        std::string sysPath(StringPrintf("%s/%s", path, de->d_name));
+        char resolved[PATH_MAX];
+        if (!realpath(sysPath.c_str(), resolved) || strncmp(resolved, "/sys/", 5))
             continue;
-
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
-        if(fd < 0)
+        if (!vm->matchesDiskSource(resolved + 4))
             continue;
 
-        d2 = fdopendir(fd);
-        if(d2 == 0)
+        int fd = open((sysPath + "/uevent").c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "add\n", 4) == 4) {
+                triggered++;
+            }
             close(fd);
-        else {
-            do_coldboot(d2, lvl + 1);
-            closedir(d2);
         }
     }
-}
 
-static void coldboot(const char *path) {
-    DIR *d = opendir(path);
-    if(d) {
-        do_coldboot(d, 0);
-        closedir(d);
-    }
+    LOG(INFO) << "Coldboot triggered " << triggered << " of " << total << " block devices in "
+            << nanoseconds_to_milliseconds(systemTime(SYSTEM_TIME_MONOTONIC) - start) << "ms";
 }
 
-static int process_config(VolumeManager *vm, bool* has_adoptable) {
+static int process_config(DiskSourceList* sources, bool* has_adoptable) {
     std::string path(android::vold::DefaultFstabPath());
     fstab = fs_mgr_read_fstab(path.c_str());
     if (!fstab) {
@@ -266,7 +340,7 @@ static int process_config(VolumeManager *vm, bool* has_adoptable) {
                 flags |= android::vold::Disk::Flags::kNonRemovable;
             }
 
-            vm->addDiskSource(std::shared_ptr<VolumeManager::DiskSource>(
+            sources->push_back(std::shared_ptr<VolumeManager::DiskSource>(
                     new VolumeManager::DiskSource(sysPattern, nickname, partnum, flags,
                                     fstype, mntopts)));
         }
@@ -295,7 +369,7 @@ static int process_config(VolumeManager *vm, bool* has_adoptable) {
                         }
                     }
                 }
-                vm->addDiskSource(std::shared_ptr<VolumeManager::DiskSource>(
+                sources->push_back(std::shared_ptr<VolumeManager::DiskSource>(
                         new VolumeManager::DiskSource("/devices/*/" + sdcard, sdcard,
                         partnum, android::vold::Disk::Flags::kAdoptable, "auto", "")));
                 *has_adoptable = true;
@@ -17,3 +17,22 @@ LOCAL_MODULE := vold_tests
 LOCAL_MODULE_TAGS := eng tests
 
 include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
+
+LOCAL_C_INCLUDES := \
+    system/core/fs_mgr/include
+
+LOCAL_SHARED_LIBRARIES := \
+    liblog \
+    libcrypto \
+    libcutils \
+    libbase \
+
+LOCAL_STATIC_LIBRARIES := libvold
+LOCAL_SRC_FILES := vold_benchmarks.cpp
+LOCAL_MODULE := vold_benchmarks
+LOCAL_MODULE_TAGS := eng tests
+
+include $(BUILD_NATIVE_BENCHMARK)
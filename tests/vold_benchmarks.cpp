@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define LOG_TAG "vold_benchmarks"
+#include <utils/Log.h>
+#include <openssl/md5.h>
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+
+#include "../PartitionTable.h"
+#include "../Process.h"
+#include "../Utils.h"
+#include "../VolumeManager.h"
+#include "../cryptfs.h"
+
+#include <benchmark/benchmark.h>
+
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+
+namespace android {
+namespace vold {
+
+static const char* kScratchTemplate = "/data/local/tmp/vold_benchmarks.XXXXXX";
+
+/* Scratch directory that is removed with everything in it */
+class ScratchDir {
+public:
+    ScratchDir() {
+        char path[PATH_MAX];
+        strlcpy(path, kScratchTemplate, sizeof(path));
+        if (mkdtemp(path) == nullptr) {
+            fprintf(stderr, "Failed to create scratch dir: %s\n", strerror(errno));
+            abort();
+        }
+        mPath = path;
+    }
+
+    ~ScratchDir() {
+        nftw(mPath.c_str(), [](const char* path, const struct stat*, int, struct FTW*) {
+            return remove(path);
+        }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    const std::string& path() const { return mPath; }
+
+private:
+    std::string mPath;
+};
+
+/*
+ * Lays out a /proc lookalike for Process::scan(): every pid gets fds,
+ * maps, cwd, root and exe pointing at system paths, and one in ten also
+ * holds an open file under kHeldPrefix, as a busy device would.
+ */
+class SyntheticProc {
+public:
+    static constexpr const char* kHeldPrefix = "/mnt/media_rw/0123-4567";
+
+    SyntheticProc(int pids, int fdsPerPid, int mapsPerPid) {
+        std::string maps;
+        for (int i = 0; i < mapsPerPid; i++) {
+            maps += StringPrintf("7f%06x000-7f%06x000 r-xp 00000000 fd:00 %d "
+                    "/system/lib/libfake%d.so\n", i, i + 1, 1000 + i, i);
+        }
+
+        for (int pid = 1000; pid < 1000 + pids; pid++) {
+            std::string dir(StringPrintf("%s/%d", mRoot.path().c_str(), pid));
+            mkdir(dir.c_str(), 0755);
+            mkdir((dir + "/fd").c_str(), 0755);
+            mkdir((dir + "/ns").c_str(), 0755);
+            for (int fd = 0; fd < fdsPerPid; fd++) {
+                symlink(StringPrintf("/data/data/com.example.%d/file%d", pid, fd).c_str(),
+                        StringPrintf("%s/fd/%d", dir.c_str(), fd).c_str());
+            }
+            if (pid % 10 == 0) {
+                symlink(StringPrintf("%s/DCIM/held%d.jpg", kHeldPrefix, pid).c_str(),
+                        StringPrintf("%s/fd/%d", dir.c_str(), fdsPerPid).c_str());
+            }
+            WriteStringToFile(maps, dir + "/maps");
+            WriteStringToFile(StringPrintf("com.example.%d", pid), dir + "/cmdline");
+            WriteStringToFile("", dir + "/ns/mnt");
+            symlink("/", (dir + "/cwd").c_str());
+            symlink("/", (dir + "/root").c_str());
+            symlink("/system/bin/app_process", (dir + "/exe").c_str());
+        }
+    }
+
+    const std::string& path() const { return mRoot.path(); }
+
+private:
+    ScratchDir mRoot;
+};
+
+/* A tree of fanout^depth directories, each holding filesPerDir small files */
+class SyntheticTree {
+public:
+    SyntheticTree(int depth, int fanout, int filesPerDir) {
+        populate(mRoot.path(), depth, fanout, filesPerDir);
+    }
+
+    const std::string& path() const { return mRoot.path(); }
+
+private:
+    ScratchDir mRoot;
+
+    void populate(const std::string& dir, int depth, int fanout, int filesPerDir) {
+        std::string contents(4096, 'x');
+        for (int i = 0; i < filesPerDir; i++) {
+            WriteStringToFile(contents, StringPrintf("%s/file%d", dir.c_str(), i));
+        }
+        if (depth == 0) return;
+        for (int i = 0; i < fanout; i++) {
+            std::string child(StringPrintf("%s/dir%d", dir.c_str(), i));
+            mkdir(child.c_str(), 0755);
+            populate(child, depth - 1, fanout, filesPerDir);
+        }
+    }
+};
+
+static void BM_ProcessScan(benchmark::State& state) {
+    SyntheticProc proc(600, 32, 200);
+    std::vector<Process::Info> found;
+    while (state.KeepRunning()) {
+        Process::scan(found, SyntheticProc::kHeldPrefix, state.range_x(), proc.path().c_str());
+    }
+    state.SetItemsProcessed(state.iterations() * 600);
+}
+BENCHMARK(BM_ProcessScan)->Arg(1)->Arg(4);
+
+static void BM_ReadPartitionTable(benchmark::State& state) {
+    ScratchDir dir;
+    std::string image(dir.path() + "/disk.img");
+    int fd = open(image.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    ftruncate(fd, 64 * 1024 * 1024);
+    close(fd);
+
+    auto type = state.range_x() ? PartitionTable::Type::kGpt : PartitionTable::Type::kMbr;
+    std::vector<PartitionSpec> specs;
+    for (int i = 0; i < 4; i++) {
+        specs.push_back({ 0x0c, false, "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "",
+                StringPrintf("part%d", i), 8 * 1024 * 1024 });
+    }
+    WritePartitionTable(image, type, specs, 1024 * 1024);
+
+    PartitionTable table;
+    while (state.KeepRunning()) {
+        ReadPartitionTable(image, table);
+    }
+}
+BENCHMARK(BM_ReadPartitionTable)->Arg(0)->Arg(1);
+
+static void BM_HexToStr(benchmark::State& state) {
+    std::string raw;
+    ReadRandomBytes(state.range_x(), raw);
+    std::string hex;
+    StrToHex(raw, hex);
+    std::string out;
+    while (state.KeepRunning()) {
+        HexToStr(hex, out);
+    }
+    state.SetBytesProcessed(state.iterations() * hex.size());
+}
+BENCHMARK(BM_HexToStr)->Arg(16)->Arg(64)->Arg(4096);
+
+static void BM_StrToHex(benchmark::State& state) {
+    std::string raw;
+    ReadRandomBytes(state.range_x(), raw);
+    std::string out;
+    while (state.KeepRunning()) {
+        StrToHex(raw, out);
+    }
+    state.SetBytesProcessed(state.iterations() * raw.size());
+}
+BENCHMARK(BM_StrToHex)->Arg(16)->Arg(64)->Arg(4096);
+
+static void BM_CryptfsGetField(benchmark::State& state) {
+    int entries = state.range_x();
+    size_t size = sizeof(struct crypt_persist_data) + entries * sizeof(struct crypt_persist_entry);
+    auto pdata = static_cast<struct crypt_persist_data*>(calloc(1, size));
+    pdata->persist_magic = PERSIST_DATA_MAGIC;
+    pdata->persist_valid_entries = entries;
+    for (int i = 0; i < entries; i++) {
+        snprintf(pdata->persist_entry[i].key, PROPERTY_KEY_MAX, "field%d", i);
+        snprintf(pdata->persist_entry[i].val, PROPERTY_VALUE_MAX, "value%d", i);
+    }
+    cryptfs_replace_persist_data(pdata);
+
+    // The last entry is the one a linear scan would reach last
+    std::string last(StringPrintf("field%d", entries - 1));
+    char value[PROPERTY_VALUE_MAX];
+    while (state.KeepRunning()) {
+        cryptfs_getfield(last.c_str(), value, sizeof(value));
+    }
+}
+BENCHMARK(BM_CryptfsGetField)->Arg(8)->Arg(32)->Arg(128);
+
+static void BM_AsecHash(benchmark::State& state) {
+    char buffer[MD5_ASCII_LENGTH_PLUS_NULL];
+    while (state.KeepRunning()) {
+        VolumeManager::asecHash("com.example.app-1", buffer, sizeof(buffer));
+    }
+}
+BENCHMARK(BM_AsecHash);
+
+static void BM_DiskSourceMatches(benchmark::State& state) {
+    // Typical fstab patterns against the sysfs paths a device reports
+    std::vector<VolumeManager::DiskSource> sources;
+    sources.emplace_back("/devices/soc.0/7864900.sdhci/mmc_host*", "sdcard", -1, 0, "", "");
+    sources.emplace_back("/devices/*.dwc3/xhci-hcd.*.auto/usb*", "usb", -1, 0, "", "");
+    sources.emplace_back("/devices/platform/msm_hsusb*", "usb", -1, 0, "", "");
+    std::vector<std::string> paths {
+        "/devices/soc.0/7864900.sdhci/mmc_host/mmc1/mmc1:aaaa/block/mmcblk1",
+        "/devices/soc.0/a800000.ssusb/a800000.dwc3/xhci-hcd.0.auto/usb1/1-1/1-1:1.0/host0",
+        "/devices/virtual/block/loop7",
+    };
+    while (state.KeepRunning()) {
+        for (auto& source : sources) {
+            for (const auto& path : paths) {
+                benchmark::DoNotOptimize(source.matches(path));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * sources.size() * paths.size());
+}
+BENCHMARK(BM_DiskSourceMatches);
+
+static void BM_GetTreeBytes(benchmark::State& state) {
+    SyntheticTree tree(3, 8, state.range_x());
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(GetTreeBytes(tree.path()));
+    }
+}
+BENCHMARK(BM_GetTreeBytes)->Arg(4)->Arg(16);
+
+}  // namespace vold
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -30,17 +30,31 @@
 #include <sys/types.h>
 #include <sys/un.h>
 
+#include <map>
+#include <string>
+
 #include <android-base/stringprintf.h>
 
 #include <cutils/sockets.h>
 #include <private/android_filesystem_config.h>
 
 static void usage(char *progname);
+static int connect_socket(const char* sockname, bool wait_for_socket);
 static int do_monitor(int sock, int stop_after_cmd);
 static int do_cmd(int sock, int argc, char **argv);
+static int do_batch(FILE* in, bool pipeline, bool wait_for_socket);
 
 static constexpr int kCommandTimeoutMs = 20 * 1000;
 
+/* Commands in flight per connection when pipelining a batch */
+static constexpr size_t kPipelineDepth = 16;
+/*
+ * Bytes of commands in flight per connection, terminators included. The
+ * daemon's FrameworkListener reads into a CMD_BUF_SIZE (1024) buffer, and
+ * a command split across two reads is lost, so never queue up more.
+ */
+static constexpr size_t kPipelineBytes = 1024;
+
 extern "C" int vdc_main(int argc, char **argv) {
     int sock;
     int wait_for_socket;
@@ -59,27 +73,53 @@ extern "C" int vdc_main(int argc, char **argv) {
         exit(5);
     }
 
+    if (!strcmp(argv[1], "--batch")) {
+        bool pipeline = argc > 2 && !strcmp(argv[2], "--pipeline");
+        int fileArg = pipeline ? 3 : 2;
+        if (argc > fileArg + 1) {
+            usage(progname);
+            exit(5);
+        }
+        FILE* in = stdin;
+        if (argc == fileArg + 1 && strcmp(argv[fileArg], "-")) {
+            in = fopen(argv[fileArg], "r");
+            if (in == nullptr) {
+                fprintf(stderr, "Failed to open %s: %s\n", argv[fileArg], strerror(errno));
+                exit(5);
+            }
+        }
+        exit(do_batch(in, pipeline, wait_for_socket));
+    }
+
     const char* sockname = "vold";
     if (!strcmp(argv[1], "cryptfs")) {
         sockname = "cryptd";
     }
 
+    if ((sock = connect_socket(sockname, wait_for_socket)) < 0) {
+        exit(4);
+    }
+
+    if (!strcmp(argv[1], "monitor")) {
+        exit(do_monitor(sock, 0));
+    } else {
+        exit(do_cmd(sock, argc, argv));
+    }
+}
+
+static int connect_socket(const char* sockname, bool wait_for_socket) {
+    int sock;
     while ((sock = socket_local_client(sockname,
                                  ANDROID_SOCKET_NAMESPACE_RESERVED,
                                  SOCK_STREAM)) < 0) {
         if (!wait_for_socket) {
             fprintf(stdout, "Error connecting to %s: %s\n", sockname, strerror(errno));
-            exit(4);
+            return -1;
         } else {
             usleep(10000);
         }
     }
-
-    if (!strcmp(argv[1], "monitor")) {
-        exit(do_monitor(sock, 0));
-    } else {
-        exit(do_cmd(sock, argc, argv));
-    }
+    return sock;
 }
 
 static int do_cmd(int sock, int argc, char **argv) {
@@ -168,9 +208,144 @@ static int do_monitor(int sock, int stop_after_seq) {
     return EIO;
 }
 
+/* One socket of a batch, with the commands still waiting on a reply */
+struct BatchConnection {
+    const char* sockname;
+    int sock;
+    /* Bytes of a reply that hasn't been terminated yet */
+    std::string partial;
+    /* Each command waiting on a reply, by sequence number, as it was sent */
+    std::map<int, std::string> inflight;
+    size_t inflightBytes;
+};
+
+/*
+ * Prints replies as they arrive until no more than max commands, and no
+ * more than maxBytes of them, are left in flight, recording the first
+ * failing code in result. Replies can come back in any order, so they're
+ * matched up by sequence number.
+ */
+static int drain_batch(BatchConnection& conn, size_t max, size_t maxBytes, int& result) {
+    char buffer[4096];
+    while (conn.inflight.size() > max || conn.inflightBytes > maxBytes) {
+        struct pollfd poll_sock = { conn.sock, POLLIN, 0 };
+        int rc = TEMP_FAILURE_RETRY(poll(&poll_sock, 1, kCommandTimeoutMs));
+        if (rc == 0) {
+            fprintf(stderr, "Timeout waiting for %s\n",
+                    conn.inflight.begin()->second.c_str());
+            return ETIMEDOUT;
+        } else if (rc < 0) {
+            fprintf(stderr, "Failed during poll: %s\n", strerror(errno));
+            return errno;
+        }
+
+        rc = TEMP_FAILURE_RETRY(read(conn.sock, buffer, sizeof(buffer)));
+        if (rc == 0) {
+            fprintf(stderr, "Lost connection to %s\n", conn.sockname);
+            return ECONNRESET;
+        } else if (rc < 0) {
+            fprintf(stderr, "Error reading data: %s\n", strerror(errno));
+            return errno;
+        }
+        conn.partial.append(buffer, rc);
+
+        size_t start = 0;
+        size_t end;
+        while ((end = conn.partial.find('\0', start)) != std::string::npos) {
+            const char* res = conn.partial.c_str() + start;
+            fprintf(stdout, "%s\n", res);
+
+            char* next;
+            int code = strtol(res, &next, 10);
+            if (code >= 200 && code < 600) {
+                auto it = conn.inflight.find(strtol(next, nullptr, 10));
+                if (it != conn.inflight.end()) {
+                    conn.inflightBytes -= it->second.length() + 1;
+                    conn.inflight.erase(it);
+                    if (code != 200 && result == 0) {
+                        result = code;
+                    }
+                }
+            }
+            start = end + 1;
+        }
+        conn.partial.erase(0, start);
+    }
+    return 0;
+}
+
+/*
+ * Runs one command per line of in, skipping blank lines and # comments,
+ * over a single connection to each daemon. Without pipeline every command
+ * waits for the one before it, on either daemon; with it, up to
+ * kPipelineDepth commands totalling at most kPipelineBytes are sent ahead
+ * on each connection, so only use it for commands that don't depend on
+ * each other.
+ */
+static int do_batch(FILE* in, bool pipeline, bool wait_for_socket) {
+    BatchConnection vold = { "vold", -1, "", {}, 0 };
+    BatchConnection cryptd = { "cryptd", -1, "", {}, 0 };
+    size_t depth = pipeline ? kPipelineDepth : 1;
+    int seq = 0;
+    int result = 0;
+    int rc = 0;
+
+    char line[4096];
+    while (rc == 0 && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* cmd = line + strspn(line, " \t");
+        if (*cmd == '\0' || *cmd == '#') {
+            continue;
+        }
+
+        bool crypt = !strncmp(cmd, "cryptfs", 7) && (cmd[7] == ' ' || cmd[7] == '\0');
+        BatchConnection& conn = crypt ? cryptd : vold;
+        if (conn.sock < 0 && (conn.sock = connect_socket(conn.sockname, wait_for_socket)) < 0) {
+            rc = 4;
+            break;
+        }
+        // Lock-step waits on both daemons, so commands never overlap
+        std::string framed(android::base::StringPrintf("%d %s", ++seq, cmd));
+        size_t bytes = framed.length() + 1;
+        if (pipeline) {
+            rc = drain_batch(conn, depth - 1,
+                    (bytes < kPipelineBytes) ? kPipelineBytes - bytes : 0, result);
+        } else if ((rc = drain_batch(vold, 0, 0, result)) == 0) {
+            rc = drain_batch(cryptd, 0, 0, result);
+        }
+        if (rc != 0) {
+            break;
+        }
+
+        if (TEMP_FAILURE_RETRY(write(conn.sock, framed.c_str(), bytes)) < 0) {
+            fprintf(stderr, "Failed to write command: %s\n", strerror(errno));
+            rc = errno;
+            break;
+        }
+        conn.inflight.emplace(seq, framed);
+        conn.inflightBytes += bytes;
+    }
+
+    for (auto conn : { &vold, &cryptd }) {
+        if (rc == 0 && conn->sock >= 0) {
+            rc = drain_batch(*conn, 0, 0, result);
+        }
+        if (conn->sock >= 0) {
+            close(conn->sock);
+        }
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return rc ? rc : result;
+}
+
 static void usage(char *progname) {
     fprintf(stderr,
-            "Usage: %s [--wait] <monitor>|<cmd> [arg1] [arg2...]\n", progname);
+            "Usage: %s [--wait] <monitor>|<cmd> [arg1] [arg2...]\n"
+            "       %s [--wait] --batch [--pipeline] [file|-]\n"
+            "  --pipeline keeps up to %zu commands, and %zu bytes of them, in flight\n",
+            progname, progname, kPipelineDepth, kPipelineBytes);
 }
 
 #ifndef MINIVOLD